@@ -0,0 +1,5 @@
+TARGET = coapload
+include($$TOP_SRCDIR/cppexample.pri)
+
+SOURCES += \
+    main.cpp
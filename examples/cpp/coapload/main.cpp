@@ -0,0 +1,401 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTemporaryDir>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QTimer>
+#include <QHash>
+#include <QVector>
+#include <QFile>
+#include <QDateTime>
+#include <QDebug>
+#include <queue>
+#include <vector>
+#include <functional>
+#include "coap/histogram.hpp"
+#include "coap/message.hpp"
+#include "coap/messagebuffer.hpp"
+#include "coap/udpendpoint.h"
+#include "settings.h"
+#include "endianhelper.h"
+
+using namespace iotlib::coap;
+
+/*
+ * Open loop CoAP load generator, the wrk2 model: requests are due at a constant rate no matter how
+ * fast the server answers, and latency is measured from the time a request was due, not from when it
+ * actually went out. A stalled server therefore shows up in the percentiles instead of silently
+ * lowering the load (coordinated omission). Service time from the first transmission is reported too.
+ * Confirmable requests are retransmitted as in RFC7252 4.2, non confirmable ones are sent once.
+ *
+ *   coapload --target 127.0.0.1:5683 --path /echo --rate 20000 --duration 30 --connections 8
+ *   coapload --method POST --payload 256 --confirmable 0.5 --hgrm post.hgrm
+ */
+
+namespace {
+const int MAX_RETRANSMIT = 4;           ///< RFC7252 4.8
+const double ACK_RANDOM_FACTOR = 1.5;
+const int TOKEN_LENGTH = 8;
+}
+
+struct Options
+{
+    Address target;
+    QString path;
+    Message::Code method;
+    int payload;
+    double rate;            ///< requests per second, all connections together
+    int duration;           ///< sec
+    int connections;
+    double confirmable;     ///< share of CON requests 0..1
+    int ackTimeout;         ///< msec
+    int timeout;            ///< msec, NON requests and separate responses
+    QString hgrm;
+};
+
+struct Request
+{
+    qint64 dueAt;           ///< usec, open loop schedule
+    qint64 sentAt;          ///< usec, first transmission
+    quint32 retransmitTimeout;
+    quint32 generation;     ///< deadlines of older generations are stale
+    quint16 messageId;
+    quint8 retransmissions;
+    bool confirmable;
+    bool acknowledged;
+    int connection;
+};
+
+struct Deadline
+{
+    qint64 at;
+    quint64 token;
+    quint32 generation;
+
+    bool operator>(const Deadline &other) const { return at > other.at; }
+};
+
+class LoadGenerator
+{
+public:
+    LoadGenerator(const Options &options) :
+        options(options), issued(0), sequence(0), running(true), finished(false),
+        sent(0), answered(0), errorResponses(0), resets(0), retransmits(0), timeouts(0), lateSends(0)
+    {
+        Message message;
+        message.setType(Message::Type::Confirmable);
+        message.setCode(options.method);
+        message.setToken(QByteArray(TOKEN_LENGTH, '\0'));
+        foreach (const QString &segment, options.path.split('/', QString::SkipEmptyParts))
+            message.addOption(Message::OptionType::UriPath, segment.toUtf8());
+        if (options.payload > 0)
+            message.setContent(QByteArray(options.payload, 'x'));
+        request = message.pack();
+
+        ticker.setTimerType(Qt::PreciseTimer);
+        QObject::connect(&ticker, &QTimer::timeout, [this]() { tick(); });
+    }
+
+    bool start()
+    {
+        QString interface = options.target.isIpv4() ? "0.0.0.0" : "::";
+        for (int i = 0; i < options.connections; ++i) {
+            iotlib::Settings *settings = new iotlib::Settings(dir.path() + QString("/connection%1.json").arg(i),
+                                                              QCoreApplication::instance());
+            settings->beginGroupSet();
+            settings->set("interface", interface);
+            settings->set("port", 0);
+            settings->endGroupSet();
+            UdpEndpoint *endpoint = new UdpEndpoint(settings, settings);
+            settings->set("bind", true); // endpoint binds on settingsChanged()
+            QObject::connect(endpoint, &EndpointBase::receivedBuffer, [this, i](MessageBuffer *buffer) {
+                MessageBuffer message = std::move(*buffer); // taken, so the endpoint doesn't build a Message
+                const MessageView &view = message.view();
+                received(i, view.type(), view.code(), view.messageId(), view.token(), view.tokenLength(),
+                         view.address());
+            });
+            QObject::connect(endpoint, &EndpointBase::received, [this, i](Message &message) {
+                QByteArray token = message.token();
+                received(i, message.type(), message.code(), message.messageId(), token.constData(), token.size(),
+                         message.address());
+            });
+            endpoints.append(endpoint);
+            messageIds.append(quint16(qrand()));
+        }
+        qInfo().noquote() << QString("Running %1 s test @ %2:%3%4, %5 connections, %6 requests/s, %7 byte payload, "
+                                     "%8% confirmable")
+                             .arg(options.duration).arg(options.target.address()).arg(options.target.port())
+                             .arg(options.path).arg(options.connections).arg(options.rate)
+                             .arg(options.payload).arg(options.confirmable * 100);
+        clock.start();
+        ticker.start(1);
+        return true;
+    }
+
+private:
+    qint64 now() const
+    {
+        return clock.nsecsElapsed() / 1000;
+    }
+
+    void tick()
+    {
+        qint64 at = now();
+        if (running) {
+            qint64 end = qint64(options.duration) * 1000000;
+            qint64 due = qint64(double(qMin(at, end)) * options.rate / 1000000);
+            for (; issued < due; ++issued)
+                issue(qint64(double(issued) * 1000000 / options.rate), at);
+            if (at >= end)
+                running = false;
+        }
+        expire(at);
+        if (!running && outstanding.isEmpty())
+            finish();
+    }
+
+    void issue(qint64 dueAt, qint64 at)
+    {
+        Request r;
+        r.dueAt = dueAt;
+        r.sentAt = at;
+        r.connection = int(issued % options.connections);
+        r.messageId = messageIds[r.connection]++;
+        r.confirmable = options.confirmable >= 1 || double(qrand()) / RAND_MAX < options.confirmable;
+        r.acknowledged = false;
+        r.retransmissions = 0;
+        r.generation = 0;
+        r.retransmitTimeout = quint32(options.ackTimeout * (1 + (ACK_RANDOM_FACTOR - 1) * double(qrand()) / RAND_MAX));
+        if (at - dueAt > 1000)
+            ++lateSends;
+
+        quint64 token = ++sequence;
+        outstanding.insert(token, r);
+        byMessageId.insert(quint32(r.connection) << 16 | r.messageId, token);
+        transmit(token, r);
+        deadlines.push(Deadline { at + (r.confirmable ? qint64(r.retransmitTimeout) : qint64(options.timeout)) * 1000,
+                                  token, r.generation });
+        ++sent;
+    }
+
+    void transmit(quint64 token, const Request &r)
+    {
+        char *p = request.data();
+        p[0] = char(0x40 | (r.confirmable ? 0x00 : 0x10) | TOKEN_LENGTH);
+        endian_store16((p + 2), r.messageId);
+        endian_store64((p + 4), token);
+        endpoints[r.connection]->sendPacked(request.constData(), request.size(), options.target);
+    }
+
+    void expire(qint64 at)
+    {
+        while (!deadlines.empty() && deadlines.top().at <= at) {
+            Deadline deadline = deadlines.top();
+            deadlines.pop();
+            QHash<quint64, Request>::iterator it = outstanding.find(deadline.token);
+            if (it == outstanding.end() || it->generation != deadline.generation)
+                continue;
+            Request &r = it.value();
+            if (r.confirmable && !r.acknowledged && r.retransmissions < MAX_RETRANSMIT) {
+                ++r.retransmissions;
+                ++r.generation;
+                r.retransmitTimeout *= 2;
+                transmit(deadline.token, r);
+                deadlines.push(Deadline { at + qint64(r.retransmitTimeout) * 1000, deadline.token, r.generation });
+                ++retransmits;
+                continue;
+            }
+            ++timeouts;
+            complete(it);
+        }
+    }
+
+    void complete(QHash<quint64, Request>::iterator it)
+    {
+        byMessageId.remove(quint32(it->connection) << 16 | it->messageId);
+        outstanding.erase(it);
+    }
+
+    void received(int connection, Message::Type type, Message::Code code, quint16 messageId,
+                  const char *token, int tokenLength, const Address &from)
+    {
+        qint64 at = now();
+        if (type == Message::Type::Confirmable) { // separate response wants an ACK
+            char ack[4] = { char(0x60), 0, 0, 0 };
+            endian_store16((ack + 2), messageId);
+            endpoints[connection]->sendPacked(ack, sizeof(ack), from);
+        }
+
+        QHash<quint64, Request>::iterator it = outstanding.end();
+        if (type == Message::Type::Reset || code == Message::Code::Empty) {
+            QHash<quint32, quint64>::const_iterator id = byMessageId.constFind(quint32(connection) << 16 | messageId);
+            if (id != byMessageId.constEnd())
+                it = outstanding.find(id.value());
+        } else if (tokenLength == TOKEN_LENGTH) {
+            it = outstanding.find(endian_load64(quint64, token));
+        }
+        if (it == outstanding.end() || it->connection != connection)
+            return;
+
+        if (type == Message::Type::Reset) {
+            ++resets;
+            complete(it);
+            return;
+        }
+        if (code == Message::Code::Empty) { // ACK, response comes separately
+            if (type == Message::Type::Acknowledgement && !it->acknowledged) {
+                it->acknowledged = true;
+                ++it->generation;
+                deadlines.push(Deadline { at + qint64(options.timeout) * 1000, it.key(), it->generation });
+            }
+            return;
+        }
+        latency.record(at - it->dueAt);
+        serviceTime.record(at - it->sentAt);
+        if (quint8(code) >= 0x80)
+            ++errorResponses;
+        ++answered;
+        complete(it);
+    }
+
+    void printLatency(const char *title, const Histogram &histogram) const
+    {
+        qInfo().noquote() << QString("  %1 msec: p50 %2  p90 %3  p99 %4  p99.9 %5  max %6  mean %7")
+                             .arg(title)
+                             .arg(histogram.valueAtPercentile(50) / 1000.0, 0, 'f', 3)
+                             .arg(histogram.valueAtPercentile(90) / 1000.0, 0, 'f', 3)
+                             .arg(histogram.valueAtPercentile(99) / 1000.0, 0, 'f', 3)
+                             .arg(histogram.valueAtPercentile(99.9) / 1000.0, 0, 'f', 3)
+                             .arg(histogram.max() / 1000.0, 0, 'f', 3)
+                             .arg(histogram.mean() / 1000.0, 0, 'f', 3);
+    }
+
+    void finish()
+    {
+        if (finished)
+            return;
+        finished = true;
+        ticker.stop();
+        double seconds = options.duration > 0 ? options.duration : 1;
+        qInfo().noquote() << QString("  %1 requests sent, %2 answered, %3 error responses, %4 resets")
+                             .arg(sent).arg(answered).arg(errorResponses).arg(resets);
+        qInfo().noquote() << QString("  %1 retransmissions, %2 timeouts, %3 sent more than 1 msec late")
+                             .arg(retransmits).arg(timeouts).arg(lateSends);
+        qInfo().noquote() << QString("  %1 requests/s, %2 responses/s")
+                             .arg(sent / seconds, 0, 'f', 1).arg(answered / seconds, 0, 'f', 1);
+        printLatency("latency     ", latency);
+        printLatency("service time", serviceTime);
+        qInfo().noquote() << "\n  Latency distribution, msec from due time\n";
+        qInfo().noquote() << latency.percentileDistribution(1000);
+        if (!options.hgrm.isEmpty()) {
+            QFile file(options.hgrm);
+            if (file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+                file.write(latency.percentileDistribution(1000).toUtf8());
+            else
+                qWarning() << "Can't write" << options.hgrm;
+        }
+        QCoreApplication::exit(timeouts ? 1 : 0);
+    }
+
+    Options options;
+    QTemporaryDir dir;
+    QVector<UdpEndpoint *> endpoints;
+    QVector<quint16> messageIds;
+    QByteArray request;                     ///< packed once, header and token patched per transmission
+    QTimer ticker;
+    QElapsedTimer clock;
+    qint64 issued;
+    quint64 sequence;
+    bool running;
+    bool finished;
+
+    QHash<quint64, Request> outstanding;    ///< by token
+    QHash<quint32, quint64> byMessageId;    ///< connection << 16 | message id -> token
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline> > deadlines;
+
+    Histogram latency;                      ///< usec, from due time
+    Histogram serviceTime;                  ///< usec, from first transmission
+    quint64 sent;
+    quint64 answered;
+    quint64 errorResponses;
+    quint64 resets;
+    quint64 retransmits;
+    quint64 timeouts;
+    quint64 lateSends;
+};
+
+// 127.0.0.1:5683, [::1]:5683 or just the address
+Address parseAddress(const QString &text)
+{
+    QString host = text;
+    quint16 port = 5683;
+    int colon = text.lastIndexOf(':');
+    if (colon > 0 && (text.count(':') == 1 || text.at(colon - 1) == ']')) {
+        port = quint16(text.mid(colon + 1).toUInt());
+        host = text.left(colon);
+    }
+    if (host.startsWith('[') && host.endsWith(']'))
+        host = host.mid(1, host.size() - 2);
+    return Address(QHostAddress(host), port);
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    qsrand(uint(QDateTime::currentMSecsSinceEpoch()));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Open loop CoAP load generator");
+    parser.addHelpOption();
+    QCommandLineOption targetOption("target", "Server", "address:port", "127.0.0.1:5683");
+    QCommandLineOption pathOption("path", "Uri-Path", "path", "/");
+    QCommandLineOption methodOption("method", "GET, POST, PUT, DELETE or FETCH", "method", "GET");
+    QCommandLineOption payloadOption("payload", "Request payload size", "bytes", "0");
+    QCommandLineOption rateOption("rate", "Requests per second, all connections together", "count", "1000");
+    QCommandLineOption durationOption("duration", "Test length", "sec", "10");
+    QCommandLineOption connectionsOption("connections", "UDP sockets requests are spread over", "count", "4");
+    QCommandLineOption confirmableOption("confirmable", "Share of CON requests, the rest are NON", "0..1", "1");
+    QCommandLineOption ackTimeoutOption("ack-timeout", "ACK_TIMEOUT", "msec", "2000");
+    QCommandLineOption timeoutOption("timeout", "NON requests and separate responses are lost after", "msec",
+                                     "5000");
+    QCommandLineOption hgrmOption("hgrm", "Write latency distribution for the HdrHistogram plotter", "file");
+    parser.addOptions(QList<QCommandLineOption>() << targetOption << pathOption << methodOption << payloadOption
+                      << rateOption << durationOption << connectionsOption << confirmableOption
+                      << ackTimeoutOption << timeoutOption << hgrmOption);
+    parser.process(app);
+
+    Options options;
+    options.target = parseAddress(parser.value(targetOption));
+    options.path = parser.value(pathOption);
+    QString method = parser.value(methodOption).toUpper();
+    if (method == "GET")
+        options.method = Message::Code::Get;
+    else if (method == "POST")
+        options.method = Message::Code::Post;
+    else if (method == "PUT")
+        options.method = Message::Code::Put;
+    else if (method == "DELETE")
+        options.method = Message::Code::Delete;
+    else if (method == "FETCH")
+        options.method = Message::Code::Fetch;
+    else
+        options.method = Message::Code::UndefinedCode;
+    options.payload = qBound(0, parser.value(payloadOption).toInt(), 64000);
+    options.rate = parser.value(rateOption).toDouble();
+    options.duration = parser.value(durationOption).toInt();
+    options.connections = qBound(1, parser.value(connectionsOption).toInt(), 1024);
+    options.confirmable = qBound(0.0, parser.value(confirmableOption).toDouble(), 1.0);
+    options.ackTimeout = qMax(1, parser.value(ackTimeoutOption).toInt());
+    options.timeout = qMax(1, parser.value(timeoutOption).toInt());
+    options.hgrm = parser.value(hgrmOption);
+    if (options.target.isNull() || options.method == Message::Code::UndefinedCode ||
+            options.rate <= 0 || options.duration <= 0) {
+        qWarning() << "Bad --target, --method, --rate or --duration";
+        return 1;
+    }
+
+    LoadGenerator generator(options);
+    if (!generator.start())
+        return 1;
+    return app.exec();
+}
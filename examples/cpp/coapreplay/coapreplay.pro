@@ -0,0 +1,5 @@
+TARGET = coapreplay
+include($$TOP_SRCDIR/cppexample.pri)
+
+SOURCES += \
+    main.cpp
@@ -0,0 +1,297 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTemporaryDir>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QHostAddress>
+#include <QHash>
+#include <QVector>
+#include <QDebug>
+#include <algorithm>
+#include "coap/capture.hpp"
+#include "coap/message.hpp"
+#include "coap/udpendpoint.h"
+#include "settings.h"
+#include "endianhelper.h"
+
+using namespace iotlib::coap;
+
+/*
+ * Replays requests recorded with Stack::setCapture() (or any pcap of CoAP traffic) against a server
+ * and reports throughput and latency. Only datagrams the captured server received are replayed, each
+ * goes through Message::unpack() and gets a fresh message id and a 4 byte token so responses can be
+ * matched. Requests are sent once, no retransmissions, unanswered ones count as lost after --timeout.
+ *
+ *   coapreplay traffic.pcapng --target 127.0.0.1:5683 --speed 1    original timing
+ *   coapreplay traffic.pcapng --speed 10                            ten times faster
+ *   coapreplay traffic.pcapng --speed max --window 512              as fast as the server answers
+ */
+
+struct Options
+{
+    QString fileName;
+    Address target;
+    double speed;           ///< 0 for max
+    int window;
+    int timeout;
+    quint16 serverPort;
+};
+
+class Replay
+{
+public:
+    Replay(const Options &options, UdpEndpoint *endpoint) :
+        options(options), endpoint(endpoint), havePending(false), pendingTimestamp(0), firstTimestamp(-1),
+        sequence(0), finished(false),
+        records(0), sent(0), skipped(0), malformed(0), answered(0), resets(0), lost(0)
+    {
+        pacer.setSingleShot(true);
+        QObject::connect(&pacer, &QTimer::timeout, [this]() { pump(); });
+        QObject::connect(&sweeper, &QTimer::timeout, [this]() { expire(); });
+        QObject::connect(endpoint, &UdpEndpoint::received, [this](Message &message) { received(message); });
+    }
+
+    bool start()
+    {
+        reader.setServerPort(options.serverPort);
+        if (!reader.open(options.fileName)) {
+            qWarning() << "Can't read" << options.fileName << reader.errorString();
+            return false;
+        }
+        readNext();
+        clock.start();
+        sweeper.start(qMax(10, options.timeout / 10));
+        QTimer::singleShot(0, [this]() { pump(); });
+        return true;
+    }
+
+private:
+    void readNext()
+    {
+        CaptureRecord record;
+        havePending = false;
+        while (reader.next(record)) {
+            ++records;
+            if (record.direction != CaptureRecord::Received)
+                continue;
+            pending.unpack(record.datagram);
+            if (!pending.isValid()) {
+                ++malformed;
+                continue;
+            }
+            if (!pending.isRequest()) { // ACKs, RSTs and pings from the captured clients
+                ++skipped;
+                continue;
+            }
+            if (firstTimestamp < 0)
+                firstTimestamp = record.timestamp;
+            pendingTimestamp = record.timestamp;
+            havePending = true;
+            return;
+        }
+    }
+
+    void pump()
+    {
+        while (havePending) {
+            if (options.speed > 0) {
+                qint64 due = qint64((pendingTimestamp - firstTimestamp) / options.speed);
+                qint64 now = clock.nsecsElapsed() / 1000;
+                if (due > now) {
+                    pacer.start(int(qMax<qint64>(1, (due - now) / 1000)));
+                    return;
+                }
+            } else if (outstanding.size() >= options.window) {
+                return; // received() pumps again
+            }
+            send();
+            readNext();
+        }
+        if (outstanding.isEmpty())
+            finish();
+    }
+
+    void send()
+    {
+        quint32 id = ++sequence;
+        char token[4];
+        endian_store32(token, id);
+        pending.setToken(token, sizeof(token));
+        pending.setMessageId(quint16(id));
+        pending.setAddress(options.target);
+        outstanding.insert(id, clock.nsecsElapsed());
+        endpoint->send(pending);
+        ++sent;
+    }
+
+    void received(Message &message)
+    {
+        quint32 id = 0;
+        if (message.type() == Message::Type::Reset) {
+            // no token, find the request by message id
+            QHash<quint32, qint64>::iterator it = outstanding.begin();
+            for (; it != outstanding.end(); ++it) {
+                if (quint16(it.key()) == message.messageId())
+                    break;
+            }
+            if (it == outstanding.end())
+                return;
+            outstanding.erase(it);
+            ++resets;
+        } else {
+            if (message.isEmpty()) // ACK of a separate response
+                return;
+            if (message.type() == Message::Type::Confirmable) {
+                Message ack;
+                ack.setType(Message::Type::Acknowledgement);
+                ack.setCode(Message::Code::Empty);
+                ack.setMessageId(message.messageId());
+                ack.setAddress(message.address());
+                endpoint->send(ack);
+            }
+            QByteArray token = message.token();
+            if (token.size() != 4)
+                return;
+            id = endian_load32(quint32, token.constData());
+            QHash<quint32, qint64>::iterator it = outstanding.find(id);
+            if (it == outstanding.end())
+                return;
+            latencies.append((clock.nsecsElapsed() - it.value()) / 1000);
+            outstanding.erase(it);
+            ++answered;
+        }
+        if (options.speed <= 0 || (!havePending && outstanding.isEmpty()))
+            pump();
+    }
+
+    void expire()
+    {
+        qint64 deadline = clock.nsecsElapsed() - qint64(options.timeout) * 1000000;
+        QHash<quint32, qint64>::iterator it = outstanding.begin();
+        while (it != outstanding.end()) {
+            if (it.value() < deadline) {
+                it = outstanding.erase(it);
+                ++lost;
+            } else {
+                ++it;
+            }
+        }
+        pump();
+    }
+
+    qint64 percentile(double p) const
+    {
+        if (latencies.isEmpty())
+            return 0;
+        int index = qMin(latencies.size() - 1, int(p * latencies.size()));
+        return latencies.at(index);
+    }
+
+    void finish()
+    {
+        if (finished)
+            return;
+        finished = true;
+        sweeper.stop();
+        double seconds = clock.nsecsElapsed() / 1e9;
+        std::sort(latencies.begin(), latencies.end());
+        qInfo().noquote() << QString("records %1, requests sent %2, skipped %3, malformed %4")
+                             .arg(records).arg(sent).arg(skipped).arg(malformed);
+        qInfo().noquote() << QString("answered %1, reset %2, lost %3 in %4 s, %5 requests/s, %6 responses/s")
+                             .arg(answered).arg(resets).arg(lost).arg(seconds, 0, 'f', 3)
+                             .arg(sent / seconds, 0, 'f', 0).arg(answered / seconds, 0, 'f', 0);
+        if (!latencies.isEmpty())
+            qInfo().noquote() << QString("latency usec: min %1 p50 %2 p90 %3 p99 %4 p99.9 %5 max %6")
+                                 .arg(latencies.first()).arg(percentile(0.5)).arg(percentile(0.9))
+                                 .arg(percentile(0.99)).arg(percentile(0.999)).arg(latencies.last());
+        QCoreApplication::exit(lost || resets ? 1 : 0);
+    }
+
+    Options options;
+    UdpEndpoint *endpoint;
+    CaptureReader reader;
+    Message pending;
+    bool havePending;
+    qint64 pendingTimestamp;
+    qint64 firstTimestamp;
+    QElapsedTimer clock;
+    QTimer pacer;
+    QTimer sweeper;
+    quint32 sequence;
+    bool finished;
+    QHash<quint32, qint64> outstanding;     ///< sequence -> nsec sent
+    QVector<qint64> latencies;              ///< usec
+
+    quint64 records;
+    quint64 sent;
+    quint64 skipped;
+    quint64 malformed;
+    quint64 answered;
+    quint64 resets;
+    quint64 lost;
+};
+
+// 127.0.0.1:5683, [::1]:5683 or just the address
+Address parseAddress(const QString &text)
+{
+    QString host = text;
+    quint16 port = 5683;
+    int colon = text.lastIndexOf(':');
+    if (colon > 0 && (text.count(':') == 1 || text.at(colon - 1) == ']')) {
+        port = quint16(text.mid(colon + 1).toUInt());
+        host = text.left(colon);
+    }
+    if (host.startsWith('[') && host.endsWith(']'))
+        host = host.mid(1, host.size() - 2);
+    return Address(QHostAddress(host), port);
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Replays CoAP requests from a pcap or pcapng capture against a server");
+    parser.addHelpOption();
+    parser.addPositionalArgument("capture", "pcap or pcapng file");
+    QCommandLineOption targetOption("target", "Server to replay against", "address:port", "127.0.0.1:5683");
+    QCommandLineOption speedOption("speed", "Timing factor, 1 is original, max ignores timing", "factor", "1");
+    QCommandLineOption windowOption("window", "Requests in flight at max speed", "count", "256");
+    QCommandLineOption timeoutOption("timeout", "Request is lost after", "msec", "5000");
+    QCommandLineOption portOption("server-port", "Port of the captured server, for captures without direction",
+                                  "port", "5683");
+    parser.addOption(targetOption);
+    parser.addOption(speedOption);
+    parser.addOption(windowOption);
+    parser.addOption(timeoutOption);
+    parser.addOption(portOption);
+    parser.process(app);
+    if (parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    Options options;
+    options.fileName = parser.positionalArguments().first();
+    options.target = parseAddress(parser.value(targetOption));
+    options.speed = parser.value(speedOption) == "max" ? 0 : parser.value(speedOption).toDouble();
+    options.window = qMax(1, parser.value(windowOption).toInt());
+    options.timeout = qMax(1, parser.value(timeoutOption).toInt());
+    options.serverPort = quint16(parser.value(portOption).toUInt());
+    if (options.target.isNull() || options.speed < 0) {
+        qWarning() << "Bad --target or --speed";
+        return 1;
+    }
+
+    QTemporaryDir dir;
+    iotlib::Settings settings(dir.path() + "/coapreplay.json");
+    settings.beginGroupSet();
+    settings.set("interface", options.target.isIpv4() ? "0.0.0.0" : "::");
+    settings.set("port", 0);
+    settings.endGroupSet();
+    UdpEndpoint endpoint(&settings);
+    settings.set("bind", true);
+
+    Replay replay(options, &endpoint);
+    if (!replay.start())
+        return 1;
+    return app.exec();
+}
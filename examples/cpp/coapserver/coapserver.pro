@@ -0,0 +1,5 @@
+TARGET = coapserver
+include($$TOP_SRCDIR/cppexample.pri)
+
+SOURCES += \
+    main.cpp
@@ -0,0 +1,389 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QTimer>
+#include <QHash>
+#include <QVector>
+#include <QStringList>
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QDebug>
+#include "coap/stack.hpp"
+#include "coap/resource.hpp"
+#include "coap/messagebuffer.hpp"
+#include "coap/udpendpoint.h"
+#include "coap/pipelineendpoint.h"
+#include "settings.h"
+
+using namespace iotlib::coap;
+
+/*
+ * Reference server for benchmarks, pair it with coapload or coapreplay. Every shard is a Stack with
+ * its own UdpEndpoint and thread, all bound to the same port with "reuse_port" so the kernel spreads
+ * peers over them. Resources:
+ *
+ *   /echo          payload and Content-Format of the request back
+ *   /fixed         --fixed-size bytes
+ *   /large         --large-size bytes in Block2 blocks (RFC7959), 1024 bytes unless the client asks less
+ *   /counter       observable (RFC7641), NON notification to every observer each --observe-interval
+ *
+ *   coapserver --port 5683 --shards 4
+ *   coapserver --shards 1 --offload --handler-threads 8   handlers on the Stack's worker pool
+ *   coapserver --shards 2 --pipeline                      socket I/O on a thread per shard, ring occupancy reported
+ */
+
+struct ShardStats
+{
+    ShardStats() : requests(0), notifications(0), observers(0) { }
+
+    QAtomicInteger<quint64> requests;
+    QAtomicInteger<quint64> notifications;
+    QAtomicInt observers;
+};
+
+/**
+ * Resources answer in pooled buffers, handle() goes through the same code for offloaded and
+ * oversized requests
+ */
+class BenchResource : public Resource
+{
+public:
+    BenchResource(const QString &path, ShardStats *stats) : Resource(path), stats(stats) { }
+
+    bool handleBuffer(const MessageView &request, MessageBuffer &response)
+    {
+        serve(request, response);
+        stats->requests.fetchAndAddRelaxed(1);
+        return true;
+    }
+
+    void handle(const Message &request, Message &response)
+    {
+        MessageBuffer in = MessageBuffer::fromMessage(request);
+        if (in.isNull() || !in.parse()) {
+            response.setCode(Message::Code::RequestEntityTooLarge);
+            return;
+        }
+        in.view().setAddress(request.address());
+        QByteArray token = response.token();
+        MessageBuffer out = MessageBuffer::allocate();
+        out.setHeader(response.type(), Message::Code::MethodNotAllowed, response.messageId(),
+                      token.constData(), token.size());
+        handleBuffer(in.view(), out);
+        Address address = response.address();
+        out.parse();
+        response = out.view().toMessage();
+        response.setAddress(address);
+    }
+
+protected:
+    virtual void serve(const MessageView &request, MessageBuffer &response) = 0;
+
+    ShardStats *stats;
+};
+
+class EchoResource : public BenchResource
+{
+public:
+    EchoResource(ShardStats *stats) : BenchResource("echo", stats) { }
+
+protected:
+    void serve(const MessageView &request, MessageBuffer &response)
+    {
+        response.setCode(Message::Code::Content);
+        int format = request.findOption(Message::OptionType::ContentFormat);
+        if (format >= 0)
+            response.addOption(Message::OptionType::ContentFormat, request.optionData(format),
+                               request.optionLength(format));
+        response.setPayload(request.payload(), request.payloadLength());
+    }
+};
+
+class FixedResource : public BenchResource
+{
+public:
+    FixedResource(ShardStats *stats, int size) : BenchResource("fixed", stats), body(size, 'x') { }
+
+protected:
+    void serve(const MessageView &, MessageBuffer &response)
+    {
+        response.setCode(Message::Code::Content);
+        response.addOption(Message::OptionType::ContentFormat, quint32(Message::ContentFormat::TextPlain));
+        if (!response.setPayload(body.constData(), body.size()))
+            response.setCode(Message::Code::InternalServerError); // --fixed-size over a datagram
+    }
+
+    QByteArray body;
+};
+
+class LargeResource : public BenchResource
+{
+public:
+    LargeResource(ShardStats *stats, int size) : BenchResource("large", stats), body(size, '\0')
+    {
+        for (int i = 0; i < size; ++i)
+            body[i] = char('a' + i % 26);
+    }
+
+protected:
+    void serve(const MessageView &request, MessageBuffer &response)
+    {
+        quint32 number = 0;
+        quint32 szx = 6;
+        int block = request.findOption(Message::OptionType::Block2);
+        if (block >= 0) {
+            quint32 value = request.optionUint(block);
+            number = value >> 4;
+            szx = qMin<quint32>(6, value & 0x7);
+        }
+        int blockSize = 16 << szx;
+        qint64 offset = qint64(number) * blockSize;
+        if (offset > 0 && offset >= body.size()) {
+            response.setCode(Message::Code::BadOption);
+            return;
+        }
+        int length = int(qMin<qint64>(blockSize, body.size() - offset));
+        bool more = offset + length < body.size();
+        response.setCode(Message::Code::Content);
+        response.addOption(Message::OptionType::ContentFormat, quint32(Message::ContentFormat::TextPlain));
+        response.addOption(Message::OptionType::Block2, number << 4 | (more ? 0x8 : 0) | szx);
+        if (number == 0)
+            response.addOption(Message::OptionType::Size2, quint32(body.size()));
+        response.setPayload(body.constData() + offset, length);
+    }
+
+    QByteArray body;
+};
+
+class CounterResource : public BenchResource
+{
+public:
+    CounterResource(ShardStats *stats, int maxObservers) :
+        BenchResource("counter", stats), endpoint(0), maxObservers(maxObservers),
+        counter(0), sequence(0), messageId(quint16(qrand()))
+    { }
+
+    EndpointBase *endpoint;
+
+    /**
+     * Stack thread only, observers live there
+     */
+    void notify()
+    {
+        ++counter;
+        sequence = (sequence + 1) & 0xffffff;
+        QByteArray value = QByteArray::number(counter);
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+        QHash<QByteArray, Observer>::iterator it = observers.begin();
+        while (it != observers.end()) {
+            if (now - it->registeredAt > OBSERVER_LIFETIME) { // clients are expected to re-register
+                it = observers.erase(it);
+                continue;
+            }
+            MessageBuffer notification = MessageBuffer::allocate();
+            notification.setHeader(Message::Type::NonConfirmable, Message::Code::Content, messageId++,
+                                   it->token.constData(), it->token.size());
+            notification.addOption(Message::OptionType::Observe, sequence);
+            notification.addOption(Message::OptionType::ContentFormat, quint32(Message::ContentFormat::TextPlain));
+            notification.setPayload(value.constData(), value.size());
+            if (endpoint)
+                endpoint->sendPacked(notification.constData(), notification.size(), it->address);
+            stats->notifications.fetchAndAddRelaxed(1);
+            ++it;
+        }
+        stats->observers.store(observers.size());
+    }
+
+protected:
+    void serve(const MessageView &request, MessageBuffer &response)
+    {
+        QByteArray key(request.token(), request.tokenLength());
+        key.append((const char *)request.address().ip(), 16);
+        key.append(char(request.address().port() >> 8)).append(char(request.address().port()));
+
+        int observe = request.findOption(Message::OptionType::Observe);
+        bool registered = false;
+        if (observe >= 0 && request.code() == Message::Code::Get) {
+            if (request.optionUint(observe) == 0 && (observers.contains(key) || observers.size() < maxObservers)) {
+                Observer &observer = observers[key];
+                observer.address = request.address();
+                observer.token = QByteArray(request.token(), request.tokenLength());
+                observer.registeredAt = QDateTime::currentMSecsSinceEpoch();
+                registered = true;
+            } else {
+                observers.remove(key);
+            }
+            stats->observers.store(observers.size());
+        }
+
+        QByteArray value = QByteArray::number(counter);
+        response.setCode(Message::Code::Content);
+        if (registered)
+            response.addOption(Message::OptionType::Observe, sequence);
+        response.addOption(Message::OptionType::ContentFormat, quint32(Message::ContentFormat::TextPlain));
+        response.setPayload(value.constData(), value.size());
+    }
+
+private:
+    static const qint64 OBSERVER_LIFETIME = 10 * 60 * 1000;
+
+    struct Observer
+    {
+        Address address;
+        QByteArray token;
+        qint64 registeredAt;
+    };
+
+    int maxObservers;
+    QHash<QByteArray, Observer> observers;  ///< by token, address and port
+    quint64 counter;
+    quint32 sequence;
+    quint16 messageId;
+};
+
+struct Shard
+{
+    ShardStats stats;
+    QThread thread;
+    Stack *stack;
+    EchoResource *echo;
+    FixedResource *fixed;
+    LargeResource *large;
+    CounterResource *counter;
+    PipelineEndpoint *pipeline;
+    quint64 lastRequests;
+};
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    qsrand(uint(QDateTime::currentMSecsSinceEpoch()));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Reference CoAP server for benchmarks");
+    parser.addHelpOption();
+    QCommandLineOption interfaceOption("interface", "Address to bind", "address", "::");
+    QCommandLineOption portOption("port", "Port to bind", "port", "5683");
+    QCommandLineOption shardsOption("shards", "Stacks with a thread each, sharing the port", "count",
+                                    QString::number(QThread::idealThreadCount()));
+    QCommandLineOption offloadOption("offload", "Run /echo, /fixed and /large on the handler pool");
+    QCommandLineOption handlerThreadsOption("handler-threads", "Handler pool size per shard", "count",
+                                            QString::number(QThread::idealThreadCount()));
+    QCommandLineOption fixedSizeOption("fixed-size", "Payload of /fixed", "bytes", "64");
+    QCommandLineOption largeSizeOption("large-size", "Body of /large", "bytes", "65536");
+    QCommandLineOption observeOption("observe-interval", "Notifications of /counter", "msec", "1000");
+    QCommandLineOption observersOption("max-observers", "Observers per shard", "count", "100000");
+    QCommandLineOption statsOption("stats-interval", "Throughput report", "msec", "1000");
+    QCommandLineOption pipelineOption("pipeline", "PipelineEndpoint, socket I/O on a dedicated thread per shard");
+    QCommandLineOption ringOption("ring", "Slots of the pipeline receive and transmit rings", "count", "4096");
+    parser.addOptions(QList<QCommandLineOption>() << interfaceOption << portOption << shardsOption
+                      << offloadOption << handlerThreadsOption << fixedSizeOption << largeSizeOption
+                      << observeOption << observersOption << statsOption << pipelineOption << ringOption);
+    parser.process(app);
+
+    int shardCount = qBound(1, parser.value(shardsOption).toInt(), 256);
+    bool offload = parser.isSet(offloadOption);
+    bool pipeline = parser.isSet(pipelineOption);
+
+    QTemporaryDir dir;
+    iotlib::Settings settings(dir.path() + "/coapserver.json");
+    settings.beginGroupSet();
+    settings.set("interface", parser.value(interfaceOption));
+    settings.set("port", parser.value(portOption).toUInt());
+    settings.set("reuse_port", shardCount > 1);
+    settings.set("pipeline_receive_ring", parser.value(ringOption).toInt());
+    settings.set("pipeline_transmit_ring", parser.value(ringOption).toInt());
+    settings.endGroupSet();
+
+    QVector<Shard *> shards;
+    for (int i = 0; i < shardCount; ++i) {
+        Shard *shard = new Shard;
+        shard->lastRequests = 0;
+        shard->stack = new Stack;
+        shard->pipeline = pipeline ? new PipelineEndpoint(&settings) : 0;
+        EndpointBase *endpoint = shard->pipeline ? static_cast<EndpointBase *>(shard->pipeline)
+                                                 : new UdpEndpoint(&settings);
+        shard->stack->addEndpoint(endpoint);
+        if (offload)
+            shard->stack->setHandlerThreads(qMax(1, parser.value(handlerThreadsOption).toInt()));
+
+        shard->echo = new EchoResource(&shard->stats);
+        shard->fixed = new FixedResource(&shard->stats, qMax(0, parser.value(fixedSizeOption).toInt()));
+        shard->large = new LargeResource(&shard->stats, qMax(1, parser.value(largeSizeOption).toInt()));
+        shard->counter = new CounterResource(&shard->stats, parser.value(observersOption).toInt());
+        shard->counter->endpoint = endpoint;
+        if (offload) {
+            shard->echo->setExecution(Resource::Execution::Offloaded);
+            shard->fixed->setExecution(Resource::Execution::Offloaded);
+            shard->large->setExecution(Resource::Execution::Offloaded);
+        }
+        shard->stack->addResource(shard->echo);
+        shard->stack->addResource(shard->fixed);
+        shard->stack->addResource(shard->large);
+        shard->stack->addResource(shard->counter);
+
+        QTimer *notifier = new QTimer(shard->stack);
+        CounterResource *counter = shard->counter;
+        QObject::connect(notifier, &QTimer::timeout, [counter]() { counter->notify(); });
+        notifier->start(qMax(1, parser.value(observeOption).toInt()));
+
+        shard->stack->moveToThread(&shard->thread);
+        QObject::connect(&shard->thread, &QThread::finished, shard->stack, &QObject::deleteLater);
+        shard->thread.start();
+        shards.append(shard);
+    }
+    settings.set("bind", true); // every endpoint binds in its own thread
+
+    qInfo().noquote() << QString("Serving on [%1]:%2 with %3 shard(s)%4%5")
+                         .arg(parser.value(interfaceOption)).arg(parser.value(portOption)).arg(shardCount)
+                         .arg(offload ? ", handlers offloaded" : "").arg(pipeline ? ", pipelined I/O" : "");
+
+    QElapsedTimer clock;
+    clock.start();
+    quint64 lastNotifications = 0;
+    QTimer stats;
+    QObject::connect(&stats, &QTimer::timeout, [&]() {
+        double seconds = clock.restart() / 1000.0;
+        quint64 total = 0;
+        quint64 notifications = 0;
+        int observers = 0;
+        QStringList perShard;
+        QStringList rings;
+        foreach (Shard *shard, shards) {
+            quint64 requests = shard->stats.requests.load();
+            perShard << QString::number((requests - shard->lastRequests) / seconds, 'f', 0);
+            total += requests - shard->lastRequests;
+            shard->lastRequests = requests;
+            notifications += shard->stats.notifications.load();
+            observers += shard->stats.observers.load();
+            if (shard->pipeline) {
+                PipelineStats ring = shard->pipeline->pipelineStats();
+                rings << QString("rx %1/%2 max %3 drop %4, tx %5/%6 max %7 drop %8")
+                         .arg(ring.receiveOccupancy).arg(ring.receiveCapacity).arg(ring.receiveHighWatermark)
+                         .arg(ring.receiveDropped).arg(ring.transmitOccupancy).arg(ring.transmitCapacity)
+                         .arg(ring.transmitHighWatermark).arg(ring.transmitDropped);
+            }
+        }
+        qInfo().noquote() << QString("%1 requests/s [%2], %3 notifications/s, %4 observers, %5 buffers in use")
+                             .arg(total / seconds, 0, 'f', 0).arg(perShard.join(' '))
+                             .arg((notifications - lastNotifications) / seconds, 0, 'f', 0)
+                             .arg(observers).arg(MessageBuffer::blocksInUse());
+        if (!rings.isEmpty())
+            qInfo().noquote() << "  rings:" << rings.join("; ");
+        lastNotifications = notifications;
+    });
+    stats.start(qMax(100, parser.value(statsOption).toInt()));
+
+    int result = app.exec();
+    foreach (Shard *shard, shards) {
+        shard->thread.quit();
+        shard->thread.wait(); // stack is deleted as the thread finishes, before its resources
+        delete shard->echo;
+        delete shard->fixed;
+        delete shard->large;
+        delete shard->counter;
+        delete shard;
+    }
+    return result;
+}
@@ -0,0 +1,5 @@
+TARGET = coapsim
+include($$TOP_SRCDIR/cppexample.pri)
+
+SOURCES += \
+    main.cpp
@@ -0,0 +1,222 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QTimer>
+#include <QVector>
+#include <QDebug>
+#include <random>
+#include "coap/stack.hpp"
+#include "coap/exchange.hpp"
+#include "coap/resource.hpp"
+#include "coap/messagebuffer.hpp"
+#include "coap/virtualclock.hpp"
+#include "coap/simulatednetwork.hpp"
+
+using namespace iotlib::coap;
+
+/*
+ * Runs whole client and server Stacks over a SimulatedNetwork on virtual time: every client sends
+ * confirmable GETs to random servers at --rate, links add latency, jitter, loss and duplication.
+ * Nothing waits for real time, so minutes of traffic between thousands of stacks take seconds, and
+ * the same --seed gives the same run, which makes retransmission and congestion tuning repeatable.
+ * Prints the per-phase latency breakdown (LatencyBreakdown) of all requests at the end.
+ *
+ *   QT_HASH_SEED=0 coapsim --clients 5000 --servers 20 --rate 2 --loss 0.05 --jitter 30
+ */
+
+class DataResource : public Resource
+{
+public:
+    DataResource(int size) : Resource("data"), body(size, 'x'), requests(0) { }
+
+    bool handleBuffer(const MessageView &, MessageBuffer &response)
+    {
+        ++requests;
+        response.setCode(Message::Code::Content);
+        response.addOption(Message::OptionType::ContentFormat, quint32(Message::ContentFormat::TextPlain));
+        response.setPayload(body.constData(), body.size());
+        return true;
+    }
+
+    void handle(const Message &, Message &response)
+    {
+        ++requests;
+        response.setCode(Message::Code::Content);
+        response.setContent(body);
+    }
+
+    QByteArray body;
+    quint64 requests;
+};
+
+class Simulation
+{
+public:
+    Simulation() : issued(0), answered(0), timedOut(0), random(1), durationMsec(0), intervalNsec(0) { }
+
+    /**
+     * Sends one request from client and schedules the next, first ones are spread over an interval
+     */
+    void request(int client)
+    {
+        if (clock.elapsed() >= durationMsec)
+            return;
+        std::uniform_int_distribution<int> pick(0, servers.size() - 1);
+        Address server = serverAddresses.at(pick(random));
+        Exchange *exchange = new Exchange(clients.at(client));
+        exchange->setUrl(QUrl(QString("coap://%1:%2/data").arg(server.hostAddress().toString()).arg(server.port())));
+        exchange->deleteAfterComplete();
+        exchange->setCallback([this](Exchange *exchange) {
+            bool ok = exchange->status() != Exchange::TimedOut;
+            breakdown.record(exchange->timings(), ok);
+            if (ok)
+                ++answered;
+            else
+                ++timedOut;
+        });
+        exchange->get();
+        ++issued;
+        clock.schedule(intervalNsec, [this, client]() { request(client); });
+    }
+
+    VirtualClock clock;
+    QVector<Stack *> clients;
+    QVector<Stack *> servers;
+    QVector<Address> serverAddresses;
+    QVector<DataResource *> resources;
+    quint64 issued;
+    quint64 answered;
+    quint64 timedOut;
+    LatencyBreakdown breakdown; ///< one for all clients, Stack::setLatencyTracking() would take memory per stack
+    std::mt19937 random;
+    qint64 durationMsec;
+    qint64 intervalNsec;
+};
+
+namespace {
+Address hostAddress(quint32 network, int index, quint16 port)
+{
+    return Address(QHostAddress(network | quint32(index / 250) << 8 | quint32(index % 250 + 1)), port);
+}
+
+QString phaseLine(const QString &name, const Histogram &histogram)
+{
+    return QString("%1 %2 %3 %4 %5 %6").arg(name, -18).arg(histogram.count(), 10)
+            .arg(histogram.valueAtPercentile(50) / 1000.0, 10, 'f', 2)
+            .arg(histogram.valueAtPercentile(99) / 1000.0, 10, 'f', 2)
+            .arg(histogram.valueAtPercentile(99.9) / 1000.0, 10, 'f', 2)
+            .arg(histogram.max() / 1000.0, 10, 'f', 2);
+}
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("CoAP stacks on a simulated network and virtual time");
+    parser.addHelpOption();
+    QCommandLineOption clientsOption("clients", "Client stacks", "count", "1000");
+    QCommandLineOption serversOption("servers", "Server stacks", "count", "10");
+    QCommandLineOption rateOption("rate", "Requests per second of every client", "requests", "1");
+    QCommandLineOption durationOption("duration", "Virtual seconds of traffic, in flight requests finish after",
+                                      "seconds", "60");
+    QCommandLineOption latencyOption("latency", "One way link latency", "msec", "20");
+    QCommandLineOption jitterOption("jitter", "Random extra latency, up to", "msec", "0");
+    QCommandLineOption lossOption("loss", "Probability a datagram is lost", "0..1", "0");
+    QCommandLineOption duplicationOption("duplication", "Probability a datagram arrives twice", "0..1", "0");
+    QCommandLineOption payloadOption("payload", "Response payload", "bytes", "16");
+    QCommandLineOption seedOption("seed", "Seed of everything random", "seed", "1");
+    parser.addOptions(QList<QCommandLineOption>() << clientsOption << serversOption << rateOption
+                      << durationOption << latencyOption << jitterOption << lossOption << duplicationOption
+                      << payloadOption << seedOption);
+    parser.process(app);
+
+    quint32 seed = parser.value(seedOption).toUInt();
+    qsrand(seed); // message ids and tokens of the stacks
+    int clientCount = qBound(1, parser.value(clientsOption).toInt(), 60000);
+    int serverCount = qBound(1, parser.value(serversOption).toInt(), 60000);
+    double rate = qMax(0.001, parser.value(rateOption).toDouble());
+
+    Simulation sim;
+    sim.random.seed(seed);
+    sim.durationMsec = qMax<qint64>(1, parser.value(durationOption).toLongLong()) * 1000;
+    sim.intervalNsec = qMax<qint64>(1, qint64(1e9 / rate));
+
+    SimulatedNetwork network(&sim.clock, seed);
+    LinkProfile link;
+    link.latency = qMax(0, parser.value(latencyOption).toInt()) * 1000;
+    link.jitter = qMax(0, parser.value(jitterOption).toInt()) * 1000;
+    link.loss = qBound(0.0, parser.value(lossOption).toDouble(), 1.0);
+    link.duplication = qBound(0.0, parser.value(duplicationOption).toDouble(), 1.0);
+    network.setDefaultLink(link);
+
+    for (int i = 0; i < serverCount; ++i) {
+        Stack *stack = new Stack;
+        stack->setClock(&sim.clock);
+        Address address = hostAddress(0x0a000000, i, 5683); // 10.0.x.y
+        stack->addEndpoint(network.createEndpoint(address));
+        DataResource *resource = new DataResource(qMax(0, parser.value(payloadOption).toInt()));
+        stack->addResource(resource);
+        sim.servers.append(stack);
+        sim.serverAddresses.append(address);
+        sim.resources.append(resource);
+    }
+    std::uniform_int_distribution<qint64> phase(0, sim.intervalNsec - 1);
+    for (int i = 0; i < clientCount; ++i) {
+        Stack *stack = new Stack;
+        stack->setClock(&sim.clock);
+        stack->addEndpoint(network.createEndpoint(hostAddress(0x0a800000, i, 5683))); // 10.128.x.y
+        sim.clients.append(stack);
+        sim.clock.schedule(phase(sim.random), [&sim, i]() { sim.request(i); });
+    }
+
+    qInfo().noquote() << QString("%1 clients at %2 requests/s, %3 servers, %4 ms +%5 latency, %6 loss, "
+                                 "%7 duplication, seed %8")
+                         .arg(clientCount).arg(rate).arg(serverCount).arg(link.latency / 1000)
+                         .arg(link.jitter / 1000).arg(link.loss).arg(link.duplication).arg(seed);
+
+    // slices of virtual time, the event loop runs in between for deleteLater() of finished exchanges
+    const qint64 drainMsec = 300 * 1000; // EXCHANGE_LIFETIME is enough for every retransmission to end
+    QElapsedTimer wall;
+    wall.start();
+    QTimer driver;
+    QObject::connect(&driver, &QTimer::timeout, [&]() {
+        sim.clock.runFor(100);
+        bool drained = sim.answered + sim.timedOut >= sim.issued;
+        if (sim.clock.elapsed() < sim.durationMsec || (!drained && sim.clock.elapsed() < sim.durationMsec + drainMsec))
+            return;
+        driver.stop();
+
+        quint64 served = 0;
+        foreach (DataResource *resource, sim.resources)
+            served += resource->requests;
+        SimulationStats stats = network.stats();
+        double simulated = sim.clock.elapsed() / 1000.0;
+        double real = qMax<qint64>(1, wall.elapsed()) / 1000.0;
+
+        qInfo().noquote() << QString("%1 s simulated in %2 s (%3x real time)")
+                             .arg(simulated, 0, 'f', 1).arg(real, 0, 'f', 1).arg(simulated / real, 0, 'f', 1);
+        qInfo().noquote() << QString("requests %1, answered %2, timed out %3, handled by servers %4")
+                             .arg(sim.issued).arg(sim.answered).arg(sim.timedOut).arg(served);
+        qInfo().noquote() << QString("datagrams %1, delivered %2, lost %3, duplicated %4, unreachable %5")
+                             .arg(stats.sent).arg(stats.delivered).arg(stats.lost).arg(stats.duplicated)
+                             .arg(stats.unreachable);
+        qInfo().noquote() << QString("%1 %2 %3 %4 %5 %6").arg("phase", -18).arg("count", 10).arg("p50 ms", 10)
+                             .arg("p99 ms", 10).arg("p99.9 ms", 10).arg("max ms", 10);
+        qInfo().noquote() << phaseLine("queueing", sim.breakdown.queueing);
+        qInfo().noquote() << phaseLine("retransmission", sim.breakdown.retransmission);
+        qInfo().noquote() << phaseLine("network", sim.breakdown.network);
+        qInfo().noquote() << phaseLine("separate response", sim.breakdown.separateResponse);
+        qInfo().noquote() << phaseLine("total", sim.breakdown.total);
+        app.quit();
+    });
+    driver.start(0);
+
+    int result = app.exec();
+    qDeleteAll(sim.clients); // exchanges go with their stacks
+    qDeleteAll(sim.servers);
+    qDeleteAll(sim.resources);
+    return result;
+}
@@ -1,4 +1,8 @@
 TEMPLATE = subdirs
 
 SUBDIRS += \
-    gppd
\ No newline at end of file
+    gppd \
+    coapreplay \
+    coapload \
+    coapserver \
+    coapsim
@@ -0,0 +1,124 @@
+#include "admissioncontrol.hpp"
+#include "peertable.hpp"
+
+bool iotlib::coap::TokenBucket::take(qint64 now, float rate, int burst)
+{
+    if (!updatedAt) {
+        tokens = burst;
+    } else if (now > updatedAt) {
+        tokens = qMin(float(burst), tokens + rate * float(now - updatedAt) / 1000);
+    }
+    updatedAt = now;
+    if (tokens < 1)
+        return false;
+    tokens -= 1;
+    return true;
+}
+
+iotlib::coap::AdmissionControl::AdmissionControl() :
+    m_lastShedAt(0),
+    m_lastPurgeAt(0)
+{
+}
+
+void iotlib::coap::AdmissionControl::setPolicy(const iotlib::coap::AdmissionPolicy &policy)
+{
+    m_policy = policy;
+    m_prefixes.clear();
+}
+
+iotlib::coap::AdmissionPolicy iotlib::coap::AdmissionControl::policy() const
+{
+    return m_policy;
+}
+
+bool iotlib::coap::AdmissionControl::isEnabled() const
+{
+    return m_policy.peerRate > 0 || m_policy.prefixRate > 0 || m_policy.maxInFlight > 0;
+}
+
+iotlib::coap::AdmissionControl::Verdict iotlib::coap::AdmissionControl::admit(iotlib::coap::PeerState *peer,
+                                                                               const iotlib::coap::Address &address,
+                                                                               int inFlight, qint64 now)
+{
+    if (m_policy.maxInFlight > 0 && inFlight >= m_policy.maxInFlight)
+        return shed(ShedOverload, now);
+
+    if (peer && m_policy.peerRate > 0) {
+        if (!peer->admission.take(now, m_policy.peerRate, m_policy.peerBurst))
+            return shed(ShedPeer, now);
+    }
+
+    if (m_policy.prefixRate > 0) {
+        Address prefix = address.prefix(address.isIpv4() ? m_policy.prefixLengthV4 : m_policy.prefixLengthV6);
+        QHash<Address, TokenBucket>::iterator it = m_prefixes.find(prefix);
+        if (it != m_prefixes.end()) {
+            if (!it->take(now, m_policy.prefixRate, m_policy.prefixBurst))
+                return shed(ShedPrefix, now);
+        } else {
+            // sources spread over many prefixes must not grow the table without bound
+            if (m_prefixes.size() >= m_policy.maxPrefixes && !purgeRefilled(now))
+                return shed(ShedPrefix, now);
+            TokenBucket bucket;
+            bucket.updatedAt = 0;
+            bucket.take(now, m_policy.prefixRate, m_policy.prefixBurst);
+            m_prefixes.insert(prefix, bucket);
+        }
+    }
+
+    ++m_stats.admitted;
+    return Admit;
+}
+
+void iotlib::coap::AdmissionControl::charge(iotlib::coap::PeerState *peer, qint64 now)
+{
+    if (m_policy.peerRate > 0)
+        peer->admission.take(now, m_policy.peerRate, m_policy.peerBurst);
+}
+
+iotlib::coap::AdmissionControl::Verdict iotlib::coap::AdmissionControl::shed(Verdict verdict, qint64 now)
+{
+    switch (verdict) {
+    case ShedPeer: ++m_stats.shedPeer; break;
+    case ShedPrefix: ++m_stats.shedPrefix; break;
+    case ShedOverload: ++m_stats.shedOverload; break;
+    case Admit: break;
+    }
+    m_lastShedAt = now;
+    return verdict;
+}
+
+iotlib::coap::AdmissionStats iotlib::coap::AdmissionControl::stats(qint64 now) const
+{
+    AdmissionStats stats = m_stats;
+    stats.shedding = m_lastShedAt && now - m_lastShedAt < 1000;
+    return stats;
+}
+
+bool iotlib::coap::AdmissionControl::purgeRefilled(qint64 now)
+{
+    // at most once a second, a flood hitting the cap would scan the table on every request otherwise
+    if (m_lastPurgeAt && now - m_lastPurgeAt < 1000)
+        return false;
+    m_lastPurgeAt = now;
+    // buckets full again are the same as no bucket, dropping them changes no decision
+    QHash<Address, TokenBucket>::iterator it = m_prefixes.begin();
+    while (it != m_prefixes.end()) {
+        if (it->tokens + m_policy.prefixRate * float(now - it->updatedAt) / 1000 >= m_policy.prefixBurst)
+            it = m_prefixes.erase(it);
+        else
+            ++it;
+    }
+    return m_prefixes.size() < m_policy.maxPrefixes;
+}
+
+void iotlib::coap::AdmissionControl::expire(qint64 updatedAt)
+{
+    QHash<Address, TokenBucket>::iterator it = m_prefixes.begin();
+    while (it != m_prefixes.end()) {
+        if (it->updatedAt < updatedAt)
+            it = m_prefixes.erase(it);
+        else
+            ++it;
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef COAP_ADMISSIONCONTROL_H
+#define COAP_ADMISSIONCONTROL_H
+
+#include "../iotlib_global.h"
+#include "message.hpp"
+
+#include <QHash>
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The AdmissionPolicy struct limits the work peers can make the stack do
+ * Rates are requests per second, 0 disables the limit
+ */
+struct AdmissionPolicy
+{
+    AdmissionPolicy() :
+        peerRate(0), peerBurst(20),
+        prefixRate(0), prefixBurst(200),
+        prefixLengthV4(24), prefixLengthV6(56), maxPrefixes(65536),
+        maxInFlight(0), retryAfter(5)
+    { }
+
+    float peerRate;         ///< per source address and port
+    int peerBurst;
+    float prefixRate;       ///< per network, so a fleet behind one prefix shares a budget
+    int prefixBurst;
+    int prefixLengthV4;
+    int prefixLengthV6;
+    int maxPrefixes;        ///< prefix buckets kept, requests from new prefixes are shed while all are in use
+    int maxInFlight;        ///< deferred and offloaded requests not answered yet, 0 for no cap
+    quint32 retryAfter;     ///< seconds, Max-Age of 5.03 responses
+};
+
+/**
+ * @brief The AdmissionStats struct counts admission decisions since the stack was created
+ */
+struct AdmissionStats
+{
+    AdmissionStats() :
+        admitted(0), shedPeer(0), shedPrefix(0), shedOverload(0), shedding(false)
+    { }
+
+    quint64 admitted;
+    quint64 shedPeer;
+    quint64 shedPrefix;
+    quint64 shedOverload;
+    bool shedding;          ///< something was shed during the last second
+};
+
+/**
+ * @brief The TokenBucket struct refills rate tokens per second up to burst
+ * Zeroed bucket is full on the first take()
+ */
+struct TokenBucket
+{
+    float tokens;
+    qint64 updatedAt;       ///< msec, 0 for never used
+
+    bool take(qint64 now, float rate, int burst);
+};
+
+struct PeerState;
+/**
+ * @brief The AdmissionControl class decides if a request is served or answered with 5.03 right away
+ * Looks only at the source and the global load, so it runs before anything is decoded or allocated.
+ * Global cap is checked first, then the peer bucket, then the prefix bucket.
+ */
+class IOTLIB_SHARED_EXPORT AdmissionControl
+{
+public:
+    enum Verdict {
+        Admit,
+        ShedPeer,
+        ShedPrefix,
+        ShedOverload
+    };
+
+    AdmissionControl();
+
+    void setPolicy(const AdmissionPolicy &policy);
+    AdmissionPolicy policy() const;
+    bool isEnabled() const;
+
+    /**
+     * @brief admit charges peer and prefix buckets
+     * @param peer state of the source, 0 for a peer without state yet, whose bucket would be full
+     * @param inFlight requests whose handlers haven't responded yet
+     * @param now msec
+     */
+    Verdict admit(PeerState *peer, const Address &address, int inFlight, qint64 now);
+    /**
+     * @brief charge takes the admitted request from the bucket of a peer created after admit()
+     */
+    void charge(PeerState *peer, qint64 now);
+
+    AdmissionStats stats(qint64 now) const;
+
+    /**
+     * @brief expire drops prefix buckets idle since updatedAt
+     */
+    void expire(qint64 updatedAt);
+
+private:
+    Verdict shed(Verdict verdict, qint64 now);
+    bool purgeRefilled(qint64 now);
+
+    AdmissionPolicy m_policy;
+    QHash<Address, TokenBucket> m_prefixes;    ///< admitted prefixes only, a missing one has a full bucket
+    AdmissionStats m_stats;
+    qint64 m_lastShedAt;
+    qint64 m_lastPurgeAt;
+};
+
+} // coap
+} // iotlib
+
+Q_DECLARE_TYPEINFO(iotlib::coap::TokenBucket, Q_PRIMITIVE_TYPE);
+
+#endif // COAP_ADMISSIONCONTROL_H
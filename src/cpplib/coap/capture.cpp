@@ -0,0 +1,653 @@
+#include "capture.hpp"
+#include "mpscqueue.hpp"
+#include "endianhelper.h"
+
+#include <QFile>
+#include <QThread>
+#include <QVector>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QAtomicInt>
+#include <QtEndian>
+#include <QDebug>
+
+namespace {
+// pcapng block types and options, draft-ietf-opsawg-pcapng
+const quint32 SECTION_HEADER_BLOCK = 0x0A0D0D0A;
+const quint32 INTERFACE_DESCRIPTION_BLOCK = 1;
+const quint32 SIMPLE_PACKET_BLOCK = 3;
+const quint32 ENHANCED_PACKET_BLOCK = 6;
+const quint32 BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+const quint16 OPTION_END = 0;
+const quint16 OPTION_IF_TSRESOL = 9;
+const quint16 OPTION_EPB_FLAGS = 2;
+const quint32 EPB_INBOUND = 1;
+const quint32 EPB_OUTBOUND = 2;
+
+// classic pcap
+const quint32 PCAP_MAGIC_USEC = 0xA1B2C3D4;
+const quint32 PCAP_MAGIC_NSEC = 0xA1B23C4D;
+
+enum LinkType {
+    LinkNull = 0,
+    LinkEthernet = 1,
+    LinkRaw = 101,
+    LinkLinuxSll = 113,
+    LinkIpv4 = 228,
+    LinkIpv6 = 229,
+    LinkLinuxSll2 = 276
+};
+
+const int IPV4_HEADER = 20;
+const int IPV6_HEADER = 40;
+const int UDP_HEADER = 8;
+const quint8 PROTOCOL_UDP = 17;
+
+inline int padded(int size)
+{
+    return (size + 3) & ~3;
+}
+
+void append16(QByteArray &to, quint16 value)
+{
+    to.append((const char *)&value, 2);
+}
+
+void append32(QByteArray &to, quint32 value)
+{
+    to.append((const char *)&value, 4);
+}
+
+quint16 ipv4Checksum(const quint8 *header)
+{
+    quint32 sum = 0;
+    for (int i = 0; i < IPV4_HEADER; i += 2)
+        sum += endian_load16(quint16, header + i);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return quint16(~sum);
+}
+}
+
+namespace iotlib {
+namespace coap {
+
+class CaptureThread : public QThread
+{
+public:
+    CaptureThread(CaptureWriterPrivate *d) : d(d) { }
+protected:
+    void run();
+private:
+    CaptureWriterPrivate *d;
+};
+
+class CaptureWriterPrivate
+{
+public:
+    CaptureWriterPrivate() :
+        thread(this), queueLimit(65536), epochUsec(0), pending(0), stopping(0), written(0), dropped(0)
+    { }
+
+    QByteArray packet(const CaptureRecord &record) const;
+    void drain();
+
+    CaptureThread thread;
+    QFile file;
+    Address local;
+    int queueLimit;
+
+    QElapsedTimer clock;
+    qint64 epochUsec;           ///< wall clock when clock was started
+
+    MpscQueue<CaptureRecord> queue;
+    QAtomicInt pending;
+    QAtomicInt stopping;
+    QMutex mutex;
+    QWaitCondition wake;
+
+    QAtomicInteger<quint64> written;
+    QAtomicInteger<quint64> dropped;
+};
+
+class CaptureReaderPrivate
+{
+public:
+    CaptureReaderPrivate() : serverPort(5683), pcapng(false), swapped(false), nanoseconds(false), linkType(0) { }
+
+    quint16 read16(const char *from) const
+    {
+        quint16 value;
+        memcpy(&value, from, 2);
+        return swapped ? qbswap(value) : value;
+    }
+    quint32 read32(const char *from) const
+    {
+        quint32 value;
+        memcpy(&value, from, 4);
+        return swapped ? qbswap(value) : value;
+    }
+
+    bool readSectionHeader(const QByteArray &block);
+    void readInterface(const QByteArray &block);
+    bool nextPcap(CaptureRecord &record);
+    bool nextPcapng(CaptureRecord &record);
+    bool decode(int linkType, const char *data, int size, CaptureRecord &record, quint32 flags) const;
+
+    QFile file;
+    QString errorString;
+    quint16 serverPort;
+    bool pcapng;
+    bool swapped;
+    bool nanoseconds;           ///< classic pcap only
+    int linkType;               ///< classic pcap only
+
+    struct Interface
+    {
+        int linkType;
+        qint64 unitsPerSecond;
+    };
+    QVector<Interface> interfaces; ///< pcapng, per section
+};
+
+} // coap
+} // iotlib
+
+void iotlib::coap::CaptureThread::run()
+{
+    while (!d->stopping.loadAcquire()) {
+        d->drain();
+        d->file.flush();
+        d->mutex.lock();
+        if (!d->pending.load() && !d->stopping.load())
+            d->wake.wait(&d->mutex, 50); // producers don't wake us, a few msec of lag is fine for a capture
+        d->mutex.unlock();
+    }
+    d->drain();
+    d->file.flush();
+}
+
+void iotlib::coap::CaptureWriterPrivate::drain()
+{
+    CaptureRecord record;
+    while (queue.pop(record)) {
+        pending.fetchAndAddRelaxed(-1);
+        QByteArray ip = packet(record);
+        int blockLength = 28 + padded(ip.size()) + 12 + 4;
+        QByteArray block;
+        block.reserve(blockLength);
+        append32(block, ENHANCED_PACKET_BLOCK);
+        append32(block, quint32(blockLength));
+        append32(block, 0); // interface
+        append32(block, quint32(quint64(record.timestamp) >> 32));
+        append32(block, quint32(quint64(record.timestamp)));
+        append32(block, quint32(ip.size()));
+        append32(block, quint32(ip.size()));
+        block.append(ip);
+        block.append(padded(ip.size()) - ip.size(), '\0');
+        append16(block, OPTION_EPB_FLAGS);
+        append16(block, 4);
+        append32(block, record.direction == CaptureRecord::Received ? EPB_INBOUND : EPB_OUTBOUND);
+        append16(block, OPTION_END);
+        append16(block, 0);
+        append32(block, quint32(blockLength));
+        if (file.write(block) != block.size()) {
+            dropped.fetchAndAddRelaxed(1);
+            continue;
+        }
+        written.fetchAndAddRelaxed(1);
+    }
+}
+
+QByteArray iotlib::coap::CaptureWriterPrivate::packet(const iotlib::coap::CaptureRecord &record) const
+{
+    bool v4 = record.peer.isIpv4();
+    Address localSide = local;
+    if (localSide.isIpv4() != v4) // the other family, dual stack socket
+        localSide = Address(QHostAddress(v4 ? QHostAddress::LocalHost : QHostAddress::LocalHostIPv6), local.port());
+    const Address &source = record.direction == CaptureRecord::Received ? record.peer : localSide;
+    const Address &destination = record.direction == CaptureRecord::Received ? localSide : record.peer;
+
+    int ipHeader = v4 ? IPV4_HEADER : IPV6_HEADER;
+    int udpLength = UDP_HEADER + record.datagram.size();
+    QByteArray packet(ipHeader + udpLength, '\0');
+    quint8 *p = (quint8 *)packet.data();
+    if (v4) {
+        p[0] = 0x45;
+        endian_store16((p + 2), quint16(ipHeader + udpLength));
+        p[8] = 64;
+        p[9] = PROTOCOL_UDP;
+        memcpy(p + 12, source.ip() + 12, 4);
+        memcpy(p + 16, destination.ip() + 12, 4);
+        endian_store16((p + 10), ipv4Checksum(p));
+    } else {
+        p[0] = 0x60;
+        endian_store16((p + 4), quint16(udpLength));
+        p[6] = PROTOCOL_UDP;
+        p[7] = 64;
+        memcpy(p + 8, source.ip(), 16);
+        memcpy(p + 24, destination.ip(), 16);
+    }
+    quint8 *udp = p + ipHeader;
+    endian_store16(udp, source.port());
+    endian_store16((udp + 2), destination.port());
+    endian_store16((udp + 4), quint16(udpLength));
+    memcpy(udp + UDP_HEADER, record.datagram.constData(), record.datagram.size());
+    return packet;
+}
+
+iotlib::coap::CaptureWriter::CaptureWriter() :
+    d(new CaptureWriterPrivate)
+{
+}
+
+iotlib::coap::CaptureWriter::~CaptureWriter()
+{
+    close();
+    delete d;
+}
+
+bool iotlib::coap::CaptureWriter::open(const QString &fileName, const iotlib::coap::Address &local)
+{
+    close();
+    d->file.setFileName(fileName);
+    if (!d->file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Can't open" << fileName << "for writing:" << d->file.errorString();
+        return false;
+    }
+    d->local = local.isNull() ? Address(QHostAddress(QHostAddress::LocalHost), 5683) : local;
+
+    QByteArray header;
+    append32(header, SECTION_HEADER_BLOCK);
+    append32(header, 28);
+    append32(header, BYTE_ORDER_MAGIC);
+    append16(header, 1);
+    append16(header, 0);
+    append32(header, 0xffffffff); // section length unknown
+    append32(header, 0xffffffff);
+    append32(header, 28);
+
+    append32(header, INTERFACE_DESCRIPTION_BLOCK);
+    append32(header, 32);
+    append16(header, LinkRaw);
+    append16(header, 0);
+    append32(header, 0xffff);
+    append16(header, OPTION_IF_TSRESOL);
+    append16(header, 1);
+    header.append(char(6)); // usec
+    header.append(3, '\0');
+    append16(header, OPTION_END);
+    append16(header, 0);
+    append32(header, 32);
+    d->file.write(header);
+
+    d->written.store(0);
+    d->dropped.store(0);
+    d->stopping.store(0);
+    d->epochUsec = QDateTime::currentMSecsSinceEpoch() * 1000;
+    d->clock.start();
+    d->thread.start(QThread::LowPriority);
+    return true;
+}
+
+void iotlib::coap::CaptureWriter::close()
+{
+    if (!d->thread.isRunning())
+        return;
+    d->stopping.storeRelease(1);
+    d->mutex.lock();
+    d->wake.wakeOne();
+    d->mutex.unlock();
+    d->thread.wait();
+    d->file.close();
+}
+
+bool iotlib::coap::CaptureWriter::isOpen() const
+{
+    return d->thread.isRunning() && !d->stopping.load();
+}
+
+void iotlib::coap::CaptureWriter::setQueueLimit(int limit)
+{
+    d->queueLimit = limit;
+}
+
+int iotlib::coap::CaptureWriter::queueLimit() const
+{
+    return d->queueLimit;
+}
+
+void iotlib::coap::CaptureWriter::write(iotlib::coap::CaptureRecord::Direction direction, const char *data, int size,
+                                        const iotlib::coap::Address &peer)
+{
+    if (!isOpen())
+        return;
+    if (d->pending.fetchAndAddRelaxed(1) >= d->queueLimit) {
+        d->pending.fetchAndAddRelaxed(-1);
+        d->dropped.fetchAndAddRelaxed(1);
+        return;
+    }
+    CaptureRecord record;
+    record.timestamp = d->epochUsec + d->clock.nsecsElapsed() / 1000;
+    record.direction = direction;
+    record.peer = peer;
+    record.datagram = QByteArray(data, size);
+    d->queue.push(record);
+}
+
+quint64 iotlib::coap::CaptureWriter::written() const
+{
+    return d->written.load();
+}
+
+quint64 iotlib::coap::CaptureWriter::dropped() const
+{
+    return d->dropped.load();
+}
+
+bool iotlib::coap::CaptureReaderPrivate::readSectionHeader(const QByteArray &block)
+{
+    if (block.size() < 28)
+        return false;
+    quint32 magic;
+    memcpy(&magic, block.constData() + 8, 4);
+    if (magic == BYTE_ORDER_MAGIC)
+        swapped = false;
+    else if (magic == qbswap(BYTE_ORDER_MAGIC))
+        swapped = true;
+    else
+        return false;
+    interfaces.clear();
+    return true;
+}
+
+void iotlib::coap::CaptureReaderPrivate::readInterface(const QByteArray &block)
+{
+    Interface interface;
+    interface.linkType = block.size() >= 20 ? read16(block.constData() + 8) : -1;
+    interface.unitsPerSecond = 1000000;
+    int offset = 16;
+    while (offset + 4 <= block.size() - 4) {
+        quint16 code = read16(block.constData() + offset);
+        quint16 length = read16(block.constData() + offset + 2);
+        if (code == OPTION_END || offset + 4 + length > block.size() - 4)
+            break;
+        if (code == OPTION_IF_TSRESOL && length >= 1) {
+            quint8 resolution = quint8(block[offset + 4]);
+            qint64 units = 1;
+            for (int i = 0; i < (resolution & 0x7f) && i < 18; ++i)
+                units *= resolution & 0x80 ? 2 : 10;
+            interface.unitsPerSecond = units;
+        }
+        offset += 4 + padded(length);
+    }
+    interfaces.append(interface);
+}
+
+bool iotlib::coap::CaptureReaderPrivate::nextPcap(iotlib::coap::CaptureRecord &record)
+{
+    for (;;) {
+        char header[16];
+        if (file.read(header, sizeof(header)) != sizeof(header))
+            return false;
+        quint32 seconds = read32(header);
+        quint32 fraction = read32(header + 4);
+        quint32 captured = read32(header + 8);
+        if (captured > 0x40000) {
+            errorString = QStringLiteral("Corrupted packet record");
+            return false;
+        }
+        QByteArray data = file.read(captured);
+        if (data.size() != int(captured))
+            return false;
+        record.timestamp = qint64(seconds) * 1000000 + (nanoseconds ? fraction / 1000 : fraction);
+        if (decode(linkType, data.constData(), data.size(), record, 0))
+            return true;
+    }
+}
+
+bool iotlib::coap::CaptureReaderPrivate::nextPcapng(iotlib::coap::CaptureRecord &record)
+{
+    for (;;) {
+        char header[8];
+        if (file.read(header, sizeof(header)) != sizeof(header))
+            return false;
+        quint32 type;
+        memcpy(&type, header, 4); // palindrome for section headers, byte order not known yet
+        if (type == SECTION_HEADER_BLOCK) {
+            char magic[4];
+            if (file.peek(magic, 4) != 4)
+                return false;
+            quint32 value;
+            memcpy(&value, magic, 4);
+            swapped = value != BYTE_ORDER_MAGIC;
+        } else {
+            type = read32(header);
+        }
+        quint32 length = read32(header + 4);
+        if (length < 12 || length > 0x100000 || length % 4) {
+            errorString = QStringLiteral("Corrupted block");
+            return false;
+        }
+        QByteArray block(header, sizeof(header));
+        block.append(file.read(length - sizeof(header)));
+        if (block.size() != int(length))
+            return false;
+
+        if (type == SECTION_HEADER_BLOCK) {
+            if (!readSectionHeader(block)) {
+                errorString = QStringLiteral("Bad section header");
+                return false;
+            }
+            continue;
+        }
+        if (type == INTERFACE_DESCRIPTION_BLOCK) {
+            readInterface(block);
+            continue;
+        }
+        if (type == SIMPLE_PACKET_BLOCK && !interfaces.isEmpty() && length >= 16) {
+            quint32 original = read32(block.constData() + 8);
+            int captured = qMin<int>(int(original), int(length) - 16);
+            record.timestamp = 0; // simple packets have no time
+            if (decode(interfaces.first().linkType, block.constData() + 12, captured, record, 0))
+                return true;
+            continue;
+        }
+        if (type != ENHANCED_PACKET_BLOCK || length < 32)
+            continue;
+
+        quint32 interfaceId = read32(block.constData() + 8);
+        if (int(interfaceId) >= interfaces.size())
+            continue;
+        const Interface &interface = interfaces.at(interfaceId);
+        quint64 units = quint64(read32(block.constData() + 12)) << 32 | read32(block.constData() + 16);
+        quint32 captured = read32(block.constData() + 20);
+        if (28 + padded(int(captured)) > int(length) - 4)
+            continue;
+        quint32 flags = 0;
+        int offset = 28 + padded(int(captured));
+        while (offset + 4 <= int(length) - 4) {
+            quint16 code = read16(block.constData() + offset);
+            quint16 optionLength = read16(block.constData() + offset + 2);
+            if (code == OPTION_END || offset + 4 + optionLength > int(length) - 4)
+                break;
+            if (code == OPTION_EPB_FLAGS && optionLength == 4)
+                flags = read32(block.constData() + offset + 4);
+            offset += 4 + padded(optionLength);
+        }
+        record.timestamp = qint64(units / interface.unitsPerSecond * 1000000 +
+                                  units % interface.unitsPerSecond * 1000000 / interface.unitsPerSecond);
+        if (decode(interface.linkType, block.constData() + 28, int(captured), record, flags & 3))
+            return true;
+    }
+}
+
+bool iotlib::coap::CaptureReaderPrivate::decode(int linkType, const char *data, int size,
+                                                iotlib::coap::CaptureRecord &record, quint32 flags) const
+{
+    const quint8 *p = (const quint8 *)data;
+    const quint8 *end = p + size;
+    quint16 etherType = 0;
+    switch (linkType) {
+    case LinkRaw:
+    case LinkIpv4:
+    case LinkIpv6:
+        break;
+    case LinkNull:
+        if (size < 4)
+            return false;
+        p += 4;
+        break;
+    case LinkEthernet:
+        if (size < 14)
+            return false;
+        etherType = endian_load16(quint16, p + 12);
+        p += 14;
+        while ((etherType == 0x8100 || etherType == 0x88a8) && end - p >= 4) {
+            etherType = endian_load16(quint16, p + 2);
+            p += 4;
+        }
+        if (etherType != 0x0800 && etherType != 0x86dd)
+            return false;
+        break;
+    case LinkLinuxSll:
+        if (size < 16)
+            return false;
+        etherType = endian_load16(quint16, p + 14);
+        p += 16;
+        if (etherType != 0x0800 && etherType != 0x86dd)
+            return false;
+        break;
+    case LinkLinuxSll2:
+        if (size < 20)
+            return false;
+        etherType = endian_load16(quint16, p);
+        p += 20;
+        if (etherType != 0x0800 && etherType != 0x86dd)
+            return false;
+        break;
+    default:
+        return false;
+    }
+
+    if (end - p < 1)
+        return false;
+    quint8 source[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    quint8 destination[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    const quint8 *udp;
+    if ((p[0] >> 4) == 4) {
+        int headerLength = (p[0] & 0x0f) * 4;
+        if (end - p < IPV4_HEADER || headerLength < IPV4_HEADER || end - p < headerLength || p[9] != PROTOCOL_UDP)
+            return false;
+        if (endian_load16(quint16, p + 6) & 0x3fff) // fragment
+            return false;
+        memcpy(source + 12, p + 12, 4);
+        memcpy(destination + 12, p + 16, 4);
+        udp = p + headerLength;
+    } else if ((p[0] >> 4) == 6) {
+        if (end - p < IPV6_HEADER || p[6] != PROTOCOL_UDP) // extension headers are not followed
+            return false;
+        memcpy(source, p + 8, 16);
+        memcpy(destination, p + 24, 16);
+        udp = p + IPV6_HEADER;
+    } else {
+        return false;
+    }
+    if (end - udp < UDP_HEADER)
+        return false;
+    quint16 sourcePort = endian_load16(quint16, udp);
+    quint16 destinationPort = endian_load16(quint16, udp + 2);
+    int payload = qMin<int>(int(endian_load16(quint16, udp + 4)) - UDP_HEADER, int(end - udp) - UDP_HEADER);
+    if (payload < 0)
+        return false;
+
+    if (flags == EPB_INBOUND)
+        record.direction = CaptureRecord::Received;
+    else if (flags == EPB_OUTBOUND)
+        record.direction = CaptureRecord::Sent;
+    else
+        record.direction = destinationPort == serverPort ? CaptureRecord::Received : CaptureRecord::Sent;
+    if (record.direction == CaptureRecord::Received)
+        record.peer = Address::fromRaw(source, sourcePort);
+    else
+        record.peer = Address::fromRaw(destination, destinationPort);
+    record.datagram = QByteArray((const char *)udp + UDP_HEADER, payload);
+    return true;
+}
+
+iotlib::coap::CaptureReader::CaptureReader() :
+    d(new CaptureReaderPrivate)
+{
+}
+
+iotlib::coap::CaptureReader::~CaptureReader()
+{
+    delete d;
+}
+
+bool iotlib::coap::CaptureReader::open(const QString &fileName)
+{
+    close();
+    d->file.setFileName(fileName);
+    if (!d->file.open(QIODevice::ReadOnly)) {
+        d->errorString = d->file.errorString();
+        return false;
+    }
+    char header[24];
+    if (d->file.peek(header, sizeof(header)) != sizeof(header)) {
+        d->errorString = QStringLiteral("File is too short");
+        d->file.close();
+        return false;
+    }
+    quint32 magic;
+    memcpy(&magic, header, 4);
+    if (magic == SECTION_HEADER_BLOCK) {
+        d->pcapng = true;
+        return true;
+    }
+    d->pcapng = false;
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC) {
+        d->swapped = false;
+    } else if (magic == qbswap(PCAP_MAGIC_USEC) || magic == qbswap(PCAP_MAGIC_NSEC)) {
+        d->swapped = true;
+    } else {
+        d->errorString = QStringLiteral("Not a pcap or pcapng file");
+        d->file.close();
+        return false;
+    }
+    d->nanoseconds = d->read32(header) == PCAP_MAGIC_NSEC;
+    d->linkType = int(d->read32(header + 20) & 0xffff);
+    d->file.seek(sizeof(header));
+    return true;
+}
+
+void iotlib::coap::CaptureReader::close()
+{
+    d->file.close();
+    d->interfaces.clear();
+    d->errorString.clear();
+}
+
+void iotlib::coap::CaptureReader::setServerPort(quint16 port)
+{
+    d->serverPort = port;
+}
+
+quint16 iotlib::coap::CaptureReader::serverPort() const
+{
+    return d->serverPort;
+}
+
+bool iotlib::coap::CaptureReader::next(iotlib::coap::CaptureRecord &record)
+{
+    if (!d->file.isOpen())
+        return false;
+    return d->pcapng ? d->nextPcapng(record) : d->nextPcap(record);
+}
+
+QString iotlib::coap::CaptureReader::errorString() const
+{
+    return d->errorString;
+}
@@ -0,0 +1,115 @@
+#ifndef COAP_CAPTURE_H
+#define COAP_CAPTURE_H
+
+#include "../iotlib_global.h"
+#include "message.hpp"
+
+#include <QString>
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The CaptureRecord struct is one datagram as seen by the stack
+ */
+struct CaptureRecord
+{
+    enum Direction {
+        Received,
+        Sent
+    };
+
+    CaptureRecord() : timestamp(0), direction(Received) { }
+
+    qint64 timestamp;       ///< usec since epoch
+    Direction direction;
+    Address peer;
+    QByteArray datagram;
+};
+
+class CaptureWriterPrivate;
+/**
+ * @brief The CaptureWriter class records datagrams into a pcapng file, @see Stack::setCapture()
+ * write() only stamps and queues the datagram, a thread of its own does the file io. When that thread
+ * falls behind more than queueLimit() datagrams new ones are dropped and counted, the stack never waits.
+ * Datagrams get synthesized IP and UDP headers (LINKTYPE_RAW, no UDP checksum) between the peer and
+ * the local address given to open(), direction goes to the epb_flags option, so Wireshark and
+ * tcpdump read the file as is and CaptureReader tells rx from tx without guessing.
+ */
+class IOTLIB_SHARED_EXPORT CaptureWriter
+{
+public:
+    CaptureWriter();
+    ~CaptureWriter();
+
+    /**
+     * @brief open truncates fileName and starts the writer thread
+     * @param local address written as this side, loopback port 5683 if null
+     */
+    bool open(const QString &fileName, const Address &local = Address());
+    /**
+     * @brief close writes out whatever is queued and stops the thread
+     */
+    void close();
+    bool isOpen() const;
+
+    /**
+     * @brief setQueueLimit Datagrams waiting for the writer thread before new ones are dropped
+     * @param limit 65536 by default
+     */
+    void setQueueLimit(int limit);
+    int queueLimit() const;
+
+    /**
+     * @brief write is safe to call from any thread, never blocks
+     */
+    void write(CaptureRecord::Direction direction, const char *data, int size, const Address &peer);
+
+    quint64 written() const;
+    quint64 dropped() const;
+
+private:
+    Q_DISABLE_COPY(CaptureWriter)
+    CaptureWriterPrivate *d;
+};
+
+class CaptureReaderPrivate;
+/**
+ * @brief The CaptureReader class reads UDP datagrams out of pcap and pcapng files
+ * Understands raw IP, Ethernet (with VLAN tags), Linux cooked and BSD loopback link types.
+ * Other packets, IP fragments and non UDP traffic are skipped. Direction comes from epb_flags when
+ * the file has them, otherwise datagrams to serverPort() are Received and everything else is Sent.
+ */
+class IOTLIB_SHARED_EXPORT CaptureReader
+{
+public:
+    CaptureReader();
+    ~CaptureReader();
+
+    bool open(const QString &fileName);
+    void close();
+
+    /**
+     * @brief setServerPort Port of the captured server, for files without direction flags
+     * @param port 5683 by default
+     */
+    void setServerPort(quint16 port);
+    quint16 serverPort() const;
+
+    /**
+     * @brief next reads the next UDP datagram
+     * @return false at the end of file or on error, @see errorString()
+     */
+    bool next(CaptureRecord &record);
+
+    QString errorString() const;
+
+private:
+    Q_DISABLE_COPY(CaptureReader)
+    CaptureReaderPrivate *d;
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_CAPTURE_H
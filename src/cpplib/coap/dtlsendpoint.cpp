@@ -0,0 +1,774 @@
+#include "dtlsendpoint.h"
+#include "peertable.hpp"
+
+#include <QUdpSocket>
+#include <QTimer>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+#include <QHash>
+#include <QDateTime>
+#include <QDebug>
+
+#include <mbedtls/version.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_cookie.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/timing.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+
+#include <string.h>
+
+#if !defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+#error "mbedTLS must be built with MBEDTLS_SSL_DTLS_CONNECTION_ID"
+#endif
+#if !defined(MBEDTLS_THREADING_C)
+#error "mbedTLS must be built with MBEDTLS_THREADING_C, handshakes run on worker threads"
+#endif
+
+namespace iotlib {
+namespace coap {
+
+static const int cidLength = 6;
+static const quint8 cidContentType = 25;     // tls12_cid record, RFC9146
+static const quint8 handshakeContentType = 22;
+static const int maxRecordSize = 16384 + 2048;
+
+class DtlsSession
+{
+public:
+    DtlsSession() :
+        id(0),
+        client(false),
+        port(0),
+        rebindPort(0),
+        state(Handshaking),
+        scheduled(false),
+        closing(false),
+        result(0),
+        lastSeen(0)
+    {
+        mbedtls_ssl_init(&ssl);
+    }
+    ~DtlsSession()
+    {
+        mbedtls_ssl_free(&ssl);
+    }
+
+    enum State {
+        Handshaking,
+        Established
+    };
+
+    quint32 id;
+    bool client;
+    QHostAddress address;
+    quint16 port;
+    QHostAddress rebindAddress; ///< where the last record with our CID came from
+    quint16 rebindPort;
+    QByteArray transportId;     ///< peer identity for HelloVerifyRequest cookies
+    QByteArray cid;             ///< our Connection ID, peer puts it into every record it sends
+    mbedtls_ssl_context ssl;
+    mbedtls_timing_delay_context timer;
+    State state;
+    bool scheduled;             ///< handshake step is queued on the worker pool
+    bool closing;               ///< remove as soon as worker is done with it
+    int result;                 ///< last mbedtls_ssl_handshake() result
+    qint64 lastSeen;
+
+    QMutex sslMutex;            ///< ssl context is driven by one thread at a time
+    QMutex ioMutex;             ///< guards inbox and outbox
+    QList<QByteArray> inbox;
+    QList<QByteArray> outbox;
+    QList<QByteArray> pending;  ///< packed messages waiting for the handshake
+};
+
+class DtlsEndpointPrivate
+{
+public:
+    DtlsEndpointPrivate(DtlsEndpoint *q);
+    ~DtlsEndpointPrivate();
+
+    bool setup();
+    bool setupConfig(mbedtls_ssl_config *conf, int endpointType);
+    DtlsSession *createSession(bool client, const QHostAddress &address, quint16 port);
+    /**
+     * @brief checkCookie verifies cookie of a ClientHello from unknown peer without creating any state,
+     * ClientHellos without a valid one get HelloVerifyRequest in reply (RFC6347 4.2.1)
+     * @return true if the peer proved it owns the address and a session may be created
+     */
+    bool checkCookie(const QByteArray &datagram, const QByteArray &transportId, QByteArray *reply);
+    void removeSession(DtlsSession *session);
+    DtlsSession *sessionFor(const QByteArray &datagram, const QHostAddress &from, quint16 fromPort);
+    void schedule(DtlsSession *session);
+    void flush(DtlsSession *session);
+    void readApplicationData(DtlsSession *session);
+    void writeApplicationData(DtlsSession *session, const QByteArray &data);
+    void saveForResumption(DtlsSession *session);
+
+    DtlsEndpoint *q;
+    Settings *settings;
+    QUdpSocket *socket;
+    QTimer *tickTimer;
+    QThreadPool handshakePool;
+
+    QMutex rngMutex;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctrDrbg;
+    mbedtls_ssl_config serverConf;
+    mbedtls_ssl_config clientConf;
+    mbedtls_ssl_cookie_ctx cookies;
+    mbedtls_ssl_cache_context cache;
+    mbedtls_ssl_ticket_context tickets;
+    mbedtls_x509_crt ca;
+    mbedtls_x509_crt cert;
+    mbedtls_pk_context key;
+    bool haveCa;
+    bool haveCert;
+    QByteArray psk;
+    QByteArray pskIdentity;
+    bool configured;
+
+    quint32 nextSessionId;
+    QHash<quint32, DtlsSession *> sessions;
+    PeerTable peers;                                  ///< PeerState::dtlsSession is the session
+    DtlsSession *sessionByPeer(const Address &peer) const;
+    QHash<QByteArray, DtlsSession *> sessionByCid;
+    QHash<Address, mbedtls_ssl_session *> resumption; ///< client sessions to resume on reconnect
+    QHash<Address, QByteArray> serverNames;           ///< expected in server certificates, @see setServerName()
+    int handshakes;
+    int maxHandshakes;
+    qint64 sessionTimeout;
+    QByteArray plaintext;
+};
+
+static QByteArray transportIdFor(const QHostAddress &address, quint16 port)
+{
+    QByteArray transportId = address.toString().toLatin1();
+    transportId.append((const char *)&port, sizeof(port));
+    return transportId;
+}
+
+static int lockedRandom(void *ctx, unsigned char *output, size_t len)
+{
+    DtlsEndpointPrivate *d = static_cast<DtlsEndpointPrivate *>(ctx);
+    QMutexLocker locker(&d->rngMutex);
+    return mbedtls_ctr_drbg_random(&d->ctrDrbg, output, len);
+}
+
+static int sessionSend(void *ctx, const unsigned char *buf, size_t len)
+{
+    DtlsSession *session = static_cast<DtlsSession *>(ctx);
+    QMutexLocker locker(&session->ioMutex);
+    session->outbox.append(QByteArray((const char *)buf, (int)len));
+    return (int)len;
+}
+
+static int sessionRecv(void *ctx, unsigned char *buf, size_t len)
+{
+    DtlsSession *session = static_cast<DtlsSession *>(ctx);
+    QMutexLocker locker(&session->ioMutex);
+    if (session->inbox.isEmpty())
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    QByteArray datagram = session->inbox.takeFirst();
+    size_t size = qMin((size_t)datagram.size(), len);
+    memcpy(buf, datagram.constData(), size);
+    return (int)size;
+}
+
+/**
+ * @brief The DtlsHandshakeTask class advances one handshake on the worker pool
+ * and reports back to the endpoint thread
+ */
+class DtlsHandshakeTask : public QRunnable
+{
+public:
+    DtlsHandshakeTask(DtlsEndpoint *endpoint, DtlsSession *session) :
+        m_endpoint(endpoint), m_session(session)
+    { }
+
+    void run()
+    {
+        {
+            QMutexLocker locker(&m_session->sslMutex);
+            int ret = mbedtls_ssl_handshake(&m_session->ssl);
+            if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED) {
+                // cookie is on it's way, wait for ClientHello carrying it with a clean context
+                mbedtls_ssl_session_reset(&m_session->ssl);
+                mbedtls_ssl_set_client_transport_id(&m_session->ssl,
+                                                    (const unsigned char *)m_session->transportId.constData(),
+                                                    m_session->transportId.size());
+                mbedtls_ssl_set_cid(&m_session->ssl, MBEDTLS_SSL_CID_ENABLED,
+                                    (const unsigned char *)m_session->cid.constData(), m_session->cid.size());
+                ret = MBEDTLS_ERR_SSL_WANT_READ;
+            }
+            m_session->result = ret;
+        }
+        QMetaObject::invokeMethod(m_endpoint, "onHandshakeStepDone", Qt::QueuedConnection,
+                                  Q_ARG(quint32, m_session->id));
+    }
+
+private:
+    DtlsEndpoint *m_endpoint;
+    DtlsSession *m_session;
+};
+
+} // coap
+} // iotlib
+
+iotlib::coap::DtlsEndpointPrivate::DtlsEndpointPrivate(DtlsEndpoint *q) :
+    q(q),
+    settings(0),
+    socket(0),
+    tickTimer(0),
+    haveCa(false),
+    haveCert(false),
+    configured(false),
+    nextSessionId(1),
+    handshakes(0),
+    maxHandshakes(256),
+    sessionTimeout(600000)
+{
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctrDrbg);
+    mbedtls_ssl_config_init(&serverConf);
+    mbedtls_ssl_config_init(&clientConf);
+    mbedtls_ssl_cookie_init(&cookies);
+    mbedtls_ssl_cache_init(&cache);
+    mbedtls_ssl_ticket_init(&tickets);
+    mbedtls_x509_crt_init(&ca);
+    mbedtls_x509_crt_init(&cert);
+    mbedtls_pk_init(&key);
+    plaintext.resize(maxRecordSize);
+}
+
+iotlib::coap::DtlsEndpointPrivate::~DtlsEndpointPrivate()
+{
+    handshakePool.waitForDone();
+    qDeleteAll(sessions);
+    foreach (mbedtls_ssl_session *saved, resumption) {
+        mbedtls_ssl_session_free(saved);
+        delete saved;
+    }
+    mbedtls_pk_free(&key);
+    mbedtls_x509_crt_free(&cert);
+    mbedtls_x509_crt_free(&ca);
+    mbedtls_ssl_ticket_free(&tickets);
+    mbedtls_ssl_cache_free(&cache);
+    mbedtls_ssl_cookie_free(&cookies);
+    mbedtls_ssl_config_free(&clientConf);
+    mbedtls_ssl_config_free(&serverConf);
+    mbedtls_ctr_drbg_free(&ctrDrbg);
+    mbedtls_entropy_free(&entropy);
+}
+
+bool iotlib::coap::DtlsEndpointPrivate::setup()
+{
+    static const char personalization[] = "iotlib-coaps";
+    if (mbedtls_ctr_drbg_seed(&ctrDrbg, mbedtls_entropy_func, &entropy,
+                              (const unsigned char *)personalization, sizeof(personalization) - 1) != 0) {
+        qWarning() << "DTLS: can't seed random generator";
+        return false;
+    }
+
+    QString caFile = settings->get("dtls_ca").toString();
+    QString certFile = settings->get("dtls_cert").toString();
+    QString keyFile = settings->get("dtls_key").toString();
+    if (!caFile.isEmpty() && mbedtls_x509_crt_parse_file(&ca, caFile.toLocal8Bit().constData()) != 0) {
+        qWarning() << "DTLS: can't load" << caFile;
+        return false;
+    }
+    haveCa = !caFile.isEmpty();
+    if (!certFile.isEmpty()) {
+        int ret = mbedtls_x509_crt_parse_file(&cert, certFile.toLocal8Bit().constData());
+#if MBEDTLS_VERSION_MAJOR >= 3
+        if (ret == 0)
+            ret = mbedtls_pk_parse_keyfile(&key, keyFile.toLocal8Bit().constData(), 0, lockedRandom, this);
+#else
+        if (ret == 0)
+            ret = mbedtls_pk_parse_keyfile(&key, keyFile.toLocal8Bit().constData(), 0);
+#endif
+        if (ret != 0) {
+            qWarning() << "DTLS: can't load" << certFile << "or" << keyFile;
+            return false;
+        }
+        haveCert = true;
+    }
+    psk = QByteArray::fromHex(settings->get("dtls_psk").toByteArray());
+    pskIdentity = settings->get("dtls_psk_identity").toByteArray();
+    if (certFile.isEmpty() && psk.isEmpty()) {
+        qWarning() << "DTLS: neither dtls_cert nor dtls_psk is set";
+        return false;
+    }
+
+    if (!setupConfig(&serverConf, MBEDTLS_SSL_IS_SERVER) ||
+            !setupConfig(&clientConf, MBEDTLS_SSL_IS_CLIENT))
+        return false;
+
+    // DtlsEndpoint::onReadyRead() checks cookies before a session exists, contexts check them once more
+    mbedtls_ssl_cookie_setup(&cookies, lockedRandom, this);
+    mbedtls_ssl_conf_dtls_cookies(&serverConf, mbedtls_ssl_cookie_write, mbedtls_ssl_cookie_check, &cookies);
+    // reconnecting clients get an abbreviated handshake either from cache or from their ticket
+    mbedtls_ssl_cache_set_max_entries(&cache, settings->get("dtls_session_cache_size").isValid() ?
+                                          settings->get("dtls_session_cache_size").toInt() : 100000);
+    mbedtls_ssl_conf_session_cache(&serverConf, &cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+    if (mbedtls_ssl_ticket_setup(&tickets, lockedRandom, this, MBEDTLS_CIPHER_AES_256_GCM, 86400) == 0)
+        mbedtls_ssl_conf_session_tickets_cb(&serverConf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &tickets);
+    mbedtls_ssl_conf_session_tickets(&clientConf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+    configured = true;
+    return true;
+}
+
+bool iotlib::coap::DtlsEndpointPrivate::setupConfig(mbedtls_ssl_config *conf, int endpointType)
+{
+    if (mbedtls_ssl_config_defaults(conf, endpointType, MBEDTLS_SSL_TRANSPORT_DATAGRAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+        return false;
+    mbedtls_ssl_conf_rng(conf, lockedRandom, this);
+    mbedtls_ssl_conf_handshake_timeout(conf, 1000, 32000);
+    mbedtls_ssl_conf_cid(conf, cidLength, MBEDTLS_SSL_UNEXPECTED_CID_IGNORE);
+    if (haveCa) {
+        mbedtls_ssl_conf_ca_chain(conf, &ca, 0);
+        mbedtls_ssl_conf_authmode(conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    } else {
+        mbedtls_ssl_conf_authmode(conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    if (haveCert && mbedtls_ssl_conf_own_cert(conf, &cert, &key) != 0)
+        return false;
+    if (!psk.isEmpty() &&
+            mbedtls_ssl_conf_psk(conf, (const unsigned char *)psk.constData(), psk.size(),
+                                 (const unsigned char *)pskIdentity.constData(), pskIdentity.size()) != 0)
+        return false;
+    return true;
+}
+
+iotlib::coap::DtlsSession *iotlib::coap::DtlsEndpointPrivate::createSession(bool client,
+                                                                          const QHostAddress &address,
+                                                                          quint16 port)
+{
+    DtlsSession *session = new DtlsSession;
+    session->id = nextSessionId++;
+    session->client = client;
+    session->address = address;
+    session->port = port;
+    session->lastSeen = QDateTime::currentMSecsSinceEpoch();
+    if (mbedtls_ssl_setup(&session->ssl, client ? &clientConf : &serverConf) != 0) {
+        delete session;
+        return 0;
+    }
+    mbedtls_ssl_set_bio(&session->ssl, session, sessionSend, sessionRecv, 0);
+    mbedtls_ssl_set_timer_cb(&session->ssl, &session->timer,
+                             mbedtls_timing_set_delay, mbedtls_timing_get_delay);
+
+    session->cid.resize(cidLength);
+    do {
+        lockedRandom(this, (unsigned char *)session->cid.data(), cidLength);
+    } while (sessionByCid.contains(session->cid));
+    mbedtls_ssl_set_cid(&session->ssl, MBEDTLS_SSL_CID_ENABLED,
+                        (const unsigned char *)session->cid.constData(), session->cid.size());
+
+    if (client) {
+        // without it any certificate signed by the CA would do, and newer mbedTLS refuses to verify at all
+        QByteArray serverName = serverNames.value(Address(address, port));
+        if (serverName.isEmpty())
+            serverName = address.toString().toLatin1();
+        if (mbedtls_ssl_set_hostname(&session->ssl, serverName.constData()) != 0) {
+            qWarning() << "Can't set DTLS server name" << serverName;
+            delete session;
+            return 0;
+        }
+        mbedtls_ssl_session *saved = resumption.value(Address(address, port), 0);
+        if (saved)
+            mbedtls_ssl_set_session(&session->ssl, saved);
+    } else {
+        session->transportId = transportIdFor(address, port);
+        mbedtls_ssl_set_client_transport_id(&session->ssl,
+                                            (const unsigned char *)session->transportId.constData(),
+                                            session->transportId.size());
+    }
+
+    sessions.insert(session->id, session);
+    peers.insert(Address(address, port))->dtlsSession = session;
+    sessionByCid.insert(session->cid, session);
+    handshakes++;
+    return session;
+}
+
+bool iotlib::coap::DtlsEndpointPrivate::checkCookie(const QByteArray &datagram, const QByteArray &transportId,
+                                                    QByteArray *reply)
+{
+    // record header(13), handshake header(12), client_version(2), random(32), session_id, cookie
+    const quint8 *in = (const quint8 *)datagram.constData();
+    int size = datagram.size();
+    if (size < 61 || in[0] != handshakeContentType ||
+            in[3] != 0 || in[4] != 0 ||                  // epoch 0
+            in[13] != MBEDTLS_SSL_HS_CLIENT_HELLO ||
+            in[19] != 0 || in[20] != 0 || in[21] != 0)  // first fragment
+        return false;
+    int sessionIdLength = in[59];
+    if (61 + sessionIdLength > size)
+        return false;
+    int cookieLength = in[60 + sessionIdLength];
+    if (61 + sessionIdLength + cookieLength > size)
+        return false;
+    const unsigned char *id = (const unsigned char *)transportId.constData();
+    if (cookieLength && mbedtls_ssl_cookie_check(&cookies, in + 61 + sessionIdLength, cookieLength,
+                                                 id, transportId.size()) == 0)
+        return true;
+
+    // HelloVerifyRequest reuses ClientHello's record and handshake headers
+    quint8 out[128];
+    memcpy(out, in, 25);
+    out[13] = MBEDTLS_SSL_HS_HELLO_VERIFY_REQUEST;
+    out[25] = 0xfe; // DTLS 1.0, RFC6347 4.2.1
+    out[26] = 0xff;
+    unsigned char *p = out + 28;
+    if (mbedtls_ssl_cookie_write(&cookies, &p, out + sizeof(out), id, transportId.size()) != 0)
+        return false;
+    int length = int(p - out);
+    out[27] = quint8(length - 28);
+    out[14] = out[22] = quint8((length - 25) >> 16);
+    out[15] = out[23] = quint8((length - 25) >> 8);
+    out[16] = out[24] = quint8(length - 25);
+    out[11] = quint8((length - 13) >> 8);
+    out[12] = quint8(length - 13);
+    *reply = QByteArray((const char *)out, length);
+    return false;
+}
+
+void iotlib::coap::DtlsEndpointPrivate::removeSession(DtlsSession *session)
+{
+    if (session->scheduled) { // worker still holds it, finish in onHandshakeStepDone()
+        session->closing = true;
+        return;
+    }
+    if (session->state == DtlsSession::Handshaking)
+        handshakes--;
+    sessions.remove(session->id);
+    if (sessionByPeer(Address(session->address, session->port)) == session)
+        peers.remove(Address(session->address, session->port));
+    sessionByCid.remove(session->cid);
+    delete session;
+}
+
+iotlib::coap::DtlsSession *iotlib::coap::DtlsEndpointPrivate::sessionFor(const QByteArray &datagram,
+                                                                       const QHostAddress &from,
+                                                                       quint16 fromPort)
+{
+    // header: type, version(2), epoch(2), sequence number(6), then CID
+    const quint8 *p = (const quint8 *)datagram.constData();
+    if (datagram.size() >= 11 + cidLength && p[0] == cidContentType) {
+        DtlsSession *session = sessionByCid.value(QByteArray::fromRawData((const char *)p + 11, cidLength), 0);
+        if (session) {
+            session->rebindAddress = from;
+            session->rebindPort = fromPort;
+            return session;
+        }
+    }
+    return sessionByPeer(Address(from, fromPort));
+}
+
+iotlib::coap::DtlsSession *iotlib::coap::DtlsEndpointPrivate::sessionByPeer(const iotlib::coap::Address &peer) const
+{
+    const PeerState *state = peers.find(peer);
+    return state ? static_cast<DtlsSession *>(state->dtlsSession) : 0;
+}
+
+void iotlib::coap::DtlsEndpointPrivate::schedule(DtlsSession *session)
+{
+    if (session->scheduled)
+        return;
+    session->scheduled = true;
+    handshakePool.start(new DtlsHandshakeTask(q, session));
+}
+
+void iotlib::coap::DtlsEndpointPrivate::flush(DtlsSession *session)
+{
+    QList<QByteArray> outbox;
+    {
+        QMutexLocker locker(&session->ioMutex);
+        outbox.swap(session->outbox);
+    }
+    foreach (const QByteArray &record, outbox)
+        socket->writeDatagram(record, session->address, session->port);
+}
+
+void iotlib::coap::DtlsEndpointPrivate::readApplicationData(DtlsSession *session)
+{
+    forever {
+        int ret;
+        {
+            QMutexLocker locker(&session->sslMutex);
+            ret = mbedtls_ssl_read(&session->ssl, (unsigned char *)plaintext.data(), plaintext.size());
+        }
+        if (ret > 0) {
+            // authenticated record with our CID from a new address: peer went through NAT rebinding
+            if (!session->rebindAddress.isNull() &&
+                    (session->rebindAddress != session->address || session->rebindPort != session->port)) {
+                peers.remove(Address(session->address, session->port));
+                session->address = session->rebindAddress;
+                session->port = session->rebindPort;
+                peers.insert(Address(session->address, session->port))->dtlsSession = session;
+            }
+            Address peer(session->address, session->port);
+            q->captureDatagram(CaptureRecord::Received, plaintext.constData(), ret, peer); // decrypted
+            Message message;
+            message.unpack(QByteArray(plaintext.constData(), ret));
+            message.setAddress(peer);
+            if (message.isValid())
+                q->deliver(message);
+            continue;
+        }
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+            break;
+        if (ret == MBEDTLS_ERR_SSL_CLIENT_RECONNECT) { // same peer started over, ClientHello is in the context
+            session->state = DtlsSession::Handshaking;
+            handshakes++;
+            schedule(session);
+            break;
+        }
+        if (ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+            qWarning() << "DTLS read from" << session->address << "failed:" << hex << -ret;
+        flush(session);
+        removeSession(session);
+        return;
+    }
+    flush(session);
+}
+
+void iotlib::coap::DtlsEndpointPrivate::writeApplicationData(DtlsSession *session, const QByteArray &data)
+{
+    int ret;
+    {
+        QMutexLocker locker(&session->sslMutex);
+        ret = mbedtls_ssl_write(&session->ssl, (const unsigned char *)data.constData(), data.size());
+    }
+    if (ret < 0)
+        qWarning() << "DTLS write to" << session->address << "failed:" << hex << -ret;
+    else
+        q->captureDatagram(CaptureRecord::Sent, data.constData(), data.size(), Address(session->address, session->port));
+    flush(session);
+}
+
+void iotlib::coap::DtlsEndpointPrivate::saveForResumption(DtlsSession *session)
+{
+    Address peer(session->address, session->port);
+    mbedtls_ssl_session *saved = resumption.value(peer, 0);
+    if (saved) {
+        mbedtls_ssl_session_free(saved);
+    } else {
+        saved = new mbedtls_ssl_session;
+        resumption.insert(peer, saved);
+    }
+    mbedtls_ssl_session_init(saved);
+    QMutexLocker locker(&session->sslMutex);
+    mbedtls_ssl_get_session(&session->ssl, saved);
+}
+
+iotlib::coap::DtlsEndpoint::DtlsEndpoint(iotlib::Settings *settings, QObject *parent) :
+    iotlib::coap::EndpointBase(parent), d(new iotlib::coap::DtlsEndpointPrivate(this))
+{
+    d->settings = settings;
+    d->socket = new QUdpSocket(this);
+    connect(d->socket, &QUdpSocket::readyRead,
+            this,      &DtlsEndpoint::onReadyRead);
+
+    d->tickTimer = new QTimer(this);
+    connect(d->tickTimer, &QTimer::timeout,
+            this,         &DtlsEndpoint::onTick);
+    d->tickTimer->start(250);
+
+    connect(settings, &Settings::settingsChanged,
+            this,     &DtlsEndpoint::onSettingsChanged);
+    onSettingsChanged();
+}
+
+iotlib::coap::DtlsEndpoint::~DtlsEndpoint()
+{
+    if (d) {
+        delete d;
+        d = 0;
+    }
+}
+
+void iotlib::coap::DtlsEndpoint::setServerName(const iotlib::coap::Address &peer, const QString &name)
+{
+    if (name.isEmpty())
+        d->serverNames.remove(peer);
+    else
+        d->serverNames.insert(peer, name.toUtf8());
+}
+
+void iotlib::coap::DtlsEndpoint::send(const iotlib::coap::Message &coapMessage)
+{
+    if (!d->configured) {
+        qWarning() << "DTLS endpoint is not configured, can't send";
+        return;
+    }
+    Address peer = coapMessage.address();
+    DtlsSession *session = d->sessionByPeer(peer);
+    if (!session) {
+        session = d->createSession(true, peer.hostAddress(), peer.port());
+        if (!session)
+            return;
+    }
+
+    QByteArray packed = coapMessage.pack();
+    if (session->state == DtlsSession::Established && !session->scheduled) {
+        d->writeApplicationData(session, packed);
+    } else {
+        session->pending.append(packed);
+        if (session->client)
+            d->schedule(session);
+    }
+}
+
+void iotlib::coap::DtlsEndpoint::onSettingsChanged()
+{
+    if (!d->configured && !d->setup())
+        return;
+
+    QVariant maxHandshakes = d->settings->get("dtls_max_handshakes");
+    if (maxHandshakes.isValid())
+        d->maxHandshakes = maxHandshakes.toInt();
+    QVariant sessionTimeout = d->settings->get("dtls_session_timeout");
+    if (sessionTimeout.isValid())
+        d->sessionTimeout = sessionTimeout.toLongLong() * 1000;
+    QVariant threads = d->settings->get("dtls_handshake_threads");
+    d->handshakePool.setMaxThreadCount(threads.isValid() ? threads.toInt() : QThread::idealThreadCount());
+
+    bool bind = d->settings->get("bind").toBool();
+    if (!bind)
+        return;
+    QHostAddress interface(d->settings->get("interface").toString());
+    quint16 port = static_cast<quint16>(d->settings->get("port").toUInt());
+    if (port == 0)
+        port = 5684;
+    if (d->socket->localAddress() == interface && d->socket->localPort() == port)
+        return;
+    d->socket->abort();
+    if (!d->socket->bind(interface, port))
+        qWarning() << "Bind failed:" << d->socket->errorString();
+}
+
+void iotlib::coap::DtlsEndpoint::onReadyRead()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    while (d->socket->hasPendingDatagrams()) {
+        QByteArray datagram;
+        datagram.resize(static_cast<int>(d->socket->pendingDatagramSize()));
+        QHostAddress from;
+        quint16 fromPort;
+        d->socket->readDatagram(datagram.data(), datagram.size(),
+                                &from, &fromPort);
+        if (datagram.isEmpty() || !d->configured)
+            continue;
+
+        DtlsSession *session = d->sessionFor(datagram, from, fromPort);
+        if (!session) {
+            if ((quint8)datagram[0] != handshakeContentType)
+                continue;
+            // no session until the cookie comes back, spoofed ClientHellos cost one HMAC and leave nothing behind
+            QByteArray reply;
+            if (!d->checkCookie(datagram, transportIdFor(from, fromPort), &reply)) {
+                if (!reply.isEmpty())
+                    d->socket->writeDatagram(reply, from, fromPort);
+                continue;
+            }
+            // reconnect storm: drop ClientHellos above the limit, clients retransmit them later
+            if (d->handshakes >= d->maxHandshakes)
+                continue;
+            session = d->createSession(false, from, fromPort);
+            if (!session)
+                continue;
+        }
+        session->lastSeen = now;
+        {
+            QMutexLocker locker(&session->ioMutex);
+            session->inbox.append(datagram);
+        }
+        if (session->state == DtlsSession::Established && !session->scheduled)
+            d->readApplicationData(session);
+        else
+            d->schedule(session);
+    }
+}
+
+void iotlib::coap::DtlsEndpoint::onHandshakeStepDone(quint32 sessionId)
+{
+    DtlsSession *session = d->sessions.value(sessionId, 0);
+    if (!session)
+        return;
+    session->scheduled = false;
+    d->flush(session);
+    if (session->closing) {
+        d->removeSession(session);
+        return;
+    }
+
+    int ret = session->result;
+    if (ret == 0) {
+        session->state = DtlsSession::Established;
+        d->handshakes--;
+        if (session->client)
+            d->saveForResumption(session);
+        foreach (const QByteArray &packed, session->pending)
+            d->writeApplicationData(session, packed);
+        session->pending.clear();
+        d->readApplicationData(session); // records which arrived right after Finished
+        return;
+    }
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        bool more;
+        {
+            QMutexLocker locker(&session->ioMutex);
+            more = !session->inbox.isEmpty();
+        }
+        if (more)
+            d->schedule(session);
+        return;
+    }
+
+    qWarning() << "DTLS handshake with" << session->address << "failed:" << hex << -ret;
+    if (session->client && !session->pending.isEmpty())
+        qWarning() << session->pending.size() << "messages to" << session->address << "were not sent";
+    d->removeSession(session);
+}
+
+void iotlib::coap::DtlsEndpoint::onTick()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<DtlsSession *> expired;
+    foreach (DtlsSession *session, d->sessions) {
+        if (session->scheduled)
+            continue;
+        if (now - session->lastSeen > d->sessionTimeout) {
+            expired.append(session);
+            continue;
+        }
+        if (session->state != DtlsSession::Handshaking)
+            continue;
+        // handshake flight timed out, next step retransmits it or gives up
+        bool timedOut;
+        {
+            QMutexLocker locker(&session->sslMutex);
+            timedOut = mbedtls_timing_get_delay(&session->timer) == 2;
+        }
+        if (timedOut)
+            d->schedule(session);
+    }
+    foreach (DtlsSession *session, expired) {
+        if (session->state == DtlsSession::Established) {
+            QMutexLocker locker(&session->sslMutex);
+            mbedtls_ssl_close_notify(&session->ssl);
+        }
+        d->flush(session);
+        d->removeSession(session);
+    }
+}
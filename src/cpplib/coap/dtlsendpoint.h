@@ -0,0 +1,60 @@
+#ifndef DTLSENDPOINT_H
+#define DTLSENDPOINT_H
+
+#include "endpointbase.hpp"
+#include "../settings.h"
+
+#include <QObject>
+
+class QUdpSocket;
+
+namespace iotlib {
+namespace coap {
+
+class DtlsEndpointPrivate;
+
+/**
+ * @brief The DtlsEndpoint class carries coaps:// over DTLS 1.2 (mbedTLS)
+ * Server side keeps a session cache and issues session tickets, so reconnecting clients
+ * do an abbreviated handshake; client side resumes saved sessions on its own.
+ * Every session gets a Connection ID (RFC9146), records carrying it are matched to the session
+ * even if peer address changed (NAT rebinding), no new handshake is needed then.
+ * Handshakes run on a worker pool, rx loop only demultiplexes records and decrypts application data.
+ *
+ * Settings: "bind", "interface", "port" (5684 by default) same as UdpEndpoint,
+ * "dtls_ca", "dtls_cert", "dtls_key" PEM file paths or "dtls_psk" (hex) with "dtls_psk_identity",
+ * "dtls_max_handshakes" limits handshakes in progress (256 by default), new ones are dropped above it,
+ * "dtls_session_timeout" in seconds (600 by default).
+ */
+class DtlsEndpoint : public EndpointBase
+{
+    Q_OBJECT
+public:
+    DtlsEndpoint(Settings *settings, QObject *parent = 0);
+    ~DtlsEndpoint();
+
+    QString scheme() const { return QStringLiteral("coaps"); }
+    /**
+     * @brief setServerName name checked against CN/SAN of peer's certificate on client handshakes,
+     * peer's IP address is checked when none is set
+     */
+    void setServerName(const Address &peer, const QString &name);
+
+public slots:
+     void send(const Message &coapMessage);
+
+private slots:
+    void onSettingsChanged();
+    void onReadyRead();
+    void onHandshakeStepDone(quint32 sessionId);
+    void onTick();
+
+private:
+    DtlsEndpointPrivate *d;
+    friend class DtlsEndpointPrivate;
+};
+
+} // coap
+} // iotlib
+
+#endif // DTLSENDPOINT_H
@@ -2,22 +2,186 @@
 #define COAP_ENDPOINTBASE_H
 
 #include "message.hpp"
+#include "messagebuffer.hpp"
+#include "capture.hpp"
+
+#include <string.h>
 
 namespace iotlib {
 namespace coap {
 
+class EndpointBase;
+
+/**
+ * @brief The Receiver class takes incoming messages from an endpoint by a plain virtual call,
+ * without signal dispatch, @see EndpointBase::setReceiver()
+ */
+class Receiver
+{
+public:
+    virtual ~Receiver() { }
+    /**
+     * @brief receive takes ownership of buffer by moving out of it
+     */
+    virtual void receive(EndpointBase *endpoint, MessageBuffer &buffer) = 0;
+    /**
+     * @brief receive is called for messages that don't fit a MessageBuffer or come from transports
+     * decoding into Message
+     */
+    virtual void receive(EndpointBase *endpoint, Message &message) = 0;
+};
+
 class EndpointBase : public QObject
 {
     Q_OBJECT
 public:
-    EndpointBase(QObject *parent = 0) : QObject(parent) { }
+    EndpointBase(QObject *parent = 0) : QObject(parent), m_receiver(0), m_capture(0) { }
     virtual ~EndpointBase() {}
 
+    /**
+     * @brief setReceiver delivers incoming messages to receiver directly, received() and receivedBuffer()
+     * are not emitted while one is set. Receiver must live in the endpoint's thread and outlive the endpoint
+     * or be reset, 0 goes back to signals. Stack::addEndpoint() sets itself on endpoints it owns and resets it
+     * when the endpoint is reparented or the stack is destroyed
+     */
+    void setReceiver(Receiver *receiver) { m_receiver = receiver; }
+    Receiver *receiver() const { return m_receiver; }
+
+    /**
+     * @brief setCapture records datagrams exactly as they are read from and written to the socket,
+     * Stack::setCapture() sets it on all of its endpoints
+     * @param writer not owned, 0 stops capturing
+     */
+    void setCapture(CaptureWriter *writer) { m_capture = writer; }
+    CaptureWriter *capture() const { return m_capture; }
+
+    /**
+     * @brief scheme returns URI scheme served by this transport, requests are routed by it
+     */
+    virtual QString scheme() const { return QStringLiteral("coap"); }
+    /**
+     * @brief isReliable returns true for transports that deliver in order by themselves (RFC8323),
+     * stack doesn't retransmit or deduplicate messages going through them
+     */
+    virtual bool isReliable() const { return false; }
+    /**
+     * @brief isCongested returns true while outgoing messages are queued faster than the network takes them,
+     * producers that can wait (pollers, bulk notifications) should hold off until congestionChanged(false)
+     */
+    virtual bool isCongested() const { return false; }
+    /**
+     * @brief setServerName tells transports that authenticate the peer which name its certificate
+     * must carry (DtlsEndpoint), stack sets it from the host of request URLs before sending
+     */
+    virtual void setServerName(const Address &peer, const QString &name) { Q_UNUSED(peer); Q_UNUSED(name); }
+
 public slots:
     virtual void send(const Message &coapMessage) = 0;
+    /**
+     * @brief sendPacked sends message already encoded in RFC7252 format, @see RequestTemplate
+     * Default implementation unpacks it and goes through send(), datagram transports write it as is
+     */
+    virtual void sendPacked(const char *data, int size, const Address &address)
+    {
+        Message message;
+        message.unpack(QByteArray::fromRawData(data, size));
+        message.setAddress(address);
+        send(message);
+    }
 
 signals:
+    /**
+     * @brief received passes a message that only lives for the emit, connect it directly
+     */
     void received(Message &coapMessage);
+    /**
+     * @brief receivedBuffer is emitted first for datagrams read into pooled buffers,
+     * receiver takes ownership by moving out of *buffer, otherwise received() follows.
+     * buffer is on the endpoint's stack, connect it directly, a queued slot would read freed memory
+     */
+    void receivedBuffer(iotlib::coap::MessageBuffer *buffer);
+    void congestionChanged(bool congested);
+    /**
+     * @brief peerFailed is emitted by connection oriented transports when the connection to address
+     * can't be made or breaks, stack fails the exchanges waiting on it
+     */
+    void peerFailed(const iotlib::coap::Address &address);
+    /**
+     * @brief sendFailed is emitted when transport refuses message for good, like a frame over peer's
+     * Max-Message-Size, stack fails the exchange with message's token
+     */
+    void sendFailed(const iotlib::coap::Message &coapMessage);
+
+protected:
+    void captureDatagram(CaptureRecord::Direction direction, const char *data, int size, const Address &peer)
+    {
+        if (m_capture)
+            m_capture->write(direction, data, size, peer);
+    }
+    void deliver(MessageBuffer &buffer)
+    {
+        if (m_receiver) {
+            m_receiver->receive(this, buffer);
+            return;
+        }
+        emit receivedBuffer(&buffer);
+        if (buffer.isNull())
+            return;
+        Message message = buffer.view().toMessage();
+        emit received(message);
+    }
+    void deliver(Message &message)
+    {
+        if (m_receiver)
+            m_receiver->receive(this, message);
+        else
+            emit received(message);
+    }
+    /**
+     * @brief deliverDatagram parses buffer in place and delivers it, valid messages the buffer can't index
+     * (more than MessageBuffer::MaxOptions options) are decoded into a Message instead
+     * @return false if datagram is not a valid message and was dropped
+     */
+    bool deliverDatagram(MessageBuffer &buffer, const Address &address, bool multicast = false)
+    {
+        if (buffer.parse()) {
+            buffer.view().setAddress(address);
+            buffer.view().setMulticast(multicast);
+            deliver(buffer);
+            return true;
+        }
+        return deliverUnpacked(buffer.constData(), buffer.size(), address, multicast);
+    }
+    /**
+     * @brief deliverDatagram copies datagrams up to MessageBuffer::Capacity into a pooled buffer,
+     * bigger ones (up to the 64 KiB UDP maximum) are decoded into a Message
+     */
+    bool deliverDatagram(const char *data, int size, const Address &address, bool multicast = false)
+    {
+        if (size <= MessageBuffer::Capacity) {
+            MessageBuffer buffer = MessageBuffer::allocate();
+            memcpy(buffer.data(), data, size_t(size));
+            buffer.setSize(size);
+            return deliverDatagram(buffer, address, multicast);
+        }
+        return deliverUnpacked(data, size, address, multicast);
+    }
+
+private:
+    bool deliverUnpacked(const char *data, int size, const Address &address, bool multicast)
+    {
+        Message message;
+        message.unpack(QByteArray::fromRawData(data, size));
+        if (!message.isValid())
+            return false;
+        message.setAddress(address);
+        message.setMulticast(multicast);
+        deliver(message);
+        return true;
+    }
+
+    Receiver *m_receiver;
+    CaptureWriter *m_capture;
 };
 
 } // coap
@@ -7,6 +7,12 @@
 
 iotlib::coap::ExchangePrivate::ExchangePrivate() :
     status(iotlib::coap::Exchange::Initial),
+    retransmissionCount(0),
+    retransmitTimeout(0),
+    sentAt(0),
+    inFlight(false),
+    awaitingAck(false),
+    requestMid(0),
     sendAfterLookup(false),
     deleteAfterComplete(false),
     observe(false)
@@ -25,10 +31,26 @@ void iotlib::coap::ExchangePrivate::setStatus(iotlib::coap::Exchange::Status sta
     emit q->statusChanged();
 }
 
+qint64 iotlib::coap::ExchangePrivate::now() const
+{
+    return stack ? stack->d_ptr->clock.nsecsElapsed() / 1000 : -1;
+}
+
+void iotlib::coap::ExchangePrivate::startRequest()
+{
+    ExchangeTimings fresh;
+    fresh.created = timings.created;
+    fresh.lookupStarted = timings.lookupStarted;
+    fresh.lookupFinished = timings.lookupFinished;
+    fresh.requested = now();
+    timings = fresh;
+}
+
 void iotlib::coap::ExchangePrivate::_q_looked_up(const QHostInfo &info)
 {
     qDebug() << "lookup complete" << info.addresses();
     Q_Q(iotlib::coap::Exchange);
+    timings.lookupFinished = now();
     if (info.error() == QHostInfo::NoError) {
         Address address = message.address();
         address.setHostAddress(info.addresses()[0]);
@@ -59,6 +81,18 @@ iotlib::coap::Exchange::Exchange(QObject *parent) :
     Q_D(iotlib::coap::Exchange);
     d->q_ptr = this;
     d->stack = Coap::defaultStack();
+    d->timings.created = d->now();
+    if (!parent)
+        setParent(d->stack);
+}
+
+iotlib::coap::Exchange::Exchange(iotlib::coap::Stack *stack, QObject *parent) :
+    QObject(parent), d_ptr(new iotlib::coap::ExchangePrivate)
+{
+    Q_D(iotlib::coap::Exchange);
+    d->q_ptr = this;
+    d->stack = stack;
+    d->timings.created = d->now();
     if (!parent)
         setParent(d->stack);
 }
@@ -69,6 +103,7 @@ iotlib::coap::Exchange::Exchange(iotlib::coap::ExchangePrivate &dd, QObject *par
     Q_D(iotlib::coap::Exchange);
     d->q_ptr = this;
     d->stack = Coap::defaultStack();
+    d->timings.created = d->now();
     if (!parent)
         setParent(d->stack);
 }
@@ -78,6 +113,8 @@ iotlib::coap::Exchange::~Exchange()
     if (d_ptr->status == Lookup ||
             d_ptr->status == InProgress)
         qWarning() << "iotlib::coap::Exchange to" << urlString() << "is destroyed in" << d_ptr->status << "state";
+    if (d_ptr->stack)
+        d_ptr->stack->d_ptr->removeExchange(this);
     if (d_ptr)
         delete d_ptr;
     //Q_D(iotlib::coap::Exchange);
@@ -95,6 +132,7 @@ void iotlib::coap::Exchange::setUrl(const QUrl &url)
         QHostAddress hostAddress = QHostAddress(url.host());
         if (hostAddress.isNull()) {
             d->setStatus(Lookup);
+            d->timings.lookupStarted = d->now();
             QHostInfo::lookupHost(url.host(), this, SLOT(_q_looked_up(QHostInfo)));
         } else {
             d->message.setAddress(Address(hostAddress, 0));
@@ -141,6 +179,7 @@ void iotlib::coap::Exchange::get()
 
     d->message.setCode(Message::Code::Get);
     d->message.setType(Message::Type::Confirmable);
+    d->startRequest();
     if (status() == Lookup) {
         d->sendAfterLookup = true;
     } else {
@@ -156,13 +195,13 @@ void iotlib::coap::Exchange::observe()
         return;
     d->setStatus(InProgress);
     d->observe = true;
+    d->startRequest();
 
-    Message get;
-    get.setCode(Message::Code::Get);
-    get.setType(Message::Type::Confirmable);
-    get.addOption(Message::OptionType::Observe);
-    get.setUrl(d->url);
-    send(get);
+    // kept in d->message, so retransmissions and collapsed observers resend the registration
+    d->message.setCode(Message::Code::Get);
+    d->message.setType(Message::Type::Confirmable);
+    d->message.addOption(Message::OptionType::Observe);
+    send(d->message);
 }
 
 void iotlib::coap::Exchange::cancel()
@@ -172,6 +211,12 @@ void iotlib::coap::Exchange::cancel()
     d->setStatus(Ready);
 }
 
+iotlib::coap::ExchangeTimings iotlib::coap::Exchange::timings() const
+{
+    Q_D(const iotlib::coap::Exchange);
+    return d->timings;
+}
+
 QByteArray iotlib::coap::Exchange::contentRaw() const
 {
     Q_D(const iotlib::coap::Exchange);
@@ -189,6 +234,12 @@ QVariant iotlib::coap::Exchange::content() const
     return unpacker(d->message.content());
 }
 
+void iotlib::coap::Exchange::setCallback(const iotlib::coap::Exchange::Callback &callback)
+{
+    Q_D(iotlib::coap::Exchange);
+    d->callback = callback;
+}
+
 void iotlib::coap::Exchange::deleteAfterComplete()
 {
     Q_D(iotlib::coap::Exchange);
@@ -211,6 +262,8 @@ void iotlib::coap::Exchange::handle(Message &message)
             d->setStatus(Completed);
         }
     }
+    if (d->callback)
+        d->callback(this);
 
     if (d->status == Completed && d->deleteAfterComplete)
         deleteLater();
@@ -221,6 +274,8 @@ void iotlib::coap::Exchange::handleError()
     Q_D(iotlib::coap::Exchange);
     emit timeout();
     d->setStatus(TimedOut);
+    if (d->callback)
+        d->callback(this);
 
     if (d->deleteAfterComplete)
         deleteLater();
@@ -4,6 +4,8 @@
 #include "iotlib_global.h"
 #include "message.hpp"
 
+#include <functional>
+
 namespace iotlib {
 namespace coap {
 
@@ -11,6 +13,41 @@ class Stack;
 class StackPrivate;
 class ExchangePrivate;
 
+/**
+ * @brief The ExchangeTimings struct holds lifecycle timestamps of an exchange, usec on the stack clock.
+ * -1 marks a phase the exchange didn't go through. Everything from requested on is reset with every
+ * get() and observe(), so a reused exchange describes its last request
+ */
+struct ExchangeTimings
+{
+    ExchangeTimings() :
+        created(-1), lookupStarted(-1), lookupFinished(-1), requested(-1), firstTransmit(-1),
+        retransmissionCount(0), ackReceived(-1), responseReceived(-1), completed(-1)
+    {
+        retransmits[0] = retransmits[1] = retransmits[2] = -1;
+    }
+
+    qint64 created;
+    qint64 lookupStarted;
+    qint64 lookupFinished;
+    qint64 requested;           ///< get() or observe() called
+    qint64 firstTransmit;       ///< stays -1 for requests collapsed into another one
+    qint64 retransmits[3];      ///< MAX_RETRANSMIT
+    quint8 retransmissionCount;
+    qint64 ackReceived;         ///< empty or piggybacked ACK
+    qint64 responseReceived;    ///< first response, the first notification for observations
+    qint64 completed;           ///< answered or given up
+
+    /**
+     * @brief lastTransmit the transmission that got through, or the last one
+     */
+    qint64 lastTransmit() const { return retransmissionCount ? retransmits[retransmissionCount - 1] : firstTransmit; }
+    /**
+     * @brief span returns to - from, -1 if either is missing
+     */
+    static qint64 span(qint64 from, qint64 to) { return from >= 0 && to >= from ? to - from : -1; }
+};
+
 /**
  * @brief The Exchange class represents a logical conversation between CoAP client and server.
  * Logical means across different message id's and even tokens for block transfer.
@@ -25,6 +62,10 @@ public:
      * @brief Exchange through default endpoint
      */
     Exchange(QObject *parent = 0);
+    /**
+     * @brief Exchange through given stack, useful when there is more than one
+     */
+    explicit Exchange(Stack *stack, QObject *parent = 0);
     virtual ~Exchange();
     /**
      * @brief setUri setts uri of a resource(-s) we are going to talk to.
@@ -49,7 +90,7 @@ public:
         Ready,       ///< Ready for making request or observe
         InProgress,  ///< Performing request, observing
         Completed,   ///< Answer received, or abort() called
-        TimedOut,    ///< Host not answered even after retransmissions
+        TimedOut,    ///< Host not answered even after retransmissions, or separate response not within EXCHANGE_LIFETIME
         LookupFailed ///< DNS lookup failed
     };
     Q_ENUM(Status)
@@ -63,9 +104,25 @@ public:
     Q_INVOKABLE void observe();
     Q_INVOKABLE void cancel();
 
+    /**
+     * @brief timings lifecycle timestamps, complete once completed() or timeout() is emitted
+     * Stack::latencyBreakdown() aggregates them over all exchanges of the stack
+     */
+    ExchangeTimings timings() const;
+
     QByteArray contentRaw() const;
     QVariant content() const;
 
+    /**
+     * @brief Callback gets every response, notifications of an observation included, and the timeout,
+     * status() tells which. A plain call, for code handling many exchanges where signals cost too much
+     */
+    typedef std::function<void (Exchange *exchange)> Callback;
+    /**
+     * @brief setCallback is called after completed() or timeout() are emitted and status() is updated
+     */
+    void setCallback(const Callback &callback);
+
     /**
      * @brief deleteAfterComplete controls lifetime of Exchange object.
      * Call this function to automatically remove exchange after answer war received or timeout occured.
@@ -2,16 +2,17 @@
 #define COAP_EXCHANGE_P_H
 
 #include "exchange.hpp"
+#include "stack.hpp"
 
 #include <functional>
 #include <QJSValue>
 #include <QHostInfo>
+#include <QPointer>
 #include <QUrl>
 
 namespace iotlib {
 namespace coap {
 
-class Stack;
 class ExchangePrivate
 {
     Q_DECLARE_PUBLIC(Exchange)
@@ -21,7 +22,7 @@ public:
 
     Exchange *q_ptr;
 
-    Stack *stack;
+    QPointer<Stack> stack;      ///< cleared when the stack is destroyed first
 
     Exchange::Status status;
     void setStatus(Exchange::Status status);
@@ -29,7 +30,18 @@ public:
     void _q_looked_up(const QHostInfo &info);
 
     quint8 retransmissionCount;
-    Message message;
+    quint32 retransmitTimeout;  ///< msec, doubles with every retransmission
+    qint64 sentAt;              ///< usec on stack clock, for RTT samples
+    bool inFlight;              ///< counted in PeerState::inFlight
+    bool awaitingAck;           ///< in StackPrivate::exchangeByMid under requestMid
+    quint16 requestMid;
+    ExchangeTimings timings;
+    Exchange::Callback callback;
+    qint64 now() const;         ///< usec on stack clock
+    void startRequest();
+    Message message;            ///< request until answered, then the last response
+    Message request;            ///< as sent by StackPrivate::txRequest(), retransmitted and resent from it
+    QByteArray token;           ///< key in StackPrivate::exchangeByToken, if it's still there
     QUrl url;
     QByteArray payload;
 
@@ -0,0 +1,200 @@
+#include "histogram.hpp"
+
+#include <QTextStream>
+#include <qmath.h>
+
+namespace {
+inline int bitLength(quint64 value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return value ? 64 - __builtin_clzll(value) : 0;
+#else
+    int length = 0;
+    while (value) {
+        value >>= 1;
+        ++length;
+    }
+    return length;
+#endif
+}
+}
+
+iotlib::coap::Histogram::Histogram(qint64 highestValue, int significantDigits) :
+    m_highestValue(qMax<qint64>(2, highestValue)),
+    m_significantDigits(qBound(1, significantDigits, 5)),
+    m_totalCount(0),
+    m_min(0),
+    m_max(0)
+{
+    qint64 singleUnitResolution = 2;
+    for (int i = 0; i < m_significantDigits; ++i)
+        singleUnitResolution *= 10;
+    int subBucketCountMagnitude = bitLength(quint64(singleUnitResolution - 1));
+    m_subBucketHalfCountMagnitude = qMax(subBucketCountMagnitude, 1) - 1;
+    qint64 subBucketCount = qint64(1) << (m_subBucketHalfCountMagnitude + 1);
+    m_subBucketHalfCount = int(subBucketCount / 2);
+    m_subBucketMask = subBucketCount - 1;
+
+    qint64 smallestUntrackable = subBucketCount;
+    m_bucketCount = 1;
+    while (smallestUntrackable <= m_highestValue) {
+        if (smallestUntrackable > (Q_INT64_C(0x7fffffffffffffff) >> 1)) {
+            ++m_bucketCount;
+            break;
+        }
+        smallestUntrackable <<= 1;
+        ++m_bucketCount;
+    }
+    m_counts.fill(0, (m_bucketCount + 1) * m_subBucketHalfCount);
+}
+
+int iotlib::coap::Histogram::countsIndex(qint64 value) const
+{
+    int bucketIndex = bitLength(quint64(value | m_subBucketMask)) - (m_subBucketHalfCountMagnitude + 1);
+    int subBucketIndex = int(value >> bucketIndex);
+    return ((bucketIndex + 1) << m_subBucketHalfCountMagnitude) + (subBucketIndex - m_subBucketHalfCount);
+}
+
+qint64 iotlib::coap::Histogram::valueFromIndex(int index) const
+{
+    int bucketIndex = (index >> m_subBucketHalfCountMagnitude) - 1;
+    qint64 subBucketIndex = (index & (m_subBucketHalfCount - 1)) + m_subBucketHalfCount;
+    if (bucketIndex < 0) {
+        subBucketIndex -= m_subBucketHalfCount;
+        bucketIndex = 0;
+    }
+    return subBucketIndex << bucketIndex;
+}
+
+qint64 iotlib::coap::Histogram::highestEquivalent(qint64 value) const
+{
+    int bucketIndex = bitLength(quint64(value | m_subBucketMask)) - (m_subBucketHalfCountMagnitude + 1);
+    qint64 lowest = (value >> bucketIndex) << bucketIndex;
+    return lowest + (qint64(1) << bucketIndex) - 1;
+}
+
+void iotlib::coap::Histogram::record(qint64 value, qint64 count)
+{
+    if (value < 0)
+        value = 0;
+    else if (value > m_highestValue)
+        value = m_highestValue;
+    m_counts[countsIndex(value)] += count;
+    if (!m_totalCount || value < m_min)
+        m_min = value;
+    if (!m_totalCount || value > m_max)
+        m_max = value;
+    m_totalCount += count;
+}
+
+void iotlib::coap::Histogram::add(const iotlib::coap::Histogram &other)
+{
+    if (!other.m_totalCount)
+        return;
+    if (other.m_counts.size() == m_counts.size() && other.m_highestValue == m_highestValue) {
+        for (int i = 0; i < m_counts.size(); ++i)
+            m_counts[i] += other.m_counts.at(i);
+        if (!m_totalCount || other.m_min < m_min)
+            m_min = other.m_min;
+        if (!m_totalCount || other.m_max > m_max)
+            m_max = other.m_max;
+        m_totalCount += other.m_totalCount;
+        return;
+    }
+    for (int i = 0; i < other.m_counts.size(); ++i) { // different layout, re-record at bucket resolution
+        if (other.m_counts.at(i))
+            record(other.valueFromIndex(i), other.m_counts.at(i));
+    }
+}
+
+void iotlib::coap::Histogram::reset()
+{
+    m_counts.fill(0);
+    m_totalCount = 0;
+    m_min = m_max = 0;
+}
+
+qint64 iotlib::coap::Histogram::min() const
+{
+    return m_min;
+}
+
+qint64 iotlib::coap::Histogram::max() const
+{
+    return m_max;
+}
+
+double iotlib::coap::Histogram::mean() const
+{
+    if (!m_totalCount)
+        return 0;
+    double sum = 0;
+    for (int i = 0; i < m_counts.size(); ++i) {
+        if (!m_counts.at(i))
+            continue;
+        qint64 value = valueFromIndex(i);
+        sum += double(value + highestEquivalent(value)) / 2 * m_counts.at(i);
+    }
+    return sum / m_totalCount;
+}
+
+double iotlib::coap::Histogram::standardDeviation() const
+{
+    if (!m_totalCount)
+        return 0;
+    double average = mean();
+    double squares = 0;
+    for (int i = 0; i < m_counts.size(); ++i) {
+        if (!m_counts.at(i))
+            continue;
+        qint64 value = valueFromIndex(i);
+        double deviation = double(value + highestEquivalent(value)) / 2 - average;
+        squares += deviation * deviation * m_counts.at(i);
+    }
+    return qSqrt(squares / m_totalCount);
+}
+
+qint64 iotlib::coap::Histogram::valueAtPercentile(double percentile) const
+{
+    if (!m_totalCount)
+        return 0;
+    qint64 target = qMax<qint64>(1, qint64(qMin(percentile, 100.0) / 100 * m_totalCount + 0.5));
+    qint64 seen = 0;
+    for (int i = 0; i < m_counts.size(); ++i) {
+        seen += m_counts.at(i);
+        if (seen >= target)
+            return qMin(highestEquivalent(valueFromIndex(i)), m_max);
+    }
+    return m_max;
+}
+
+QString iotlib::coap::Histogram::percentileDistribution(double scale, int ticksPerHalfDistance) const
+{
+    QString text;
+    QTextStream out(&text);
+    out << QString("%1 %2 %3 %4\n").arg("Value", 12).arg("Percentile", 14).arg("TotalCount", 10)
+           .arg("1/(1-Percentile)", 14);
+    out << "\n";
+    ticksPerHalfDistance = qMax(1, ticksPerHalfDistance);
+    if (m_totalCount) {
+        int index = 0;
+        qint64 cumulative = 0;
+        for (int step = 0; step < 64 * ticksPerHalfDistance; ++step) {
+            double percentile = 100.0 * (1.0 - qPow(0.5, double(step) / ticksPerHalfDistance));
+            qint64 value = valueAtPercentile(percentile);
+            for (; index < m_counts.size() && valueFromIndex(index) <= value; ++index)
+                cumulative += m_counts.at(index);
+            if (value >= m_max)
+                break;
+            out << QString("%1 %2 %3 %4\n").arg(value / scale, 12, 'f', 3).arg(percentile / 100, 14, 'f', 12)
+                   .arg(cumulative, 10).arg(1.0 / (1.0 - percentile / 100), 14, 'f', 2);
+        }
+        out << QString("%1 %2 %3\n").arg(m_max / scale, 12, 'f', 3).arg(1.0, 14, 'f', 12).arg(m_totalCount, 10);
+    }
+    out << QString("#[Mean    = %1, StdDeviation   = %2]\n").arg(mean() / scale, 12, 'f', 3)
+           .arg(standardDeviation() / scale, 12, 'f', 3);
+    out << QString("#[Max     = %1, Total count    = %2]\n").arg(m_max / scale, 12, 'f', 3).arg(m_totalCount, 12);
+    out << QString("#[Buckets = %1, SubBuckets     = %2]\n").arg(m_bucketCount, 12).arg(m_subBucketHalfCount * 2, 12);
+    out.flush();
+    return text;
+}
@@ -0,0 +1,71 @@
+#ifndef COAP_HISTOGRAM_H
+#define COAP_HISTOGRAM_H
+
+#include "../iotlib_global.h"
+
+#include <QVector>
+#include <QString>
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The Histogram class records values with fixed relative precision (HdrHistogram layout)
+ * Buckets are powers of two, each split linearly in enough sub buckets to keep significantDigits,
+ * so recording is a couple of shifts and one increment and memory doesn't grow with the count.
+ * Values above highestValue are clamped to it. Not thread safe, add() per thread histograms instead.
+ */
+class IOTLIB_SHARED_EXPORT Histogram
+{
+public:
+    /**
+     * @param highestValue largest value tracked, 1 hour in usec by default
+     * @param significantDigits 1..5
+     */
+    Histogram(qint64 highestValue = 3600LL * 1000000, int significantDigits = 3);
+
+    void record(qint64 value, qint64 count = 1);
+    void add(const Histogram &other);
+    void reset();
+
+    qint64 count() const { return m_totalCount; }
+    qint64 min() const;
+    qint64 max() const;
+    double mean() const;
+    double standardDeviation() const;
+    /**
+     * @brief valueAtPercentile
+     * @param percentile 0..100
+     * @return highest value equivalent to the one at percentile, 0 if empty
+     */
+    qint64 valueAtPercentile(double percentile) const;
+
+    /**
+     * @brief percentileDistribution formats the histogram as HdrHistogram .hgrm text,
+     * readable by the HdrHistogram plotter
+     * @param scale values are divided by it, 1000 prints msec out of usec
+     * @param ticksPerHalfDistance lines per halving of the distance to 100%
+     */
+    QString percentileDistribution(double scale = 1.0, int ticksPerHalfDistance = 5) const;
+
+private:
+    int countsIndex(qint64 value) const;
+    qint64 valueFromIndex(int index) const;
+    qint64 highestEquivalent(qint64 value) const;
+
+    qint64 m_highestValue;
+    int m_significantDigits;
+    int m_subBucketHalfCountMagnitude;
+    int m_subBucketHalfCount;
+    qint64 m_subBucketMask;
+    int m_bucketCount;
+    qint64 m_totalCount;
+    qint64 m_min;
+    qint64 m_max;
+    QVector<qint64> m_counts;
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_HISTOGRAM_H
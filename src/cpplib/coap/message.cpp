@@ -4,6 +4,8 @@
 #include <QAtomicInt>
 #include <QDebug>
 #include <QMetaEnum>
+#include <QStringList>
+#include <QNetworkInterface>
 
 namespace iotlib {
 namespace coap {
@@ -45,7 +47,8 @@ public:
         version(1),
         type(Message::Type::Reset),
         code(Message::Code::Empty),
-        message_id(0)
+        message_id(0),
+        multicast(false)
     {
         // TODO   d->errors =
     }
@@ -59,7 +62,7 @@ public:
         options(other.options),
         payload(other.payload),
         address(other.address),
-        port(other.port),
+        multicast(other.multicast),
         errors(other.errors)
     { }
     ~MessagePrivate() { }
@@ -71,8 +74,8 @@ public:
     QByteArray token;
     QList<Option> options;
     QByteArray payload;
-    QHostAddress address;
-    quint16 port;
+    Address address;
+    bool multicast;
 
     enum Error {
         FORMAT_ERROR           = 1,
@@ -90,26 +93,78 @@ public:
 
 Address::Address()
 {
+    memset(this, 0, sizeof(Address));
 }
 
-Address::Address(const QString &address) : m_address(address)
+Address::Address(const QString &address)
 {
+    memset(this, 0, sizeof(Address));
+    setAddress(address);
 }
 
-Address::Address(const QHostAddress &hostAddress, quint16 port) :
-    m_hostAddress(hostAddress), m_port(port)
+Address::Address(const QHostAddress &hostAddress, quint16 port)
 {
+    memset(this, 0, sizeof(Address));
+    setHostAddress(hostAddress);
+    m_port = port;
+}
+
+static const quint8 v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+Address Address::fromRaw(const quint8 *ip, quint16 port, quint32 scopeId)
+{
+    Address address;
+    memcpy(address.m_ip, ip, sizeof(address.m_ip));
+    address.m_port = port;
+    if (!memcmp(ip, v4mapped, sizeof(v4mapped))) {
+        address.m_family = 4;
+    } else {
+        address.m_family = 6;
+        address.m_scopeId = scopeId;
+    }
+    return address;
 }
 
 Address Address::setHostAddress(const QHostAddress &hostAddress)
 {
-    m_hostAddress = hostAddress;
+    memset(m_ip, 0, sizeof(m_ip));
+    m_scopeId = 0;
+    m_family = 0;
+    if (hostAddress.protocol() == QAbstractSocket::IPv4Protocol) {
+        m_ip[10] = m_ip[11] = 0xff;
+        endian_store32((m_ip + 12), hostAddress.toIPv4Address());
+        m_family = 4;
+    } else if (hostAddress.protocol() == QAbstractSocket::IPv6Protocol) {
+        Q_IPV6ADDR ip = hostAddress.toIPv6Address();
+        memcpy(m_ip, ip.c, sizeof(m_ip));
+        // ::ffff:a.b.c.d from dual-stack sockets is the same peer as a.b.c.d, same as fromRaw()
+        if (!memcmp(m_ip, v4mapped, sizeof(v4mapped))) {
+            m_family = 4;
+            return *this;
+        }
+        m_family = 6;
+        QString scope = hostAddress.scopeId();
+        if (!scope.isEmpty()) {
+            bool numeric;
+            m_scopeId = scope.toUInt(&numeric);
+            if (!numeric)
+                m_scopeId = QNetworkInterface::interfaceFromName(scope).index();
+        }
+    }
     return *this;
 }
 
 QHostAddress Address::hostAddress() const
 {
-    return m_hostAddress;
+    if (m_family == 4)
+        return QHostAddress(endian_load32(quint32, (m_ip + 12)));
+    if (m_family == 6) {
+        QHostAddress hostAddress(m_ip);
+        if (m_scopeId)
+            hostAddress.setScopeId(QString::number(m_scopeId));
+        return hostAddress;
+    }
+    return QHostAddress();
 }
 
 Address Address::setPort(quint16 port)
@@ -125,16 +180,43 @@ quint16 Address::port() const
 
 Address Address::setAddress(const QString &address)
 {
-    m_address = address;
-    m_hostAddress = QHostAddress(address);
-    return *this;
+    return setHostAddress(QHostAddress(address));
 }
 
 QString Address::address() const
 {
-    if (m_address.isEmpty())
-        return m_hostAddress.toString();
-    return m_address;
+    return hostAddress().toString();
+}
+
+bool Address::isNull() const
+{
+    return m_family == 0;
+}
+
+bool Address::isIpv4() const
+{
+    return m_family == 4;
+}
+
+bool Address::isMulticast() const
+{
+    if (m_family == 4)
+        return (m_ip[12] & 0xf0) == 0xe0; // 224.0.0.0/4
+    if (m_family == 6)
+        return m_ip[0] == 0xff; // ff00::/8
+    return false;
+}
+
+Address Address::prefix(int bits) const
+{
+    Address network = *this;
+    network.m_port = 0;
+    int first = qBound(0, (m_family == 4 ? 96 : 0) + bits, 128);
+    for (int i = first / 8; i < 16; ++i) {
+        int keep = i == first / 8 ? first % 8 : 0;
+        network.m_ip[i] &= quint8(0xff00 >> keep);
+    }
+    return network;
 }
 
 Message::Message()
@@ -205,12 +287,17 @@ bool Message::isEmpty() const
 
 bool Message::isRequest() const
 {
-    return ((quint8)d->code >= 0x01 && (quint8)d->code <= 0x04);
+    return ((quint8)d->code >= 0x01 && (quint8)d->code <= 0x07);
 }
 
 bool Message::isResponse() const
 {
-    return (!isEmpty() && !isRequest());
+    return (!isEmpty() && !isRequest() && !isSignaling());
+}
+
+bool Message::isSignaling() const
+{
+    return ((quint8)d->code >> 5) == 7;
 }
 
 void Message::setToken(const QByteArray &token)
@@ -285,31 +372,66 @@ void Message::setUrl(const QUrl &url)
         addOption(OptionType::UriPath, path.toUtf8());
 }
 
-void Message::setContentFormat(Message::ContentFormat format)
+QUrl Message::url() const
 {
-    Message::OptionType optionContentFormat = OptionType::ContentFormat;
-    if (format == ContentFormat::TextPlain) {
-        addOption(optionContentFormat, QByteArray());
-    } else if ((quint16)format < 256) {
-        quint8 f = (quint8)format;
-        addOption(optionContentFormat, QByteArray((const char*)&f, 1));
-    } else {
-        quint16 f = (quint16)format;
-        QByteArray data;
-        data.resize(2);
-        endian_store16(data.data(), f);
-        addOption(optionContentFormat, data);
+    QUrl url;
+    QStringList path;
+    QStringList query;
+    foreach (const Option &option, d->options) {
+        if (option.type() == OptionType::UriPath)
+            path.append(QString::fromUtf8(option.data()));
+        else if (option.type() == OptionType::UriQuery)
+            query.append(QString::fromUtf8(option.data()));
     }
+    url.setPath("/" + path.join("/"));
+    if (!query.isEmpty())
+        url.setQuery(query.join("&"));
+    return url;
+}
+
+QByteArray iotlib::coap::pack_uint(quint32 value)
+{
+    QByteArray data;
+    for (int shift = 24; shift >= 0; shift -= 8)
+        if (!data.isEmpty() || ((value >> shift) & 0xff))
+            data.append((char)((value >> shift) & 0xff));
+    return data;
+}
+
+quint32 iotlib::coap::unpack_uint(const QByteArray &data)
+{
+    quint32 value = 0;
+    for (int i = 0; i < data.size() && i < 4; ++i)
+        value = (value << 8) | (quint8)data[i];
+    return value;
+}
+
+void Message::setContentFormat(Message::ContentFormat format)
+{
+    addOption(OptionType::ContentFormat, pack_uint((quint16)format));
 }
 
 Message::ContentFormat Message::contentFormat() const
 {
     foreach (const Option &option, d->options)
         if (option.type() == OptionType::ContentFormat)
-            return (ContentFormat)option.data().data()[0];
+            return (ContentFormat)unpack_uint(option.data());
     return ContentFormat::TextPlain;
 }
 
+void Message::setAccept(Message::ContentFormat format)
+{
+    addOption(OptionType::Accept, pack_uint((quint16)format));
+}
+
+Message::ContentFormat Message::accept(Message::ContentFormat defaultFormat) const
+{
+    foreach (const Option &option, d->options)
+        if (option.type() == OptionType::Accept)
+            return (ContentFormat)unpack_uint(option.data());
+    return defaultFormat;
+}
+
 void Message::setContent(const QByteArray &content)
 {
     d->payload = content;
@@ -320,42 +442,46 @@ QByteArray Message::content() const
     return d->payload;
 }
 
-quint8 *pack_option(quint8 *p, quint16 optionNumber, const QByteArray &value, bool write)
+quint8 *pack_option(quint8 *p, quint16 delta, const QByteArray &value, bool write)
 {
+    // RFC7252 3.1, delta and length above 12 go into extended bytes, 13 and 269 biased
     quint8 *h = p;
     p++;
-    if (optionNumber <= 12) {
+    quint8 header = 0;
+    if (delta <= 12) {
+        header = (quint8)delta << 4;
+    } else if (delta <= 268) {
+        header = 13 << 4;
         if (write)
-            *h = (quint8)optionNumber << 4;
-    } else if (optionNumber > 12 && optionNumber <= 255) {
-        if (write) {
-            *h = 13 << 4;
-            *p = (quint8)optionNumber - 13;
-        }
+            *p = (quint8)(delta - 13);
         p++;
-    } else if (optionNumber > 255) {
-        *h = 14 << 4;
-        // write me!!!
-
+    } else {
+        header = 14 << 4;
+        if (write)
+            endian_store16(p, (quint16)(delta - 269));
+        p += 2;
     }
 
-    if (value.length() <= 12) {
+    quint32 length = value.length();
+    if (length <= 12) {
+        header |= (quint8)length;
+    } else if (length <= 268) {
+        header |= 13;
         if (write)
-            *h |= (quint8)value.length();
-    } else if (value.length() > 12 && value.length() <= 255) {
-        if (write) {
-            *h |= 13;
-            *p = (quint8)value.length();
-        }
+            *p = (quint8)(length - 13);
         p++;
-    } else if (value.length() > 255) {
-        *h |= 14;
-        //write me
+    } else {
+        header |= 14;
+        if (write)
+            endian_store16(p, (quint16)(length - 269));
+        p += 2;
     }
 
-    if (write)
-        memcpy(p, value.data(), value.length());
-    p += value.length();
+    if (write) {
+        *h = header;
+        memcpy(p, value.constData(), length);
+    }
+    p += length;
 
     return p;
 }
@@ -367,11 +493,11 @@ QByteArray Message::pack() const
     quint32 pduSize = 4; // header
     pduSize += d->token.length();
     quint8 *p = 0;
-    quint16 optionDelta = 0;
+    quint16 previous = 0;
     for (int i = 0; i < d->options.length(); ++i) {
-        quint16 optionNumber = (quint16)d->options[i].type() - optionDelta;
-        p = pack_option(p, optionNumber, d->options[i].data(), false);
-        optionDelta = optionNumber;
+        quint16 optionNumber = (quint16)d->options[i].type();
+        p = pack_option(p, optionNumber - previous, d->options[i].data(), false);
+        previous = optionNumber;
     }
     pduSize += p - (quint8 *)0;
 
@@ -390,24 +516,44 @@ QByteArray Message::pack() const
     p += 4;
     memcpy(p, d->token.data(), d->token.length());
     p += d->token.length();
-    optionDelta = 0;
+    previous = 0;
     for (int i = 0; i < d->options.length(); ++i) {
-        quint16 optionNumber = (quint16)d->options[i].type() - optionDelta;
-        p = pack_option(p, optionNumber, d->options[i].data(), true);
-        optionDelta = optionNumber;
+        quint16 optionNumber = (quint16)d->options[i].type();
+        p = pack_option(p, optionNumber - previous, d->options[i].data(), true);
+        previous = optionNumber;
+    }
+    if (d->payload.size() > 0) {
+        *(p++) = 0xff;
+        memcpy(p, d->payload.constData(), d->payload.length());
     }
-    *(p++) = 0xff;
-    memcpy(p, d->payload, d->payload.length());
 
     return packed;
 }
 
+// RFC7252 3.1, nibbles 13 and 14 are followed by 1 and 2 extended bytes biased by 13 and 269
+static bool unpack_extended(quint32 &value, const quint8 *&p, const quint8 *end)
+{
+    if (value == 13) {
+        if (end - p < 1)
+            return false;
+        value = *p + 13;
+        p++;
+    } else if (value == 14) {
+        if (end - p < 2)
+            return false;
+        value = endian_load16(quint32, p) + 269;
+        p += 2;
+    }
+    return true;
+}
+
 void Message::unpack(const QByteArray &packed)
 {
     d->errors = MessagePrivate::Errors(0);
     d->options.clear();
-    quint8 *p = (quint8 *)packed.data();
-    quint8 *pend = (quint8 *)packed.data() + packed.size() - 1;
+    d->payload.clear();
+    const quint8 *p = (const quint8 *)packed.constData();
+    const quint8 *end = p + packed.size();
 
     if (packed.size() < 4) {
         d->errors |= MessagePrivate::FORMAT_ERROR;
@@ -421,71 +567,73 @@ void Message::unpack(const QByteArray &packed)
     d->type = (Message::Type)( (p[0] & 0x30) >> 4 );
     quint8 tokenLength = (p[0] & 0xf);
     d->code = (Message::Code)p[1];
-    if (tokenLength > 8)
-        d->errors |= MessagePrivate::WRONG_TOKEN_LENGTH;
-    else
-        d->token = QByteArray((const char *)p + 4, tokenLength);
-
     d->message_id = endian_load16(quint16, (p + 2));
-
-    if (packed.size() == 4) // only header present, ok
+    if (tokenLength > 8) {
+        d->errors |= MessagePrivate::WRONG_TOKEN_LENGTH;
         return;
+    }
+    if (4 + tokenLength > packed.size()) {
+        d->errors |= MessagePrivate::NOT_ENOUGH_DATA;
+        return;
+    }
+    d->token = QByteArray((const char *)p + 4, tokenLength);
+    p += 4 + tokenLength;
 
-    p += tokenLength;
-    p += 4;
-
-    quint16 optionNumber = 0;
-    do {
+    quint32 optionNumber = 0;
+    while (p < end) {
         if (*p == 0xff) {
-            quint32 payloadSize = pend - p;
-            if (payloadSize == 0)
+            p++;
+            if (p == end)
                 d->errors |= MessagePrivate::WRONG_PAYLOAD_MARKER;
-            d->payload = QByteArray((const char *)p + 1, payloadSize);
+            d->payload = QByteArray((const char *)p, int(end - p));
             return;
         }
 
-        quint16 optionDelta = (*p & 0xf0) >> 4;
-        quint16 optionLength = (*p & 0xf);
+        quint32 optionDelta = (*p & 0xf0) >> 4;
+        quint32 optionLength = (*p & 0xf);
         p++;
-        if (optionDelta == 13) {
-            optionDelta = *p + 13;
-            p++;
-        } else if (optionDelta == 14) {
-            optionDelta = endian_load16(quint16, p);
-            p += 2;
-        } else if (optionDelta == 15) {
-            d->errors |= MessagePrivate::WRONG_PAYLOAD_MARKER;
+        if (optionDelta == 15 || optionLength == 15) {
+            d->errors |= MessagePrivate::WRONG_OPTION_HEADER;
             return;
         }
-        if (optionLength == 13) {
-            optionLength = *p + 13;
-            p++;
-        } else if (optionLength == 14) {
-            optionLength = endian_load16(quint16, p);
-            p += 2;
-        } else if (optionLength == 15) {
-            d->errors |= MessagePrivate::WRONG_PAYLOAD_MARKER;
+        if (!unpack_extended(optionDelta, p, end) ||
+                !unpack_extended(optionLength, p, end) ||
+                optionLength > quint32(end - p)) {
+            d->errors |= MessagePrivate::NOT_ENOUGH_DATA;
             return;
         }
-
         optionNumber += optionDelta;
+        if (optionNumber > 0xffff) {
+            d->errors |= MessagePrivate::WRONG_OPTION_HEADER;
+            return;
+        }
+
         Option option((Message::OptionType)optionNumber, QByteArray((const char *)p, optionLength));
         d->options.append(option);
         p += optionLength;
-    } while (p <= pend);
-
-    if (p > pend + 1)
-        d->errors |= MessagePrivate::NOT_ENOUGH_DATA;
+    }
 }
 
 Address Message::address() const
 {
-
+    return d->address;
 }
 
 void Message::setAddress(const Address &address)
 {
+    d->address = address;
+}
 
+void Message::setMulticast(bool multicast)
+{
+    if (d->multicast == multicast)
+        return;
+    d->multicast = multicast;
+}
+
+bool Message::isMulticast() const
+{
+    return d->multicast;
 }
 
 bool Message::isValid() const
@@ -10,6 +10,8 @@
 #include <QHostAddress>
 #include <QUrl>
 
+#include <string.h>
+
 namespace iotlib {
 namespace coap {
 
@@ -40,6 +42,9 @@ public:
     Post                     = 0x02,
     Put                      = 0x03,
     Delete                   = 0x04,
+    Fetch                    = 0x05, ///< RFC8132
+    Patch                    = 0x06,
+    IPatch                   = 0x07,
     Created                  = 0x41,
     Deleted                  = 0x42,
     Valid                    = 0x43,
@@ -58,9 +63,14 @@ public:
     InternalServerError      = 0xa0,
     NotImplemented           = 0xa1,
     BadGateway               = 0xa2,
-    ServiceUnavailabl        = 0xa3,
+    ServiceUnavailable       = 0xa3,
     GatewayTimeout           = 0xa4,
     ProxyingNotSupported     = 0xa5,
+    Csm                      = 0xe1, ///< RFC8323 signaling, reliable transports only
+    Ping                     = 0xe2,
+    Pong                     = 0xe3,
+    Release                  = 0xe4,
+    Abort                    = 0xe5,
     UndefinedCode            = 0xff
     };
     Q_ENUM(Code)
@@ -94,7 +104,12 @@ public:
     AppXml    = 41,
     AppOctet  = 42,
     AppExi    = 47,
-    AppJson   = 50
+    AppJson   = 50,
+    AppCbor   = 60,
+    SenmlJson = 110,
+    SenmlCbor = 112,
+    LwM2mTlv  = 11542,
+    LwM2mJson = 11543
     };
     Q_ENUM(ContentFormat)
 
@@ -109,6 +124,7 @@ public:
     bool isEmpty() const;
     bool isRequest() const;
     bool isResponse() const;
+    bool isSignaling() const;
 
     void setToken(const QByteArray &token);
     void setToken(const char *token, quint8 length);
@@ -128,6 +144,13 @@ public:
     void setContentFormat(ContentFormat format);
     ContentFormat contentFormat() const;
 
+    void setAccept(ContentFormat format);
+    /**
+     * @brief accept returns format requested by Accept option
+     * @param defaultFormat is returned when there is no such option
+     */
+    ContentFormat accept(ContentFormat defaultFormat = ContentFormat::TextPlain) const;
+
     void setContent(const QByteArray &content);
     QByteArray content() const;
 
@@ -137,6 +160,13 @@ public:
     Address address() const;
     void setAddress(const Address &address);
 
+    /**
+     * @brief setMulticast marks message as exchanged over a multicast group
+     * Set by endpoints on requests received through a joined group, server copies it to the response
+     */
+    void setMulticast(bool multicast);
+    bool isMulticast() const;
+
     QString errorString() const;
     bool isValid() const;
     bool isNull() const;
@@ -145,13 +175,27 @@ private:
     QSharedDataPointer<MessagePrivate> d;
 };
 
-class Address
+/**
+ * @brief The Address class is IP address and port of a peer, trivially copyable, 24 bytes
+ * IPv4 is kept in IPv4-mapped form and IPv4-mapped IPv6 addresses are taken as IPv4,
+ * so a peer hashes and compares the same way whichever socket family it came through.
+ * Numeric addresses only, host names are resolved by Exchange before they get here.
+ */
+class IOTLIB_SHARED_EXPORT Address
 {
 public:
     Address();
     Address(const QString &address);
     Address(const QHostAddress &hostAddress, quint16 port);
-
+    /**
+     * @brief fromRaw makes address out of 16 bytes in network order without going through QHostAddress,
+     * IPv4-mapped ones become IPv4
+     */
+    static Address fromRaw(const quint8 *ip, quint16 port, quint32 scopeId = 0);
+
+    /**
+     * @brief setHostAddress sets the IP, ::ffff:a.b.c.d becomes IPv4 a.b.c.d as in fromRaw()
+     */
     Address setHostAddress(const QHostAddress &hostAddress);
     QHostAddress hostAddress() const;
 
@@ -161,12 +205,47 @@ public:
     Address setAddress(const QString &address);
     QString address() const;
 
+    bool isNull() const;
+    bool isIpv4() const;
+    bool isMulticast() const;
+    /**
+     * @brief prefix returns network address of bits length with port 0, bits count from the start
+     * of IPv4 address for IPv4 ones, so prefix(24) is a /24 for both families
+     */
+    Address prefix(int bits) const;
+
+    /**
+     * @brief ip returns 16 bytes in network order
+     */
+    const quint8 *ip() const { return m_ip; }
+    /**
+     * @brief scopeId returns IPv6 interface index, 0 if none
+     */
+    quint32 scopeId() const { return m_scopeId; }
+
+    bool operator ==(const Address &other) const { return !memcmp(this, &other, sizeof(Address)); }
+    bool operator !=(const Address &other) const { return !(*this == other); }
+
 private:
-    QHostAddress m_hostAddress;
+    quint8 m_ip[16];
+    quint32 m_scopeId;
     quint16 m_port;
-    QString m_address;
+    quint8 m_family;        ///< 0 for null address, 4 or 6
+    quint8 m_reserved;      ///< keeps padding zero for memcmp
 };
 
+inline uint qHash(const Address &address, uint seed = 0)
+{
+    quint64 high, low;
+    memcpy(&high, address.ip(), 8);
+    memcpy(&low, address.ip() + 8, 8);
+    quint64 h = high * Q_UINT64_C(0x9e3779b97f4a7c15) ^ low;
+    h ^= quint64(address.port()) << 32 | address.scopeId();
+    h *= Q_UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 32;
+    return uint(h) ^ seed;
+}
+
 class Option
 {
 public:
@@ -183,9 +262,17 @@ private:
     QByteArray m_data;
 };
 
+/**
+ * @brief pack_uint encodes uint option value, leading zero bytes are dropped (RFC7252 3.2)
+ */
+IOTLIB_SHARED_EXPORT QByteArray pack_uint(quint32 value);
+IOTLIB_SHARED_EXPORT quint32 unpack_uint(const QByteArray &data);
+
 } // coap
 } // iotlib
 
+Q_DECLARE_TYPEINFO(iotlib::coap::Address, Q_PRIMITIVE_TYPE);
+
 QDebug operator<<(QDebug debug, const iotlib::coap::Message &message);
 
 #endif // COAP_MESSAGE_H
@@ -0,0 +1,424 @@
+#include "messagebuffer.hpp"
+#include "endianhelper.h"
+
+#include <QMutex>
+#include <QAtomicInt>
+
+#include <string.h>
+
+namespace iotlib {
+namespace coap {
+
+struct MessageBlock
+{
+    MessageBlock *next;
+    int size;
+    quint16 lastOption;
+    bool payloadSet;
+    MessageView view;
+    char data[MessageBuffer::Capacity];
+};
+
+} // coap
+} // iotlib
+
+using iotlib::coap::MessageBlock;
+
+namespace {
+const int SLAB_BLOCKS = 64;
+const int MAX_CACHED_BLOCKS = 4 * SLAB_BLOCKS;
+
+QBasicAtomicInt liveBlocks = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+/**
+ * Blocks cached by exited threads or spilled by threads that free more than they allocate,
+ * like a protocol thread releasing buffers filled by an I/O thread
+ */
+struct SharedFreeList
+{
+    QMutex mutex;
+    MessageBlock *head;
+    SharedFreeList() : head(0) { }
+};
+
+SharedFreeList &sharedFreeList()
+{
+    static SharedFreeList list;
+    return list;
+}
+
+/**
+ * Per thread free list, no locking on the usual path. Slabs are never returned to the system,
+ * so a block may safely be freed by any thread.
+ */
+class ThreadPool
+{
+public:
+    ThreadPool() : head(0), count(0) { }
+    ~ThreadPool()
+    {
+        if (head)
+            spill(count);
+    }
+
+    MessageBlock *take()
+    {
+        if (!head)
+            refill();
+        MessageBlock *block = head;
+        head = block->next;
+        --count;
+        return block;
+    }
+
+    void give(MessageBlock *block)
+    {
+        block->next = head;
+        head = block;
+        if (++count > MAX_CACHED_BLOCKS)
+            spill(SLAB_BLOCKS);
+    }
+
+private:
+    void refill()
+    {
+        SharedFreeList &shared = sharedFreeList();
+        {
+            QMutexLocker locker(&shared.mutex);
+            while (shared.head && count < SLAB_BLOCKS) {
+                MessageBlock *block = shared.head;
+                shared.head = block->next;
+                block->next = head;
+                head = block;
+                ++count;
+            }
+        }
+        if (head)
+            return;
+        MessageBlock *slab = new MessageBlock[SLAB_BLOCKS];
+        for (int i = 0; i < SLAB_BLOCKS; ++i) {
+            slab[i].next = head;
+            head = &slab[i];
+        }
+        count = SLAB_BLOCKS;
+    }
+
+    void spill(int blocks)
+    {
+        MessageBlock *first = head;
+        MessageBlock *last = head;
+        for (int i = 1; i < blocks && last->next; ++i)
+            last = last->next;
+        head = last->next;
+        count = 0;
+        for (MessageBlock *block = head; block; block = block->next)
+            ++count;
+
+        SharedFreeList &shared = sharedFreeList();
+        QMutexLocker locker(&shared.mutex);
+        last->next = shared.head;
+        shared.head = first;
+    }
+
+    MessageBlock *head;
+    int count;
+};
+
+thread_local ThreadPool threadPool;
+
+quint8 *packOptionHeader(quint8 *p, quint32 delta, quint32 length)
+{
+    quint8 *h = p++;
+    quint8 header = 0;
+    if (delta <= 12) {
+        header = quint8(delta << 4);
+    } else if (delta <= 268) {
+        header = 13 << 4;
+        *p++ = quint8(delta - 13);
+    } else {
+        header = 14 << 4;
+        endian_store16(p, quint16(delta - 269));
+        p += 2;
+    }
+    if (length <= 12) {
+        header |= quint8(length);
+    } else if (length <= 268) {
+        header |= 13;
+        *p++ = quint8(length - 13);
+    } else {
+        header |= 14;
+        endian_store16(p, quint16(length - 269));
+        p += 2;
+    }
+    *h = header;
+    return p;
+}
+
+int optionHeaderSize(quint32 delta, quint32 length)
+{
+    return 1 + (delta > 268 ? 2 : delta > 12 ? 1 : 0) + (length > 268 ? 2 : length > 12 ? 1 : 0);
+}
+
+bool readExtended(const quint8 *data, int size, int &pos, quint32 &value)
+{
+    if (value == 13) {
+        if (pos + 1 > size)
+            return false;
+        value = data[pos++] + 13;
+    } else if (value == 14) {
+        if (pos + 2 > size)
+            return false;
+        value = endian_load16(quint16, (data + pos)) + 269;
+        pos += 2;
+    } else if (value == 15) {
+        return false;
+    }
+    return true;
+}
+}
+
+iotlib::coap::MessageView::MessageView() :
+    m_data(0),
+    m_size(0),
+    m_payloadOffset(0),
+    m_optionCount(0),
+    m_valid(false),
+    m_multicast(false)
+{
+}
+
+bool iotlib::coap::MessageView::parse(const char *data, int size)
+{
+    m_data = (const quint8 *)data;
+    m_size = size;
+    m_payloadOffset = size;
+    m_optionCount = 0;
+    m_valid = false;
+
+    if (size < 4 || (m_data[0] >> 6) != 1)
+        return false;
+    int tokenLength = m_data[0] & 0xf;
+    if (tokenLength > 8 || 4 + tokenLength > size)
+        return false;
+
+    int pos = 4 + tokenLength;
+    quint32 number = 0;
+    while (pos < size) {
+        if (m_data[pos] == 0xff) {
+            if (pos + 1 >= size) // marker without payload
+                return false;
+            m_payloadOffset = pos + 1;
+            break;
+        }
+        quint32 delta = m_data[pos] >> 4;
+        quint32 length = m_data[pos] & 0xf;
+        ++pos;
+        if (!readExtended(m_data, size, pos, delta) || !readExtended(m_data, size, pos, length))
+            return false;
+        number += delta;
+        if (number > 0xffff || pos + int(length) > size || m_optionCount == MaxOptions)
+            return false;
+        OptionRef &option = m_options[m_optionCount++];
+        option.number = quint16(number);
+        option.length = quint16(length);
+        option.offset = quint16(pos);
+        pos += length;
+    }
+    m_valid = true;
+    return true;
+}
+
+quint32 iotlib::coap::MessageView::optionUint(int i) const
+{
+    quint32 value = 0;
+    const quint8 *p = m_data + m_options[i].offset;
+    for (int j = 0; j < m_options[i].length && j < 4; ++j)
+        value = value << 8 | p[j];
+    return value;
+}
+
+int iotlib::coap::MessageView::findOption(iotlib::coap::Message::OptionType type, int from) const
+{
+    for (int i = qMax(from, 0); i < m_optionCount; ++i) {
+        if (m_options[i].number == (quint16)type)
+            return i;
+        if (m_options[i].number > (quint16)type)
+            break;
+    }
+    return -1;
+}
+
+iotlib::coap::Message iotlib::coap::MessageView::toMessage() const
+{
+    Message message;
+    message.unpack(QByteArray((const char *)m_data, m_size));
+    message.setAddress(m_address);
+    message.setMulticast(m_multicast);
+    return message;
+}
+
+iotlib::coap::MessageBuffer::MessageBuffer() :
+    m_block(0)
+{
+}
+
+iotlib::coap::MessageBuffer::MessageBuffer(iotlib::coap::MessageBlock *block) :
+    m_block(block)
+{
+}
+
+iotlib::coap::MessageBuffer::MessageBuffer(iotlib::coap::MessageBuffer &&other) :
+    m_block(other.m_block)
+{
+    other.m_block = 0;
+}
+
+iotlib::coap::MessageBuffer &iotlib::coap::MessageBuffer::operator=(iotlib::coap::MessageBuffer &&other)
+{
+    if (this != &other) {
+        if (m_block) {
+            threadPool.give(m_block);
+            liveBlocks.fetchAndAddRelaxed(-1);
+        }
+        m_block = other.m_block;
+        other.m_block = 0;
+    }
+    return *this;
+}
+
+iotlib::coap::MessageBuffer::~MessageBuffer()
+{
+    if (m_block) {
+        threadPool.give(m_block);
+        liveBlocks.fetchAndAddRelaxed(-1);
+    }
+}
+
+iotlib::coap::MessageBuffer iotlib::coap::MessageBuffer::allocate()
+{
+    MessageBlock *block = threadPool.take();
+    block->size = 0;
+    block->lastOption = 0;
+    block->payloadSet = false;
+    block->view = MessageView();
+    liveBlocks.fetchAndAddRelaxed(1);
+    return MessageBuffer(block);
+}
+
+iotlib::coap::MessageBuffer iotlib::coap::MessageBuffer::fromMessage(const iotlib::coap::Message &message)
+{
+    QByteArray packed = message.pack();
+    if (packed.size() > Capacity)
+        return MessageBuffer();
+    MessageBuffer buffer = allocate();
+    memcpy(buffer.data(), packed.constData(), packed.size());
+    buffer.setSize(packed.size());
+    buffer.parse();
+    buffer.view().setAddress(message.address());
+    buffer.view().setMulticast(message.isMulticast());
+    return buffer;
+}
+
+char *iotlib::coap::MessageBuffer::data()
+{
+    return m_block->data;
+}
+
+const char *iotlib::coap::MessageBuffer::constData() const
+{
+    return m_block->data;
+}
+
+int iotlib::coap::MessageBuffer::size() const
+{
+    return m_block ? m_block->size : 0;
+}
+
+void iotlib::coap::MessageBuffer::setSize(int size)
+{
+    m_block->size = qBound(0, size, int(Capacity));
+}
+
+bool iotlib::coap::MessageBuffer::parse()
+{
+    return m_block->view.parse(m_block->data, m_block->size);
+}
+
+iotlib::coap::MessageView &iotlib::coap::MessageBuffer::view()
+{
+    return m_block->view;
+}
+
+const iotlib::coap::MessageView &iotlib::coap::MessageBuffer::view() const
+{
+    return m_block->view;
+}
+
+void iotlib::coap::MessageBuffer::setHeader(iotlib::coap::Message::Type type, iotlib::coap::Message::Code code,
+                                            quint16 messageId, const char *token, int tokenLength)
+{
+    tokenLength = qBound(0, tokenLength, 8);
+    quint8 *p = (quint8 *)m_block->data;
+    p[0] = quint8(1 << 6 | (quint8)type << 4 | tokenLength);
+    p[1] = (quint8)code;
+    endian_store16((p + 2), messageId);
+    memcpy(p + 4, token, tokenLength);
+    m_block->size = 4 + tokenLength;
+    m_block->lastOption = 0;
+    m_block->payloadSet = false;
+}
+
+void iotlib::coap::MessageBuffer::setCode(iotlib::coap::Message::Code code)
+{
+    m_block->data[1] = (char)code;
+}
+
+iotlib::coap::Message::Code iotlib::coap::MessageBuffer::code() const
+{
+    return (Message::Code)(quint8)m_block->data[1];
+}
+
+bool iotlib::coap::MessageBuffer::addOption(iotlib::coap::Message::OptionType type, const char *data, int length)
+{
+    quint16 number = (quint16)type;
+    if (m_block->payloadSet || number < m_block->lastOption || length < 0 || length > 0xffff + 269)
+        return false;
+    quint32 delta = number - m_block->lastOption;
+    if (m_block->size + optionHeaderSize(delta, length) + length > Capacity)
+        return false;
+    quint8 *p = packOptionHeader((quint8 *)m_block->data + m_block->size, delta, length);
+    memcpy(p, data, length);
+    m_block->size = int(p - (quint8 *)m_block->data) + length;
+    m_block->lastOption = number;
+    return true;
+}
+
+bool iotlib::coap::MessageBuffer::addOption(iotlib::coap::Message::OptionType type, quint32 value)
+{
+    char bytes[4];
+    int length = 0;
+    for (int shift = 24; shift >= 0; shift -= 8)
+        if (length || ((value >> shift) & 0xff))
+            bytes[length++] = char((value >> shift) & 0xff);
+    return addOption(type, bytes, length);
+}
+
+bool iotlib::coap::MessageBuffer::setPayload(const char *data, int length)
+{
+    if (m_block->payloadSet || length < 0)
+        return false;
+    if (!length)
+        return true;
+    if (m_block->size + 1 + length > Capacity)
+        return false;
+    m_block->data[m_block->size] = char(0xff);
+    memcpy(m_block->data + m_block->size + 1, data, length);
+    m_block->size += 1 + length;
+    m_block->payloadSet = true;
+    return true;
+}
+
+int iotlib::coap::MessageBuffer::blocksInUse()
+{
+    return liveBlocks.load();
+}
@@ -0,0 +1,149 @@
+#ifndef COAP_MESSAGEBUFFER_H
+#define COAP_MESSAGEBUFFER_H
+
+#include "../iotlib_global.h"
+#include "message.hpp"
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The MessageView class is a parsed, read only look at a message in RFC7252 format
+ * Nothing is copied: token, options and payload point into the bytes given to parse(),
+ * which must outlive the view. Convert with toMessage() when a Message is needed.
+ */
+class IOTLIB_SHARED_EXPORT MessageView
+{
+public:
+    enum { MaxOptions = 32 };
+
+    MessageView();
+
+    /**
+     * @brief parse indexes header, options and payload
+     * @return false if data is not a valid message or has more than MaxOptions options
+     */
+    bool parse(const char *data, int size);
+    bool isValid() const { return m_valid; }
+
+    const char *data() const { return (const char *)m_data; }
+    int size() const { return m_size; }
+
+    Message::Type type() const { return (Message::Type)((m_data[0] >> 4) & 0x3); }
+    Message::Code code() const { return (Message::Code)m_data[1]; }
+    quint16 messageId() const { return quint16(m_data[2] << 8 | m_data[3]); }
+    const char *token() const { return (const char *)m_data + 4; }
+    int tokenLength() const { return m_data[0] & 0xf; }
+
+    bool isEmpty() const { return m_data[1] == 0; }
+    bool isRequest() const { return m_data[1] >= 0x01 && m_data[1] <= 0x07; }
+    bool isResponse() const { return m_data[1] >= 0x40 && (m_data[1] >> 5) != 7; }
+
+    int optionCount() const { return m_optionCount; }
+    Message::OptionType optionType(int i) const { return (Message::OptionType)m_options[i].number; }
+    const char *optionData(int i) const { return (const char *)m_data + m_options[i].offset; }
+    int optionLength(int i) const { return m_options[i].length; }
+    quint32 optionUint(int i) const;
+    /**
+     * @brief findOption returns index of the first option of type at or after from, -1 if none
+     */
+    int findOption(Message::OptionType type, int from = 0) const;
+
+    const char *payload() const { return (const char *)m_data + m_payloadOffset; }
+    int payloadLength() const { return m_size - m_payloadOffset; }
+
+    Address address() const { return m_address; }
+    void setAddress(const Address &address) { m_address = address; }
+    bool isMulticast() const { return m_multicast; }
+    void setMulticast(bool multicast) { m_multicast = multicast; }
+
+    /**
+     * @brief toMessage makes implicitly shared Message out of the view, copies everything
+     */
+    Message toMessage() const;
+
+private:
+    struct OptionRef {
+        quint16 number;
+        quint16 length;
+        quint16 offset;
+    };
+
+    const quint8 *m_data;
+    int m_size;
+    int m_payloadOffset;
+    int m_optionCount;
+    bool m_valid;
+    bool m_multicast;
+    Address m_address;
+    OptionRef m_options[MaxOptions];
+};
+
+struct MessageBlock;
+/**
+ * @brief The MessageBuffer class owns one datagram worth of memory taken from a per thread slab pool
+ * Move only, memory goes back to the pool of the thread that destroys it. Used on the hot paths
+ * instead of Message, so receiving, dispatching and answering a request doesn't touch the heap.
+ * Building a message: setHeader(), then options in ascending order, then payload.
+ */
+class IOTLIB_SHARED_EXPORT MessageBuffer
+{
+public:
+    enum { Capacity = 1280 };   ///< IPv6 minimum MTU, bigger messages take Message path
+
+    MessageBuffer();
+    MessageBuffer(MessageBuffer &&other);
+    MessageBuffer &operator=(MessageBuffer &&other);
+    ~MessageBuffer();
+
+    /**
+     * @brief allocate takes a block from the current thread's pool
+     */
+    static MessageBuffer allocate();
+    /**
+     * @brief fromMessage packs message into a new buffer, null buffer if it doesn't fit
+     */
+    static MessageBuffer fromMessage(const Message &message);
+
+    bool isNull() const { return !m_block; }
+    char *data();
+    const char *constData() const;
+    int size() const;
+    void setSize(int size);
+    int capacity() const { return Capacity; }
+
+    /**
+     * @brief parse indexes current contents, view() is valid after that
+     */
+    bool parse();
+    MessageView &view();
+    const MessageView &view() const;
+
+    void setHeader(Message::Type type, Message::Code code, quint16 messageId,
+                   const char *token, int tokenLength);
+    void setCode(Message::Code code);
+    Message::Code code() const;
+    /**
+     * @brief addOption appends option, type must not be lower than the previous one
+     * @return false if it doesn't fit or breaks the order
+     */
+    bool addOption(Message::OptionType type, const char *data, int length);
+    bool addOption(Message::OptionType type, quint32 value);
+    bool setPayload(const char *data, int length);
+
+    /**
+     * @brief blocksInUse returns number of blocks currently owned by buffers in all threads
+     */
+    static int blocksInUse();
+
+private:
+    Q_DISABLE_COPY(MessageBuffer)
+    explicit MessageBuffer(MessageBlock *block);
+
+    MessageBlock *m_block;
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_MESSAGEBUFFER_H
@@ -0,0 +1,74 @@
+#ifndef COAP_MPSCQUEUE_H
+#define COAP_MPSCQUEUE_H
+
+#include <QAtomicPointer>
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The MpscQueue class is an unbounded lock-free queue, any thread may push, one thread pops.
+ * Linked list with a stub node (D. Vyukov), push is one atomic exchange and never waits for other
+ * producers or the consumer. pop() may miss an item whose push is still in progress, the producer
+ * has to wake the consumer after push() returns.
+ */
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue() : m_tail(new Node)
+    {
+        m_head.store(m_tail);
+    }
+
+    ~MpscQueue()
+    {
+        T value;
+        while (pop(value))
+            ;
+        delete m_tail;
+    }
+
+    void push(const T &value)
+    {
+        Node *node = new Node;
+        node->value = value;
+        Node *previous = m_head.fetchAndStoreOrdered(node);
+        previous->next.storeRelease(node);
+    }
+
+    /**
+     * @brief pop consumer side only
+     * @return false if queue is empty
+     */
+    bool pop(T &value)
+    {
+        Node *tail = m_tail;
+        Node *next = tail->next.loadAcquire();
+        if (!next)
+            return false;
+        value = next->value;
+        next->value = T(); // next becomes the stub, don't keep the value alive
+        m_tail = next;
+        delete tail;
+        return true;
+    }
+
+private:
+    Q_DISABLE_COPY(MpscQueue)
+
+    struct Node
+    {
+        Node() : next(0) { }
+        QAtomicPointer<Node> next;
+        T value;
+    };
+
+    QAtomicPointer<Node> m_head;    ///< last pushed, producers
+    Node *m_tail;                   ///< stub, consumer
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_MPSCQUEUE_H
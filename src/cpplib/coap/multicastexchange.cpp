@@ -0,0 +1,75 @@
+#include "multicastexchange.hpp"
+#include "multicastexchange_p.hpp"
+#include "stack_p.hpp"
+
+iotlib::coap::MulticastExchangePrivate::MulticastExchangePrivate() :
+    windowTimer(0)
+{
+}
+
+void iotlib::coap::MulticastExchangePrivate::_q_status_changed()
+{
+    if (status != iotlib::coap::Exchange::InProgress)
+        return;
+    responses.clear();
+    windowTimer->start();
+}
+
+void iotlib::coap::MulticastExchangePrivate::_q_window_closed()
+{
+    Q_Q(iotlib::coap::MulticastExchange);
+    if (stack)
+        stack->d_ptr->removeExchange(q); // late answers are not ours anymore
+    emit q->completed();
+    setStatus(iotlib::coap::Exchange::Completed);
+
+    if (deleteAfterComplete)
+        q->deleteLater();
+}
+
+iotlib::coap::MulticastExchange::MulticastExchange(QObject *parent) :
+    iotlib::coap::Exchange(*new iotlib::coap::MulticastExchangePrivate, parent)
+{
+    Q_D(iotlib::coap::MulticastExchange);
+    d->windowTimer = new QTimer(this);
+    d->windowTimer->setSingleShot(true);
+    d->windowTimer->setInterval(5000);
+    connect(d->windowTimer, SIGNAL(timeout()),
+            this,           SLOT(_q_window_closed()));
+    connect(this, SIGNAL(statusChanged()),
+            this, SLOT(_q_status_changed()));
+}
+
+iotlib::coap::MulticastExchange::~MulticastExchange()
+{
+}
+
+void iotlib::coap::MulticastExchange::setCollectionWindow(int msec)
+{
+    Q_D(iotlib::coap::MulticastExchange);
+    d->windowTimer->setInterval(msec);
+}
+
+int iotlib::coap::MulticastExchange::collectionWindow() const
+{
+    Q_D(const iotlib::coap::MulticastExchange);
+    return d->windowTimer->interval();
+}
+
+QList<iotlib::coap::Message> iotlib::coap::MulticastExchange::responses() const
+{
+    Q_D(const iotlib::coap::MulticastExchange);
+    return d->responses;
+}
+
+void iotlib::coap::MulticastExchange::handle(iotlib::coap::Message &message)
+{
+    Q_D(iotlib::coap::MulticastExchange);
+    if (d->status != InProgress)
+        return;
+    d->message = message;
+    d->responses.append(message);
+    emit responseReceived(message);
+}
+
+#include "moc_multicastexchange.cpp"
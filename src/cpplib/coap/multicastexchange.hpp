@@ -0,0 +1,53 @@
+#ifndef COAP_MULTICASTEXCHANGE_H
+#define COAP_MULTICASTEXCHANGE_H
+
+#include "exchange.hpp"
+
+namespace iotlib {
+namespace coap {
+
+class MulticastExchangePrivate;
+
+/**
+ * @brief The MulticastExchange class sends one NON request to a group and gathers all the answers.
+ * Every response is reported through responseReceived() while collection window is open,
+ * completed() is emitted once it closes.
+ * Use group address in url, coap://[ff02::fd]/.well-known/core for example.
+ */
+class IOTLIB_SHARED_EXPORT MulticastExchange : public Exchange
+{
+    Q_OBJECT
+    Q_PROPERTY(int collectionWindow READ collectionWindow WRITE setCollectionWindow)
+public:
+    MulticastExchange(QObject *parent = 0);
+    ~MulticastExchange();
+
+    /**
+     * @brief setCollectionWindow sets for how long responses are gathered after request is sent
+     * @param msec defaults to 5000, servers spread their answers over DEFAULT_LEISURE of the same length
+     */
+    void setCollectionWindow(int msec);
+    int collectionWindow() const;
+
+    /**
+     * @brief responses returns everything received during the last collection window
+     * Use Message::address() to tell group members apart
+     */
+    QList<Message> responses() const;
+
+signals:
+    void responseReceived(const iotlib::coap::Message &response);
+
+protected:
+    void handle(Message &message);
+
+private:
+    Q_DECLARE_PRIVATE(MulticastExchange)
+    Q_PRIVATE_SLOT(d_func(), void _q_status_changed())
+    Q_PRIVATE_SLOT(d_func(), void _q_window_closed())
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_MULTICASTEXCHANGE_H
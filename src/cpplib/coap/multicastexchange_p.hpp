@@ -0,0 +1,28 @@
+#ifndef COAP_MULTICASTEXCHANGE_P_H
+#define COAP_MULTICASTEXCHANGE_P_H
+
+#include "multicastexchange.hpp"
+#include "exchange_p.hpp"
+
+#include <QTimer>
+
+namespace iotlib {
+namespace coap {
+
+class MulticastExchangePrivate : public ExchangePrivate
+{
+    Q_DECLARE_PUBLIC(MulticastExchange)
+public:
+    MulticastExchangePrivate();
+
+    QTimer *windowTimer;
+    QList<Message> responses;
+
+    void _q_status_changed();
+    void _q_window_closed();
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_MULTICASTEXCHANGE_P_H
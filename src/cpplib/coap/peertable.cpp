@@ -0,0 +1,139 @@
+#include "peertable.hpp"
+
+void iotlib::coap::PeerState::addRttSample(qint32 usec)
+{
+    if (usec <= 0)
+        usec = 1;
+    if (!srtt) {
+        srtt = usec;
+        rttvar = usec / 2;
+        return;
+    }
+    qint32 delta = srtt > usec ? srtt - usec : usec - srtt;
+    rttvar = rttvar - rttvar / 4 + delta / 4;
+    srtt = srtt - srtt / 8 + usec / 8;
+}
+
+quint32 iotlib::coap::PeerState::retransmitTimeout(quint32 defaultMsec) const
+{
+    if (!srtt)
+        return defaultMsec;
+    // RFC6298 RTO, kept within 1 s and ACK_TIMEOUT * 2 like CoCoA does
+    quint32 rto = quint32((qint64(srtt) + 4 * qint64(rttvar)) / 1000);
+    return qBound<quint32>(1000, rto, defaultMsec * 2);
+}
+
+iotlib::coap::PeerTable::PeerTable(int capacity) :
+    m_size(0)
+{
+    int slots = 16;
+    while (slots < capacity * 2)
+        slots *= 2;
+    m_slots.resize(slots);
+    memset(m_slots.data(), 0, slots * sizeof(PeerState));
+    m_mask = slots - 1;
+}
+
+iotlib::coap::PeerState *iotlib::coap::PeerTable::find(const iotlib::coap::Address &address)
+{
+    int slot = slotFor(address);
+    return m_slots[slot].address.isNull() ? 0 : &m_slots[slot];
+}
+
+const iotlib::coap::PeerState *iotlib::coap::PeerTable::find(const iotlib::coap::Address &address) const
+{
+    int slot = slotFor(address);
+    return m_slots[slot].address.isNull() ? 0 : &m_slots[slot];
+}
+
+iotlib::coap::PeerState *iotlib::coap::PeerTable::insert(const iotlib::coap::Address &address)
+{
+    if (address.isNull())
+        return 0;
+    int slot = slotFor(address);
+    if (!m_slots[slot].address.isNull())
+        return &m_slots[slot];
+
+    if ((m_size + 1) * 4 > m_slots.size() * 3) { // load factor 0.75
+        grow();
+        slot = slotFor(address);
+    }
+    PeerState &state = m_slots[slot];
+    memset(&state, 0, sizeof(PeerState));
+    state.address = address;
+    state.nextMessageId = quint16(qrand()); // RFC7252 4.4, start randomized
+    ++m_size;
+    return &state;
+}
+
+bool iotlib::coap::PeerTable::remove(const iotlib::coap::Address &address)
+{
+    int slot = slotFor(address);
+    if (m_slots[slot].address.isNull())
+        return false;
+    eraseSlot(slot);
+    return true;
+}
+
+int iotlib::coap::PeerTable::expire(qint64 lastSeen)
+{
+    int removed = 0;
+    for (int slot = 0; slot < m_slots.size(); ++slot) {
+        // erase shifts the next entry into this slot, look at it again
+        while (!m_slots[slot].address.isNull() && m_slots[slot].lastSeen < lastSeen &&
+               !m_slots[slot].inFlight && !m_slots[slot].dtlsSession) {
+            eraseSlot(slot);
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+int iotlib::coap::PeerTable::size() const
+{
+    return m_size;
+}
+
+void iotlib::coap::PeerTable::clear()
+{
+    memset(m_slots.data(), 0, m_slots.size() * sizeof(PeerState));
+    m_size = 0;
+}
+
+int iotlib::coap::PeerTable::slotFor(const iotlib::coap::Address &address) const
+{
+    int slot = qHash(address) & m_mask;
+    while (!m_slots[slot].address.isNull() && m_slots[slot].address != address)
+        slot = (slot + 1) & m_mask;
+    return slot;
+}
+
+void iotlib::coap::PeerTable::grow()
+{
+    QVector<PeerState> old;
+    old.swap(m_slots);
+    m_slots.resize(old.size() * 2);
+    memset(m_slots.data(), 0, m_slots.size() * sizeof(PeerState));
+    m_mask = m_slots.size() - 1;
+    foreach (const PeerState &state, old)
+        if (!state.address.isNull())
+            m_slots[slotFor(state.address)] = state;
+}
+
+void iotlib::coap::PeerTable::eraseSlot(int slot)
+{
+    // backward shift deletion, no tombstones to slow down later probes
+    int hole = slot;
+    int next = (hole + 1) & m_mask;
+    while (!m_slots[next].address.isNull()) {
+        int home = qHash(m_slots[next].address) & m_mask;
+        // entry may move into the hole if its home is not between hole and next (cyclically)
+        if (((next - home) & m_mask) >= ((next - hole) & m_mask)) {
+            m_slots[hole] = m_slots[next];
+            hole = next;
+        }
+        next = (next + 1) & m_mask;
+    }
+    memset(&m_slots[hole], 0, sizeof(PeerState));
+    --m_size;
+}
@@ -0,0 +1,80 @@
+#ifndef COAP_PEERTABLE_H
+#define COAP_PEERTABLE_H
+
+#include "../iotlib_global.h"
+#include "message.hpp"
+#include "admissioncontrol.hpp"
+
+#include <QVector>
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The PeerState struct is what stack and endpoints remember about one peer
+ */
+struct PeerState
+{
+    Address address;
+    quint16 nextMessageId;
+    quint16 inFlight;       ///< confirmable requests waiting for the first response
+    qint32 srtt;            ///< smoothed round trip time, microseconds, 0 until first sample
+    qint32 rttvar;
+    qint64 lastSeen;        ///< milliseconds, clock of table owner
+    void *dtlsSession;      ///< owned by DtlsEndpoint
+    TokenBucket admission;  ///< per peer request budget, @see AdmissionControl
+
+    /**
+     * @brief addRttSample updates estimator as in RFC6298, only samples of not retransmitted messages
+     */
+    void addRttSample(qint32 usec);
+    /**
+     * @brief retransmitTimeout returns initial timeout for the next confirmable, msec
+     * @param defaultMsec ACK_TIMEOUT used until the first sample
+     */
+    quint32 retransmitTimeout(quint32 defaultMsec) const;
+};
+
+/**
+ * @brief The PeerTable class maps Address to PeerState, open addressing with linear probing
+ * One probe is usually one cache line, no allocations except growth.
+ * Pointers returned by find() and insert() stay valid until the next insert() or remove().
+ */
+class IOTLIB_SHARED_EXPORT PeerTable
+{
+public:
+    explicit PeerTable(int capacity = 64);
+
+    PeerState *find(const Address &address);
+    const PeerState *find(const Address &address) const;
+    /**
+     * @brief insert returns existing state or new zeroed one with random nextMessageId
+     */
+    PeerState *insert(const Address &address);
+    bool remove(const Address &address);
+
+    /**
+     * @brief expire removes peers not seen since lastSeen with nothing in flight
+     * @return number of removed peers
+     */
+    int expire(qint64 lastSeen);
+
+    int size() const;
+    void clear();
+
+private:
+    int slotFor(const Address &address) const;
+    void grow();
+    void eraseSlot(int slot);
+
+    QVector<PeerState> m_slots;     ///< null address marks free slot
+    int m_size;
+    int m_mask;
+};
+
+} // coap
+} // iotlib
+
+Q_DECLARE_TYPEINFO(iotlib::coap::PeerState, Q_PRIMITIVE_TYPE);
+
+#endif // COAP_PEERTABLE_H
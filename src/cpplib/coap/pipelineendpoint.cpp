@@ -0,0 +1,542 @@
+#include "pipelineendpoint.h"
+#include "messagebuffer.hpp"
+#include "spscring.hpp"
+
+#include <QThread>
+#include <QHostAddress>
+#include <QMutex>
+#include <QQueue>
+#include <QDebug>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+namespace {
+const int RECEIVE_BATCH = 256;  ///< datagrams handed to the stack per wakeup, then other events get a turn
+const int DEFAULT_RING = 4096;
+const int MAX_DATAGRAM = 65536;
+const int MAX_OVERSIZE = 256;   ///< datagrams bigger than a slot queued each way, Block2 with big blocks and the like
+}
+
+namespace iotlib {
+namespace coap {
+
+struct RawDatagram
+{
+    Address address;
+    int size;
+    char data[MessageBuffer::Capacity];
+};
+
+class PipelineEndpointPrivate;
+class PipelineThread : public QThread
+{
+public:
+    PipelineThread(PipelineEndpointPrivate *d) : d(d) { }
+
+protected:
+    void run();
+
+private:
+    PipelineEndpointPrivate *d;
+};
+
+class PipelineEndpointPrivate
+{
+public:
+    PipelineEndpointPrivate(PipelineEndpoint *q);
+    ~PipelineEndpointPrivate();
+
+    bool open(const QHostAddress &interface, quint16 port);
+    void close();
+
+    // I/O thread
+    void ioLoop();
+    bool readSocket();
+    bool flushTransmit();
+
+    Address fromSockaddr(const sockaddr *address, socklen_t length) const;
+    socklen_t toSockaddr(const Address &address, sockaddr_in6 *to) const;
+
+    PipelineEndpoint *q;
+    Settings *settings;
+    QHostAddress boundInterface;
+    quint16 boundPort;
+
+    int fd;
+    int family;
+    int wakePipe[2];            ///< written by the protocol thread to get the I/O thread out of poll()
+    PipelineThread *thread;
+    SpscRing<RawDatagram> *receiveRing;     ///< I/O thread -> protocol thread
+    SpscRing<RawDatagram> *transmitRing;    ///< protocol thread -> I/O thread
+    char scratch[MessageBuffer::Capacity];  ///< datagrams read while the receive ring is full
+    char overflow[MAX_DATAGRAM - MessageBuffer::Capacity];  ///< rest of datagrams bigger than a slot
+
+    // datagrams bigger than a slot go around the rings, copied to the heap
+    QMutex oversizeMutex;
+    QQueue<QPair<QByteArray, Address> > receiveOversize;
+    QQueue<QPair<QByteArray, Address> > transmitOversize;
+    QAtomicInt transmitOversizePending;
+    void wakeIoThread();
+
+    QAtomicInt stopping;
+    QAtomicInt receiveScheduled;    ///< onReceived() is queued, no need to post another
+    QAtomicInt sleeping;            ///< I/O thread is about to poll(), transmit has to wake it
+    QAtomicInt congested;
+    QAtomicInt receiveHighWatermark;
+    QAtomicInt transmitHighWatermark;
+    QAtomicInteger<quint64> received;
+    QAtomicInteger<quint64> receiveDropped;
+    QAtomicInteger<quint64> sent;
+    QAtomicInteger<quint64> transmitDropped;
+};
+
+} // coap
+} // iotlib
+
+void iotlib::coap::PipelineThread::run()
+{
+    d->ioLoop();
+}
+
+iotlib::coap::PipelineEndpointPrivate::PipelineEndpointPrivate(iotlib::coap::PipelineEndpoint *q) :
+    q(q),
+    settings(0),
+    boundPort(0),
+    fd(-1),
+    family(AF_INET6),
+    thread(0),
+    receiveRing(0),
+    transmitRing(0),
+    stopping(0),
+    receiveScheduled(0),
+    sleeping(0),
+    congested(0),
+    receiveHighWatermark(0),
+    transmitHighWatermark(0),
+    received(0),
+    receiveDropped(0),
+    sent(0),
+    transmitDropped(0),
+    transmitOversizePending(0)
+{
+    wakePipe[0] = wakePipe[1] = -1;
+}
+
+iotlib::coap::PipelineEndpointPrivate::~PipelineEndpointPrivate()
+{
+    close();
+}
+
+bool iotlib::coap::PipelineEndpointPrivate::open(const QHostAddress &interface, quint16 port)
+{
+    QVariant receiveSetting = settings->get("pipeline_receive_ring");
+    QVariant transmitSetting = settings->get("pipeline_transmit_ring");
+    int receiveSlots = receiveSetting.isValid() ? receiveSetting.toInt() : DEFAULT_RING;
+    int transmitSlots = transmitSetting.isValid() ? transmitSetting.toInt() : DEFAULT_RING;
+    if (receiveSlots <= 0 || transmitSlots <= 0 || receiveSlots > 1 << 20 || transmitSlots > 1 << 20) {
+        qWarning() << "pipeline_receive_ring and pipeline_transmit_ring must be 1..1048576";
+        return false;
+    }
+
+    // dual stack socket unless bound to an IPv4 interface
+    family = interface.protocol() == QAbstractSocket::IPv4Protocol ? AF_INET : AF_INET6;
+    fd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        qWarning() << "socket() failed:" << strerror(errno);
+        return false;
+    }
+    if (settings->get("reuse_port").toBool()) {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+    sockaddr_in6 local;
+    socklen_t localLength;
+    if (family == AF_INET6) {
+        int v6only = 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        Address bindAddress = interface.isNull() || interface == QHostAddress::Any || interface == QHostAddress::AnyIPv6 ?
+                    Address(QHostAddress(QHostAddress::AnyIPv6), port) : Address(interface, port);
+        localLength = toSockaddr(bindAddress, &local);
+    } else {
+        localLength = toSockaddr(Address(interface, port), &local);
+    }
+    if (::bind(fd, (const sockaddr *)&local, localLength) < 0) {
+        qWarning() << "Bind failed:" << strerror(errno);
+        return false;
+    }
+
+    if (::pipe(wakePipe) < 0) {
+        qWarning() << "pipe() failed:" << strerror(errno);
+        return false;
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(wakePipe[i], F_SETFL, fcntl(wakePipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(wakePipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    receiveRing = new SpscRing<RawDatagram>(receiveSlots);
+    transmitRing = new SpscRing<RawDatagram>(transmitSlots);
+    stopping.store(0);
+    receiveScheduled.store(0);
+    sleeping.store(0);
+    congested.store(0);
+    receiveHighWatermark.store(0);
+    transmitHighWatermark.store(0);
+    received.store(0);
+    receiveDropped.store(0);
+    sent.store(0);
+    transmitDropped.store(0);
+
+    boundInterface = interface;
+    boundPort = port;
+    thread = new PipelineThread(this);
+    thread->start(QThread::HighPriority);
+    return true;
+}
+
+void iotlib::coap::PipelineEndpointPrivate::close()
+{
+    if (thread) {
+        stopping.store(1);
+        char wake = 1;
+        if (::write(wakePipe[1], &wake, 1) < 0 && errno != EAGAIN)
+            qWarning() << "Can't wake pipeline I/O thread:" << strerror(errno);
+        thread->wait();
+        delete thread;
+        thread = 0;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (wakePipe[i] >= 0) {
+            ::close(wakePipe[i]);
+            wakePipe[i] = -1;
+        }
+    }
+    delete receiveRing;
+    receiveRing = 0;
+    delete transmitRing;
+    transmitRing = 0;
+    receiveOversize.clear();
+    transmitOversize.clear();
+    transmitOversizePending.store(0);
+    boundPort = 0;
+}
+
+void iotlib::coap::PipelineEndpointPrivate::wakeIoThread()
+{
+    if (sleeping.testAndSetOrdered(1, 0)) {
+        char wake = 1;
+        if (::write(wakePipe[1], &wake, 1) < 0 && errno != EAGAIN)
+            qWarning() << "Can't wake pipeline I/O thread:" << strerror(errno);
+    }
+}
+
+void iotlib::coap::PipelineEndpointPrivate::ioLoop()
+{
+    pollfd fds[2];
+    fds[0].fd = fd;
+    fds[1].fd = wakePipe[0];
+    fds[1].events = POLLIN;
+    bool socketFull = false;
+    while (!stopping.load()) {
+        // bounded, so a flood can't keep the transmit side and stop() waiting
+        bool anyReceived = false;
+        for (int i = 0; i < RECEIVE_BATCH && readSocket(); ++i)
+            anyReceived = true;
+        if (anyReceived && receiveScheduled.testAndSetOrdered(0, 1))
+            QMetaObject::invokeMethod(q, "onReceived", Qt::QueuedConnection);
+        if (!socketFull)
+            socketFull = !flushTransmit();
+
+        // announced before the last look at the ring, sendPacked() either sees it or we see its datagram
+        sleeping.fetchAndStoreOrdered(1);
+        if (!socketFull && (!transmitRing->isEmpty() || transmitOversizePending.load())) {
+            sleeping.fetchAndStoreOrdered(0);
+            continue;
+        }
+        fds[0].events = POLLIN | (socketFull ? POLLOUT : 0);
+        int ready = ::poll(fds, 2, -1);
+        sleeping.fetchAndStoreOrdered(0);
+        if (ready < 0)
+            continue; // EINTR
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (::read(wakePipe[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        if (fds[0].revents & POLLOUT)
+            socketFull = false;
+    }
+}
+
+bool iotlib::coap::PipelineEndpointPrivate::readSocket()
+{
+    RawDatagram *slot = receiveRing->reserve();
+    sockaddr_in6 from;
+    iovec vectors[2];
+    vectors[0].iov_base = slot ? slot->data : scratch;
+    vectors[0].iov_len = MessageBuffer::Capacity;
+    vectors[1].iov_base = overflow;
+    vectors[1].iov_len = sizeof(overflow);
+    msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_name = &from;
+    header.msg_namelen = sizeof(from);
+    header.msg_iov = vectors;
+    header.msg_iovlen = 2;
+    ssize_t size = ::recvmsg(fd, &header, 0);
+    if (size < 0)
+        return errno == EINTR;
+    if (size > MessageBuffer::Capacity) {
+        QByteArray datagram((const char *)vectors[0].iov_base, MessageBuffer::Capacity);
+        datagram.append(overflow, int(size) - MessageBuffer::Capacity);
+        QMutexLocker lock(&oversizeMutex);
+        if (receiveOversize.size() >= MAX_OVERSIZE) {
+            receiveDropped.fetchAndAddRelaxed(1);
+            return true;
+        }
+        receiveOversize.enqueue(qMakePair(datagram, fromSockaddr((const sockaddr *)&from, header.msg_namelen)));
+        received.fetchAndAddRelaxed(1);
+        return true;
+    }
+    if (!slot) { // ring full
+        receiveDropped.fetchAndAddRelaxed(1);
+        return true;
+    }
+    slot->address = fromSockaddr((const sockaddr *)&from, header.msg_namelen);
+    slot->size = int(size);
+    receiveRing->commit();
+    received.fetchAndAddRelaxed(1);
+    int occupancy = receiveRing->size();
+    if (occupancy > receiveHighWatermark.load())
+        receiveHighWatermark.store(occupancy);
+    return true;
+}
+
+bool iotlib::coap::PipelineEndpointPrivate::flushTransmit()
+{
+    while (RawDatagram *slot = transmitRing->peek()) {
+        sockaddr_in6 to;
+        socklen_t length = toSockaddr(slot->address, &to);
+        if (::sendto(fd, slot->data, size_t(slot->size), 0, (const sockaddr *)&to, length) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+                return false;
+            // unreachable peer and the like, the datagram is lost as it would be on the wire
+        } else {
+            sent.fetchAndAddRelaxed(1);
+        }
+        transmitRing->release();
+    }
+    while (transmitOversizePending.load()) {
+        QPair<QByteArray, Address> datagram;
+        {
+            QMutexLocker lock(&oversizeMutex);
+            datagram = transmitOversize.head();
+        }
+        sockaddr_in6 to;
+        socklen_t length = toSockaddr(datagram.second, &to);
+        if (::sendto(fd, datagram.first.constData(), size_t(datagram.first.size()), 0,
+                     (const sockaddr *)&to, length) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+                return false;
+        } else {
+            sent.fetchAndAddRelaxed(1);
+        }
+        QMutexLocker lock(&oversizeMutex);
+        transmitOversize.dequeue();
+        transmitOversizePending.deref();
+    }
+    if (congested.testAndSetOrdered(1, 0))
+        QMetaObject::invokeMethod(q, "onTransmitDrained", Qt::QueuedConnection);
+    return true;
+}
+
+iotlib::coap::Address iotlib::coap::PipelineEndpointPrivate::fromSockaddr(const sockaddr *address,
+                                                                          socklen_t length) const
+{
+    if (address->sa_family == AF_INET6 && length >= sizeof(sockaddr_in6)) {
+        const sockaddr_in6 *in6 = (const sockaddr_in6 *)address;
+        return Address::fromRaw(in6->sin6_addr.s6_addr, ntohs(in6->sin6_port), in6->sin6_scope_id);
+    }
+    if (address->sa_family == AF_INET && length >= sizeof(sockaddr_in)) {
+        const sockaddr_in *in = (const sockaddr_in *)address;
+        quint8 ip[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+        memcpy(ip + 12, &in->sin_addr, 4);
+        return Address::fromRaw(ip, ntohs(in->sin_port));
+    }
+    return Address();
+}
+
+socklen_t iotlib::coap::PipelineEndpointPrivate::toSockaddr(const iotlib::coap::Address &address,
+                                                            sockaddr_in6 *to) const
+{
+    memset(to, 0, sizeof(*to));
+    if (family == AF_INET) {
+        sockaddr_in *in = (sockaddr_in *)to;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(address.port());
+        memcpy(&in->sin_addr, address.ip() + 12, 4);
+        return sizeof(sockaddr_in);
+    }
+    to->sin6_family = AF_INET6; // IPv4 goes v4-mapped through the dual stack socket
+    to->sin6_port = htons(address.port());
+    to->sin6_scope_id = address.scopeId();
+    memcpy(&to->sin6_addr, address.ip(), 16);
+    return sizeof(sockaddr_in6);
+}
+
+iotlib::coap::PipelineEndpoint::PipelineEndpoint(iotlib::Settings *settings, QObject *parent) :
+    iotlib::coap::EndpointBase(parent), d(new iotlib::coap::PipelineEndpointPrivate(this))
+{
+    d->settings = settings;
+    connect(settings, &Settings::settingsChanged,
+            this,     &PipelineEndpoint::onSettingsChanged);
+    onSettingsChanged();
+}
+
+iotlib::coap::PipelineEndpoint::~PipelineEndpoint()
+{
+    if (d) {
+        delete d;
+        d = 0;
+    }
+}
+
+bool iotlib::coap::PipelineEndpoint::isCongested() const
+{
+    return d->congested.load();
+}
+
+iotlib::coap::PipelineStats iotlib::coap::PipelineEndpoint::pipelineStats() const
+{
+    PipelineStats stats;
+    if (!d->receiveRing)
+        return stats;
+    stats.receiveOccupancy = d->receiveRing->size();
+    stats.receiveHighWatermark = d->receiveHighWatermark.load();
+    stats.receiveCapacity = d->receiveRing->capacity();
+    stats.transmitOccupancy = d->transmitRing->size();
+    stats.transmitHighWatermark = d->transmitHighWatermark.load();
+    stats.transmitCapacity = d->transmitRing->capacity();
+    stats.received = d->received.load();
+    stats.receiveDropped = d->receiveDropped.load();
+    stats.sent = d->sent.load();
+    stats.transmitDropped = d->transmitDropped.load();
+    return stats;
+}
+
+void iotlib::coap::PipelineEndpoint::send(const iotlib::coap::Message &coapMessage)
+{
+    QByteArray packed = coapMessage.pack();
+    sendPacked(packed.constData(), packed.size(), coapMessage.address());
+}
+
+void iotlib::coap::PipelineEndpoint::sendPacked(const char *data, int size, const iotlib::coap::Address &address)
+{
+    if (!d->transmitRing)
+        return;
+    if (size > MessageBuffer::Capacity) {
+        QMutexLocker lock(&d->oversizeMutex);
+        if (d->transmitOversize.size() >= MAX_OVERSIZE) {
+            d->transmitDropped.fetchAndAddRelaxed(1);
+            return;
+        }
+        d->transmitOversize.enqueue(qMakePair(QByteArray(data, size), address));
+        d->transmitOversizePending.ref();
+        lock.unlock();
+        captureDatagram(CaptureRecord::Sent, data, size, address);
+        d->wakeIoThread();
+        return;
+    }
+    RawDatagram *slot = d->transmitRing->reserve();
+    if (!slot) {
+        d->transmitDropped.fetchAndAddRelaxed(1);
+        return;
+    }
+    memcpy(slot->data, data, size_t(size));
+    slot->size = size;
+    slot->address = address;
+    d->transmitRing->commit();
+    captureDatagram(CaptureRecord::Sent, data, size, address);
+
+    int occupancy = d->transmitRing->size();
+    if (occupancy > d->transmitHighWatermark.load())
+        d->transmitHighWatermark.store(occupancy);
+    if (occupancy > d->transmitRing->capacity() * 3 / 4 && d->congested.testAndSetOrdered(0, 1))
+        emit congestionChanged(true);
+    d->wakeIoThread();
+}
+
+void iotlib::coap::PipelineEndpoint::onSettingsChanged()
+{
+    bool bind = d->settings->get("bind").toBool();
+    if (!bind) {
+        d->close();
+        return;
+    }
+    QHostAddress interface(d->settings->get("interface").toString());
+    quint16 port = static_cast<quint16>(d->settings->get("port").toUInt());
+    if (port == 0)
+        port = 5683;
+    if (d->thread && d->boundInterface == interface && d->boundPort == port)
+        return;
+    d->close();
+    if (!d->open(interface, port))
+        d->close();
+}
+
+void iotlib::coap::PipelineEndpoint::onReceived()
+{
+    d->receiveScheduled.storeRelease(0); // datagrams committed from now on post another call
+    if (!d->receiveRing)
+        return;
+    QQueue<QPair<QByteArray, Address> > oversize;
+    {
+        QMutexLocker lock(&d->oversizeMutex);
+        oversize.swap(d->receiveOversize);
+    }
+    while (!oversize.isEmpty()) {
+        QPair<QByteArray, Address> datagram = oversize.dequeue();
+        captureDatagram(CaptureRecord::Received, datagram.first.constData(), datagram.first.size(), datagram.second);
+        deliverDatagram(datagram.first.constData(), datagram.first.size(), datagram.second);
+        if (!d->receiveRing) // closed by a handler
+            return;
+    }
+    for (int i = 0; i < RECEIVE_BATCH; ++i) {
+        RawDatagram *slot = d->receiveRing->peek();
+        if (!slot)
+            return;
+        MessageBuffer buffer = MessageBuffer::allocate();
+        memcpy(buffer.data(), slot->data, size_t(slot->size));
+        buffer.setSize(slot->size);
+        Address address = slot->address;
+        d->receiveRing->release(); // slot goes back to the I/O thread before the stack gets busy
+        captureDatagram(CaptureRecord::Received, buffer.constData(), buffer.size(), address);
+        if (!deliverDatagram(buffer, address))
+            continue;
+        if (!d->receiveRing) // closed by a handler
+            return;
+    }
+    if (d->receiveScheduled.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "onReceived", Qt::QueuedConnection);
+}
+
+void iotlib::coap::PipelineEndpoint::onTransmitDrained()
+{
+    if (!d->congested.load())
+        emit congestionChanged(false);
+}
@@ -0,0 +1,79 @@
+#ifndef PIPELINEENDPOINT_H
+#define PIPELINEENDPOINT_H
+
+#include "endpointbase.hpp"
+#include "../settings.h"
+
+#include <QObject>
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The PipelineStats struct describes the rings between PipelineEndpoint's I/O thread and its owner
+ */
+struct PipelineStats
+{
+    PipelineStats() :
+        receiveOccupancy(0), receiveHighWatermark(0), receiveCapacity(0), transmitOccupancy(0),
+        transmitHighWatermark(0), transmitCapacity(0), received(0), receiveDropped(0), sent(0), transmitDropped(0)
+    { }
+
+    int receiveOccupancy;       ///< datagrams read but not yet taken by the protocol thread
+    int receiveHighWatermark;   ///< since the endpoint was bound
+    int receiveCapacity;
+    int transmitOccupancy;      ///< datagrams waiting for the socket
+    int transmitHighWatermark;
+    int transmitCapacity;
+    quint64 received;
+    quint64 receiveDropped;     ///< read while the receive ring, or the queue of datagrams bigger than a slot, was full
+    quint64 sent;
+    quint64 transmitDropped;    ///< sent while the transmit ring, or the queue of datagrams bigger than a slot, was full
+};
+
+class PipelineEndpointPrivate;
+
+/**
+ * @brief The PipelineEndpoint class carries coap:// over UDP with socket I/O on a thread of its own.
+ * The I/O thread keeps draining the socket into a single producer single consumer ring of raw datagrams
+ * and writes whatever comes through a second ring the other way, so a stalled application or Stack
+ * delays processing but the kernel socket buffer doesn't overflow until the receive ring is full too.
+ * The protocol thread, the one the endpoint lives in, is woken once per batch. POSIX only, no multicast.
+ *
+ * Settings: "bind", "interface", "port" (5683 by default), "reuse_port" same as UdpEndpoint,
+ * "pipeline_receive_ring", "pipeline_transmit_ring" slots, rounded up to a power of two (4096 by default).
+ */
+class PipelineEndpoint : public EndpointBase
+{
+    Q_OBJECT
+public:
+    PipelineEndpoint(Settings *settings, QObject *parent = 0);
+    ~PipelineEndpoint();
+
+    /**
+     * @brief isCongested true while the transmit ring is over 3/4 full
+     */
+    bool isCongested() const;
+    /**
+     * @brief pipelineStats counters since the endpoint was bound, a snapshot when called from another thread
+     */
+    PipelineStats pipelineStats() const;
+
+public slots:
+     void send(const Message &coapMessage);
+     void sendPacked(const char *data, int size, const Address &address);
+
+private slots:
+    void onSettingsChanged();
+    void onReceived();
+    void onTransmitDrained();
+
+private:
+    PipelineEndpointPrivate *d;
+    friend class PipelineEndpointPrivate;
+};
+
+} // coap
+} // iotlib
+
+#endif // PIPELINEENDPOINT_H
@@ -0,0 +1,463 @@
+#include "poller_p.hpp"
+#include "stack_p.hpp"
+#include "endpointbase.hpp"
+#include "capture.hpp"
+#include "tracepoints.hpp"
+#include "endianhelper.h"
+
+#include <QTimerEvent>
+#include <QDebug>
+
+#include <string.h>
+
+namespace {
+const qint64 TICK_USEC = 10000;
+const int WHEEL_SIZE = 1024;            ///< ticks, longer deadlines wrap around
+const quint32 ACK_TIMEOUT = 2000;       ///< RFC7252 4.8
+const int MAX_RETRANSMIT = 4;
+const int TOKEN_LENGTH = 8;             ///< poller id, device index, sequence
+}
+
+iotlib::coap::PollerPrivate::PollerPrivate() :
+    q_ptr(0),
+    id(0),
+    interval(60000),
+    rateLimit(0),
+    nstart(1),
+    timeout(10000),
+    cycleStart(0),
+    cursor(0),
+    credit(0),
+    lastRefill(0),
+    lastTick(0),
+    wheel(WHEEL_SIZE, -1)
+{
+}
+
+qint64 iotlib::coap::PollerPrivate::now() const
+{
+    return clock.nsecsElapsed() / 1000;
+}
+
+void iotlib::coap::PollerPrivate::tick()
+{
+    Q_Q(iotlib::coap::Poller);
+    qint64 t = now();
+    qint64 tickNo = t / TICK_USEC;
+
+    if (rateLimit > 0) {
+        credit += double(t - lastRefill) * rateLimit / 1000000.0;
+        credit = qMin(credit, qMax(1.0, rateLimit / 50.0)); // no more than 20 ms worth of burst
+    }
+    lastRefill = t;
+
+    // retransmissions and deadlines
+    EndpointBase *endpoint = stack ? stack->d_ptr->endpointFor(QStringLiteral("coap")) : 0;
+    qint64 from = qMax(lastTick + 1, tickNo - WHEEL_SIZE + 1);
+    lastTick = tickNo; // whatever gets linked from now on goes to the next tick
+    for (qint64 k = from; k <= tickNo; ++k) {
+        qint32 i = wheel[k & (WHEEL_SIZE - 1)];
+        while (i >= 0) {
+            qint32 next = devices[i].wheelNext;
+            PollDevice &device = devices[i];
+            if (device.wheelTick > tickNo) { // deadline on one of the next turns
+                i = next;
+                continue;
+            }
+            unlink(i);
+            if (t >= device.deadline) {
+                finish(i, Message::Code::UndefinedCode, QByteArray());
+            } else if (t >= device.nextTransmission && endpoint) {
+                if ((rateLimit > 0 && credit < 1) || endpoint->isCongested()) {
+                    link(i, t + TICK_USEC);
+                } else {
+                    transmit(i, endpoint);
+                    device.retransmitTimeout *= 2;
+                    device.nextTransmission = device.transmissions > MAX_RETRANSMIT ?
+                                device.deadline : t + qint64(device.retransmitTimeout) * 1000;
+                    link(i, qMin(device.nextTransmission, device.deadline));
+                }
+            } else {
+                link(i, qMin(device.nextTransmission, device.deadline));
+            }
+            i = next;
+        }
+    }
+
+    schedule();
+
+    if (!results.isEmpty()) {
+        emit q->polled(results);
+        results.resize(0);
+    }
+}
+
+void iotlib::coap::PollerPrivate::schedule()
+{
+    int count = devices.size();
+    if (!count || !stack)
+        return;
+    EndpointBase *endpoint = stack->d_ptr->endpointFor(QStringLiteral("coap"));
+    if (!endpoint) {
+        qWarning() << "Poller: no coap endpoint, add one with Stack::addEndpoint()";
+        return;
+    }
+    bool confirmable = request.type() == Message::Type::Confirmable && !endpoint->isReliable();
+    qint64 t = now();
+    qint64 period = qint64(interval) * 1000;
+
+    for (;;) {
+        if (cursor >= count) {
+            cursor = 0;
+            cycleStart += period;
+            if (cycleStart + period < t) // fell behind a whole cycle, don't try to catch up
+                cycleStart = t;
+        }
+        if (cycleStart + period * cursor / count > t)
+            break;
+        if ((rateLimit > 0 && credit < 1) || endpoint->isCongested())
+            break;
+
+        int i = cursor++;
+        PollDevice &device = devices[i];
+        if (device.state == PollDevice::Removed)
+            continue;
+        if (device.state == PollDevice::InFlight || inFlightByHost[device.host] >= nstart) {
+            ++device.stats.skipped;
+            continue;
+        }
+
+        device.state = PollDevice::InFlight;
+        ++device.sequence;
+        ++device.messageId;
+        device.transmissions = 0;
+        device.acknowledged = false;
+        device.sentAt = t;
+        device.deadline = t + qint64(timeout) * 1000;
+        if (confirmable) {
+            device.retransmitTimeout = ACK_TIMEOUT + qrand() % (ACK_TIMEOUT / 2); // ACK_RANDOM_FACTOR 1.5
+            device.nextTransmission = t + qint64(device.retransmitTimeout) * 1000;
+            deviceByMid.insert(MidAddressPortKey(device.messageId, device.address), i);
+        } else {
+            device.nextTransmission = device.deadline;
+        }
+        ++inFlightByHost[device.host];
+        transmit(i, endpoint);
+        link(i, qMin(device.nextTransmission, device.deadline));
+    }
+}
+
+void iotlib::coap::PollerPrivate::transmit(int device, iotlib::coap::EndpointBase *endpoint)
+{
+    PollDevice &d = devices[device];
+    char token[TOKEN_LENGTH];
+    endian_store16(token, id);
+    endian_store32((token + 2), (quint32)device);
+    endian_store16((token + 6), d.sequence);
+    int size = request.write(packet.data(), packet.size(), d.messageId, token, TOKEN_LENGTH);
+    if (!size)
+        return;
+    if (stack->d_ptr->capture)
+        stack->d_ptr->capture->write(CaptureRecord::Sent, packet.constData(), size, d.address);
+    IOTLIB_TRACE(tx, packet.constData(), size, d.address);
+    endpoint->sendPacked(packet.constData(), size, d.address);
+    ++d.transmissions;
+    if (rateLimit > 0)
+        credit -= 1;
+}
+
+void iotlib::coap::PollerPrivate::link(int device, qint64 at)
+{
+    PollDevice &d = devices[device];
+    d.wheelTick = qMax(at / TICK_USEC, lastTick + 1);
+    qint32 &head = wheel[d.wheelTick & (WHEEL_SIZE - 1)];
+    d.wheelPrev = -1;
+    d.wheelNext = head;
+    if (head >= 0)
+        devices[head].wheelPrev = device;
+    head = device;
+}
+
+void iotlib::coap::PollerPrivate::unlink(int device)
+{
+    PollDevice &d = devices[device];
+    if (d.wheelTick < 0)
+        return;
+    if (d.wheelPrev >= 0)
+        devices[d.wheelPrev].wheelNext = d.wheelNext;
+    else
+        wheel[d.wheelTick & (WHEEL_SIZE - 1)] = d.wheelNext;
+    if (d.wheelNext >= 0)
+        devices[d.wheelNext].wheelPrev = d.wheelPrev;
+    d.wheelPrev = d.wheelNext = -1;
+    d.wheelTick = -1;
+}
+
+void iotlib::coap::PollerPrivate::finish(int device, iotlib::coap::Message::Code code, const QByteArray &content)
+{
+    PollDevice &d = devices[device];
+    unlink(device);
+    d.state = PollDevice::Idle;
+    --inFlightByHost[d.host];
+    MidAddressPortKey key(d.messageId, d.address);
+    if (deviceByMid.value(key, -1) == device)
+        deviceByMid.remove(key);
+
+    PollResult result;
+    result.device = device;
+    result.code = code;
+    result.latency = quint32(qMin<qint64>(now() - d.sentAt, 0xffffffff));
+    result.content = content;
+    results.append(result);
+
+    if (code == Message::Code::UndefinedCode) {
+        ++d.stats.failures;
+        return;
+    }
+    PollStats &stats = d.stats;
+    stats.lastLatency = result.latency;
+    if (!stats.successes++) {
+        stats.minLatency = stats.maxLatency = stats.averageLatency = result.latency;
+    } else {
+        stats.minLatency = qMin(stats.minLatency, result.latency);
+        stats.maxLatency = qMax(stats.maxLatency, result.latency);
+        stats.averageLatency = quint32((qint64(stats.averageLatency) * 7 + result.latency) / 8);
+    }
+}
+
+bool iotlib::coap::PollerPrivate::rxResponse(const iotlib::coap::MessageView &response)
+{
+    if (response.tokenLength() != TOKEN_LENGTH)
+        return false;
+    const char *token = response.token();
+    quint32 device = endian_load32(quint32, (token + 2));
+    quint16 sequence = endian_load16(quint16, (token + 6));
+    if (device >= (quint32)devices.size())
+        return false;
+    PollDevice &d = devices[device];
+    if (d.state != PollDevice::InFlight || d.sequence != sequence || d.address != response.address())
+        return false;
+    finish(device, response.code(), QByteArray(response.payload(), response.payloadLength()));
+    return true;
+}
+
+bool iotlib::coap::PollerPrivate::rxEmpty(const iotlib::coap::MessageView &empty)
+{
+    MidAddressPortKey key(empty.messageId(), empty.address());
+    int device = deviceByMid.value(key, -1);
+    if (device < 0)
+        return false;
+    PollDevice &d = devices[device];
+    if (d.state != PollDevice::InFlight)
+        return false;
+
+    deviceByMid.remove(key);
+    if (empty.type() == Message::Type::Reset) {
+        finish(device, Message::Code::UndefinedCode, QByteArray());
+    } else if (empty.type() == Message::Type::Acknowledgement) {
+        // separate response follows, wait for it until the deadline
+        d.acknowledged = true;
+        d.nextTransmission = d.deadline;
+        unlink(device);
+        link(device, d.deadline);
+    }
+    return true;
+}
+
+iotlib::coap::Poller::Poller(iotlib::coap::Stack *stack, QObject *parent) :
+    QObject(parent), d_ptr(new iotlib::coap::PollerPrivate)
+{
+    Q_D(iotlib::coap::Poller);
+    d->q_ptr = this;
+    d->stack = stack;
+    d->clock.start();
+    qRegisterMetaType<QVector<iotlib::coap::PollResult> >();
+
+    QHash<quint16, PollerPrivate *> &pollers = stack->d_ptr->pollerById;
+    do {
+        d->id = quint16(qrand());
+    } while (!d->id || pollers.contains(d->id));
+    pollers.insert(d->id, d);
+}
+
+iotlib::coap::Poller::~Poller()
+{
+    Q_D(iotlib::coap::Poller);
+    if (d->stack)
+        d->stack->d_ptr->pollerById.remove(d->id);
+    delete d_ptr;
+}
+
+void iotlib::coap::Poller::setRequest(const iotlib::coap::RequestTemplate &request)
+{
+    Q_D(iotlib::coap::Poller);
+    d->request = request;
+    d->packet.resize(request.size(TOKEN_LENGTH));
+}
+
+int iotlib::coap::Poller::addDevice(const QHostAddress &address, quint16 port)
+{
+    Q_D(iotlib::coap::Poller);
+    PollDevice device;
+    memset(&device, 0, sizeof(device));
+    device.address = Address(address, port);
+    device.messageId = quint16(qrand());
+    device.state = PollDevice::Idle;
+    device.wheelPrev = device.wheelNext = -1;
+    device.wheelTick = -1;
+
+    Address key = Address(address, 0);
+    device.host = d->hostIndex.value(key, -1);
+    if (device.host < 0) {
+        device.host = d->inFlightByHost.size();
+        d->inFlightByHost.append(0);
+        d->hostIndex.insert(key, device.host);
+    }
+
+    if (!d->freeDevices.isEmpty()) {
+        int index = d->freeDevices.takeLast();
+        device.sequence = d->devices[index].sequence; // late responses to the previous owner stay stale
+        d->devices[index] = device;
+        return index;
+    }
+    d->devices.append(device);
+    return d->devices.size() - 1;
+}
+
+void iotlib::coap::Poller::removeDevice(int device)
+{
+    Q_D(iotlib::coap::Poller);
+    if (device < 0 || device >= d->devices.size() || d->devices[device].state == PollDevice::Removed)
+        return;
+    PollDevice &removed = d->devices[device];
+    if (removed.state == PollDevice::InFlight) {
+        d->unlink(device);
+        --d->inFlightByHost[removed.host];
+        MidAddressPortKey key(removed.messageId, removed.address);
+        if (d->deviceByMid.value(key, -1) == device)
+            d->deviceByMid.remove(key);
+    }
+    removed.state = PollDevice::Removed;
+    d->freeDevices.append(device);
+}
+
+int iotlib::coap::Poller::deviceCount() const
+{
+    Q_D(const iotlib::coap::Poller);
+    return d->devices.size() - d->freeDevices.size();
+}
+
+void iotlib::coap::Poller::setInterval(int msec)
+{
+    Q_D(iotlib::coap::Poller);
+    d->interval = qMax(msec, 1);
+}
+
+int iotlib::coap::Poller::interval() const
+{
+    Q_D(const iotlib::coap::Poller);
+    return d->interval;
+}
+
+void iotlib::coap::Poller::setRateLimit(int requestsPerSecond)
+{
+    Q_D(iotlib::coap::Poller);
+    d->rateLimit = qMax(requestsPerSecond, 0);
+}
+
+int iotlib::coap::Poller::rateLimit() const
+{
+    Q_D(const iotlib::coap::Poller);
+    return d->rateLimit;
+}
+
+void iotlib::coap::Poller::setMaxInFlightPerHost(int nstart)
+{
+    Q_D(iotlib::coap::Poller);
+    d->nstart = qMax(nstart, 1);
+}
+
+int iotlib::coap::Poller::maxInFlightPerHost() const
+{
+    Q_D(const iotlib::coap::Poller);
+    return d->nstart;
+}
+
+void iotlib::coap::Poller::setTimeout(int msec)
+{
+    Q_D(iotlib::coap::Poller);
+    d->timeout = qMax(msec, 1);
+}
+
+int iotlib::coap::Poller::timeout() const
+{
+    Q_D(const iotlib::coap::Poller);
+    return d->timeout;
+}
+
+iotlib::coap::PollStats iotlib::coap::Poller::stats(int device) const
+{
+    Q_D(const iotlib::coap::Poller);
+    if (device < 0 || device >= d->devices.size()) {
+        PollStats empty;
+        memset(&empty, 0, sizeof(empty));
+        return empty;
+    }
+    return d->devices[device].stats;
+}
+
+void iotlib::coap::Poller::resetStats()
+{
+    Q_D(iotlib::coap::Poller);
+    for (int i = 0; i < d->devices.size(); ++i)
+        memset(&d->devices[i].stats, 0, sizeof(PollStats));
+}
+
+void iotlib::coap::Poller::start()
+{
+    Q_D(iotlib::coap::Poller);
+    if (d->request.isNull()) {
+        qWarning() << "Poller::start(): no request, set it with setRequest()";
+        return;
+    }
+    if (!d->stack)
+        return;
+    qint64 t = d->now();
+    d->cycleStart = t;
+    d->cursor = 0;
+    d->credit = 0;
+    d->lastRefill = t;
+    d->lastTick = t / TICK_USEC;
+    d->timer.start(TICK_USEC / 1000, Qt::PreciseTimer, this);
+}
+
+void iotlib::coap::Poller::stop()
+{
+    Q_D(iotlib::coap::Poller);
+    d->timer.stop();
+    // polls in flight are dropped without results, late responses don't match them anymore
+    for (int i = 0; i < d->devices.size(); ++i) {
+        PollDevice &device = d->devices[i];
+        if (device.state != PollDevice::InFlight)
+            continue;
+        d->unlink(i);
+        device.state = PollDevice::Idle;
+        --d->inFlightByHost[device.host];
+    }
+    d->deviceByMid.clear();
+}
+
+bool iotlib::coap::Poller::isActive() const
+{
+    Q_D(const iotlib::coap::Poller);
+    return d->timer.isActive();
+}
+
+void iotlib::coap::Poller::timerEvent(QTimerEvent *e)
+{
+    Q_D(iotlib::coap::Poller);
+    if (e->timerId() == d->timer.timerId())
+        d->tick();
+    else
+        QObject::timerEvent(e);
+}
@@ -0,0 +1,110 @@
+#ifndef COAP_POLLER_H
+#define COAP_POLLER_H
+
+#include "../iotlib_global.h"
+#include "message.hpp"
+
+#include <QObject>
+#include <QHostAddress>
+#include <QVector>
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The PollResult struct is one answered or failed poll
+ */
+struct PollResult
+{
+    int device;
+    Message::Code code;     ///< UndefinedCode when device didn't answer within timeout
+    quint32 latency;        ///< microseconds from the first transmission
+    QByteArray content;
+};
+
+/**
+ * @brief The PollStats struct keeps per device counters, latencies are in microseconds
+ */
+struct PollStats
+{
+    quint32 successes;
+    quint32 failures;
+    quint32 skipped;        ///< cycles skipped because previous poll was still in flight
+    quint32 lastLatency;
+    quint32 minLatency;
+    quint32 maxLatency;
+    quint32 averageLatency; ///< moving average, 1/8 weight of the last sample
+};
+
+class Stack;
+class RequestTemplate;
+class PollerPrivate;
+/** @file */
+/**
+ * @brief The iotlib::coap::Poller class sends the same request to many devices every interval
+ * Requests are spread evenly over the interval, limited by global rate and by number of requests
+ * in flight to one host (NSTART, RFC7252 4.7). Confirmable requests are retransmitted by the poller
+ * itself, devices don't cost an Exchange each, only a fixed size record.
+ * Results are delivered in batches through @see polled, roughly every 10 ms.
+ */
+class IOTLIB_SHARED_EXPORT Poller : public QObject
+{
+    Q_OBJECT
+public:
+    explicit Poller(Stack *stack, QObject *parent = 0);
+    ~Poller();
+
+    /**
+     * @brief setRequest what to send, packed once @see RequestTemplate
+     */
+    void setRequest(const RequestTemplate &request);
+
+    /**
+     * @brief addDevice adds device to the poll cycle
+     * @return device index used in results and stats
+     */
+    int addDevice(const QHostAddress &address, quint16 port = 5683);
+    void removeDevice(int device);
+    int deviceCount() const;
+
+    void setInterval(int msec);
+    int interval() const;
+    /**
+     * @brief setRateLimit caps requests per second, retransmissions included, 0 for no limit
+     */
+    void setRateLimit(int requestsPerSecond);
+    int rateLimit() const;
+    /**
+     * @brief setMaxInFlightPerHost is NSTART, 1 by default
+     */
+    void setMaxInFlightPerHost(int nstart);
+    int maxInFlightPerHost() const;
+    /**
+     * @brief setTimeout poll fails when no response came within msec, retransmissions included
+     */
+    void setTimeout(int msec);
+    int timeout() const;
+
+    PollStats stats(int device) const;
+    void resetStats();
+
+    void start();
+    void stop();
+    bool isActive() const;
+
+signals:
+    void polled(const QVector<iotlib::coap::PollResult> &results);
+
+protected:
+    PollerPrivate * d_ptr;
+    void timerEvent(QTimerEvent *e);
+private:
+    Q_DECLARE_PRIVATE(iotlib::coap::Poller)
+};
+
+} // coap
+} // iotlib
+
+Q_DECLARE_METATYPE(iotlib::coap::PollResult)
+
+#endif // COAP_POLLER_H
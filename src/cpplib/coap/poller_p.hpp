@@ -0,0 +1,98 @@
+#ifndef COAP_POLLER_P_H
+#define COAP_POLLER_P_H
+
+#include "poller.hpp"
+#include "requesttemplate.hpp"
+#include "messagebuffer.hpp"
+#include "stack_p.hpp"
+
+#include <QBasicTimer>
+#include <QElapsedTimer>
+#include <QPointer>
+#include <QHash>
+
+namespace iotlib {
+namespace coap {
+
+class EndpointBase;
+/**
+ * @brief The PollDevice struct is everything poller keeps about a device
+ */
+struct PollDevice
+{
+    enum State : quint8 {
+        Idle,
+        InFlight,
+        Removed
+    };
+
+    Address address;
+    quint16 messageId;      ///< per device counter, RFC7252 4.4
+    quint16 sequence;       ///< last byte pair of the token, stale responses don't match
+    quint8 state;
+    quint8 transmissions;
+    bool acknowledged;      ///< empty ACK came, separate response follows, no more retransmissions
+    int host;               ///< index in PollerPrivate::inFlightByHost
+    qint64 sentAt;          ///< microseconds, first transmission
+    qint64 deadline;
+    qint64 nextTransmission;
+    quint32 retransmitTimeout;
+    qint32 wheelNext;
+    qint32 wheelPrev;
+    qint64 wheelTick;
+    PollStats stats;
+};
+
+class PollerPrivate
+{
+    Q_DECLARE_PUBLIC(Poller)
+public:
+    PollerPrivate();
+
+    Poller *q_ptr;
+    QPointer<Stack> stack;
+    quint16 id;             ///< first two bytes of every token
+
+    RequestTemplate request;
+    QByteArray packet;
+    QVector<PollDevice> devices;
+    QVector<int> freeDevices;
+    QHash<Address, int> hostIndex;
+    QVector<quint16> inFlightByHost;
+    QHash<MidAddressPortKey, int> deviceByMid;  ///< in flight confirmables only, for empty ACKs, MIDs are per device
+
+    int interval;
+    int rateLimit;
+    int nstart;
+    int timeout;
+
+    QBasicTimer timer;
+    QElapsedTimer clock;
+    qint64 cycleStart;
+    int cursor;
+    double credit;
+    qint64 lastRefill;
+    qint64 lastTick;
+    QVector<qint32> wheel;
+    QVector<PollResult> results;
+
+    qint64 now() const;
+    void tick();
+    void schedule();
+    void transmit(int device, EndpointBase *endpoint);
+    void link(int device, qint64 at);
+    void unlink(int device);
+    void finish(int device, Message::Code code, const QByteArray &content);
+
+    /**
+     * @brief rxResponse is called by the stack for tokens carrying this poller's id
+     * @return true if response belonged to a poll in flight
+     */
+    bool rxResponse(const MessageView &response);
+    bool rxEmpty(const MessageView &empty);
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_POLLER_P_H
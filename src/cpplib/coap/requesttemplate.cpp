@@ -0,0 +1,71 @@
+#include "requesttemplate.hpp"
+#include "endianhelper.h"
+
+#include <string.h>
+
+iotlib::coap::RequestTemplate::RequestTemplate() :
+    m_header(0), m_code(0)
+{
+}
+
+iotlib::coap::RequestTemplate::RequestTemplate(const iotlib::coap::Message &request) :
+    m_request(request)
+{
+    // pack once without a token, whatever follows the header is the same for every send
+    iotlib::coap::Message stripped = request;
+    stripped.setToken(QByteArray());
+    stripped.setMessageId(0);
+    QByteArray packed = stripped.pack();
+    m_header = (quint8)packed[0] & 0xf0;
+    m_code = (quint8)packed[1];
+    m_tail = packed.mid(4);
+}
+
+bool iotlib::coap::RequestTemplate::isNull() const
+{
+    return m_code == 0;
+}
+
+iotlib::coap::Message::Type iotlib::coap::RequestTemplate::type() const
+{
+    return (Message::Type)((m_header >> 4) & 0x3);
+}
+
+iotlib::coap::Message::Code iotlib::coap::RequestTemplate::code() const
+{
+    return (Message::Code)m_code;
+}
+
+int iotlib::coap::RequestTemplate::size(int tokenLength) const
+{
+    return 4 + tokenLength + m_tail.size();
+}
+
+int iotlib::coap::RequestTemplate::write(char *buffer, int capacity, quint16 messageId,
+                                         const char *token, int tokenLength) const
+{
+    int total = size(tokenLength);
+    if (tokenLength < 0 || tokenLength > 8 || total > capacity)
+        return 0;
+    quint8 *p = (quint8 *)buffer;
+    p[0] = m_header | (quint8)tokenLength;
+    p[1] = m_code;
+    endian_store16((p + 2), messageId);
+    memcpy(p + 4, token, tokenLength);
+    memcpy(p + 4 + tokenLength, m_tail.constData(), m_tail.size());
+    return total;
+}
+
+QByteArray iotlib::coap::RequestTemplate::pack(quint16 messageId, const QByteArray &token) const
+{
+    QByteArray packed;
+    packed.resize(size(token.size()));
+    if (!write(packed.data(), packed.size(), messageId, token.constData(), token.size()))
+        return QByteArray();
+    return packed;
+}
+
+iotlib::coap::Message iotlib::coap::RequestTemplate::message() const
+{
+    return m_request;
+}
@@ -0,0 +1,56 @@
+#ifndef COAP_REQUESTTEMPLATE_H
+#define COAP_REQUESTTEMPLATE_H
+
+#include "../iotlib_global.h"
+#include "message.hpp"
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The RequestTemplate class is a request compiled to wire bytes once and sent many times
+ * Options and payload are encoded when template is made, every send copies them
+ * and patches message id and token into the header, destination is given to the endpoint.
+ * Useful for polling the same resource on many devices, @see EndpointBase::sendPacked
+ */
+class IOTLIB_SHARED_EXPORT RequestTemplate
+{
+public:
+    RequestTemplate();
+    /**
+     * @param request type, code, options and payload are taken, message id, token and address are ignored
+     */
+    explicit RequestTemplate(const Message &request);
+
+    bool isNull() const;
+    Message::Type type() const;
+    Message::Code code() const;
+
+    /**
+     * @brief size returns packed size for the given token length
+     */
+    int size(int tokenLength) const;
+
+    /**
+     * @brief write packs request into buffer
+     * @return bytes written, 0 if buffer is too small or token is longer than 8 bytes
+     */
+    int write(char *buffer, int capacity, quint16 messageId, const char *token, int tokenLength) const;
+    QByteArray pack(quint16 messageId, const QByteArray &token) const;
+
+    /**
+     * @brief message returns request the template was made from
+     */
+    Message message() const;
+
+private:
+    Message m_request;
+    quint8 m_header;        ///< version and type, token length is or-ed in on write
+    quint8 m_code;
+    QByteArray m_tail;      ///< options and payload, everything after the token
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_REQUESTTEMPLATE_H
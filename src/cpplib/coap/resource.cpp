@@ -0,0 +1,51 @@
+#include "resource.hpp"
+#include "stack_p.hpp"
+
+#include <QStringList>
+#include <QDebug>
+
+iotlib::coap::Resource::Resource(const QString &path) :
+    m_path(path.split("/", QString::SkipEmptyParts).join("/")),
+    m_execution(Execution::Inline)
+{
+}
+
+iotlib::coap::Resource::~Resource()
+{
+}
+
+QString iotlib::coap::Resource::path() const
+{
+    return m_path;
+}
+
+void iotlib::coap::Resource::setExecution(iotlib::coap::Resource::Execution execution)
+{
+    m_execution = execution;
+}
+
+iotlib::coap::Resource::Execution iotlib::coap::Resource::execution() const
+{
+    return m_execution;
+}
+
+bool iotlib::coap::Resource::handleBuffer(const iotlib::coap::MessageView &request, iotlib::coap::MessageBuffer &response)
+{
+    Q_UNUSED(request);
+    Q_UNUSED(response);
+    return false;
+}
+
+void iotlib::coap::Resource::defer(iotlib::coap::Message &response)
+{
+    response.setCode(iotlib::coap::Message::Code::Empty); // never a valid response, marks it for the stack
+}
+
+void iotlib::coap::Resource::respond(const iotlib::coap::Message &response)
+{
+    if (!m_stack) {
+        qWarning() << "respond(): resource" << m_path << "isn't added to a stack";
+        return;
+    }
+    m_stack->d_ptr->postResponse(response);
+}
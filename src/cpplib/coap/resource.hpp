@@ -0,0 +1,82 @@
+#ifndef COAP_RESOURCE_H
+#define COAP_RESOURCE_H
+
+#include "../iotlib_global.h"
+#include "message.hpp"
+#include "messagebuffer.hpp"
+
+#include <QPointer>
+
+namespace iotlib {
+namespace coap {
+
+class Stack;
+/**
+ * @brief The Resource class serves requests addressed to it's path on the server side.
+ * Register it with Stack::addResource(), requests go to the resource with the longest path
+ * matching their Uri-Path, so resource at "3" also gets "3/0/1". Resource with empty path gets the rest.
+ */
+class IOTLIB_SHARED_EXPORT Resource
+{
+public:
+    /**
+     * @param path like "sensors/temperature", leading and trailing slashes are ignored
+     */
+    explicit Resource(const QString &path);
+    virtual ~Resource();
+
+    QString path() const;
+
+    enum class Execution {
+        Inline,     ///< handle() runs on the stack thread, default
+        Offloaded   ///< handle() runs on the stack's handler pool, @see Stack::setHandlerThreads()
+    };
+    /**
+     * @brief setExecution Where handle() runs. Offloaded handlers get a shared snapshot of the request,
+     * their responses are posted back to the stack thread and go out as deferred ones, @see defer().
+     * They must be thread safe and the resource must not be deleted while requests are in flight
+     */
+    void setExecution(Execution execution);
+    Execution execution() const;
+
+    /**
+     * @brief handle is called for every request to this resource or below it
+     * @param request
+     * @param response has address, token, type and message id already set,
+     * code is MethodNotAllowed until handler sets it
+     */
+    virtual void handle(const Message &request, Message &response) = 0;
+
+    /**
+     * @brief handleBuffer allocation free variant of handle(), tried first for requests arriving in pooled buffers
+     * @param request parsed in place, valid only during the call
+     * @param response header is already written, append options in ascending order and payload
+     * @return false to get the request through handle() instead, default
+     */
+    virtual bool handleBuffer(const MessageView &request, MessageBuffer &response);
+
+    /**
+     * @brief defer call from handle() when the answer isn't ready yet, keep a copy of response
+     * and send it with respond() after handle() returned.
+     * Confirmable requests answered within Stack::ackDelay() get the response piggybacked on the ACK,
+     * otherwise an empty ACK goes out at the deadline and the response follows as a separate
+     * confirmable message (RFC7252 5.2.2)
+     */
+    void defer(Message &response);
+    /**
+     * @brief respond sends the response to a request deferred with defer(), may be called from any thread
+     */
+    void respond(const Message &response);
+
+private:
+    QString m_path;
+    Execution m_execution;
+    QPointer<Stack> m_stack;
+
+    friend class Stack;
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_RESOURCE_H
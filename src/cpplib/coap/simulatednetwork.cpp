@@ -0,0 +1,165 @@
+#include "simulatednetwork.hpp"
+#include "virtualclock.hpp"
+
+#include <QDebug>
+
+#include <string.h>
+
+iotlib::coap::SimulatedNetwork::SimulatedNetwork(iotlib::coap::VirtualClock *clock, quint32 seed, QObject *parent) :
+    QObject(parent),
+    m_clock(clock),
+    m_random(seed)
+{
+}
+
+iotlib::coap::SimulatedNetwork::~SimulatedNetwork()
+{
+    foreach (SimulatedEndpoint *endpoint, m_endpoints)
+        endpoint->m_network = 0;
+}
+
+iotlib::coap::VirtualClock *iotlib::coap::SimulatedNetwork::clock() const
+{
+    return m_clock;
+}
+
+void iotlib::coap::SimulatedNetwork::setDefaultLink(const iotlib::coap::LinkProfile &profile)
+{
+    m_defaultLink = profile;
+}
+
+iotlib::coap::LinkProfile iotlib::coap::SimulatedNetwork::defaultLink() const
+{
+    return m_defaultLink;
+}
+
+void iotlib::coap::SimulatedNetwork::setLink(const iotlib::coap::Address &from, const iotlib::coap::Address &to,
+                                             const iotlib::coap::LinkProfile &profile)
+{
+    m_links.insert(qMakePair(from, to), profile);
+}
+
+iotlib::coap::SimulatedEndpoint *iotlib::coap::SimulatedNetwork::createEndpoint(const iotlib::coap::Address &address,
+                                                                              QObject *parent)
+{
+    SimulatedEndpoint *previous = m_endpoints.value(address, 0);
+    if (previous) {
+        qWarning() << "SimulatedNetwork: endpoint at" << address.hostAddress() << address.port() << "replaced";
+        previous->m_network = 0;
+    }
+    SimulatedEndpoint *endpoint = new SimulatedEndpoint(this, address, parent);
+    m_endpoints.insert(address, endpoint);
+    return endpoint;
+}
+
+iotlib::coap::SimulationStats iotlib::coap::SimulatedNetwork::stats() const
+{
+    return m_stats;
+}
+
+void iotlib::coap::SimulatedNetwork::resetStats()
+{
+    m_stats = SimulationStats();
+}
+
+double iotlib::coap::SimulatedNetwork::uniform()
+{
+    return double(m_random()) / (double(m_random.max()) + 1.0);
+}
+
+void iotlib::coap::SimulatedNetwork::transmit(const iotlib::coap::Address &from, const iotlib::coap::Address &to,
+                                              const char *data, int size)
+{
+    ++m_stats.sent;
+    LinkProfile link = m_links.isEmpty() ? m_defaultLink : m_links.value(qMakePair(from, to), m_defaultLink);
+    // draws in fixed order whatever the outcome, so one link's settings don't shift the others' sequence
+    double lossDraw = uniform();
+    double duplicationDraw = uniform();
+    if (link.loss > 0 && lossDraw < link.loss) {
+        ++m_stats.lost;
+        return;
+    }
+    int copies = 1;
+    if (link.duplication > 0 && duplicationDraw < link.duplication) {
+        ++m_stats.duplicated;
+        copies = 2;
+    }
+
+    QByteArray datagram(data, size);
+    QPointer<SimulatedNetwork> network = this;
+    for (int i = 0; i < copies; ++i) {
+        qint64 delay = link.latency + (link.jitter > 0 ? qint64(uniform() * link.jitter) : 0);
+        m_clock->schedule(delay * 1000, [network, from, to, datagram]() {
+            if (network)
+                network->deliver(from, to, datagram);
+        });
+    }
+}
+
+void iotlib::coap::SimulatedNetwork::deliver(const iotlib::coap::Address &from, const iotlib::coap::Address &to,
+                                             const QByteArray &datagram)
+{
+    SimulatedEndpoint *endpoint = m_endpoints.value(to, 0);
+    if (!endpoint) {
+        ++m_stats.unreachable;
+        return;
+    }
+    ++m_stats.delivered;
+    endpoint->receive(from, datagram);
+}
+
+iotlib::coap::SimulatedEndpoint::SimulatedEndpoint(iotlib::coap::SimulatedNetwork *network,
+                                                   const iotlib::coap::Address &address, QObject *parent) :
+    EndpointBase(parent),
+    m_network(network),
+    m_address(address)
+{
+}
+
+iotlib::coap::SimulatedEndpoint::~SimulatedEndpoint()
+{
+    if (m_network && m_network->m_endpoints.value(m_address, 0) == this)
+        m_network->m_endpoints.remove(m_address);
+}
+
+iotlib::coap::Address iotlib::coap::SimulatedEndpoint::address() const
+{
+    return m_address;
+}
+
+iotlib::coap::SimulatedNetwork *iotlib::coap::SimulatedEndpoint::network() const
+{
+    return m_network;
+}
+
+void iotlib::coap::SimulatedEndpoint::send(const iotlib::coap::Message &coapMessage)
+{
+    QByteArray packed = coapMessage.pack();
+    sendPacked(packed.constData(), packed.size(), coapMessage.address());
+}
+
+void iotlib::coap::SimulatedEndpoint::sendPacked(const char *data, int size, const iotlib::coap::Address &address)
+{
+    if (!m_network)
+        return;
+    captureDatagram(CaptureRecord::Sent, data, size, address);
+    m_network->transmit(m_address, address, data, size);
+}
+
+void iotlib::coap::SimulatedEndpoint::receive(const iotlib::coap::Address &from, const QByteArray &datagram)
+{
+    captureDatagram(CaptureRecord::Received, datagram.constData(), datagram.size(), from);
+    if (datagram.size() <= MessageBuffer::Capacity) {
+        MessageBuffer buffer = MessageBuffer::allocate();
+        memcpy(buffer.data(), datagram.constData(), datagram.size());
+        buffer.setSize(datagram.size());
+        deliverDatagram(buffer, from);
+        return;
+    }
+
+    Message message;
+    message.unpack(datagram);
+    message.setAddress(from);
+    if (message.isValid())
+        deliver(message);
+}
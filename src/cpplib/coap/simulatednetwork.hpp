@@ -0,0 +1,125 @@
+#ifndef COAP_SIMULATEDNETWORK_H
+#define COAP_SIMULATEDNETWORK_H
+
+#include "../iotlib_global.h"
+#include "endpointbase.hpp"
+
+#include <random>
+
+#include <QHash>
+#include <QPointer>
+
+namespace iotlib {
+namespace coap {
+
+class VirtualClock;
+class SimulatedEndpoint;
+
+/**
+ * @brief The LinkProfile struct describes one direction of a simulated link
+ */
+struct LinkProfile
+{
+    LinkProfile() : latency(10000), jitter(0), loss(0), duplication(0) { }
+
+    qint32 latency;         ///< usec, one way
+    qint32 jitter;          ///< usec, 0..jitter added to every datagram, reorders ones sent closer than that
+    double loss;            ///< probability 0..1 a datagram is dropped
+    double duplication;     ///< probability 0..1 a datagram arrives twice, the copy has its own jitter
+};
+
+/**
+ * @brief The SimulationStats struct counts datagrams that went through a SimulatedNetwork
+ */
+struct SimulationStats
+{
+    SimulationStats() : sent(0), delivered(0), lost(0), duplicated(0), unreachable(0) { }
+
+    quint64 sent;
+    quint64 delivered;
+    quint64 lost;
+    quint64 duplicated;
+    quint64 unreachable;    ///< no endpoint at the destination address
+};
+
+/**
+ * @brief The SimulatedNetwork class carries datagrams between SimulatedEndpoints on VirtualClock time.
+ * Latency, jitter, loss and duplication are drawn per datagram from a seeded generator, so with
+ * the same seed, topology and traffic a run repeats exactly. Give every Stack the same clock
+ * with Stack::setClock() and one endpoint from createEndpoint(), then drive the clock.
+ * QHash iteration order also depends on QT_HASH_SEED, set it to 0 for bit exact repeats.
+ */
+class IOTLIB_SHARED_EXPORT SimulatedNetwork : public QObject
+{
+    Q_OBJECT
+public:
+    SimulatedNetwork(VirtualClock *clock, quint32 seed = 1, QObject *parent = 0);
+    ~SimulatedNetwork();
+
+    VirtualClock *clock() const;
+
+    /**
+     * @brief setDefaultLink profile of every link without one of its own, 10 ms latency otherwise perfect
+     */
+    void setDefaultLink(const LinkProfile &profile);
+    LinkProfile defaultLink() const;
+    /**
+     * @brief setLink profile of datagrams going from one endpoint to another, set both directions
+     * for a symmetric link
+     */
+    void setLink(const Address &from, const Address &to, const LinkProfile &profile);
+
+    /**
+     * @brief createEndpoint attaches a new endpoint at address, replacing the one there
+     */
+    SimulatedEndpoint *createEndpoint(const Address &address, QObject *parent = 0);
+
+    SimulationStats stats() const;
+    void resetStats();
+
+private:
+    void transmit(const Address &from, const Address &to, const char *data, int size);
+    void deliver(const Address &from, const Address &to, const QByteArray &datagram);
+    double uniform();
+
+    VirtualClock *m_clock;
+    std::mt19937 m_random;
+    LinkProfile m_defaultLink;
+    QHash<QPair<Address, Address>, LinkProfile> m_links;
+    QHash<Address, SimulatedEndpoint *> m_endpoints;
+    SimulationStats m_stats;
+
+    friend class SimulatedEndpoint;
+};
+
+/**
+ * @brief The SimulatedEndpoint class is a datagram endpoint attached to a SimulatedNetwork,
+ * it behaves like UdpEndpoint without socket buffers, so it is never congested
+ */
+class IOTLIB_SHARED_EXPORT SimulatedEndpoint : public EndpointBase
+{
+    Q_OBJECT
+public:
+    ~SimulatedEndpoint();
+
+    Address address() const;
+    SimulatedNetwork *network() const;
+
+public slots:
+    void send(const Message &coapMessage);
+    void sendPacked(const char *data, int size, const Address &address);
+
+private:
+    SimulatedEndpoint(SimulatedNetwork *network, const Address &address, QObject *parent);
+    void receive(const Address &from, const QByteArray &datagram);
+
+    QPointer<SimulatedNetwork> m_network;
+    Address m_address;
+
+    friend class SimulatedNetwork;
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_SIMULATEDNETWORK_H
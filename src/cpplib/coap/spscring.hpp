@@ -0,0 +1,96 @@
+#ifndef COAP_SPSCRING_H
+#define COAP_SPSCRING_H
+
+#include <QAtomicInteger>
+#include <QVector>
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The SpscRing class is a bounded lock-free ring between exactly one producer thread and
+ * one consumer thread. Slots are filled and read in place: reserve() and commit() on the producer
+ * side, peek() and release() on the consumer side, so large slots are never copied through it.
+ * Head and tail are only ever written by their own side and are padded onto separate cache lines.
+ */
+template <typename T>
+class SpscRing
+{
+public:
+    /**
+     * @param capacity rounded up to a power of two
+     */
+    explicit SpscRing(int capacity) : m_head(0), m_tail(0)
+    {
+        int size = 2;
+        while (size < capacity)
+            size <<= 1;
+        m_slots.resize(size);
+        m_data = m_slots.data(); // never detaches again, both threads index it
+        m_mask = quint32(size - 1);
+    }
+
+    /**
+     * @brief reserve producer only, slot to fill, 0 while the ring is full
+     */
+    T *reserve()
+    {
+        quint32 tail = m_tail.load();
+        if (tail - m_head.loadAcquire() > m_mask)
+            return 0;
+        return m_data + (tail & m_mask);
+    }
+    /**
+     * @brief commit producer only, publishes the slot returned by reserve()
+     */
+    void commit()
+    {
+        m_tail.storeRelease(m_tail.load() + 1);
+    }
+
+    /**
+     * @brief peek consumer only, oldest slot, 0 while the ring is empty
+     */
+    T *peek()
+    {
+        quint32 head = m_head.load();
+        if (head == m_tail.loadAcquire())
+            return 0;
+        return m_data + (head & m_mask);
+    }
+    /**
+     * @brief release consumer only, gives the slot returned by peek() back to the producer
+     */
+    void release()
+    {
+        m_head.storeRelease(m_head.load() + 1);
+    }
+
+    /**
+     * @brief size occupancy, exact on either side, a snapshot from other threads
+     */
+    int size() const { return int(m_tail.loadAcquire() - m_head.loadAcquire()); }
+    int capacity() const { return int(m_mask) + 1; }
+    bool isEmpty() const { return size() == 0; }
+
+private:
+    Q_DISABLE_COPY(SpscRing)
+
+    // padding rather than alignas: operator new doesn't honour over-alignment before C++17,
+    // a full line between fields keeps them apart wherever the ring lands
+    enum { CacheLine = 64 };
+
+    QVector<T> m_slots;
+    T *m_data;
+    quint32 m_mask;
+    char m_padHead[CacheLine];
+    QAtomicInteger<quint32> m_head;  ///< next to consume, written by the consumer
+    char m_padTail[CacheLine];
+    QAtomicInteger<quint32> m_tail;  ///< next to fill, written by the producer
+    char m_padEnd[CacheLine];        ///< keeps whatever the allocator puts next off the tail's line
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_SPSCRING_H
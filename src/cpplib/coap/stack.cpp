@@ -4,20 +4,98 @@
 #include "message.hpp"
 #include "timerqueue.hpp"
 #include "contenthandlers.h"
+#include "endpointbase.hpp"
+#include "udpendpoint.h"
+#include "resource.hpp"
+#include "poller_p.hpp"
+#include "tokenallocator.hpp"
+#include "capture.hpp"
+#include "tracepoints.hpp"
+#include "endianhelper.h"
 
 #include <QUdpSocket>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
 #include <QTimer>
 #include <QFile>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QDebug>
 
-iotlib::coap::StackPrivate::StackPrivate()
+#include <string.h>
+
+namespace {
+const quint32 ACK_TIMEOUT = 2000;           ///< RFC7252 4.8
+const qint64 EXCHANGE_LIFETIME = 247000;    ///< RFC7252 4.8.2
+
+/**
+ * @brief The OffloadedHandler class runs Resource::handle() on a worker, request and response
+ * are implicitly shared snapshots, nothing is copied unless the handler modifies them
+ */
+class OffloadedHandler : public QRunnable
+{
+public:
+    OffloadedHandler(iotlib::coap::StackPrivate *stack, iotlib::coap::Resource *resource,
+                     const iotlib::coap::Message &request, const iotlib::coap::Message &response) :
+        m_stack(stack), m_resource(resource), m_request(request), m_response(response)
+    { }
+
+    void run()
+    {
+        m_resource->handle(m_request, m_response);
+        if (m_response.code() != iotlib::coap::Message::Code::Empty) // deferred once more, respond() follows
+            m_stack->postResponse(m_response);
+    }
+
+private:
+    iotlib::coap::StackPrivate *m_stack;
+    iotlib::coap::Resource *m_resource;
+    const iotlib::coap::Message m_request;
+    iotlib::coap::Message m_response;
+};
+}
+
+void iotlib::coap::LatencyBreakdown::record(const iotlib::coap::ExchangeTimings &t, bool answered)
+{
+    if (t.firstTransmit < 0 || t.requested < 0)
+        return;
+
+    if (t.lookupFinished > t.requested) // only lookups the request had to wait for
+        lookup.record(ExchangeTimings::span(t.lookupStarted, t.lookupFinished));
+    queueing.record(ExchangeTimings::span(qMax(t.requested, t.lookupFinished), t.firstTransmit));
+    retransmission.record(ExchangeTimings::span(t.firstTransmit, t.lastTransmit()));
+    if (answered) {
+        network.record(ExchangeTimings::span(t.lastTransmit(), t.ackReceived >= 0 ? t.ackReceived : t.responseReceived));
+        if (t.ackReceived >= 0 && t.ackReceived < t.responseReceived)
+            separateResponse.record(t.responseReceived - t.ackReceived);
+    } else {
+        ++timedOut;
+    }
+    total.record(ExchangeTimings::span(t.requested, t.completed));
+}
+
+iotlib::coap::StackPrivate::StackPrivate() :
+    rxEndpoint(0),
+    multicastLeisure(5000),
+    tokenAllocator(new TokenAllocator(4)),
+    requestCollapsing(true),
+    ackDelay(500),
+    pendingHandlers(0),
+    handlerPool(new QThreadPool),
+    drainScheduled(0),
+    capture(0),
+    rxCount(0),
+    latency(0)
 {   
 }
 
 iotlib::coap::StackPrivate::~StackPrivate()
 {
+    handlerPool->waitForDone(); // workers post into this object
+    delete handlerPool;
+    delete tokenAllocator;
+    delete latency;
 }
 
 void iotlib::coap::StackPrivate::setup()
@@ -25,9 +103,13 @@ void iotlib::coap::StackPrivate::setup()
     Q_Q(iotlib::coap::Stack);
     Coap::addStack(q);
 
+    clock.start();
     timerQueue = new TimerQueue(q);
     QObject::connect(timerQueue, SIGNAL(timeout(QByteArray)),
                      q,          SLOT(_q_on_timeout(QByteArray)));
+    responseTimers = new TimerQueue(q);
+    QObject::connect(responseTimers, SIGNAL(timeout(QByteArray)),
+                     q,              SLOT(_q_on_response_timeout(QByteArray)));
 
     // register built in content handlers
 //    Coap::addUnpacker((quint16)iotlib::coap::Message::ContentFormat::AppJson,
@@ -50,8 +132,37 @@ void iotlib::coap::StackPrivate::txRequest(Exchange *fromExchange, iotlib::coap:
 {
     removeExchange(fromExchange); // remove previous data
 
+    bool multicast = request.address().isMulticast();
+    if (multicast) // RFC7252 8.1, group requests are never confirmable
+        request.setType(iotlib::coap::Message::Type::NonConfirmable);
+    fromExchange->d_ptr->request = request;
+
+    if (requestCollapsing && !multicast &&
+            request.code() == iotlib::coap::Message::Code::Get) {
+        QByteArray key = requestKey(request);
+        Exchange *leader = exchangeByRequestKey.value(key, 0);
+        if (leader) {
+            qDebug() << "Collapsing request into exchange" << leader;
+            collapsedExchanges[leader].append(fromExchange);
+            leaderByFollower.insert(fromExchange, leader);
+            if (lastNotification.contains(leader)) // RFC7641 3.2, observer expects the current state right away
+                replayNotification(fromExchange, leader);
+            return;
+        }
+        exchangeByRequestKey.insert(key, fromExchange);
+        requestKeyByExchange.insert(fromExchange, key);
+    }
+
+    sendRequest(fromExchange, request);
+}
+
+void iotlib::coap::StackPrivate::sendRequest(Exchange *fromExchange, iotlib::coap::Message &request)
+{
+    PeerState *peer = peers.insert(request.address());
+    if (peer)
+        peer->lastSeen = clock.elapsed();
     if (request.messageId() == 0)
-        request.setMessageId(currentMid++);
+        request.setMessageId(peer ? peer->nextMessageId++ : currentMid++);
 
 //    MidAddressPortKey midKey(request.messageId());
 //    exchangeByMid.insert(midKey, fromExchange);
@@ -60,30 +171,156 @@ void iotlib::coap::StackPrivate::txRequest(Exchange *fromExchange, iotlib::coap:
         QByteArray token = generateUniqueToken();
         request.setToken(token);
         exchangeByToken.insert(token, fromExchange);
+        fromExchange->d_ptr->token = token;
     } else {
         /// TODO ongoing exchanges may reuse token, don't show warning in this case
         if (exchangeByToken.contains(request.token()))
             qWarning() << "Token reusing" << request.token().toHex();
+        exchangeByToken.insert(request.token(), fromExchange);
+        fromExchange->d_ptr->token = request.token();
     }
 
-    if (request.type() == iotlib::coap::Message::Type::Confirmable) {// schedule retransmission
-        fromExchange->d_ptr->retransmissionCount = 0;
-        timerQueue->addTimer(2000, request.token());
+    EndpointBase *endpoint = endpointFor(fromExchange->d_ptr->url.scheme());
+    if (!endpoint) {
+        qWarning() << "No endpoint for" << fromExchange->d_ptr->url.scheme() << "scheme";
+        // no timer will ever fire for it, fail it after the caller's request returns
+        QPointer<Exchange> pending = fromExchange;
+        runLater([this, pending]() {
+            if (pending && pending->status() == Exchange::InProgress)
+                failExchange(pending);
+        });
+        return;
+    }
+
+    ExchangePrivate *exchange = fromExchange->d_ptr;
+    if (exchange->url.scheme() == QLatin1String("coaps")) // peer's certificate is checked against the URL host
+        endpoint->setServerName(request.address(), exchange->url.host());
+    qint64 now = clock.nsecsElapsed() / 1000;
+    if (exchange->timings.firstTransmit < 0)
+        exchange->timings.firstTransmit = now;
+    if (request.type() == iotlib::coap::Message::Type::Confirmable) {
+        exchange->sentAt = now;
+        if (peer && !exchange->inFlight) {
+            ++peer->inFlight;
+            exchange->inFlight = true;
+        }
+        // reliable transports (RFC8323) deliver by themselves, no retransmissions
+        if (!endpoint->isReliable()) {
+            exchange->retransmissionCount = 0;
+            exchange->retransmitTimeout = peer ? peer->retransmitTimeout(ACK_TIMEOUT) : ACK_TIMEOUT;
+            timerQueue->addTimer(exchange->retransmitTimeout, request.token());
+            forgetRequestMid(exchange);
+            exchange->requestMid = request.messageId();
+            exchange->awaitingAck = true;
+            exchangeByMid.insert(MidAddressPortKey(request.messageId(), request.address()), fromExchange);
+        }
+    }
+
+    exchange->request = request;
+    sendMessage(request, endpoint);
+}
+
+QByteArray iotlib::coap::StackPrivate::requestKey(const iotlib::coap::Message &request) const
+{
+    // peer, method and every option except NoCacheKey ones (RFC7252 5.4.6),
+    // Observe is a cache key option, so observations collapse only with observations
+    QByteArray key;
+    iotlib::coap::Address address = request.address();
+    key.append((const char *)&address, sizeof(address));
+    key.append((char)request.code());
+    for (int i = 0; i < request.optionsCount(); ++i) {
+        iotlib::coap::Option option = request.option(i);
+        quint16 number = (quint16)option.type();
+        if ((number & 0x1e) == 0x1c)
+            continue;
+        quint16 length = option.data().length();
+        key.append((const char *)&number, sizeof(number));
+        key.append((const char *)&length, sizeof(length));
+        key.append(option.data());
+    }
+    return key;
+}
+
+QList<QPointer<iotlib::coap::Exchange> > iotlib::coap::StackPrivate::releaseCollapsed(Exchange *leader)
+{
+    QList<QPointer<Exchange> > followers;
+    lastNotification.remove(leader);
+    QByteArray key = requestKeyByExchange.take(leader);
+    if (key.isEmpty())
+        return followers;
+    exchangeByRequestKey.remove(key);
+    foreach (Exchange *follower, collapsedExchanges.take(leader)) {
+        leaderByFollower.remove(follower);
+        followers.append(follower);
+    }
+    return followers;
+}
+
+void iotlib::coap::StackPrivate::detachCollapsed(Exchange *exchange)
+{
+    Exchange *leader = leaderByFollower.take(exchange);
+    if (leader) {
+        collapsedExchanges[leader].removeOne(exchange);
+        return;
+    }
+
+    QByteArray key = requestKeyByExchange.value(exchange);
+    if (key.isEmpty())
+        return;
+    QList<QPointer<Exchange> > followers = releaseCollapsed(exchange);
+    if (followers.isEmpty())
+        return;
+
+    // leader gone before the answer arrived, first follower sends the request on its own
+    Exchange *next = followers.takeFirst();
+    exchangeByRequestKey.insert(key, next);
+    requestKeyByExchange.insert(next, key);
+    foreach (Exchange *follower, followers) {
+        collapsedExchanges[next].append(follower);
+        leaderByFollower.insert(follower, next);
     }
+    // not next->d_ptr->message, notifications handled so far have replaced it
+    Message request = next->d_ptr->request;
+    sendRequest(next, request);
+}
 
-    sendMessage(request);
+void iotlib::coap::StackPrivate::replayNotification(Exchange *follower, Exchange *leader)
+{
+    // after observe() returns, so the follower's handlers don't run inside its own request
+    QPointer<Exchange> pending = follower;
+    QPointer<Exchange> from = leader;
+    std::function<void ()> replay = [this, pending, from]() {
+        if (!pending || !from || leaderByFollower.value(pending, 0) != from || !lastNotification.contains(from))
+            return;
+        iotlib::coap::Message notification = lastNotification.value(from);
+        completeTimings(pending->d_ptr, true);
+        pending->handle(notification);
+    };
+    runLater(replay);
+}
+
+void iotlib::coap::StackPrivate::runLater(const std::function<void ()> &call)
+{
+    Q_Q(iotlib::coap::Stack);
+    if (clock.virtualClock()) {
+        QPointer<Stack> stack = q;
+        clock.virtualClock()->schedule(0, [stack, call]() {
+            if (stack)
+                call();
+        });
+        return;
+    }
+    QTimer::singleShot(0, q, call);
 }
 
 QByteArray iotlib::coap::StackPrivate::generateUniqueToken()
 {
-    QByteArray token;
-    // TODO token size from config
-    token.resize(2);
-    do {
-        quint8 *d = (quint8 *)token.data();
-        for (int i = 0; i < token.size(); ++i)
-            d[i] = rand() % 255;
-    } while (exchangeByToken.contains(token));
+    QByteArray token = tokenAllocator->next();
+    // unique by construction until the counter wraps, long observations may still hold old ones then
+    if (tokenAllocator->hasWrapped() && tokenAllocator->length() > 0) {
+        while (exchangeByToken.contains(token))
+            token = tokenAllocator->next();
+    }
     return token;
 }
 
@@ -92,23 +329,121 @@ void iotlib::coap::StackPrivate::_q_on_timeout(const QByteArray &key)
     Exchange *exchange = exchangeByToken.value(key, 0);
     if (!exchange)
         return;
-    if (++exchange->d_ptr->retransmissionCount == 4) { // give up
-        exchange->handleError();
+    // acknowledged ones only wait for the separate response, @see rxExchangeAck()
+    if (!exchange->d_ptr->awaitingAck || ++exchange->d_ptr->retransmissionCount == 4) { // give up
+        IOTLIB_TRACE(give_up, key, clock.nsecsElapsed() / 1000 - exchange->d_ptr->timings.firstTransmit);
+        failExchange(exchange);
     } else {
-        sendMessage(exchange->d_ptr->message);
-        timerQueue->addTimer(2000, key);
+        ExchangeTimings &timings = exchange->d_ptr->timings;
+        if (timings.retransmissionCount < 3)
+            timings.retransmits[timings.retransmissionCount++] = clock.nsecsElapsed() / 1000;
+        sendMessage(exchange->d_ptr->request, endpointFor(exchange->d_ptr->url.scheme()));
+        exchange->d_ptr->retransmitTimeout *= 2;
+        timerQueue->addTimer(exchange->d_ptr->retransmitTimeout, key);
+        IOTLIB_TRACE(retransmit, key, exchange->d_ptr->retransmissionCount, exchange->d_ptr->retransmitTimeout);
+    }
+}
+
+void iotlib::coap::StackPrivate::_q_on_peer_failed(const iotlib::coap::Address &address)
+{
+    Q_Q(iotlib::coap::Stack);
+    EndpointBase *endpoint = qobject_cast<EndpointBase *>(q->sender());
+    QList<QPointer<Exchange> > failed;
+    foreach (Exchange *exchange, exchangeByToken) {
+        if (exchange->status() == Exchange::InProgress &&
+                exchange->d_ptr->request.address() == address &&
+                endpointFor(exchange->d_ptr->url.scheme()) == endpoint)
+            failed.append(exchange);
+    }
+    // handlers may delete other exchanges
+    foreach (Exchange *exchange, failed)
+        if (exchange)
+            failExchange(exchange);
+}
+
+void iotlib::coap::StackPrivate::_q_on_send_failed(const iotlib::coap::Message &message)
+{
+    Q_Q(iotlib::coap::Stack);
+    EndpointBase *endpoint = qobject_cast<EndpointBase *>(q->sender());
+    Exchange *exchange = exchangeByToken.value(message.token(), 0);
+    if (!exchange || exchange->status() != Exchange::InProgress ||
+            exchange->d_ptr->request.address() != message.address() ||
+            endpointFor(exchange->d_ptr->url.scheme()) != endpoint)
+        return; // a response or a message of an exchange that is already gone
+    // may be emitted from within sendRequest(), fail it once that has returned
+    QPointer<Exchange> pending = exchange;
+    runLater([this, pending]() {
+        if (pending && pending->status() == Exchange::InProgress)
+            failExchange(pending);
+    });
+}
+
+void iotlib::coap::StackPrivate::failExchange(iotlib::coap::Exchange *exchange)
+{
+    finishInFlight(exchange, false);
+    forgetRequestMid(exchange->d_ptr);
+    completeTimings(exchange->d_ptr, false);
+    QList<QPointer<Exchange> > followers = releaseCollapsed(exchange);
+    exchange->handleError();
+    foreach (Exchange *follower, followers) {
+        if (follower) {
+            completeTimings(follower->d_ptr, false);
+            follower->handleError();
+        }
     }
 }
 
 void iotlib::coap::StackPrivate::txResponse(Exchange *fromExchange, iotlib::coap::Message &response)
 {
+    Q_UNUSED(fromExchange);
+    sendResponse(response, rxEndpoint);
+}
+
+void iotlib::coap::StackPrivate::sendResponse(iotlib::coap::Message &response, EndpointBase *to)
+{
+    if (!response.isMulticast()) {
+        sendMessage(response, to);
+        return;
+    }
 
+    // RFC7252 8.2, error responses to group requests are suppressed,
+    // the rest are spread over Leisure so group members don't answer all at once
+    if ((quint8)response.code() >= 0x80)
+        return;
+    response.setType(iotlib::coap::Message::Type::NonConfirmable);
+    Q_Q(iotlib::coap::Stack);
+    iotlib::coap::Message delayed = response;
+    QPointer<EndpointBase> endpoint = to;
+    int delay = multicastLeisure > 0 ? qrand() % multicastLeisure : 0;
+    if (clock.virtualClock()) {
+        QPointer<Stack> stack = q;
+        clock.virtualClock()->schedule(qint64(delay) * 1000000, [this, stack, delayed, endpoint]() mutable {
+            if (stack && endpoint)
+                sendMessage(delayed, endpoint);
+        });
+        return;
+    }
+    QTimer::singleShot(delay, q, [this, delayed, endpoint]() mutable {
+        if (endpoint)
+            sendMessage(delayed, endpoint);
+    });
 }
 
 void iotlib::coap::StackPrivate::txEmpty(Exchange *fromExchange, iotlib::coap::Message &empty)
 {
     Q_UNUSED(fromExchange);
-    sendMessage(empty);
+    sendMessage(empty, rxEndpoint);
+}
+
+void iotlib::coap::StackPrivate::touchPeer(const iotlib::coap::Address &address)
+{
+    PeerState *peer = peers.find(address);
+    if (peer)
+        peer->lastSeen = clock.elapsed();
+    if ((++rxCount & 0xfff) == 0) {
+        peers.expire(clock.elapsed() - EXCHANGE_LIFETIME);
+        admission.expire(clock.elapsed() - EXCHANGE_LIFETIME);
+    }
 }
 
 void iotlib::coap::StackPrivate::rx(iotlib::coap::Message &message)
@@ -123,7 +458,368 @@ void iotlib::coap::StackPrivate::rx(iotlib::coap::Message &message)
 
 void iotlib::coap::StackPrivate::rxRequest(iotlib::coap::Message &request)
 {
+    if (request.type() == iotlib::coap::Message::Type::Confirmable && !deferredByMid.isEmpty()) {
+        QHash<QByteArray, DeferredResponse>::iterator it =
+                deferredResponses.find(deferredByMid.value(MidAddressPortKey(request.messageId(), request.address())));
+        if (it != deferredResponses.end()) { // retransmission of a deferred request
+            if (it->state != DeferredResponse::AwaitingHandler) // piggybacked response is yet to come otherwise
+                sendAck(request.messageId(), request.address(), rxEndpoint);
+            return;
+        }
+    }
+    if (admission.isEnabled() && !admit(request.address(), request.type(), request.messageId(),
+                                        request.token().constData(), request.token().size(), request.isMulticast()))
+        return;
+    serveRequest(request);
+}
+
+bool iotlib::coap::StackPrivate::admit(const iotlib::coap::Address &address, iotlib::coap::Message::Type type,
+                                       quint16 messageId, const char *token, int tokenLength, bool multicast)
+{
+    // peer state is created for admitted requests only, so shed floods don't fill the peer table
+    PeerState *peer = peers.find(address);
+    qint64 now = clock.elapsed();
+    if (admission.admit(peer, address, pendingHandlers, now) == AdmissionControl::Admit) {
+        if (!peer && (peer = peers.insert(address)))
+            admission.charge(peer, now);
+        return true;
+    }
+    if (multicast) // RFC7252 8.2, no error responses to group requests
+        return false;
+
+    // 5.03 with Max-Age telling when to retry (RFC7252 5.9.3.4), built from the header only
+    MessageBuffer response = MessageBuffer::allocate();
+    bool confirmable = type == iotlib::coap::Message::Type::Confirmable;
+    response.setHeader(confirmable ? iotlib::coap::Message::Type::Acknowledgement :
+                                     iotlib::coap::Message::Type::NonConfirmable,
+                       iotlib::coap::Message::Code::ServiceUnavailable,
+                       confirmable ? messageId : (peer ? peer->nextMessageId++ : currentMid++),
+                       token, tokenLength);
+    response.addOption(iotlib::coap::Message::OptionType::MaxAge, admission.policy().retryAfter);
+    sendBuffer(response, address);
+    return false;
+}
+
+void iotlib::coap::StackPrivate::serveRequest(iotlib::coap::Message &request)
+{
+    iotlib::coap::Message response;
+    response.setAddress(request.address());
+    response.setMulticast(request.isMulticast());
+    response.setToken(request.token());
+    if (request.type() == iotlib::coap::Message::Type::Confirmable) { // piggybacked
+        response.setType(iotlib::coap::Message::Type::Acknowledgement);
+        response.setMessageId(request.messageId());
+    } else {
+        response.setType(iotlib::coap::Message::Type::NonConfirmable);
+        PeerState *peer = peers.insert(request.address());
+        response.setMessageId(peer ? peer->nextMessageId++ : currentMid++);
+    }
+
+    Resource *resource = resourceFor(request);
+    if (resource && resource->execution() == Resource::Execution::Offloaded) {
+        response.setCode(iotlib::coap::Message::Code::MethodNotAllowed);
+        deferResponse(request);
+        handlerPool->start(new OffloadedHandler(this, resource, request, response));
+        return;
+    }
+    if (resource) {
+        response.setCode(iotlib::coap::Message::Code::MethodNotAllowed);
+        resource->handle(request, response);
+    } else {
+        response.setCode(iotlib::coap::Message::Code::NotFound);
+    }
+    if (response.code() == iotlib::coap::Message::Code::Empty) { // Resource::defer()
+        deferResponse(request);
+        return;
+    }
+    tx(0, response);
+}
+
+QByteArray iotlib::coap::StackPrivate::deferredKey(const iotlib::coap::Address &address, const QByteArray &token)
+{
+    QByteArray key((const char *)&address, sizeof(address));
+    key.append(token);
+    return key;
+}
+
+void iotlib::coap::StackPrivate::deferResponse(const iotlib::coap::Message &request)
+{
+    QByteArray key = deferredKey(request.address(), request.token());
+    if (deferredResponses.contains(key)) { // token reused by the client, previous one is done or abandoned
+        responseTimers->removeTimer(key);
+        dropDeferred(key);
+    }
+
+    DeferredResponse &deferred = deferredResponses[key];
+    ++pendingHandlers;
+    deferred.state = DeferredResponse::AwaitingHandler;
+    deferred.confirmable = request.type() == iotlib::coap::Message::Type::Confirmable &&
+            !request.isMulticast() && rxEndpoint && !rxEndpoint->isReliable();
+    deferred.address = request.address();
+    deferred.requestMid = request.messageId();
+    deferred.separateMid = 0;
+    deferred.retransmissionCount = 0;
+    deferred.retransmitTimeout = 0;
+    deferred.endpoint = rxEndpoint;
+    if (deferred.confirmable) {
+        deferredByMid.insert(MidAddressPortKey(deferred.requestMid, deferred.address), key);
+        responseTimers->addTimer(quint32(ackDelay), key);
+    } else { // nothing to acknowledge, just forget it if the handler never answers
+        responseTimers->addTimer(quint32(EXCHANGE_LIFETIME), key);
+    }
+}
+
+void iotlib::coap::StackPrivate::respondDeferred(const iotlib::coap::Message &deferredResponse)
+{
+    iotlib::coap::Message response = deferredResponse;
+    QByteArray key = deferredKey(response.address(), response.token());
+    QHash<QByteArray, DeferredResponse>::iterator it = deferredResponses.find(key);
+    if (it == deferredResponses.end()) {
+        qWarning() << "respond(): no deferred request with token" << response.token().toHex();
+        return;
+    }
+    DeferredResponse &deferred = it.value();
+    if (deferred.state == DeferredResponse::AwaitingAck || deferred.state == DeferredResponse::Completed) {
+        qWarning() << "respond(): already responded to token" << response.token().toHex();
+        return;
+    }
+    responseTimers->removeTimer(key);
+    if (!deferred.endpoint) {
+        dropDeferred(key);
+        return;
+    }
+
+    if (deferred.state == DeferredResponse::AwaitingHandler) { // in time, rides on the ACK
+        QPointer<EndpointBase> endpoint = deferred.endpoint;
+        dropDeferred(key);
+        sendResponse(response, endpoint);
+        return;
+    }
+
+    // empty ACK already went out, separate confirmable response (RFC7252 5.2.2)
+    --pendingHandlers;
+    PeerState *peer = peers.insert(deferred.address);
+    deferred.separateMid = peer ? peer->nextMessageId++ : currentMid++;
+    response.setType(iotlib::coap::Message::Type::Confirmable);
+    response.setMessageId(deferred.separateMid);
+    deferred.response = response;
+    deferred.state = DeferredResponse::AwaitingAck;
+    deferred.retransmissionCount = 0;
+    deferred.retransmitTimeout = peer ? peer->retransmitTimeout(ACK_TIMEOUT) : ACK_TIMEOUT;
+    separateByMid.insert(MidAddressPortKey(deferred.separateMid, deferred.address), key);
+    responseTimers->addTimer(deferred.retransmitTimeout, key);
+    sendMessage(response, deferred.endpoint);
+}
+
+void iotlib::coap::StackPrivate::postResponse(const iotlib::coap::Message &response)
+{
+    Q_Q(iotlib::coap::Stack);
+    if (QThread::currentThread() == q->thread()) {
+        respondDeferred(response);
+        return;
+    }
+    postedResponses.push(response);
+    if (drainScheduled.testAndSetOrdered(0, 1)) // one wakeup for a burst of responses
+        QMetaObject::invokeMethod(q, "_q_drain_responses", Qt::QueuedConnection);
+}
+
+void iotlib::coap::StackPrivate::_q_drain_responses()
+{
+    drainScheduled.storeRelease(0); // responses pushed from now on schedule another drain
+    iotlib::coap::Message response;
+    while (postedResponses.pop(response))
+        respondDeferred(response);
+}
+
+bool iotlib::coap::StackPrivate::rxDeferredEmpty(iotlib::coap::Message::Type type, quint16 messageId,
+                                                 const iotlib::coap::Address &address)
+{
+    if (separateByMid.isEmpty() || type == iotlib::coap::Message::Type::Confirmable)
+        return false;
+    QByteArray key = separateByMid.value(MidAddressPortKey(messageId, address));
+    QHash<QByteArray, DeferredResponse>::iterator it = deferredResponses.find(key);
+    if (it == deferredResponses.end() || it->state != DeferredResponse::AwaitingAck)
+        return false;
+    // ACK, or RST when the client isn't interested anymore, done either way
+    responseTimers->removeTimer(key);
+    completeDeferred(key);
+    return true;
+}
+
+void iotlib::coap::StackPrivate::dropDeferred(const QByteArray &key)
+{
+    QHash<QByteArray, DeferredResponse>::iterator it = deferredResponses.find(key);
+    if (it == deferredResponses.end())
+        return;
+    DeferredResponse deferred = it.value();
+    deferredResponses.erase(it);
+    if (deferred.state == DeferredResponse::AwaitingHandler || deferred.state == DeferredResponse::Acknowledged)
+        --pendingHandlers;
+    if (deferred.confirmable)
+        deferredByMid.remove(MidAddressPortKey(deferred.requestMid, deferred.address));
+    if (deferred.state == DeferredResponse::AwaitingAck)
+        separateByMid.remove(MidAddressPortKey(deferred.separateMid, deferred.address));
+}
+
+void iotlib::coap::StackPrivate::completeDeferred(const QByteArray &key)
+{
+    DeferredResponse &deferred = deferredResponses[key];
+    separateByMid.remove(MidAddressPortKey(deferred.separateMid, deferred.address));
+    deferred.state = DeferredResponse::Completed;
+    deferred.response = iotlib::coap::Message();
+    // duplicates of the request may still arrive (RFC7252 4.5), they only get the empty ACK again
+    responseTimers->addTimer(quint32(EXCHANGE_LIFETIME), key);
+}
+
+void iotlib::coap::StackPrivate::_q_on_response_timeout(const QByteArray &key)
+{
+    // timer being fired is still queued, only add timers here
+    QHash<QByteArray, DeferredResponse>::iterator it = deferredResponses.find(key);
+    if (it == deferredResponses.end())
+        return;
+    DeferredResponse &deferred = it.value();
+    switch (deferred.state) {
+    case DeferredResponse::AwaitingHandler:
+        if (deferred.confirmable && deferred.endpoint) { // handler is slow, stop client retransmissions
+            sendAck(deferred.requestMid, deferred.address, deferred.endpoint);
+            deferred.state = DeferredResponse::Acknowledged;
+            responseTimers->addTimer(quint32(EXCHANGE_LIFETIME), key);
+            return;
+        }
+        break;
+    case DeferredResponse::Acknowledged:
+        qWarning() << "Deferred request from" << deferred.address.hostAddress() << "was never answered";
+        break;
+    case DeferredResponse::AwaitingAck:
+        if (++deferred.retransmissionCount < 4 && deferred.endpoint) {
+            sendMessage(deferred.response, deferred.endpoint);
+            deferred.retransmitTimeout *= 2;
+            responseTimers->addTimer(deferred.retransmitTimeout, key);
+        } else {
+            completeDeferred(key);
+        }
+        return;
+    case DeferredResponse::Completed:
+        break;
+    }
+    dropDeferred(key);
+}
+
+bool iotlib::coap::StackPrivate::rxBuffer(iotlib::coap::MessageBuffer &message)
+{
+    const MessageView &view = message.view();
+    if (view.isRequest()) {
+        if (view.isMulticast()) // leisure and suppression of group responses live in txResponse()
+            return false;
+        if (view.type() == iotlib::coap::Message::Type::Confirmable && !deferredByMid.isEmpty() &&
+                deferredByMid.contains(MidAddressPortKey(view.messageId(), view.address())))
+            return false; // duplicate of a deferred one, rxRequest() knows what to do
+        if (admission.isEnabled() && !admit(view.address(), view.type(), view.messageId(),
+                                            view.token(), view.tokenLength(), false))
+            return true;
+        if (!rxRequestBuffer(view)) {
+            iotlib::coap::Message request = view.toMessage();
+            serveRequest(request);
+        }
+        return true;
+    }
+
+    if (view.isResponse()) {
+        if (view.type() == iotlib::coap::Message::Type::Reset || view.tokenLength() != 8 || pollerById.isEmpty())
+            return false;
+        PollerPrivate *poller = pollerById.value(endian_load16(quint16, view.token()), 0);
+        if (!poller || !poller->rxResponse(view))
+            return false;
+        if (view.type() == iotlib::coap::Message::Type::Confirmable) { // separate response
+            MessageBuffer ack = MessageBuffer::allocate();
+            ack.setHeader(iotlib::coap::Message::Type::Acknowledgement, iotlib::coap::Message::Code::Empty,
+                          view.messageId(), 0, 0);
+            sendBuffer(ack, view.address());
+        }
+        return true;
+    }
 
+    // empty messages matter to deferred responses and pollers, exchanges only note the ACK time
+    if (rxDeferredEmpty(view.type(), view.messageId(), view.address()) ||
+            rxExchangeAck(view.type(), view.messageId(), view.address()))
+        return true;
+    foreach (PollerPrivate *poller, pollerById)
+        if (poller->rxEmpty(view))
+            break;
+    return true;
+}
+
+bool iotlib::coap::StackPrivate::rxRequestBuffer(const iotlib::coap::MessageView &request)
+{
+    Resource *resource = resourceFor(request);
+
+    MessageBuffer response = MessageBuffer::allocate();
+    iotlib::coap::Message::Type type = iotlib::coap::Message::Type::Acknowledgement; // piggybacked
+    quint16 messageId = request.messageId();
+    if (request.type() != iotlib::coap::Message::Type::Confirmable) {
+        type = iotlib::coap::Message::Type::NonConfirmable;
+        PeerState *peer = peers.insert(request.address());
+        messageId = peer ? peer->nextMessageId++ : currentMid++;
+    }
+    response.setHeader(type, resource ? iotlib::coap::Message::Code::MethodNotAllowed :
+                                        iotlib::coap::Message::Code::NotFound,
+                       messageId, request.token(), request.tokenLength());
+    if (resource && (resource->execution() == Resource::Execution::Offloaded ||
+                     !resource->handleBuffer(request, response)))
+        return false;
+    sendBuffer(response, request.address());
+    return true;
+}
+
+iotlib::coap::Resource *iotlib::coap::StackPrivate::resourceFor(const iotlib::coap::MessageView &request) const
+{
+    // same longest match as for Message, comparing Uri-Path options with the path in place
+    Resource *best = 0;
+    int bestLength = -1;
+    for (int r = 0; r < resourcePaths.size(); ++r) {
+        const QByteArray &path = resourcePaths.at(r).first;
+        if (path.size() <= bestLength)
+            continue;
+        int pos = 0;
+        bool matches = path.isEmpty();
+        for (int i = request.findOption(iotlib::coap::Message::OptionType::UriPath);
+             i >= 0 && !matches;
+             i = request.findOption(iotlib::coap::Message::OptionType::UriPath, i + 1)) {
+            if (pos > 0) {
+                if (pos >= path.size() || path.at(pos) != '/')
+                    break;
+                ++pos;
+            }
+            int length = request.optionLength(i);
+            if (pos + length > path.size() || memcmp(path.constData() + pos, request.optionData(i), length) != 0)
+                break;
+            pos += length;
+            matches = pos == path.size();
+        }
+        if (matches) {
+            best = resourcePaths.at(r).second;
+            bestLength = path.size();
+        }
+    }
+    return best;
+}
+
+iotlib::coap::Resource *iotlib::coap::StackPrivate::resourceFor(const iotlib::coap::Message &request) const
+{
+    if (resourceByPath.isEmpty())
+        return 0;
+    QStringList path;
+    for (int i = 0; i < request.optionsCount(); ++i) {
+        iotlib::coap::Option option = request.option(i);
+        if (option.type() == iotlib::coap::Message::OptionType::UriPath)
+            path.append(QString::fromUtf8(option.data()));
+    }
+    for (int depth = path.size(); depth >= 0; --depth) { // longest match first
+        Resource *resource = resourceByPath.value(QStringList(path.mid(0, depth)).join("/"), 0);
+        if (resource)
+            return resource;
+    }
+    return 0;
 }
 
 void iotlib::coap::StackPrivate::rxResponse(iotlib::coap::Message &response)
@@ -132,12 +828,48 @@ void iotlib::coap::StackPrivate::rxResponse(iotlib::coap::Message &response)
         qDebug() << "Ignoring response with Type::Reset";
         return;
     }
+    if (response.token().size() == 8 && !pollerById.isEmpty()) {
+        PollerPrivate *poller = pollerById.value(endian_load16(quint16, response.token().constData()), 0);
+        MessageBuffer buffer = poller ? MessageBuffer::fromMessage(response) : MessageBuffer();
+        if (!buffer.isNull() && poller->rxResponse(buffer.view())) {
+            ackResponse(response);
+            return;
+        }
+    }
     Exchange *exchange = exchangeByToken.value(response.token(), 0);
     if (exchange) {
         qDebug() << "found exchange" << exchange;
+        if (!ackResponse(response))
+            return;
         timerQueue->removeTimer(response.token());
+        finishInFlight(exchange, true);
+        forgetRequestMid(exchange->d_ptr);
+        if (response.type() == iotlib::coap::Message::Type::Acknowledgement) { // piggybacked
+            qint64 now = clock.nsecsElapsed() / 1000;
+            IOTLIB_TRACE(ack_matched, response.messageId(), response.token(), true,
+                         now - exchange->d_ptr->timings.lastTransmit());
+            if (exchange->d_ptr->timings.ackReceived < 0)
+                exchange->d_ptr->timings.ackReceived = now;
+        }
+        completeTimings(exchange->d_ptr, true);
+        QList<QPointer<Exchange> > followers;
+        if (exchange->d_ptr->observe && requestKeyByExchange.contains(exchange))
+            lastNotification.insert(exchange, response);
+        if (exchange->d_ptr->observe) // notifications go to every collapsed observer
+            foreach (Exchange *follower, collapsedExchanges.value(exchange))
+                followers.append(follower);
+        else // answered, next identical request goes to the network again
+            followers = releaseCollapsed(exchange);
         exchange->handle(response);
-    } else {
+        foreach (Exchange *follower, followers) {
+            if (follower) {
+                completeTimings(follower->d_ptr, true);
+                follower->handle(response);
+            }
+        }
+    } else if (ackedResponses.contains(MidAddressPortKey(response.messageId(), response.address()))) {
+        ackResponse(response); // retransmission of one already handled, our ACK got lost
+    } else if (rxEndpoint && !rxEndpoint->isReliable()) {
         qDebug() << "Strange or after observe response received, RST it";
         iotlib::coap::Message rst;
         rst.setAddress(response.address());
@@ -148,24 +880,244 @@ void iotlib::coap::StackPrivate::rxResponse(iotlib::coap::Message &response)
     }
 }
 
+bool iotlib::coap::StackPrivate::ackResponse(const iotlib::coap::Message &response)
+{
+    // separate responses and notifications sent CON (RFC7252 5.2.2, RFC7641 4.5)
+    if (response.type() != iotlib::coap::Message::Type::Confirmable)
+        return true;
+    sendAck(response.messageId(), response.address(), rxEndpoint);
+
+    qint64 now = clock.elapsed();
+    while (!ackedResponseOrder.isEmpty() && ackedResponseOrder.head().first < now - EXCHANGE_LIFETIME) {
+        QPair<qint64, MidAddressPortKey> oldest = ackedResponseOrder.dequeue();
+        QHash<MidAddressPortKey, qint64>::iterator it = ackedResponses.find(oldest.second);
+        if (it != ackedResponses.end() && it.value() == oldest.first)
+            ackedResponses.erase(it);
+    }
+    MidAddressPortKey key(response.messageId(), response.address());
+    if (ackedResponses.contains(key)) {
+        qDebug() << "Duplicate response" << response.messageId() << "ACKed again";
+        return false;
+    }
+    ackedResponses.insert(key, now);
+    ackedResponseOrder.enqueue(qMakePair(now, key));
+    return true;
+}
+
 void iotlib::coap::StackPrivate::rxEmpty(iotlib::coap::Message &empty)
 {
+    if (rxDeferredEmpty(empty.type(), empty.messageId(), empty.address()) ||
+            rxExchangeAck(empty.type(), empty.messageId(), empty.address()))
+        return;
+    if (pollerById.isEmpty())
+        return;
+    MessageBuffer buffer = MessageBuffer::fromMessage(empty);
+    if (buffer.isNull())
+        return;
+    foreach (PollerPrivate *poller, pollerById)
+        if (poller->rxEmpty(buffer.view()))
+            return;
+}
+
+bool iotlib::coap::StackPrivate::rxExchangeAck(iotlib::coap::Message::Type type, quint16 messageId,
+                                              const iotlib::coap::Address &address)
+{
+    if (type != iotlib::coap::Message::Type::Acknowledgement || exchangeByMid.isEmpty())
+        return false;
+    Exchange *exchange = exchangeByMid.take(MidAddressPortKey(messageId, address));
+    if (!exchange)
+        return false;
+    // separate response follows (RFC7252 5.2.2), no more retransmissions, it has EXCHANGE_LIFETIME to arrive
+    exchange->d_ptr->awaitingAck = false;
+    QByteArray token = exchange->d_ptr->request.token();
+    timerQueue->removeTimer(token);
+    timerQueue->addTimer(quint32(EXCHANGE_LIFETIME), token);
+    finishInFlight(exchange, true);
+    qint64 now = clock.nsecsElapsed() / 1000;
+    IOTLIB_TRACE(ack_matched, messageId, token, false,
+                 now - exchange->d_ptr->timings.lastTransmit());
+    if (exchange->d_ptr->timings.ackReceived < 0)
+        exchange->d_ptr->timings.ackReceived = now;
+    return true;
+}
+
+void iotlib::coap::StackPrivate::forgetRequestMid(ExchangePrivate *exchange)
+{
+    if (!exchange->awaitingAck)
+        return;
+    exchange->awaitingAck = false;
+    exchangeByMid.remove(MidAddressPortKey(exchange->requestMid, exchange->request.address()));
+}
 
+void iotlib::coap::StackPrivate::sendAck(quint16 messageId, const iotlib::coap::Address &address,
+                                         EndpointBase *endpoint)
+{
+    iotlib::coap::Message ack;
+    ack.setAddress(address);
+    ack.setType(iotlib::coap::Message::Type::Acknowledgement);
+    ack.setMessageId(messageId);
+    sendMessage(ack, endpoint);
 }
 
 void iotlib::coap::StackPrivate::removeExchange(Exchange *exchange)
 {
-    QByteArray token = exchangeByToken.key(exchange);
-    if (token.isEmpty())
+    finishInFlight(exchange, false);
+    forgetRequestMid(exchange->d_ptr);
+    detachCollapsed(exchange);
+    // a reused token may have been taken over by another exchange since
+    QByteArray token = exchange->d_ptr->token;
+    if (exchangeByToken.value(token, 0) != exchange)
         return;
     qDebug() << "Removing exchange with token:" << token.toHex();
     exchangeByToken.remove(token);
     timerQueue->removeTimer(token);
 }
 
+void iotlib::coap::StackPrivate::finishInFlight(Exchange *exchange, bool answered)
+{
+    ExchangePrivate *d = exchange->d_ptr;
+    if (!d->inFlight)
+        return;
+    d->inFlight = false;
+    PeerState *peer = peers.find(d->request.address());
+    if (!peer)
+        return;
+    if (peer->inFlight)
+        --peer->inFlight;
+    if (answered && d->retransmissionCount == 0) // Karn, retransmitted ones are ambiguous
+        peer->addRttSample(qint32(qMin<qint64>(clock.nsecsElapsed() / 1000 - d->sentAt, 0x7fffffff)));
+}
+
+void iotlib::coap::StackPrivate::completeTimings(ExchangePrivate *exchange, bool answered)
+{
+    ExchangeTimings &t = exchange->timings;
+    if (t.completed >= 0)
+        return;
+    qint64 now = clock.nsecsElapsed() / 1000;
+    if (answered)
+        t.responseReceived = now;
+    t.completed = now;
+    IOTLIB_TRACE(exchange_completed, exchange->request.token(), answered, ExchangeTimings::span(t.created, now));
+    if (latency)
+        latency->record(t, answered);
+}
+
 void iotlib::coap::StackPrivate::_q_on_message_received(Message &message)
 {
+    Q_Q(iotlib::coap::Stack);
+    receive(qobject_cast<EndpointBase *>(q->sender()), message);
+}
+
+void iotlib::coap::StackPrivate::_q_on_buffer_received(iotlib::coap::MessageBuffer *buffer)
+{
+    Q_Q(iotlib::coap::Stack);
+    receive(qobject_cast<EndpointBase *>(q->sender()), *buffer);
+}
+
+void iotlib::coap::StackPrivate::_q_on_endpoint_destroyed(QObject *object)
+{
+    // already past ~EndpointBase, only the address is left to compare
+    forgetEndpoint(static_cast<EndpointBase *>(object));
+}
+
+void iotlib::coap::StackPrivate::forgetEndpoint(EndpointBase *endpoint)
+{
+    endpoints.removeAll(endpoint);
+    if (rxEndpoint == endpoint)
+        rxEndpoint = 0;
+    for (QHash<QByteArray, DeferredResponse>::iterator it = deferredResponses.begin();
+         it != deferredResponses.end(); ++it) {
+        if (it->endpoint == endpoint)
+            it->endpoint = 0;
+    }
+}
+
+void iotlib::coap::StackPrivate::updateDelivery(EndpointBase *endpoint)
+{
+    Q_Q(iotlib::coap::Stack);
+    // owned endpoints call the stack directly, the rest go through directly connected signals
+    QObject::disconnect(endpoint, SIGNAL(received(Message&)),
+                        q,        SLOT(_q_on_message_received(Message&)));
+    QObject::disconnect(endpoint, SIGNAL(receivedBuffer(iotlib::coap::MessageBuffer*)),
+                        q,        SLOT(_q_on_buffer_received(iotlib::coap::MessageBuffer*)));
+    if (endpoint->parent() == q) {
+        endpoint->setReceiver(this);
+        return;
+    }
+    if (endpoint->receiver() == this)
+        endpoint->setReceiver(0);
+    QObject::connect(endpoint, SIGNAL(received(Message&)),
+                     q,        SLOT(_q_on_message_received(Message&)), Qt::DirectConnection);
+    QObject::connect(endpoint, SIGNAL(receivedBuffer(iotlib::coap::MessageBuffer*)),
+                     q,        SLOT(_q_on_buffer_received(iotlib::coap::MessageBuffer*)), Qt::DirectConnection);
+}
+
+void iotlib::coap::StackPrivate::detachEndpoint(EndpointBase *endpoint)
+{
+    Q_Q(iotlib::coap::Stack);
+    endpoint->removeEventFilter(q);
+    QObject::disconnect(endpoint, 0, q, 0);
+    if (endpoint->receiver() == this)
+        endpoint->setReceiver(0);
+    if (endpoint->capture() == capture)
+        endpoint->setCapture(0);
+    forgetEndpoint(endpoint);
+}
+
+void iotlib::coap::StackPrivate::receive(EndpointBase *endpoint, iotlib::coap::Message &message)
+{
+    rxEndpoint = endpoint;
+    IOTLIB_TRACE(rx, message.pack().size(), message.address());
+    IOTLIB_TRACE(decoded, message);
+    touchPeer(message.address());
+    rx(message);
+}
+
+void iotlib::coap::StackPrivate::receive(EndpointBase *endpoint, iotlib::coap::MessageBuffer &buffer)
+{
+    rxEndpoint = endpoint;
+    MessageBuffer message = std::move(buffer); // ours now, endpoint won't emit received()
+    IOTLIB_TRACE(rx, message.size(), message.view().address());
+    IOTLIB_TRACE(decoded, message.view());
+    touchPeer(message.view().address());
+    if (rxBuffer(message))
+        return;
+    iotlib::coap::Message unpacked = message.view().toMessage();
+    rx(unpacked);
+}
+
+void iotlib::coap::StackPrivate::sendMessage(iotlib::coap::Message &message, EndpointBase *endpoint)
+{
+    if (!endpoint) {
+        if (endpoints.isEmpty()) {
+            qWarning() << "Can't send a message, no endpoints, add one with Stack::addEndpoint()";
+            return;
+        }
+        endpoint = endpoints.first();
+    }
+    IOTLIB_TRACE(tx, message);
+    endpoint->send(message);
+}
 
+void iotlib::coap::StackPrivate::sendBuffer(const iotlib::coap::MessageBuffer &buffer, const iotlib::coap::Address &address)
+{
+    EndpointBase *endpoint = rxEndpoint;
+    if (!endpoint) {
+        if (endpoints.isEmpty())
+            return;
+        endpoint = endpoints.first();
+    }
+    IOTLIB_TRACE(tx, buffer.constData(), buffer.size(), address);
+    endpoint->sendPacked(buffer.constData(), buffer.size(), address);
+}
+
+iotlib::coap::EndpointBase *iotlib::coap::StackPrivate::endpointFor(const QString &scheme) const
+{
+    QString s = scheme.isEmpty() ? QStringLiteral("coap") : scheme;
+    foreach (EndpointBase *endpoint, endpoints)
+        if (endpoint->scheme() == s)
+            return endpoint;
+    return 0;
 }
 
 iotlib::coap::Stack::Stack(QObject *parent) :
@@ -187,9 +1139,257 @@ iotlib::coap::Stack::Stack(iotlib::coap::StackPrivate &dd, QObject *parent) :
 iotlib::coap::Stack::~Stack()
 {
     if (d_ptr) {
+        // owned endpoints are deleted after this body, others may outlive the stack
+        foreach (EndpointBase *endpoint, d_ptr->endpoints)
+            d_ptr->detachEndpoint(endpoint);
+        // exchanges outliving the stack must not reach back into it
+        foreach (Exchange *exchange, findChildren<Exchange *>(QString(), Qt::FindDirectChildrenOnly))
+            exchange->d_ptr->stack = 0;
         delete d_ptr;
         d_ptr = 0;
     }
 }
 
+void iotlib::coap::Stack::setRequestCollapsing(bool enabled)
+{
+    Q_D(iotlib::coap::Stack);
+    d->requestCollapsing = enabled;
+}
+
+bool iotlib::coap::Stack::requestCollapsing() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->requestCollapsing;
+}
+
+void iotlib::coap::Stack::setTokenLength(int length)
+{
+    Q_D(iotlib::coap::Stack);
+    if (length == d->tokenAllocator->length())
+        return;
+    if (!d->exchangeByToken.isEmpty()) {
+        // a fresh allocator starts over and would hand out tokens of exchanges still waiting for responses
+        qWarning() << "Stack::setTokenLength(): exchanges are in progress, keeping token length";
+        return;
+    }
+    delete d->tokenAllocator;
+    d->tokenAllocator = new TokenAllocator(length);
+}
+
+int iotlib::coap::Stack::tokenLength() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->tokenAllocator->length();
+}
+
+void iotlib::coap::Stack::setAckDelay(int msec)
+{
+    Q_D(iotlib::coap::Stack);
+    d->ackDelay = qMax(0, msec);
+}
+
+int iotlib::coap::Stack::ackDelay() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->ackDelay;
+}
+
+void iotlib::coap::Stack::setHandlerThreads(int count)
+{
+    Q_D(iotlib::coap::Stack);
+    d->handlerPool->setMaxThreadCount(qMax(1, count));
+}
+
+int iotlib::coap::Stack::handlerThreads() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->handlerPool->maxThreadCount();
+}
+
+void iotlib::coap::Stack::setAdmissionPolicy(const iotlib::coap::AdmissionPolicy &policy)
+{
+    Q_D(iotlib::coap::Stack);
+    d->admission.setPolicy(policy);
+}
+
+iotlib::coap::AdmissionPolicy iotlib::coap::Stack::admissionPolicy() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->admission.policy();
+}
+
+iotlib::coap::AdmissionStats iotlib::coap::Stack::admissionStats() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->admission.stats(d->clock.elapsed());
+}
+
+void iotlib::coap::Stack::setCapture(iotlib::coap::CaptureWriter *writer)
+{
+    Q_D(iotlib::coap::Stack);
+    d->capture = writer;
+    foreach (EndpointBase *endpoint, d->endpoints)
+        endpoint->setCapture(writer);
+}
+
+iotlib::coap::CaptureWriter *iotlib::coap::Stack::capture() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->capture;
+}
+
+void iotlib::coap::Stack::setClock(iotlib::coap::VirtualClock *clock)
+{
+    Q_D(iotlib::coap::Stack);
+    if (d->peers.size() || !d->exchangeByToken.isEmpty() || !d->deferredResponses.isEmpty()) {
+        // peer RTTs, exchange timestamps and timers are all relative to the current clock
+        qWarning() << "Stack::setClock(): stack already has traffic, keeping its clock";
+        return;
+    }
+    d->clock.setVirtual(clock);
+    d->timerQueue->setClock(clock);
+    d->responseTimers->setClock(clock);
+}
+
+iotlib::coap::VirtualClock *iotlib::coap::Stack::clock() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->clock.virtualClock();
+}
+
+void iotlib::coap::Stack::setLatencyTracking(bool enabled)
+{
+    Q_D(iotlib::coap::Stack);
+    if (enabled == (d->latency != 0))
+        return;
+    delete d->latency;
+    d->latency = enabled ? new LatencyBreakdown : 0;
+}
+
+bool iotlib::coap::Stack::latencyTracking() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->latency != 0;
+}
+
+iotlib::coap::LatencyBreakdown iotlib::coap::Stack::latencyBreakdown() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->latency ? *d->latency : LatencyBreakdown();
+}
+
+void iotlib::coap::Stack::resetLatencyBreakdown()
+{
+    Q_D(iotlib::coap::Stack);
+    if (!d->latency)
+        return;
+    d->latency->lookup.reset();
+    d->latency->queueing.reset();
+    d->latency->retransmission.reset();
+    d->latency->network.reset();
+    d->latency->separateResponse.reset();
+    d->latency->total.reset();
+    d->latency->timedOut = 0;
+}
+
+void iotlib::coap::Stack::addEndpoint(iotlib::coap::EndpointBase *endpoint)
+{
+    Q_D(iotlib::coap::Stack);
+    if (!endpoint || d->endpoints.contains(endpoint))
+        return;
+    // received() and receivedBuffer() arguments don't outlive the emit, they can't be queued
+    if (endpoint->thread() != thread()) {
+        qWarning() << "addEndpoint(): endpoint lives in another thread, move it to the stack's thread first";
+        return;
+    }
+    if (!endpoint->parent())
+        endpoint->setParent(this);
+    d->endpoints.append(endpoint);
+    endpoint->setCapture(d->capture);
+    connect(endpoint, SIGNAL(peerFailed(iotlib::coap::Address)),
+            this,     SLOT(_q_on_peer_failed(iotlib::coap::Address)));
+    connect(endpoint, SIGNAL(sendFailed(iotlib::coap::Message)),
+            this,     SLOT(_q_on_send_failed(iotlib::coap::Message)));
+    connect(endpoint, SIGNAL(destroyed(QObject*)),
+            this,     SLOT(_q_on_endpoint_destroyed(QObject*)));
+    endpoint->installEventFilter(this);
+    d->updateDelivery(endpoint);
+}
+
+bool iotlib::coap::Stack::eventFilter(QObject *watched, QEvent *event)
+{
+    Q_D(iotlib::coap::Stack);
+    if (event->type() == QEvent::ParentChange || event->type() == QEvent::ThreadChange) {
+        EndpointBase *endpoint = qobject_cast<EndpointBase *>(watched);
+        if (endpoint && d->endpoints.contains(endpoint)) {
+            if (event->type() == QEvent::ParentChange) {
+                d->updateDelivery(endpoint);
+            } else {
+                // descendants move along with the stack, anything else leaves it behind
+                QObject *ancestor = endpoint->parent();
+                while (ancestor && ancestor != this)
+                    ancestor = ancestor->parent();
+                if (!ancestor) {
+                    qWarning() << "Endpoint moved to another thread, detached from the stack";
+                    d->detachEndpoint(endpoint);
+                }
+            }
+        }
+    }
+    return QObject::eventFilter(watched, event);
+}
+
+bool iotlib::coap::Stack::bindMulticast(const QHostAddress &groupAddress, const QNetworkInterface &iface)
+{
+    Q_D(iotlib::coap::Stack);
+    bool joined = false;
+    foreach (EndpointBase *endpoint, d->endpoints) {
+        UdpEndpoint *udpEndpoint = qobject_cast<UdpEndpoint *>(endpoint);
+        if (udpEndpoint && udpEndpoint->joinMulticastGroup(groupAddress, iface))
+            joined = true;
+    }
+    if (!joined)
+        qWarning() << "bindMulticast(): no UDP endpoint joined" << groupAddress;
+    return joined;
+}
+
+void iotlib::coap::Stack::addResource(iotlib::coap::Resource *resource)
+{
+    Q_D(iotlib::coap::Stack);
+    if (d->resourceByPath.contains(resource->path())) {
+        qWarning() << "Resource" << resource->path() << "replaced";
+        removeResource(d->resourceByPath.value(resource->path()));
+    }
+    d->resourceByPath.insert(resource->path(), resource);
+    resource->m_stack = this;
+    d->resourcePaths.append(qMakePair(resource->path().toUtf8(), resource));
+}
+
+void iotlib::coap::Stack::removeResource(iotlib::coap::Resource *resource)
+{
+    Q_D(iotlib::coap::Stack);
+    if (d->resourceByPath.value(resource->path()) != resource)
+        return;
+    d->resourceByPath.remove(resource->path());
+    resource->m_stack = 0;
+    for (int i = 0; i < d->resourcePaths.size(); ++i) {
+        if (d->resourcePaths.at(i).second == resource) {
+            d->resourcePaths.remove(i);
+            break;
+        }
+    }
+}
+
+void iotlib::coap::Stack::setMulticastLeisure(int msec)
+{
+    Q_D(iotlib::coap::Stack);
+    d->multicastLeisure = msec;
+}
+
+int iotlib::coap::Stack::multicastLeisure() const
+{
+    Q_D(const iotlib::coap::Stack);
+    return d->multicastLeisure;
+}
+
 #include "moc_stack.cpp"
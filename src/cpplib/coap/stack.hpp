@@ -3,6 +3,8 @@
 
 #include "../iotlib_global.h"
 #include "message.hpp"
+#include "admissioncontrol.hpp"
+#include "histogram.hpp"
 
 #include <QObject>
 #include <QHostAddress>
@@ -13,8 +15,41 @@
 namespace iotlib {
 namespace coap {
 
+class CaptureWriter;
 class CoapExchange;
+struct ExchangeTimings;
+class EndpointBase;
+class MessageBuffer;
+class Resource;
 class StackPrivate;
+class VirtualClock;
+
+/**
+ * @brief The LatencyBreakdown struct splits request latency into phases, usec histograms
+ * fed from ExchangeTimings of every exchange that went to the network
+ */
+struct IOTLIB_SHARED_EXPORT LatencyBreakdown
+{
+    LatencyBreakdown() :
+        lookup(300LL * 1000000, 2), queueing(300LL * 1000000, 2), retransmission(300LL * 1000000, 2),
+        network(300LL * 1000000, 2), separateResponse(300LL * 1000000, 2), total(300LL * 1000000, 2),
+        timedOut(0)
+    { }
+
+    /**
+     * @brief record adds a finished request, ones that never went to the network are skipped
+     * @param answered false if it was given up
+     */
+    void record(const ExchangeTimings &timings, bool answered);
+
+    Histogram lookup;           ///< host name resolution
+    Histogram queueing;         ///< request issued (and resolved) until first transmission
+    Histogram retransmission;   ///< first to last transmission, time lost to loss
+    Histogram network;          ///< last transmission until the ACK or response, round trip plus peer
+    Histogram separateResponse; ///< empty ACK until the separate response, peer processing
+    Histogram total;            ///< request issued until answered or given up
+    quint64 timedOut;           ///< given up after MAX_RETRANSMIT, counted in total too
+};
 /** @file */
 /**
  * @brief The iotlib::coap::Stack class
@@ -43,6 +78,102 @@ public:
      */
     virtual ~Stack();
 
+    /**
+     * @brief setRequestCollapsing Attach identical in-flight GET and Observe requests to the one already sent
+     * @param enabled true by default
+     * Requests are identical when they go to the same peer with the same method and cache-key options
+     * (RFC7252 5.4.2), only one of them goes to the network and its response completes all the others.
+     */
+    void setRequestCollapsing(bool enabled);
+    bool requestCollapsing() const;
+
+    /**
+     * @brief setTokenLength Length of tokens for outgoing requests, @see TokenAllocator
+     * @param length 0..8 bytes, 4 by default. With 0 only one request may be in flight,
+     * since responses are matched by token. Ignored with a warning while exchanges are in progress
+     */
+    void setTokenLength(int length);
+    int tokenLength() const;
+
+    /**
+     * @brief setAckDelay How long a deferred confirmable request waits for its response before
+     * an empty ACK is sent, @see Resource::defer()
+     * @param msec 500 by default, keep it well below ACK_TIMEOUT so clients don't retransmit
+     */
+    void setAckDelay(int msec);
+    int ackDelay() const;
+
+    /**
+     * @brief setHandlerThreads Size of the pool running handlers of Resource::Offloaded resources
+     * @param count QThread::idealThreadCount() by default
+     */
+    void setHandlerThreads(int count);
+    int handlerThreads() const;
+
+    /**
+     * @brief setAdmissionPolicy Limit requests per peer, per network prefix and in flight overall,
+     * requests over the limits are answered with 5.03 Service Unavailable and Max-Age retry hint
+     * right after the header is read. No limits by default
+     */
+    void setAdmissionPolicy(const AdmissionPolicy &policy);
+    AdmissionPolicy admissionPolicy() const;
+    /**
+     * @brief admissionStats returns admitted and shed request counters and current shedding state
+     */
+    AdmissionStats admissionStats() const;
+
+    /**
+     * @brief setCapture Record every datagram endpoints receive and send, with time and peer address
+     * Bytes are recorded as the endpoint read or wrote them, including ones that don't parse. DTLS endpoints
+     * record decrypted datagrams, TCP connections aren't recorded
+     * @param writer opened CaptureWriter, not owned, 0 stops capturing. Replay with examples/cpp/coapreplay
+     */
+    void setCapture(CaptureWriter *writer);
+    CaptureWriter *capture() const;
+
+    /**
+     * @brief setLatencyTracking Aggregate ExchangeTimings of completed exchanges per phase
+     * @param enabled false by default, histograms take about 150 KB per stack
+     * Requests collapsed into another one are not counted, their leader is
+     */
+    void setLatencyTracking(bool enabled);
+    bool latencyTracking() const;
+    /**
+     * @brief latencyBreakdown returns histograms since tracking was enabled or last reset
+     */
+    LatencyBreakdown latencyBreakdown() const;
+    void resetLatencyBreakdown();
+
+    /**
+     * @brief setClock Run timers, retransmissions and timestamps on simulated time
+     * @param clock not owned, 0 for real time. Set it before any traffic, ignored with a warning after.
+     * Stack, its endpoints and resources must live in the thread driving the clock and
+     * Resource::Offloaded handlers keep running on real threads. @see SimulatedNetwork
+     */
+    void setClock(VirtualClock *clock);
+    VirtualClock *clock() const;
+
+    /**
+     * @brief addEndpoint Attach transport to this stack
+     * @param endpoint UdpEndpoint for example, stack becomes it's parent if it has none.
+     * Endpoint must live in the stack's thread, ones from other threads are refused with a warning:
+     * received() passes a reference and receivedBuffer() a buffer on the endpoint's stack, neither survives a queued call.
+     * Endpoints owned by the stack deliver by a direct call (EndpointBase::setReceiver()), others through
+     * directly connected received() and receivedBuffer() signals. Reparenting switches between the two,
+     * moving endpoint to another thread without the stack detaches it, stack clears the receiver when destroyed
+     * Requests are routed by url scheme to the first endpoint serving it (coap://, coap+tcp://, ...),
+     * responses go back through the endpoint request came from
+     */
+    void addEndpoint(EndpointBase *endpoint);
+
+    /**
+     * @brief addResource Serve requests under resource->path()
+     * @param resource is not owned by the stack, remove it before deleting
+     * Requests without matching resource are answered with NotFound
+     */
+    void addResource(Resource *resource);
+    void removeResource(Resource *resource);
+
     /**
      * @brief bind Bind on specific interface and port
      * @param address QHostAddress::LocalHost for example
@@ -59,7 +190,18 @@ public:
      * @param iface
      * @return true on success
      * Note that enabling multicast without any protection is not recommended by RFC7252 11.3
+     * Responses to group requests are delayed by random time within @see multicastLeisure
+     */
+    bool bindMulticast(const QHostAddress &groupAddress,
+                       const QNetworkInterface &iface = QNetworkInterface());
+
+    /**
+     * @brief setMulticastLeisure Configure the window responses to group requests are spread over
+     * @param msec defaults to DEFAULT_LEISURE (RFC7252 8.2), should be about S * G / R
+     * for group size G, response size S and data rate R
      */
+    void setMulticastLeisure(int msec);
+    int multicastLeisure() const;
 
 
     /**
@@ -110,12 +252,23 @@ public:
 protected:
     StackPrivate * d_ptr;
     Stack(StackPrivate &dd, QObject *parent);
+    bool eventFilter(QObject *watched, QEvent *event);
 private:
     Q_DECLARE_PRIVATE(iotlib::coap::Stack)
     Q_PRIVATE_SLOT(d_func(), void _q_on_message_received(Message &message))
+    Q_PRIVATE_SLOT(d_func(), void _q_on_buffer_received(iotlib::coap::MessageBuffer *buffer))
     Q_PRIVATE_SLOT(d_func(), void _q_on_timeout(const QByteArray &))
+    Q_PRIVATE_SLOT(d_func(), void _q_on_peer_failed(const iotlib::coap::Address &))
+    Q_PRIVATE_SLOT(d_func(), void _q_on_send_failed(const iotlib::coap::Message &))
+    Q_PRIVATE_SLOT(d_func(), void _q_on_endpoint_destroyed(QObject *))
+    Q_PRIVATE_SLOT(d_func(), void _q_on_response_timeout(const QByteArray &))
+    Q_PRIVATE_SLOT(d_func(), void _q_drain_responses())
     friend class Exchange;
     friend class ExchangePrivate;
+    friend class MulticastExchangePrivate;
+    friend class Poller;
+    friend class PollerPrivate;
+    friend class Resource;
 };
 
 } // coap
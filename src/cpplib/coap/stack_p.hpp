@@ -2,10 +2,20 @@
 #define COAPENDPOINT_P_H
 
 #include "stack.hpp"
+#include "peertable.hpp"
+#include "messagebuffer.hpp"
+#include "mpscqueue.hpp"
+#include "virtualclock.hpp"
+#include "endpointbase.hpp"
 
 #include <QObject>
 #include <QUdpSocket>
 #include <QTimer>
+#include <QPointer>
+#include <QAtomicInt>
+#include <QQueue>
+
+class QThreadPool;
 
 namespace iotlib {
 namespace coap {
@@ -13,17 +23,13 @@ namespace coap {
 class MidAddressPortKey
 {
 public:
-    MidAddressPortKey(quint32 messageId,
-                      const QHostAddress &address = QHostAddress(),
-                      quint16 port = 0) :
-        m_messageId(messageId), m_address(address), m_port(port)
+    MidAddressPortKey(quint16 messageId, const Address &address = Address()) :
+        m_messageId(messageId), m_address(address)
     { }
 
-
 private:
-    quint32 m_messageId;
-    QHostAddress m_address;
-    quint16 m_port;
+    quint16 m_messageId;
+    Address m_address;
 
     friend bool operator==(const MidAddressPortKey &m1, const MidAddressPortKey &m2);
     friend inline uint qHash(const MidAddressPortKey &key, uint seed);
@@ -32,18 +38,47 @@ private:
 inline bool operator==(const MidAddressPortKey &m1, const MidAddressPortKey &m2)
 {
     return (m1.m_messageId == m2.m_messageId) &&
-           (m1.m_address   == m2.m_address) &&
-           (m1.m_port      == m2.m_port);
+           (m1.m_address   == m2.m_address);
 }
 
 inline uint qHash(const MidAddressPortKey &key, uint seed)
 {
-    return qHash(key.m_address, seed) ^ key.m_messageId ^ key.m_port;
+    return qHash(key.m_address, seed) ^ key.m_messageId;
 }
 
 class TimerQueue;
+class CaptureWriter;
 class Exchange;
-class StackPrivate
+class ExchangePrivate;
+class EndpointBase;
+
+/**
+ * @brief The DeferredResponse struct tracks a request whose handler called Resource::defer()
+ */
+struct DeferredResponse
+{
+    enum State {
+        AwaitingHandler,    ///< ACK deadline armed, response may still be piggybacked
+        Acknowledged,       ///< empty ACK sent, response goes out as separate CON
+        AwaitingAck,        ///< separate CON sent, retransmitted until ACKed
+        Completed           ///< separate response done, request MID kept for EXCHANGE_LIFETIME to catch duplicates
+    };
+
+    State state;
+    bool confirmable;       ///< request needs an ACK, false for NON, group and reliable transport requests
+    Address address;
+    quint16 requestMid;
+    quint16 separateMid;
+    quint8 retransmissionCount;
+    quint32 retransmitTimeout;
+    QPointer<EndpointBase> endpoint;
+    Message response;       ///< separate response, kept for retransmissions
+};
+
+class Resource;
+class PollerPrivate;
+class TokenAllocator;
+class StackPrivate : public Receiver
 {
     Q_DECLARE_PUBLIC(Stack)
 public:
@@ -59,7 +94,12 @@ public:
      */
     void tx(Exchange *fromExchange, Message &message);
     void txRequest(Exchange *fromExchange, Message &request);
+    void sendRequest(Exchange *fromExchange, Message &request);
     void txResponse(Exchange *fromExchange, Message &response);
+    /**
+     * @brief sendResponse sends response through endpoint its request came from, group responses after Leisure
+     */
+    void sendResponse(Message &response, EndpointBase *to);
     void txEmpty(Exchange *fromExchange, Message &empty);
     /**
      * @brief rx from network, pass to upper layers
@@ -68,25 +108,142 @@ public:
      */
     void rx(Message &message);
     void rxRequest(Message &request);
+    void serveRequest(Message &request);
     void rxResponse(Message &response);
+    bool ackResponse(const Message &response);
+    // CON responses ACKed within EXCHANGE_LIFETIME, retransmissions are ACKed again but handled once
+    QHash<MidAddressPortKey, qint64> ackedResponses;
+    QQueue<QPair<qint64, MidAddressPortKey> > ackedResponseOrder;
     void rxEmpty(Message &empty);
+    void sendAck(quint16 messageId, const Address &address, EndpointBase *endpoint);
+    /**
+     * @brief rxBuffer allocation free path for requests to resources implementing handleBuffer()
+     * and for poller traffic
+     * @return false if message has to go through rx() as Message
+     */
+    bool rxBuffer(MessageBuffer &message);
+    bool rxRequestBuffer(const MessageView &request);
+    void touchPeer(const Address &address);
     Stack *q_ptr;
 
     void removeExchange(Exchange *exchange);
 
     // Network
+    QList<EndpointBase *> endpoints;
+    EndpointBase *rxEndpoint; ///< endpoint the message being processed came from
+    EndpointBase *endpointFor(const QString &scheme) const;
     void _q_on_message_received(Message &message);
-    void sendMessage(Message &message);
+    void _q_on_buffer_received(iotlib::coap::MessageBuffer *buffer);
+    void _q_on_endpoint_destroyed(QObject *object);
+    void forgetEndpoint(EndpointBase *endpoint);  ///< drops every pointer to endpoint, which may be half destroyed
+    void updateDelivery(EndpointBase *endpoint);
+    void detachEndpoint(EndpointBase *endpoint);
+    // Receiver, endpoints sharing the thread call these directly instead of the slots above
+    void receive(EndpointBase *endpoint, MessageBuffer &buffer);
+    void receive(EndpointBase *endpoint, Message &message);
+    void sendMessage(Message &message, EndpointBase *endpoint = 0);
+    void sendBuffer(const MessageBuffer &buffer, const Address &address);
+
+    // Multicast
+    int multicastLeisure;
+
+    // Resources
+    QHash<QString, Resource *> resourceByPath;
+    QVector<QPair<QByteArray, Resource *> > resourcePaths; ///< utf-8 paths for matching views in place
+    Resource *resourceFor(const Message &request) const;
+    Resource *resourceFor(const MessageView &request) const;
 
     // Classification
+    TokenAllocator *tokenAllocator;
     QByteArray generateUniqueToken();
     quint16 currentMid;
-    QHash<MidAddressPortKey, Exchange *> exchangeByMid;
+    QHash<MidAddressPortKey, Exchange *> exchangeByMid;    ///< CON requests waiting for an ACK
+    /**
+     * @brief rxExchangeAck stamps ExchangeTimings::ackReceived of the request an empty ACK is for
+     * @return false if no exchange waits for it
+     */
+    bool rxExchangeAck(Message::Type type, quint16 messageId, const Address &address);
+    void forgetRequestMid(ExchangePrivate *exchange);
     QHash<QByteArray, Exchange *> exchangeByToken;
 
+    // Request collapsing
+    bool requestCollapsing;
+    QByteArray requestKey(const Message &request) const;
+    QHash<QByteArray, Exchange *> exchangeByRequestKey;
+    QHash<Exchange *, QByteArray> requestKeyByExchange;
+    QHash<Exchange *, QList<Exchange *> > collapsedExchanges; ///< leader -> exchanges waiting for its response
+    QHash<Exchange *, Exchange *> leaderByFollower;
+    QHash<Exchange *, Message> lastNotification;  ///< observing leader -> latest notification, for late followers
+    QList<QPointer<Exchange> > releaseCollapsed(Exchange *leader);
+    void detachCollapsed(Exchange *exchange);
+    void replayNotification(Exchange *follower, Exchange *leader);
+    /**
+     * @brief runLater calls back on the next event loop pass, or the virtual clock's when one is set
+     */
+    void runLater(const std::function<void ()> &call);
+
+    // Deferred responses, piggybacked if the handler answers within ackDelay, separate otherwise
+    int ackDelay;
+    TimerQueue *responseTimers;
+    QHash<QByteArray, DeferredResponse> deferredResponses;  ///< by deferredKey()
+    QHash<MidAddressPortKey, QByteArray> deferredByMid;     ///< by request MID of confirmable requests
+    QHash<MidAddressPortKey, QByteArray> separateByMid;     ///< by MID of the separate response
+    int pendingHandlers;    ///< deferred requests whose handler hasn't responded yet, AdmissionPolicy::maxInFlight
+    static QByteArray deferredKey(const Address &address, const QByteArray &token);
+    void deferResponse(const Message &request);
+    void respondDeferred(const Message &response);
+    bool rxDeferredEmpty(Message::Type type, quint16 messageId, const Address &address);
+    void dropDeferred(const QByteArray &key);
+    void completeDeferred(const QByteArray &key);
+    void _q_on_response_timeout(const QByteArray &key);
+
+    // Offloaded handlers, responses come back from workers through the queue
+    QThreadPool *handlerPool;
+    MpscQueue<Message> postedResponses;
+    QAtomicInt drainScheduled;
+    /**
+     * @brief postResponse respondDeferred() callable from any thread
+     */
+    void postResponse(const Message &response);
+    void _q_drain_responses();
+
+    // Admission, checked before a request is decoded any further than its header
+    AdmissionControl admission;
+    /**
+     * @brief admit returns false if request was shed, 5.03 is already sent then
+     */
+    bool admit(const Address &address, Message::Type type, quint16 messageId,
+               const char *token, int tokenLength, bool multicast);
+
+    // Capture, endpoints record their datagrams into it, @see EndpointBase::setCapture()
+    CaptureWriter *capture;
+
+    // Pollers, their tokens start with poller id
+    QHash<quint16, PollerPrivate *> pollerById;
+
+    // Peers
+    PeerTable peers;
+    Clock clock;                ///< real or VirtualClock time, @see Stack::setClock()
+    quint32 rxCount;            ///< idle peers are expired every few thousand messages
+    void finishInFlight(Exchange *exchange, bool answered);
+
+    // Latency breakdown, 0 unless Stack::setLatencyTracking()
+    LatencyBreakdown *latency;
+    /**
+     * @brief completeTimings stamps the end of a request and adds it to the breakdown,
+     * later notifications of an observation are ignored
+     */
+    void completeTimings(ExchangePrivate *exchange, bool answered);
+
     // Reliability
     TimerQueue *timerQueue;
     void _q_on_timeout(const QByteArray &key);
+    void _q_on_peer_failed(const Address &address);
+    void _q_on_send_failed(const Message &message);
+    /**
+     * @brief failExchange gives up on exchange and its collapsed followers, they get timeout()
+     */
+    void failExchange(Exchange *exchange);
 };
 
 } // coap
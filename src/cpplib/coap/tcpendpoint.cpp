@@ -0,0 +1,367 @@
+#include "tcpendpoint.h"
+#include "endianhelper.h"
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QDebug>
+
+#include <string.h>
+
+namespace iotlib {
+namespace coap {
+
+// advertised in our CSM, peers may send messages up to this size
+static const quint32 maxMessageSize = 8 * 1024 * 1024;
+// RFC8323 5.3.1, assumed until peer's CSM arrives
+static const quint32 defaultMaxMessageSize = 1152;
+
+enum SignalingOption {
+    MaxMessageSize    = 2,
+    BlockWiseTransfer = 4
+};
+
+struct PendingFrame
+{
+    QByteArray frame;
+    Message message; ///< to fail its exchange if the peer can't take it
+};
+
+class TcpConnection
+{
+public:
+    TcpConnection() :
+        socket(0),
+        port(0),
+        csmSent(false),
+        peerCsmReceived(false),
+        peerMaxMessageSize(defaultMaxMessageSize),
+        peerBlockWise(false)
+    { }
+
+    QTcpSocket *socket;
+    QHostAddress address;
+    quint16 port;
+    QByteArray rxBuffer;
+    /// frames waiting for connection to be established, or over the default Max-Message-Size for peer's CSM
+    QList<PendingFrame> pending;
+    bool csmSent;
+    bool peerCsmReceived;
+    quint32 peerMaxMessageSize;
+    bool peerBlockWise;
+};
+
+} // coap
+} // iotlib
+
+iotlib::coap::TcpEndpoint::TcpEndpoint(iotlib::Settings *settings, QObject *parent) :
+    iotlib::coap::EndpointBase(parent), m_settings(settings)
+{
+    m_server = new QTcpServer(this);
+    connect(m_server, &QTcpServer::newConnection,
+            this,     &TcpEndpoint::onNewConnection);
+
+    connect(settings, &Settings::settingsChanged,
+            this,     &TcpEndpoint::onSettingsChanged);
+    onSettingsChanged();
+}
+
+iotlib::coap::TcpEndpoint::~TcpEndpoint()
+{
+    qDeleteAll(m_connections);
+}
+
+QByteArray iotlib::coap::TcpEndpoint::frame(const iotlib::coap::Message &message)
+{
+    QByteArray packed = message.pack();
+    quint8 tokenLength = (quint8)packed[0] & 0x0f;
+    quint32 length = packed.size() - 4 - tokenLength; // options, payload marker and payload
+
+    quint8 extended[4];
+    int extendedSize = 0;
+    quint8 len;
+    if (length < 13) {
+        len = length;
+    } else if (length < 269) {
+        len = 13;
+        extended[0] = length - 13;
+        extendedSize = 1;
+    } else if (length < 65805) {
+        len = 14;
+        endian_store16(extended, length - 269);
+        extendedSize = 2;
+    } else {
+        len = 15;
+        endian_store32(extended, length - 65805);
+        extendedSize = 4;
+    }
+
+    // no Type and Message ID, the rest is the same as in RFC7252
+    QByteArray framed;
+    framed.reserve(packed.size() + extendedSize - 2);
+    framed.append((char)((len << 4) | tokenLength));
+    framed.append((const char *)extended, extendedSize);
+    framed.append(packed.constData() + 1, 1); // code
+    framed.append(packed.constData() + 4, packed.size() - 4);
+    return framed;
+}
+
+bool iotlib::coap::TcpEndpoint::takeFrame(QByteArray &buffer, iotlib::coap::Message &message)
+{
+    if (buffer.size() < 2)
+        return false;
+    const quint8 *p = (const quint8 *)buffer.constData();
+    quint8 len = p[0] >> 4;
+    quint8 tokenLength = p[0] & 0x0f;
+    int extendedSize = len == 13 ? 1 : (len == 14 ? 2 : (len == 15 ? 4 : 0));
+    if (buffer.size() < 2 + extendedSize)
+        return false;
+
+    quint32 length = len;
+    if (len == 13)
+        length = p[1] + 13;
+    else if (len == 14)
+        length = endian_load16(quint32, p + 1) + 269;
+    else if (len == 15)
+        length = endian_load32(quint32, p + 1) + 65805;
+    quint32 frameSize = 2 + extendedSize + tokenLength + length;
+    if ((quint32)buffer.size() < frameSize)
+        return false;
+
+    // rebuild RFC7252 header, so that Message::unpack() can be reused
+    QByteArray packed;
+    packed.resize(4 + tokenLength + length);
+    quint8 *u = (quint8 *)packed.data();
+    u[0] = 0x40 | ((quint8)Message::Type::NonConfirmable << 4) | tokenLength;
+    u[1] = p[1 + extendedSize];
+    u[2] = 0;
+    u[3] = 0;
+    memcpy(u + 4, p + 2 + extendedSize, tokenLength + length);
+    message.unpack(packed);
+    buffer.remove(0, frameSize);
+    return true;
+}
+
+void iotlib::coap::TcpEndpoint::send(const iotlib::coap::Message &coapMessage)
+{
+    PeerKey peer(coapMessage.address().hostAddress(), coapMessage.address().port());
+    TcpConnection *connection = m_connections.value(peer, 0);
+    if (!connection) {
+        QTcpSocket *socket = new QTcpSocket(this);
+        connection = addConnection(socket, peer);
+        connect(socket, &QTcpSocket::connected,
+                this,   &TcpEndpoint::onConnected);
+        socket->connectToHost(peer.first, peer.second);
+    }
+
+    QByteArray framed = frame(coapMessage);
+    if (connection->peerCsmReceived && (quint32)framed.size() > connection->peerMaxMessageSize) {
+        reject(connection, coapMessage, framed.size());
+        return;
+    }
+    write(connection, framed, coapMessage);
+}
+
+void iotlib::coap::TcpEndpoint::onSettingsChanged()
+{
+    bool bind = m_settings->get("bind").toBool();
+    if (!bind) {
+        m_server->close();
+        return;
+    }
+
+    QHostAddress interface(m_settings->get("interface").toString());
+    quint16 port = static_cast<quint16>(m_settings->get("port").toUInt());
+    if (port == 0)
+        port = 5683;
+
+    if (m_server->isListening()) {
+        if (m_server->serverAddress() == interface && m_server->serverPort() == port)
+            return;
+        m_server->close();
+    }
+    if (!m_server->listen(interface, port))
+        qWarning() << "Listen failed:" << m_server->errorString();
+}
+
+void iotlib::coap::TcpEndpoint::onNewConnection()
+{
+    while (m_server->hasPendingConnections()) {
+        QTcpSocket *socket = m_server->nextPendingConnection();
+        TcpConnection *connection = addConnection(socket, PeerKey(socket->peerAddress(), socket->peerPort()));
+        sendCsm(connection);
+    }
+}
+
+void iotlib::coap::TcpEndpoint::onConnected()
+{
+    TcpConnection *connection = m_connectionBySocket.value(qobject_cast<QTcpSocket *>(sender()), 0);
+    if (!connection)
+        return;
+    sendCsm(connection);
+    flushPending(connection);
+}
+
+void iotlib::coap::TcpEndpoint::onReadyRead()
+{
+    TcpConnection *connection = m_connectionBySocket.value(qobject_cast<QTcpSocket *>(sender()), 0);
+    if (!connection)
+        return;
+    QTcpSocket *socket = connection->socket;
+    connection->rxBuffer.append(socket->readAll());
+
+    forever {
+        Message message;
+        if (!takeFrame(connection->rxBuffer, message))
+            break;
+        if (!message.isValid()) {
+            qWarning() << "Malformed message from" << connection->address << ", aborting connection";
+            socket->abort();
+            return;
+        }
+        if (message.isSignaling()) {
+            handleSignaling(connection, message);
+            if (!m_connectionBySocket.contains(socket)) // released or aborted
+                return;
+            continue;
+        }
+        message.setAddress(Address(connection->address, connection->port));
+        deliver(message);
+    }
+
+    if ((quint32)connection->rxBuffer.size() > maxMessageSize + 8) {
+        qWarning() << connection->address << "exceeded Max-Message-Size, aborting connection";
+        socket->abort();
+    }
+}
+
+void iotlib::coap::TcpEndpoint::onDisconnected()
+{
+    dropConnection(qobject_cast<QTcpSocket *>(sender()));
+}
+
+void iotlib::coap::TcpEndpoint::onError(QAbstractSocket::SocketError error)
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    TcpConnection *connection = m_connectionBySocket.value(socket, 0);
+    if (!connection)
+        return;
+    if (error != QAbstractSocket::RemoteHostClosedError)
+        qWarning() << "Connection to" << connection->address << "failed:" << socket->errorString();
+    dropConnection(socket);
+}
+
+void iotlib::coap::TcpEndpoint::dropConnection(QTcpSocket *socket)
+{
+    TcpConnection *connection = m_connectionBySocket.take(socket);
+    if (!connection)
+        return;
+    if (!connection->pending.isEmpty())
+        qWarning() << connection->pending.size() << "messages to" << connection->address << "were not sent";
+    Address peer(connection->address, connection->port);
+    m_connections.remove(PeerKey(connection->address, connection->port));
+    socket->deleteLater();
+    delete connection;
+    // responses come back over the same connection only (RFC8323 3.3)
+    emit peerFailed(peer);
+}
+
+iotlib::coap::TcpConnection *iotlib::coap::TcpEndpoint::addConnection(QTcpSocket *socket, const PeerKey &peer)
+{
+    TcpConnection *connection = new TcpConnection;
+    connection->socket = socket;
+    connection->address = peer.first;
+    connection->port = peer.second;
+    m_connections.insert(peer, connection);
+    m_connectionBySocket.insert(socket, connection);
+    connect(socket, &QTcpSocket::readyRead,
+            this,   &TcpEndpoint::onReadyRead);
+    connect(socket, &QTcpSocket::disconnected,
+            this,   &TcpEndpoint::onDisconnected);
+    connect(socket, static_cast<void (QAbstractSocket::*)(QAbstractSocket::SocketError)>(&QAbstractSocket::error),
+            this,   &TcpEndpoint::onError);
+    return connection;
+}
+
+void iotlib::coap::TcpEndpoint::write(TcpConnection *connection, const QByteArray &frame,
+                                      const iotlib::coap::Message &message)
+{
+    // until peer's CSM arrives only the RFC8323 5.3.1 default is safe, bigger frames wait for it in order
+    bool fits = connection->peerCsmReceived || (quint32)frame.size() <= defaultMaxMessageSize;
+    if (!connection->csmSent || !fits || !connection->pending.isEmpty()) {
+        PendingFrame pending;
+        pending.frame = frame;
+        pending.message = message;
+        connection->pending.append(pending);
+        return;
+    }
+    connection->socket->write(frame);
+}
+
+void iotlib::coap::TcpEndpoint::flushPending(TcpConnection *connection)
+{
+    if (!connection->csmSent)
+        return;
+    while (!connection->pending.isEmpty()) {
+        const PendingFrame &pending = connection->pending.first();
+        quint32 size = pending.frame.size();
+        if (!connection->peerCsmReceived && size > defaultMaxMessageSize)
+            return;
+        if (size > connection->peerMaxMessageSize) {
+            PendingFrame rejected = connection->pending.takeFirst();
+            reject(connection, rejected.message, size);
+            continue;
+        }
+        connection->socket->write(pending.frame);
+        connection->pending.removeFirst();
+    }
+}
+
+void iotlib::coap::TcpEndpoint::reject(TcpConnection *connection, const iotlib::coap::Message &message, int size)
+{
+    qWarning() << "Message of" << size << "bytes exceeds Max-Message-Size" << connection->peerMaxMessageSize
+               << "of" << connection->address;
+    emit sendFailed(message);
+}
+
+void iotlib::coap::TcpEndpoint::sendCsm(TcpConnection *connection)
+{
+    Message csm;
+    csm.setCode(Message::Code::Csm);
+    csm.addOption((Message::OptionType)MaxMessageSize, pack_uint(maxMessageSize));
+    csm.addOption((Message::OptionType)BlockWiseTransfer);
+    connection->socket->write(frame(csm)); // must be the first message on the connection
+    connection->csmSent = true;
+}
+
+void iotlib::coap::TcpEndpoint::handleSignaling(TcpConnection *connection, const iotlib::coap::Message &message)
+{
+    switch (message.code()) {
+    case Message::Code::Csm:
+        foreach (const Option &option, message.options()) {
+            if ((int)option.type() == MaxMessageSize)
+                connection->peerMaxMessageSize = unpack_uint(option.data());
+            else if ((int)option.type() == BlockWiseTransfer)
+                connection->peerBlockWise = true;
+        }
+        connection->peerCsmReceived = true;
+        flushPending(connection);
+        break;
+    case Message::Code::Ping: {
+        Message pong;
+        pong.setCode(Message::Code::Pong);
+        pong.setToken(message.token());
+        connection->socket->write(frame(pong));
+        break;
+    }
+    case Message::Code::Pong:
+        break;
+    case Message::Code::Release:
+        connection->socket->disconnectFromHost();
+        break;
+    case Message::Code::Abort:
+        connection->socket->abort();
+        break;
+    default:
+        qWarning() << "Unknown signaling message" << message;
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef TCPENDPOINT_H
+#define TCPENDPOINT_H
+
+#include "endpointbase.hpp"
+#include "../settings.h"
+
+#include <QObject>
+#include <QHash>
+#include <QPair>
+#include <QHostAddress>
+#include <QAbstractSocket>
+
+class QTcpServer;
+class QTcpSocket;
+
+namespace iotlib {
+namespace coap {
+
+class TcpConnection;
+
+/**
+ * @brief The TcpEndpoint class carries CoAP over TCP (RFC8323)
+ * One connection is kept per peer and shared by all the exchanges with it,
+ * connections are made on first send or accepted when "bind" setting is true.
+ * Signaling messages (CSM, Ping/Pong, Release, Abort) are handled here and never reach the stack.
+ */
+class TcpEndpoint : public EndpointBase
+{
+    Q_OBJECT
+public:
+    TcpEndpoint(Settings *settings, QObject *parent = 0);
+    ~TcpEndpoint();
+
+    QString scheme() const { return QStringLiteral("coap+tcp"); }
+    bool isReliable() const { return true; }
+
+    /**
+     * @brief frame packs message into RFC8323 3.2 framing: Len/TKL, extended length, code, token, options, payload
+     */
+    static QByteArray frame(const Message &message);
+    /**
+     * @brief takeFrame removes first complete frame from buffer
+     * @return false if buffer doesn't contain whole frame yet
+     */
+    static bool takeFrame(QByteArray &buffer, Message &message);
+
+public slots:
+     void send(const Message &coapMessage);
+
+private slots:
+    void onSettingsChanged();
+    void onNewConnection();
+    void onConnected();
+    void onReadyRead();
+    void onDisconnected();
+    void onError(QAbstractSocket::SocketError error);
+
+private:
+    typedef QPair<QHostAddress, quint16> PeerKey;
+
+    TcpConnection *addConnection(QTcpSocket *socket, const PeerKey &peer);
+    /**
+     * @brief dropConnection forgets connection of socket, unsent frames are dropped and peerFailed() is emitted
+     */
+    void dropConnection(QTcpSocket *socket);
+    /**
+     * @brief write sends frame or queues it until our CSM is out and, if it's over 1152 bytes, peer's CSM is in
+     */
+    void write(TcpConnection *connection, const QByteArray &frame, const Message &message);
+    void flushPending(TcpConnection *connection);
+    /**
+     * @brief reject drops message too big for peer's Max-Message-Size and emits sendFailed()
+     */
+    void reject(TcpConnection *connection, const Message &message, int size);
+    void sendCsm(TcpConnection *connection);
+    void handleSignaling(TcpConnection *connection, const Message &message);
+
+    Settings *m_settings;
+    QTcpServer *m_server;
+    QHash<PeerKey, TcpConnection *> m_connections;
+    QHash<QTcpSocket *, TcpConnection *> m_connectionBySocket;
+};
+
+} // coap
+} // iotlib
+
+#endif // TCPENDPOINT_H
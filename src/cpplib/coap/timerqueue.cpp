@@ -1,21 +1,34 @@
 #include <QBasicTimer>
-#include <QDateTime>
+#include <QVector>
+#include <QPointer>
 #include <QDebug>
 
 #include "timerqueue.hpp"
+#include "virtualclock.hpp"
 
 namespace iotlib {
 namespace coap {
 
 typedef struct {
-    QDateTime dt;
+    qint64 at;          ///< nsec on TimerQueuePrivate::clock
     QByteArray key;
 } coap_timer_t;
 
+}
+}
+
+Q_DECLARE_TYPEINFO(iotlib::coap::coap_timer_t, Q_MOVABLE_TYPE);
+
+namespace iotlib {
+namespace coap {
+
 class TimerQueuePrivate {
 public:
     QBasicTimer timer;
-    QList<coap_timer_t> queue;
+    QVector<coap_timer_t> queue;    ///< keeps its capacity, adding and removing don't allocate
+    Clock clock;
+    qint64 armedAt;     ///< deadline the timer or wake up is set for, -1 if none
+    quint64 wakeUp;     ///< VirtualClock event of the pending wake up, 0 if none
 };
 
 }
@@ -25,7 +38,9 @@ public:
 iotlib::coap::TimerQueue::TimerQueue(QObject *parent) :
     QObject(parent), d(new iotlib::coap::TimerQueuePrivate)
 {
-
+    d->clock.start();
+    d->armedAt = -1;
+    d->wakeUp = 0;
 }
 
 iotlib::coap::TimerQueue::~TimerQueue()
@@ -38,18 +53,14 @@ iotlib::coap::TimerQueue::~TimerQueue()
 
 void iotlib::coap::TimerQueue::addTimer(quint32 msec, const QByteArray &key)
 {
-    QDateTime dt = QDateTime::currentDateTime().addMSecs(msec);
-    int idx = 0;
-    for (; idx < d->queue.size(); ++idx) {
-        if (dt < d->queue[idx].dt)
-            break;
-        if (idx == d->queue.size() - 1)
-            idx += 1; // after last one
-    }
-    coap_timer_t timer{dt, key};
+    qint64 at = d->clock.nsecsElapsed() + qint64(msec) * 1000000;
+    int idx = d->queue.size();
+    while (idx > 0 && at < d->queue[idx - 1].at) // mostly appended, timeouts grow
+        --idx;
+    coap_timer_t timer{at, key};
     d->queue.insert(idx, timer);
     if (idx == 0)
-        d->timer.start(msec, this);
+        arm();
 }
 
 void iotlib::coap::TimerQueue::removeTimer(const QByteArray &key)
@@ -60,29 +71,62 @@ void iotlib::coap::TimerQueue::removeTimer(const QByteArray &key)
             break;
     if (i == d->queue.size())
         return;
-    if (i != 0) {
-        d->queue.removeAt(i);
-        return;
-    }
-    d->queue.pop_front();
-    if (d->queue.isEmpty()) {
-        d->timer.stop();
-    } else {
-        qint64 msec = QDateTime::currentDateTime().msecsTo(d->queue.front().dt);
-        d->timer.start(msec, this);
-    }
+    d->queue.remove(i); // armed for the old head still, fire() re-arms if that is too early
+}
+
+void iotlib::coap::TimerQueue::setClock(iotlib::coap::VirtualClock *clock)
+{
+    d->queue.clear();
+    d->timer.stop();
+    d->armedAt = -1;
+    if (d->wakeUp)
+        d->clock.virtualClock()->cancel(d->wakeUp);
+    d->wakeUp = 0;
+    d->clock.setVirtual(clock);
 }
 
 void iotlib::coap::TimerQueue::timerEvent(QTimerEvent *e)
 {
     Q_UNUSED(e);
-    coap_timer_t &timer = d->queue.front();
-    emit timeout(timer.key);
-    d->timer.stop();
-    d->queue.pop_front();
-    if (!d->queue.isEmpty()) {
-        qint64 msec = QDateTime::currentDateTime().msecsTo(d->queue.front().dt);
-        d->timer.start(msec, this);
+    fire();
+}
+
+void iotlib::coap::TimerQueue::arm()
+{
+    // restarting QBasicTimer registers a timer with the dispatcher, which allocates, so an early
+    // wake up is left alone and fire() looks again, only an earlier head re-arms
+    if (d->queue.isEmpty() || (d->armedAt >= 0 && d->armedAt <= d->queue.front().at))
+        return;
+    d->armedAt = d->queue.front().at;
+    qint64 nsec = qMax<qint64>(0, d->armedAt - d->clock.nsecsElapsed());
+    VirtualClock *clock = d->clock.virtualClock();
+    if (!clock) {
+        d->timer.start(int((nsec + 999999) / 1000000), this);
+        return;
     }
+    if (d->wakeUp) // later one, the heap would otherwise keep every superseded wake up
+        clock->cancel(d->wakeUp);
+    QPointer<TimerQueue> guard(this);
+    d->wakeUp = clock->schedule(nsec, [guard]() {
+        if (!guard)
+            return;
+        guard->d->wakeUp = 0;
+        guard->fire();
+    });
 }
 
+void iotlib::coap::TimerQueue::fire()
+{
+    d->timer.stop();
+    d->armedAt = -1;
+    if (d->queue.isEmpty())
+        return;
+    if (d->queue.front().at > d->clock.nsecsElapsed()) { // armed for a timer removed since
+        arm();
+        return;
+    }
+    QByteArray key = d->queue.front().key;
+    d->queue.removeFirst();
+    arm(); // before the signal, receivers add and remove timers
+    emit timeout(key);
+}
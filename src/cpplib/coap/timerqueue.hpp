@@ -9,6 +9,7 @@ namespace iotlib {
 namespace coap {
 
 class TimerQueuePrivate;
+class VirtualClock;
 class TimerQueue : public QObject
 {
     Q_OBJECT
@@ -22,6 +23,10 @@ public:
      */
     void addTimer(quint32 msec, const QByteArray &key);
     void removeTimer(const QByteArray &key);
+    /**
+     * @brief setClock runs timers on simulated time, 0 for real time, pending timers are dropped
+     */
+    void setClock(VirtualClock *clock);
 
 signals:
     void timeout(const QByteArray &key);
@@ -32,6 +37,9 @@ protected:
     void timerEvent(QTimerEvent *e);
 
 private:
+    void arm();
+    void fire();
+
     TimerQueuePrivate *d;
 };
 
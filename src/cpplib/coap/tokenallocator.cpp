@@ -0,0 +1,126 @@
+#include "tokenallocator.hpp"
+
+#include <random>
+
+namespace {
+const int ROUNDS = 6;
+
+quint64 mix(quint64 x)
+{
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= Q_UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 27;
+    x *= Q_UINT64_C(0x94d049bb133111eb);
+    x ^= x >> 31;
+    return x;
+}
+
+quint64 lowBits(int bits)
+{
+    return bits >= 64 ? ~Q_UINT64_C(0) : (Q_UINT64_C(1) << bits) - 1;
+}
+}
+
+iotlib::coap::TokenAllocator::TokenAllocator(int length, int shardBits) :
+    m_length(qBound(0, length, 8)),
+    m_wrapped(0)
+{
+    int bits = m_length * 8;
+    m_shardBits = bits ? qBound(0, shardBits, qMin(8, bits - 1)) : 0;
+    m_counterBits = bits - m_shardBits;
+    m_halfBits = bits / 2;
+
+    std::random_device random;
+    for (int i = 0; i < ROUNDS; ++i)
+        m_keys[i] = (quint64(random()) << 32) ^ random();
+
+    m_shards = new Shard[1 << m_shardBits];
+    for (int i = 0; i < (1 << m_shardBits); ++i)
+        m_shards[i].counter.store(0);
+}
+
+iotlib::coap::TokenAllocator::~TokenAllocator()
+{
+    delete [] m_shards;
+}
+
+int iotlib::coap::TokenAllocator::length() const
+{
+    return m_length;
+}
+
+int iotlib::coap::TokenAllocator::shardCount() const
+{
+    return 1 << m_shardBits;
+}
+
+void iotlib::coap::TokenAllocator::write(char *out, int shard)
+{
+    if (!m_length)
+        return;
+    shard &= shardCount() - 1;
+    quint64 counter = m_shards[shard].counter.fetchAndAddRelaxed(1);
+    if (m_counterBits < 64 && (counter >> m_counterBits))
+        m_wrapped.store(1);
+
+    quint64 value = permute(quint64(shard) << m_counterBits | (counter & lowBits(m_counterBits)));
+    for (int i = m_length - 1; i >= 0; --i, value >>= 8)
+        out[i] = char(value & 0xff);
+}
+
+QByteArray iotlib::coap::TokenAllocator::next(int shard)
+{
+    QByteArray token(m_length, Qt::Uninitialized);
+    write(token.data(), shard);
+    return token;
+}
+
+int iotlib::coap::TokenAllocator::shard(const QByteArray &token) const
+{
+    if (token.size() != m_length)
+        return -1;
+    if (!m_shardBits)
+        return 0;
+    quint64 value = 0;
+    for (int i = 0; i < m_length; ++i)
+        value = value << 8 | quint8(token[i]);
+    return int(unpermute(value) >> m_counterBits);
+}
+
+bool iotlib::coap::TokenAllocator::hasWrapped() const
+{
+    return m_wrapped.load();
+}
+
+quint64 iotlib::coap::TokenAllocator::round(int r, quint64 half) const
+{
+    return mix(half ^ m_keys[r]) & lowBits(m_halfBits);
+}
+
+quint64 iotlib::coap::TokenAllocator::permute(quint64 value) const
+{
+    // balanced Feistel network, token length in bits is always even
+    quint64 mask = lowBits(m_halfBits);
+    quint64 left = (value >> m_halfBits) & mask;
+    quint64 right = value & mask;
+    for (int r = 0; r < ROUNDS; ++r) {
+        quint64 next = left ^ round(r, right);
+        left = right;
+        right = next;
+    }
+    return left << m_halfBits | right;
+}
+
+quint64 iotlib::coap::TokenAllocator::unpermute(quint64 value) const
+{
+    quint64 mask = lowBits(m_halfBits);
+    quint64 left = (value >> m_halfBits) & mask;
+    quint64 right = value & mask;
+    for (int r = ROUNDS - 1; r >= 0; --r) {
+        quint64 previous = right ^ round(r, left);
+        right = left;
+        left = previous;
+    }
+    return left << m_halfBits | right;
+}
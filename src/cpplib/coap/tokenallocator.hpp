@@ -0,0 +1,74 @@
+#ifndef COAP_TOKENALLOCATOR_H
+#define COAP_TOKENALLOCATOR_H
+
+#include "../iotlib_global.h"
+
+#include <QByteArray>
+#include <QAtomicInteger>
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The TokenAllocator class hands out tokens that are unique and hard to guess (RFC7252 5.3.1)
+ * Token is a per shard counter with shard id in the top bits, passed through keyed Feistel permutation
+ * over the whole token length. Permutation is a bijection, so tokens don't repeat until shard counter
+ * wraps around and no lookup is needed, while off-path attacker without the key can't predict the next one.
+ * Shard id comes back with shard(), threads allocating from their own shard never touch the same counter.
+ * Thread safe.
+ */
+class IOTLIB_SHARED_EXPORT TokenAllocator
+{
+public:
+    /**
+     * @param length token length in bytes, 0..8
+     * @param shardBits number of top bits holding shard id, up to 8 and less than length * 8
+     */
+    explicit TokenAllocator(int length = 4, int shardBits = 0);
+    ~TokenAllocator();
+
+    int length() const;
+    int shardCount() const;
+
+    /**
+     * @brief write puts next token of shard into out, length() bytes
+     */
+    void write(char *out, int shard = 0);
+    QByteArray next(int shard = 0);
+
+    /**
+     * @brief shard returns shard token was allocated from, -1 if it's not one of ours by length
+     */
+    int shard(const QByteArray &token) const;
+
+    /**
+     * @brief hasWrapped returns true once any shard used up it's counter space,
+     * from then on tokens may repeat ones that are still in use
+     */
+    bool hasWrapped() const;
+
+private:
+    Q_DISABLE_COPY(TokenAllocator)
+
+    struct Shard {
+        QAtomicInteger<quint64> counter;
+        char padding[64 - sizeof(QAtomicInteger<quint64>)]; ///< one cache line per shard
+    };
+
+    quint64 permute(quint64 value) const;
+    quint64 unpermute(quint64 value) const;
+    quint64 round(int r, quint64 half) const;
+
+    int m_length;
+    int m_shardBits;
+    int m_counterBits;
+    int m_halfBits;
+    quint64 m_keys[6];
+    Shard *m_shards;
+    QAtomicInt m_wrapped;
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_TOKENALLOCATOR_H
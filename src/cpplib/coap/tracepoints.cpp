@@ -0,0 +1,15 @@
+#include "tracepoints.hpp"
+
+// a tracer increments the semaphore while it is attached to the probe, tools find them in ".probes"
+#define IOTLIB_TRACE_DEFINE(name) \
+    volatile unsigned short IOTLIB_TRACE_SEMAPHORE(name) __attribute__((section(".probes"))) = 0
+
+extern "C" {
+IOTLIB_TRACE_DEFINE(rx);
+IOTLIB_TRACE_DEFINE(decoded);
+IOTLIB_TRACE_DEFINE(tx);
+IOTLIB_TRACE_DEFINE(retransmit);
+IOTLIB_TRACE_DEFINE(give_up);
+IOTLIB_TRACE_DEFINE(ack_matched);
+IOTLIB_TRACE_DEFINE(exchange_completed);
+}
@@ -0,0 +1,123 @@
+#ifndef COAP_TRACEPOINTS_H
+#define COAP_TRACEPOINTS_H
+
+/*
+ * USDT probes of provider "iotlib" for bpftrace, perf and SystemTap, built in with qmake CONFIG+=usdt
+ * (needs sys/sdt.h, systemtap-sdt-dev or systemtap-sdt-devel). A probe site is a nop, and its arguments
+ * are only evaluated while a tracer has set the probe's semaphore, so attached or not nothing is
+ * formatted. Without usdt IOTLIB_TRACE() expands to nothing. Example scripts in examples/bpftrace.
+ *
+ *   rx                  size, peer ip (16 bytes, IPv4 v4-mapped), peer port
+ *   decoded             type, code, message id, token, token length
+ *   tx                  type, code, message id, token, token length, size, peer ip, peer port
+ *   retransmit          token, token length, retransmission 1..3, next timeout msec
+ *   give_up             token, token length, usec since first transmission
+ *   ack_matched         message id, token, token length, piggybacked, usec since last transmission
+ *   exchange_completed  token, token length, answered, usec since the exchange was created
+ */
+
+#ifdef IOTLIB_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#include "message.hpp"
+#include "messagebuffer.hpp"
+
+#define IOTLIB_TRACE_SEMAPHORE(name) iotlib_##name##_semaphore
+
+// unmangled, the probe notes refer to them by name; hidden, so they resolve inside the library
+#define IOTLIB_TRACE_DECLARE(name) \
+    extern volatile unsigned short IOTLIB_TRACE_SEMAPHORE(name) __attribute__((visibility("hidden")))
+
+extern "C" {
+IOTLIB_TRACE_DECLARE(rx);
+IOTLIB_TRACE_DECLARE(decoded);
+IOTLIB_TRACE_DECLARE(tx);
+IOTLIB_TRACE_DECLARE(retransmit);
+IOTLIB_TRACE_DECLARE(give_up);
+IOTLIB_TRACE_DECLARE(ack_matched);
+IOTLIB_TRACE_DECLARE(exchange_completed);
+}
+
+/**
+ * IOTLIB_TRACE(name, ...) fires probe name with arguments made by iotlib::coap::trace::name(...)
+ */
+#define IOTLIB_TRACE(name, ...) \
+    do { \
+        if (Q_UNLIKELY(IOTLIB_TRACE_SEMAPHORE(name))) \
+            iotlib::coap::trace::name(__VA_ARGS__); \
+    } while (0)
+
+namespace iotlib {
+namespace coap {
+namespace trace {
+
+inline void rx(int size, const Address &peer)
+{
+    STAP_PROBEV(iotlib, rx, size, peer.ip(), peer.port());
+}
+
+inline void decoded(int type, int code, quint16 messageId, const char *token, int tokenLength)
+{
+    STAP_PROBEV(iotlib, decoded, type, code, messageId, token, tokenLength);
+}
+inline void decoded(const MessageView &view)
+{
+    decoded(int(view.type()), int(view.code()), view.messageId(), view.token(), view.tokenLength());
+}
+inline void decoded(const Message &message)
+{
+    QByteArray token = message.token();
+    decoded(int(message.type()), int(message.code()), message.messageId(), token.constData(), token.size());
+}
+
+/**
+ * @param data packed message, header and token are read from it
+ */
+inline void tx(const char *data, int size, const Address &peer)
+{
+    if (size < 4)
+        return;
+    const quint8 *header = (const quint8 *)data;
+    int tokenLength = qMin(header[0] & 0xf, size - 4);
+    STAP_PROBEV(iotlib, tx, (header[0] >> 4) & 0x3, header[1], quint16(header[2] << 8 | header[3]),
+            data + 4, tokenLength, size, peer.ip(), peer.port());
+}
+inline void tx(const Message &message)
+{
+    QByteArray packed = message.pack();
+    tx(packed.constData(), packed.size(), message.address());
+}
+
+inline void retransmit(const QByteArray &token, int retransmission, quint32 timeout)
+{
+    STAP_PROBEV(iotlib, retransmit, token.constData(), token.size(), retransmission, timeout);
+}
+
+inline void give_up(const QByteArray &token, qint64 elapsed)
+{
+    STAP_PROBEV(iotlib, give_up, token.constData(), token.size(), elapsed);
+}
+
+inline void ack_matched(quint16 messageId, const QByteArray &token, bool piggybacked, qint64 elapsed)
+{
+    STAP_PROBEV(iotlib, ack_matched, messageId, token.constData(), token.size(), int(piggybacked), elapsed);
+}
+
+inline void exchange_completed(const QByteArray &token, bool answered, qint64 elapsed)
+{
+    STAP_PROBEV(iotlib, exchange_completed, token.constData(), token.size(), int(answered), elapsed);
+}
+
+} // trace
+} // coap
+} // iotlib
+
+#else
+
+#define IOTLIB_TRACE(name, ...) do { } while (0)
+
+#endif // IOTLIB_USDT
+
+#endif // COAP_TRACEPOINTS_H
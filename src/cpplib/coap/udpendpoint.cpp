@@ -1,9 +1,26 @@
 #include "udpendpoint.h"
 
 #include <QUdpSocket>
+#include <QNetworkInterface>
+#include <QSocketNotifier>
+#include <QTimer>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#endif
 
 iotlib::coap::UdpEndpoint::UdpEndpoint(iotlib::Settings *settings, QObject *parent) :
-    iotlib::coap::EndpointBase(parent), m_settings(settings)
+    iotlib::coap::EndpointBase(parent),
+    m_sendQueueCapacity(256),
+    m_dropPolicy(DropPolicy::DropOldestNonConfirmable),
+    m_congested(false),
+    m_writeNotifier(0),
+    m_settings(settings),
+    m_multicastSocket(0)
 {
     m_socket = new QUdpSocket(this);
     connect(m_socket, &QUdpSocket::readyRead,
@@ -18,9 +35,143 @@ void iotlib::coap::UdpEndpoint::send(const iotlib::coap::Message &coapMessage)
     QByteArray packed = coapMessage.pack();
     qDebug() << "Sending datagram to" << coapMessage.address().hostAddress()
              << coapMessage.address().port();
-    m_socket->writeDatagram(packed,
-                            coapMessage.address().hostAddress(),
-                            coapMessage.address().port());
+    sendPacked(packed.constData(), packed.size(), coapMessage.address());
+}
+
+void iotlib::coap::UdpEndpoint::sendPacked(const char *data, int size, const iotlib::coap::Address &address)
+{
+    // queued ones go first, otherwise a burst would overtake what's waiting
+    if (m_sendStats.depth == 0 && write(data, size, address))
+        return;
+    enqueue(data, size, address);
+}
+
+void iotlib::coap::UdpEndpoint::setSendQueueCapacity(int capacity)
+{
+    m_sendQueueCapacity = qMax(1, capacity);
+}
+
+int iotlib::coap::UdpEndpoint::sendQueueCapacity() const
+{
+    return m_sendQueueCapacity;
+}
+
+void iotlib::coap::UdpEndpoint::setDropPolicy(iotlib::coap::UdpEndpoint::DropPolicy policy)
+{
+    m_dropPolicy = policy;
+}
+
+iotlib::coap::UdpEndpoint::DropPolicy iotlib::coap::UdpEndpoint::dropPolicy() const
+{
+    return m_dropPolicy;
+}
+
+iotlib::coap::SendQueueStats iotlib::coap::UdpEndpoint::sendQueueStats() const
+{
+    return m_sendStats;
+}
+
+bool iotlib::coap::UdpEndpoint::isCongested() const
+{
+    return m_congested;
+}
+
+bool iotlib::coap::UdpEndpoint::write(const char *data, int size, const iotlib::coap::Address &address)
+{
+    if (m_socket->writeDatagram(data, size, address.hostAddress(), address.port()) >= 0) {
+        captureDatagram(CaptureRecord::Sent, data, size, address);
+        return true;
+    }
+    if (m_socket->error() == QAbstractSocket::DatagramTooLargeError) { // would never go out, don't queue it
+        qWarning() << "Datagram of" << size << "bytes is too large for" << address.hostAddress();
+        ++m_sendStats.dropped;
+        return true;
+    }
+    return false;
+}
+
+void iotlib::coap::UdpEndpoint::enqueue(const char *data, int size, const iotlib::coap::Address &address)
+{
+    quint8 type = size > 1 ? (quint8(data[0]) >> 4) & 0x3 : 0;
+    Priority priority = NonConfirmable;
+    if (type >= 2) // ACK or RST, stops the peer's retransmissions
+        priority = Control;
+    else if (type == 0)
+        priority = Confirmable;
+
+    if (priority != Control && m_sendStats.depth >= m_sendQueueCapacity) {
+        if (m_dropPolicy == DropPolicy::DropOldestNonConfirmable && !m_sendQueue[NonConfirmable].isEmpty()) {
+            m_sendQueue[NonConfirmable].dequeue();
+            --m_sendStats.depth;
+            ++m_sendStats.dropped;
+        } else {
+            ++m_sendStats.dropped;
+            if (priority == Confirmable)
+                ++m_sendStats.droppedConfirmable;
+            return;
+        }
+    }
+
+    QueuedDatagram datagram;
+    datagram.data = QByteArray(data, size);
+    datagram.address = address;
+    m_sendQueue[priority].enqueue(datagram);
+    ++m_sendStats.queued;
+    ++m_sendStats.depth;
+    m_sendStats.maxDepth = qMax(m_sendStats.maxDepth, m_sendStats.depth);
+    if (m_sendStats.depth >= m_sendQueueCapacity * 3 / 4)
+        setCongested(true);
+
+    qintptr descriptor = m_socket->socketDescriptor();
+    if (descriptor < 0) { // nothing to wait on, try again a bit later
+        QTimer::singleShot(10, this, SLOT(onWritable()));
+        return;
+    }
+    if (m_writeNotifier && m_writeNotifier->socket() != descriptor) { // socket was rebound
+        delete m_writeNotifier;
+        m_writeNotifier = 0;
+    }
+    if (!m_writeNotifier) {
+        m_writeNotifier = new QSocketNotifier(descriptor, QSocketNotifier::Write, this);
+        connect(m_writeNotifier, SIGNAL(activated(int)),
+                this,            SLOT(onWritable()));
+    }
+    m_writeNotifier->setEnabled(true);
+}
+
+void iotlib::coap::UdpEndpoint::onWritable()
+{
+    int written = 0;
+    for (int p = Control; p < PriorityCount; ++p) {
+        QQueue<QueuedDatagram> &queue = m_sendQueue[p];
+        while (!queue.isEmpty()) {
+            const QueuedDatagram &datagram = queue.head();
+            if (!write(datagram.data.constData(), datagram.data.size(), datagram.address)) {
+                if (written) // socket buffer is full again, wait for the next notification
+                    return;
+                // failed right after the socket reported space, not a full buffer
+                qWarning() << "Dropping datagram to" << datagram.address.hostAddress() << ":" << m_socket->errorString();
+                ++m_sendStats.dropped;
+                if (p == Confirmable)
+                    ++m_sendStats.droppedConfirmable;
+            } else {
+                ++written;
+            }
+            queue.dequeue();
+            --m_sendStats.depth;
+        }
+    }
+    if (m_writeNotifier)
+        m_writeNotifier->setEnabled(false);
+    setCongested(false);
+}
+
+void iotlib::coap::UdpEndpoint::setCongested(bool congested)
+{
+    if (m_congested == congested)
+        return;
+    m_congested = congested;
+    emit congestionChanged(congested);
 }
 
 void iotlib::coap::UdpEndpoint::onSettingsChanged()
@@ -35,6 +186,11 @@ void iotlib::coap::UdpEndpoint::onSettingsChanged()
     quint16 port = static_cast<quint16>(m_settings->get("port").toUInt());
 
     if (m_socket->localAddress() != interface || m_socket->localPort() != port) {
+        if (m_settings->get("reuse_port").toBool() && port != 0) {
+            if (!bindSharedPort(interface, port))
+                qWarning() << "Bind with port reuse failed:" << m_socket->errorString();
+            return;
+        }
         if (port == 0) {
             port = 42400;
             while (!m_socket->bind(interface, port))
@@ -47,20 +203,112 @@ void iotlib::coap::UdpEndpoint::onSettingsChanged()
     }
 }
 
+bool iotlib::coap::UdpEndpoint::bindSharedPort(const QHostAddress &interface, quint16 port)
+{
+#if defined(Q_OS_UNIX) && defined(SO_REUSEPORT)
+    // QUdpSocket::ShareAddress is only SO_REUSEADDR on Linux, which doesn't spread datagrams
+    bool v4 = interface.protocol() == QAbstractSocket::IPv4Protocol;
+    int fd = ::socket(v4 ? AF_INET : AF_INET6, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return false;
+    int on = 1;
+    int off = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    sockaddr_in6 local;
+    socklen_t localLength;
+    memset(&local, 0, sizeof(local));
+    Address address = interface.isNull() ? Address(QHostAddress(QHostAddress::AnyIPv6), port) : Address(interface, port);
+    if (v4) {
+        sockaddr_in *in = (sockaddr_in *)&local;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        memcpy(&in->sin_addr, address.ip() + 12, 4);
+        localLength = sizeof(sockaddr_in);
+    } else {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)); // dual stack like QHostAddress::Any
+        local.sin6_family = AF_INET6;
+        local.sin6_port = htons(port);
+        local.sin6_scope_id = address.scopeId();
+        memcpy(&local.sin6_addr, address.ip(), 16);
+        localLength = sizeof(sockaddr_in6);
+    }
+    if (::bind(fd, (const sockaddr *)&local, localLength) < 0) {
+        ::close(fd);
+        return false;
+    }
+    m_socket->abort();
+    return m_socket->setSocketDescriptor(fd, QAbstractSocket::BoundState);
+#else
+    return m_socket->bind(interface, port, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint);
+#endif
+}
+
+bool iotlib::coap::UdpEndpoint::joinMulticastGroup(const QHostAddress &groupAddress,
+                                                   const QNetworkInterface &iface)
+{
+    if (!m_multicastSocket) {
+        QVariant portSetting = m_settings->get("multicast_port");
+        quint16 port = portSetting.isValid() ? static_cast<quint16>(portSetting.toUInt()) : 5683;
+        QHostAddress any = groupAddress.protocol() == QAbstractSocket::IPv6Protocol ?
+                    QHostAddress::AnyIPv6 : QHostAddress::AnyIPv4;
+        m_multicastSocket = new QUdpSocket(this);
+        if (!m_multicastSocket->bind(any, port, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)) {
+            qWarning() << "Multicast bind failed:" << m_multicastSocket->errorString();
+            delete m_multicastSocket;
+            m_multicastSocket = 0;
+            return false;
+        }
+        connect(m_multicastSocket, &QUdpSocket::readyRead,
+                this,              &UdpEndpoint::onMulticastReadyRead);
+    }
+
+    bool joined = iface.isValid() ?
+                m_multicastSocket->joinMulticastGroup(groupAddress, iface) :
+                m_multicastSocket->joinMulticastGroup(groupAddress);
+    if (!joined)
+        qWarning() << "Can't join" << groupAddress << ":" << m_multicastSocket->errorString();
+    return joined;
+}
+
 void iotlib::coap::UdpEndpoint::onReadyRead()
 {
-    while (m_socket->hasPendingDatagrams()) {
-        QByteArray datagram;
-        datagram.resize(static_cast<int>(m_socket->pendingDatagramSize()));
+    readDatagrams(m_socket, false);
+}
+
+void iotlib::coap::UdpEndpoint::onMulticastReadyRead()
+{
+    readDatagrams(m_multicastSocket, true);
+}
+
+void iotlib::coap::UdpEndpoint::readDatagrams(QUdpSocket *socket, bool multicast)
+{
+    while (socket->hasPendingDatagrams()) {
         QHostAddress from;
         quint16 fromPort;
-        m_socket->readDatagram(datagram.data(), datagram.size(),
-                                &from, &fromPort);
+        if (socket->pendingDatagramSize() <= MessageBuffer::Capacity) {
+            MessageBuffer buffer = MessageBuffer::allocate();
+            qint64 size = socket->readDatagram(buffer.data(), buffer.capacity(), &from, &fromPort);
+            if (size < 0)
+                continue;
+            Address address(from, fromPort);
+            captureDatagram(CaptureRecord::Received, buffer.data(), int(size), address);
+            buffer.setSize(int(size));
+            deliverDatagram(buffer, address, multicast);
+            continue;
+        }
+
+        QByteArray datagram;
+        datagram.resize(static_cast<int>(socket->pendingDatagramSize()));
+        if (socket->readDatagram(datagram.data(), datagram.size(), &from, &fromPort) < 0)
+            continue;
+        Address address(from, fromPort);
+        captureDatagram(CaptureRecord::Received, datagram.constData(), datagram.size(), address);
         Message message;
         message.unpack(datagram);
-        message.setAddress(Address(from, fromPort));
+        message.setAddress(address);
+        message.setMulticast(multicast);
         qDebug() << "Processing incoming pdu from:" << from.toString() << message;
         if (message.isValid())
-            emit received(message);
+            deliver(message);
     }
 }
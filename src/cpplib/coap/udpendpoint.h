@@ -5,28 +5,112 @@
 #include "../settings.h"
 
 #include <QObject>
+#include <QQueue>
 
 class QUdpSocket;
+class QSocketNotifier;
+class QHostAddress;
+class QNetworkInterface;
 
 namespace iotlib {
 namespace coap {
 
+/**
+ * @brief The SendQueueStats struct describes UdpEndpoint outgoing queue
+ */
+struct SendQueueStats
+{
+    SendQueueStats() : depth(0), maxDepth(0), queued(0), dropped(0), droppedConfirmable(0) { }
+
+    int depth;                  ///< datagrams waiting for the socket now
+    int maxDepth;               ///< high watermark since the endpoint was created
+    quint64 queued;             ///< datagrams that didn't go out on the first attempt
+    quint64 dropped;            ///< by the drop policy, including droppedConfirmable
+    quint64 droppedConfirmable;
+};
+
+/**
+ * @brief The UdpEndpoint class carries coap:// over QUdpSocket
+ * Settings: "bind", "interface", "port" (some free port from 42400 if 0), "multicast_port",
+ * "reuse_port" lets several endpoints, usually one per thread and Stack, bind the same port,
+ * the kernel spreads peers over them (SO_REUSEPORT)
+ */
 class UdpEndpoint : public EndpointBase
 {
     Q_OBJECT
 public:
     UdpEndpoint(Settings *settings, QObject *parent = 0);
 
+    /**
+     * @brief The DropPolicy enum decides what goes when the send queue is full.
+     * ACKs, piggybacked responses included, and RSTs are never dropped, they may exceed the capacity:
+     * the peer would retransmit its CON and the handler would run again for a dropped response
+     */
+    enum class DropPolicy {
+        DropOldestNonConfirmable,   ///< evict the oldest NON, drop the new message if there is none, default
+        DropNewest                  ///< keep the queue, drop the new message
+    };
+
+    /**
+     * @brief setSendQueueCapacity Datagrams kept while the socket buffer is full, 256 by default
+     * congestionChanged(true) is emitted at 3/4 of it, congestionChanged(false) once the queue is empty
+     */
+    void setSendQueueCapacity(int capacity);
+    int sendQueueCapacity() const;
+    void setDropPolicy(DropPolicy policy);
+    DropPolicy dropPolicy() const;
+    SendQueueStats sendQueueStats() const;
+    bool isCongested() const;
+
+    /**
+     * @brief joinMulticastGroup Receive group requests on groupAddress
+     * @param groupAddress ff0x::fd or 224.0.1.187 for "All CoAP Nodes"
+     * @param iface interface to join on, system default if invalid
+     * @return true on success
+     * Group socket is bound to "multicast_port" setting (5683 by default), messages received through it
+     * are marked with Message::setMulticast()
+     */
+    bool joinMulticastGroup(const QHostAddress &groupAddress, const QNetworkInterface &iface);
+
 public slots:
      void send(const Message &coapMessage);
+     void sendPacked(const char *data, int size, const Address &address);
 
 private slots:
     void onSettingsChanged();
     void onReadyRead();
+    void onMulticastReadyRead();
+    void onWritable();
 
 private:
+    void readDatagrams(QUdpSocket *socket, bool multicast);
+    bool bindSharedPort(const QHostAddress &interface, quint16 port);
+
+    enum Priority {
+        Control,        ///< ACK, empty or piggybacked, and RST, never dropped
+        Confirmable,
+        NonConfirmable,
+        PriorityCount
+    };
+    struct QueuedDatagram
+    {
+        QByteArray data;
+        Address address;
+    };
+    bool write(const char *data, int size, const Address &address);
+    void enqueue(const char *data, int size, const Address &address);
+    void setCongested(bool congested);
+
+    QQueue<QueuedDatagram> m_sendQueue[PriorityCount];
+    int m_sendQueueCapacity;
+    DropPolicy m_dropPolicy;
+    SendQueueStats m_sendStats;
+    bool m_congested;
+    QSocketNotifier *m_writeNotifier;
+
     Settings *m_settings;
     QUdpSocket *m_socket;
+    QUdpSocket *m_multicastSocket;
 };
 
 } // coap
@@ -0,0 +1,608 @@
+#include "uringendpoint.h"
+#include "messagebuffer.hpp"
+
+#include <QSocketNotifier>
+#include <QHostAddress>
+#include <QQueue>
+#include <QHash>
+#include <QVector>
+#include <QDebug>
+
+#include <liburing.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+namespace {
+/**
+ * recvmsg header, peer address and the largest UDP datagram, provided buffers can't be picked by size.
+ * Anonymous pages are faulted in on first write, so small datagrams only ever touch the first page
+ */
+const unsigned RECEIVE_BUFFER_SIZE = 65536 + 256;
+const int SEND_SLOT_SIZE = iotlib::coap::MessageBuffer::Capacity;
+const int BUFFER_GROUP = 0;
+const int MAX_OVERFLOW = 4096;              ///< datagrams waiting for a free send slot
+const int COMPLETION_BATCH = 256;
+
+enum Operation {
+    Receive = 1,
+    Send = 2,
+    SendHeap = 3    ///< datagram bigger than a send slot, from its own heap buffer
+};
+
+inline quint64 userData(Operation operation, quint32 index)
+{
+    return quint64(operation) << 32 | index;
+}
+
+void *mapMemory(size_t size)
+{
+    void *memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? 0 : memory;
+}
+}
+
+namespace iotlib {
+namespace coap {
+
+struct HeapSend
+{
+    QByteArray data;
+    sockaddr_in6 address;
+};
+
+struct SendSlot
+{
+    sockaddr_in6 address;
+    socklen_t addressLength;
+    qint32 nextFree;
+    bool waitingNotification;   ///< zero copy send, buffer is the kernel's until IORING_CQE_F_NOTIF
+};
+
+class UringEndpointPrivate
+{
+public:
+    UringEndpointPrivate(UringEndpoint *q);
+    ~UringEndpointPrivate();
+
+    bool open(const QHostAddress &interface, quint16 port);
+    void close();
+
+    io_uring_sqe *sqe();
+    void armReceive();
+    int processCompletions();
+    bool received(io_uring_cqe *cqe, int returned);
+    void sent(io_uring_cqe *cqe);
+    void sentHeap(io_uring_cqe *cqe);
+    bool submitHeapSend(const char *data, int size, const Address &address);
+    bool send(const char *data, int size, const Address &address);
+    bool submitSend(const char *data, int size, const Address &address);
+    void releaseSlot(qint32 index);
+    void flushOverflow();
+    void scheduleSubmit();
+    void setCongested(bool congested);
+
+    Address fromSockaddr(const sockaddr *address, socklen_t length) const;
+    socklen_t toSockaddr(const Address &address, sockaddr_in6 *to) const;
+
+    UringEndpoint *q;
+    Settings *settings;
+    QHostAddress boundInterface;
+    quint16 boundPort;
+
+    io_uring ring;
+    bool ringOpen;
+    bool sqpoll;
+    int fd;
+    int family;
+    int eventFd;
+    QSocketNotifier *notifier;
+
+    io_uring_buf_ring *bufferRing;
+    char *receiveMemory;
+    unsigned receiveCount;
+    msghdr receiveHeader;       ///< template for multishot recvmsg, only name lengths matter
+    bool receiveArmed;
+
+    char *sendMemory;
+    QVector<SendSlot> sendSlots;
+    qint32 freeSlot;
+    int freeSlots;
+    QQueue<QPair<QByteArray, Address> > overflow;
+    QHash<quint32, HeapSend *> heapSends;   ///< in the kernel's hands until their completion
+    quint32 nextHeapSend;
+    bool submitScheduled;
+    bool congested;
+};
+
+} // coap
+} // iotlib
+
+iotlib::coap::UringEndpointPrivate::UringEndpointPrivate(iotlib::coap::UringEndpoint *q) :
+    q(q),
+    settings(0),
+    boundPort(0),
+    ringOpen(false),
+    sqpoll(false),
+    fd(-1),
+    family(AF_INET6),
+    eventFd(-1),
+    notifier(0),
+    bufferRing(0),
+    receiveMemory(0),
+    receiveCount(0),
+    receiveArmed(false),
+    sendMemory(0),
+    freeSlot(-1),
+    freeSlots(0),
+    nextHeapSend(0),
+    submitScheduled(false),
+    congested(false)
+{
+    memset(&ring, 0, sizeof(ring));
+    memset(&receiveHeader, 0, sizeof(receiveHeader));
+}
+
+iotlib::coap::UringEndpointPrivate::~UringEndpointPrivate()
+{
+    close();
+}
+
+bool iotlib::coap::UringEndpointPrivate::open(const QHostAddress &interface, quint16 port)
+{
+    QVariant entriesSetting = settings->get("uring_entries");
+    QVariant buffersSetting = settings->get("uring_receive_buffers");
+    QVariant slotsSetting = settings->get("uring_send_slots");
+    unsigned entries = entriesSetting.isValid() ? entriesSetting.toUInt() : 4096;
+    receiveCount = buffersSetting.isValid() ? buffersSetting.toUInt() : 4096;
+    int slotCount = slotsSetting.isValid() ? slotsSetting.toInt() : 1024;
+    sqpoll = settings->get("uring_sqpoll").toBool();
+    if (!receiveCount || (receiveCount & (receiveCount - 1)) || receiveCount > 32768 || slotCount <= 0) {
+        qWarning() << "uring_receive_buffers must be a power of two up to 32768, uring_send_slots positive";
+        return false;
+    }
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000;
+    }
+    int ret = io_uring_queue_init_params(entries, &ring, &params);
+    if (ret < 0) {
+        qWarning() << "io_uring setup failed:" << strerror(-ret);
+        return false;
+    }
+    ringOpen = true;
+
+    // dual stack socket unless bound to an IPv4 interface
+    family = interface.protocol() == QAbstractSocket::IPv4Protocol ? AF_INET : AF_INET6;
+    fd = ::socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        qWarning() << "socket() failed:" << strerror(errno);
+        return false;
+    }
+    if (settings->get("reuse_port").toBool()) {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+    sockaddr_in6 local;
+    socklen_t localLength;
+    if (family == AF_INET6) {
+        int v6only = 0;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        Address bindAddress = interface.isNull() || interface == QHostAddress::Any || interface == QHostAddress::AnyIPv6 ?
+                    Address(QHostAddress(QHostAddress::AnyIPv6), port) : Address(interface, port);
+        localLength = toSockaddr(bindAddress, &local);
+    } else {
+        localLength = toSockaddr(Address(interface, port), &local);
+    }
+    if (::bind(fd, (const sockaddr *)&local, localLength) < 0) {
+        qWarning() << "Bind failed:" << strerror(errno);
+        return false;
+    }
+
+    // provided buffers for multishot receive
+    receiveMemory = (char *)mapMemory(size_t(receiveCount) * RECEIVE_BUFFER_SIZE);
+    bufferRing = receiveMemory ? io_uring_setup_buf_ring(&ring, receiveCount, BUFFER_GROUP, 0, &ret) : 0;
+    if (!bufferRing) {
+        qWarning() << "io_uring provided buffer ring setup failed:" << strerror(-ret);
+        return false;
+    }
+    int mask = io_uring_buf_ring_mask(receiveCount);
+    for (unsigned i = 0; i < receiveCount; ++i)
+        io_uring_buf_ring_add(bufferRing, receiveMemory + size_t(i) * RECEIVE_BUFFER_SIZE, RECEIVE_BUFFER_SIZE,
+                              (unsigned short)i, mask, int(i));
+    io_uring_buf_ring_advance(bufferRing, int(receiveCount));
+    receiveHeader.msg_namelen = sizeof(sockaddr_in6);
+    receiveHeader.msg_controllen = 0;
+
+    // one registered area for all send slots
+    sendMemory = (char *)mapMemory(size_t(slotCount) * SEND_SLOT_SIZE);
+    if (!sendMemory) {
+        qWarning() << "Can't allocate send buffers";
+        return false;
+    }
+    iovec area;
+    area.iov_base = sendMemory;
+    area.iov_len = size_t(slotCount) * SEND_SLOT_SIZE;
+    ret = io_uring_register_buffers(&ring, &area, 1);
+    if (ret < 0) {
+        qWarning() << "io_uring buffer registration failed:" << strerror(-ret);
+        return false;
+    }
+    sendSlots.resize(slotCount);
+    for (int i = 0; i < slotCount; ++i) {
+        sendSlots[i].nextFree = i + 1 < slotCount ? i + 1 : -1;
+        sendSlots[i].waitingNotification = false;
+    }
+    freeSlot = 0;
+    freeSlots = slotCount;
+
+    eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd < 0 || io_uring_register_eventfd(&ring, eventFd) < 0) {
+        qWarning() << "io_uring eventfd registration failed";
+        return false;
+    }
+    notifier = new QSocketNotifier(eventFd, QSocketNotifier::Read, q);
+    QObject::connect(notifier, SIGNAL(activated(int)),
+                     q,        SLOT(onCompletions()));
+
+    boundInterface = interface;
+    boundPort = port;
+    armReceive();
+    io_uring_submit(&ring);
+    return true;
+}
+
+void iotlib::coap::UringEndpointPrivate::close()
+{
+    delete notifier;
+    notifier = 0;
+    if (ringOpen) {
+        if (bufferRing)
+            io_uring_free_buf_ring(&ring, bufferRing, receiveCount, BUFFER_GROUP);
+        io_uring_queue_exit(&ring); // cancels the receive, waits for sends holding our buffers
+        ringOpen = false;
+    }
+    qDeleteAll(heapSends);
+    heapSends.clear();
+    bufferRing = 0;
+    if (fd >= 0)
+        ::close(fd);
+    if (eventFd >= 0)
+        ::close(eventFd);
+    fd = eventFd = -1;
+    if (receiveMemory)
+        munmap(receiveMemory, size_t(receiveCount) * RECEIVE_BUFFER_SIZE);
+    if (sendMemory)
+        munmap(sendMemory, size_t(sendSlots.size()) * SEND_SLOT_SIZE);
+    receiveMemory = sendMemory = 0;
+    receiveArmed = false;
+    sendSlots.clear();
+    freeSlot = -1;
+    freeSlots = 0;
+    overflow.clear();
+    boundInterface = QHostAddress();
+    boundPort = 0;
+}
+
+io_uring_sqe *iotlib::coap::UringEndpointPrivate::sqe()
+{
+    io_uring_sqe *entry = io_uring_get_sqe(&ring);
+    if (!entry) { // submission queue full, push it to the kernel and take a fresh one
+        io_uring_submit(&ring);
+        entry = io_uring_get_sqe(&ring);
+    }
+    return entry;
+}
+
+void iotlib::coap::UringEndpointPrivate::armReceive()
+{
+    io_uring_sqe *entry = sqe();
+    if (!entry)
+        return;
+    io_uring_prep_recvmsg_multishot(entry, fd, &receiveHeader, 0);
+    entry->flags |= IOSQE_BUFFER_SELECT;
+    entry->buf_group = BUFFER_GROUP;
+    io_uring_sqe_set_data64(entry, userData(Receive, 0));
+    receiveArmed = true;
+}
+
+int iotlib::coap::UringEndpointPrivate::processCompletions()
+{
+    if (!ringOpen)
+        return 0;
+    io_uring_cqe *cqes[COMPLETION_BATCH];
+    int total = 0;
+    for (;;) {
+        unsigned count = io_uring_peek_batch_cqe(&ring, cqes, COMPLETION_BATCH);
+        if (!count)
+            break;
+        int returned = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            switch (cqes[i]->user_data >> 32) {
+            case Receive:
+                if (received(cqes[i], returned))
+                    ++returned;
+                break;
+            case Send:
+                sent(cqes[i]);
+                break;
+            case SendHeap:
+                sentHeap(cqes[i]);
+                break;
+            }
+        }
+        io_uring_cq_advance(&ring, count);
+        if (returned) // buffers back to the kernel once per batch
+            io_uring_buf_ring_advance(bufferRing, returned);
+        total += int(count);
+    }
+    if (!receiveArmed) // multishot ends when buffers ran out, or on errors
+        armReceive();
+    flushOverflow();
+    io_uring_submit(&ring);
+    submitScheduled = false;
+    return total;
+}
+
+bool iotlib::coap::UringEndpointPrivate::received(io_uring_cqe *cqe, int returned)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        receiveArmed = false;
+    if (cqe->res < 0) {
+        if (cqe->res != -ENOBUFS)
+            qWarning() << "recvmsg failed:" << strerror(-cqe->res);
+        return false;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        return false;
+
+    unsigned short bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buffer = receiveMemory + size_t(bufferId) * RECEIVE_BUFFER_SIZE;
+    io_uring_recvmsg_out *out = io_uring_recvmsg_validate(buffer, cqe->res, &receiveHeader);
+    if (out && !(out->flags & MSG_TRUNC)) {
+        unsigned length = io_uring_recvmsg_payload_length(out, cqe->res, &receiveHeader);
+        const char *payload = (const char *)io_uring_recvmsg_payload(out, &receiveHeader);
+        Address address = fromSockaddr((const sockaddr *)io_uring_recvmsg_name(out),
+                                       qMin<socklen_t>(out->namelen, receiveHeader.msg_namelen));
+        q->captureDatagram(CaptureRecord::Received, payload, int(length), address);
+        // copied out so the kernel gets the buffer back right away, the stack may keep the message
+        q->deliverDatagram(payload, int(length), address);
+    }
+    io_uring_buf_ring_add(bufferRing, buffer, RECEIVE_BUFFER_SIZE, bufferId,
+                          io_uring_buf_ring_mask(receiveCount), returned);
+    return true;
+}
+
+void iotlib::coap::UringEndpointPrivate::sent(io_uring_cqe *cqe)
+{
+    qint32 index = qint32(cqe->user_data & 0xffffffff);
+    if (index < 0 || index >= sendSlots.size())
+        return;
+    if (cqe->flags & IORING_CQE_F_NOTIF) { // kernel is done with the buffer
+        releaseSlot(index);
+        return;
+    }
+    if (cqe->res < 0)
+        qWarning() << "send failed:" << strerror(-cqe->res);
+    if (cqe->flags & IORING_CQE_F_MORE)
+        sendSlots[index].waitingNotification = true;
+    else
+        releaseSlot(index);
+}
+
+void iotlib::coap::UringEndpointPrivate::sentHeap(io_uring_cqe *cqe)
+{
+    if (cqe->res < 0)
+        qWarning() << "send failed:" << strerror(-cqe->res);
+    delete heapSends.take(quint32(cqe->user_data & 0xffffffff));
+}
+
+bool iotlib::coap::UringEndpointPrivate::send(const char *data, int size, const iotlib::coap::Address &address)
+{
+    if (size > SEND_SLOT_SIZE) // Block2 with big blocks and the like, rare enough for a plain copying send
+        return submitHeapSend(data, size, address);
+    if (freeSlot < 0 || !overflow.isEmpty()) {
+        if (overflow.size() >= MAX_OVERFLOW)
+            return false;
+        overflow.enqueue(qMakePair(QByteArray(data, size), address));
+        setCongested(true);
+        return true;
+    }
+    return submitSend(data, size, address);
+}
+
+bool iotlib::coap::UringEndpointPrivate::submitSend(const char *data, int size, const iotlib::coap::Address &address)
+{
+    io_uring_sqe *entry = sqe();
+    if (!entry)
+        return false;
+
+    qint32 index = freeSlot;
+    SendSlot &slot = sendSlots[index];
+    freeSlot = slot.nextFree;
+    if (--freeSlots < sendSlots.size() / 4)
+        setCongested(true);
+    slot.waitingNotification = false;
+    slot.addressLength = toSockaddr(address, &slot.address);
+    char *buffer = sendMemory + size_t(index) * SEND_SLOT_SIZE;
+    memcpy(buffer, data, size);
+
+    io_uring_prep_send_zc_fixed(entry, fd, buffer, size_t(size), 0, 0, 0);
+    io_uring_prep_send_set_addr(entry, (const sockaddr *)&slot.address, (__u16)slot.addressLength);
+    io_uring_sqe_set_data64(entry, userData(Send, quint32(index)));
+    scheduleSubmit();
+    return true;
+}
+
+bool iotlib::coap::UringEndpointPrivate::submitHeapSend(const char *data, int size, const iotlib::coap::Address &address)
+{
+    io_uring_sqe *entry = sqe();
+    if (!entry)
+        return false;
+    HeapSend *heapSend = new HeapSend;
+    heapSend->data = QByteArray(data, size);
+    socklen_t addressLength = toSockaddr(address, &heapSend->address);
+    quint32 id = nextHeapSend++;
+    heapSends.insert(id, heapSend);
+
+    io_uring_prep_send(entry, fd, heapSend->data.constData(), size_t(size), 0);
+    io_uring_prep_send_set_addr(entry, (const sockaddr *)&heapSend->address, (__u16)addressLength);
+    io_uring_sqe_set_data64(entry, userData(SendHeap, id));
+    scheduleSubmit();
+    return true;
+}
+
+void iotlib::coap::UringEndpointPrivate::releaseSlot(qint32 index)
+{
+    sendSlots[index].waitingNotification = false;
+    sendSlots[index].nextFree = freeSlot;
+    freeSlot = index;
+    if (++freeSlots > sendSlots.size() / 2 && overflow.isEmpty())
+        setCongested(false);
+}
+
+void iotlib::coap::UringEndpointPrivate::flushOverflow()
+{
+    while (!overflow.isEmpty() && freeSlot >= 0) {
+        QPair<QByteArray, Address> datagram = overflow.dequeue();
+        submitSend(datagram.first.constData(), datagram.first.size(), datagram.second);
+    }
+}
+
+void iotlib::coap::UringEndpointPrivate::scheduleSubmit()
+{
+    if (sqpoll) { // kernel thread picks it up, io_uring_submit() only wakes it if it went idle
+        io_uring_submit(&ring);
+        return;
+    }
+    // everything sent during one event loop iteration goes in one io_uring_enter()
+    if (submitScheduled)
+        return;
+    submitScheduled = true;
+    QMetaObject::invokeMethod(q, "onSubmit", Qt::QueuedConnection);
+}
+
+void iotlib::coap::UringEndpointPrivate::setCongested(bool congested)
+{
+    if (this->congested == congested)
+        return;
+    this->congested = congested;
+    emit q->congestionChanged(congested);
+}
+
+iotlib::coap::Address iotlib::coap::UringEndpointPrivate::fromSockaddr(const sockaddr *address, socklen_t length) const
+{
+    if (address->sa_family == AF_INET6 && length >= sizeof(sockaddr_in6)) {
+        const sockaddr_in6 *in6 = (const sockaddr_in6 *)address;
+        return Address::fromRaw(in6->sin6_addr.s6_addr, ntohs(in6->sin6_port), in6->sin6_scope_id);
+    }
+    if (address->sa_family == AF_INET && length >= sizeof(sockaddr_in)) {
+        const sockaddr_in *in = (const sockaddr_in *)address;
+        quint8 ip[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+        memcpy(ip + 12, &in->sin_addr, 4);
+        return Address::fromRaw(ip, ntohs(in->sin_port));
+    }
+    return Address();
+}
+
+socklen_t iotlib::coap::UringEndpointPrivate::toSockaddr(const iotlib::coap::Address &address, sockaddr_in6 *to) const
+{
+    memset(to, 0, sizeof(*to));
+    if (family == AF_INET) {
+        sockaddr_in *in = (sockaddr_in *)to;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(address.port());
+        memcpy(&in->sin_addr, address.ip() + 12, 4);
+        return sizeof(sockaddr_in);
+    }
+    to->sin6_family = AF_INET6; // IPv4 goes v4-mapped through the dual stack socket
+    to->sin6_port = htons(address.port());
+    to->sin6_scope_id = address.scopeId();
+    memcpy(&to->sin6_addr, address.ip(), 16);
+    return sizeof(sockaddr_in6);
+}
+
+iotlib::coap::UringEndpoint::UringEndpoint(iotlib::Settings *settings, QObject *parent) :
+    iotlib::coap::EndpointBase(parent), d(new iotlib::coap::UringEndpointPrivate(this))
+{
+    d->settings = settings;
+    connect(settings, &Settings::settingsChanged,
+            this,     &UringEndpoint::onSettingsChanged);
+    onSettingsChanged();
+}
+
+iotlib::coap::UringEndpoint::~UringEndpoint()
+{
+    if (d) {
+        delete d;
+        d = 0;
+    }
+}
+
+bool iotlib::coap::UringEndpoint::isCongested() const
+{
+    return d->congested;
+}
+
+int iotlib::coap::UringEndpoint::processCompletions()
+{
+    return d->processCompletions();
+}
+
+void iotlib::coap::UringEndpoint::send(const iotlib::coap::Message &coapMessage)
+{
+    QByteArray packed = coapMessage.pack();
+    sendPacked(packed.constData(), packed.size(), coapMessage.address());
+}
+
+void iotlib::coap::UringEndpoint::sendPacked(const char *data, int size, const iotlib::coap::Address &address)
+{
+    if (!d->ringOpen) {
+        qWarning() << "io_uring endpoint is not bound, can't send";
+        return;
+    }
+    if (d->send(data, size, address))
+        captureDatagram(CaptureRecord::Sent, data, size, address);
+}
+
+void iotlib::coap::UringEndpoint::onSettingsChanged()
+{
+    bool bind = d->settings->get("bind").toBool();
+    if (!bind) {
+        d->close();
+        return;
+    }
+    QHostAddress interface(d->settings->get("interface").toString());
+    quint16 port = static_cast<quint16>(d->settings->get("port").toUInt());
+    if (port == 0)
+        port = 5683;
+    if (d->ringOpen && d->boundInterface == interface && d->boundPort == port)
+        return;
+    d->close();
+    if (!d->open(interface, port))
+        d->close();
+}
+
+void iotlib::coap::UringEndpoint::onCompletions()
+{
+    quint64 count;
+    if (::read(d->eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        qWarning() << "eventfd read failed:" << strerror(errno);
+    d->processCompletions();
+}
+
+void iotlib::coap::UringEndpoint::onSubmit()
+{
+    if (!d->submitScheduled || !d->ringOpen)
+        return;
+    d->submitScheduled = false;
+    io_uring_submit(&d->ring);
+}
@@ -0,0 +1,63 @@
+#ifndef URINGENDPOINT_H
+#define URINGENDPOINT_H
+
+#include "endpointbase.hpp"
+#include "../settings.h"
+
+#include <QObject>
+
+namespace iotlib {
+namespace coap {
+
+class UringEndpointPrivate;
+
+/**
+ * @brief The UringEndpoint class carries coap:// over UDP through io_uring, Linux only
+ * One multishot recvmsg fills datagrams into a ring of provided buffers, sends go out of a registered
+ * buffer area. The ring signals completions through an eventfd, so the only thing the Qt event loop
+ * sees is one notifier; a batch of completions is handled per wakeup and datagrams go to the stack
+ * in pooled MessageBuffers, never through QUdpSocket. Datagrams bigger than a MessageBuffer are
+ * received and sent through heap copies instead.
+ * Needs kernel 6.0 and liburing 2.4, build with qmake CONFIG+=uring. No multicast.
+ *
+ * Settings: "bind", "interface", "port" (5683 by default), "reuse_port" same as UdpEndpoint,
+ * "uring_entries" submission queue size (4096 by default),
+ * "uring_receive_buffers" provided receive buffers, power of two (4096 by default), each reserves 64 KiB
+ * of address space for the largest datagram but only the pages written to are backed by memory,
+ * "uring_send_slots" datagrams in flight towards the kernel (1024 by default),
+ * "uring_sqpoll" kernel thread polls the submission queue, no syscalls on send (false by default).
+ */
+class UringEndpoint : public EndpointBase
+{
+    Q_OBJECT
+public:
+    UringEndpoint(Settings *settings, QObject *parent = 0);
+    ~UringEndpoint();
+
+    bool isCongested() const;
+
+    /**
+     * @brief processCompletions handles whatever completed without waiting for the eventfd,
+     * for callers that busy poll
+     * @return number of completions handled
+     */
+    int processCompletions();
+
+public slots:
+     void send(const Message &coapMessage);
+     void sendPacked(const char *data, int size, const Address &address);
+
+private slots:
+    void onSettingsChanged();
+    void onCompletions();
+    void onSubmit();
+
+private:
+    UringEndpointPrivate *d;
+    friend class UringEndpointPrivate;
+};
+
+} // coap
+} // iotlib
+
+#endif // URINGENDPOINT_H
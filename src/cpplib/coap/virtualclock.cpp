@@ -0,0 +1,59 @@
+#include "virtualclock.hpp"
+
+#include <algorithm>
+
+iotlib::coap::VirtualClock::VirtualClock() :
+    m_now(0),
+    m_sequence(0)
+{
+}
+
+quint64 iotlib::coap::VirtualClock::schedule(qint64 delayNsec, const std::function<void()> &event)
+{
+    Event e;
+    e.at = m_now + qMax<qint64>(0, delayNsec);
+    e.sequence = ++m_sequence;
+    e.run = event;
+    m_events.append(e);
+    std::push_heap(m_events.begin(), m_events.end(), &VirtualClock::later);
+    return e.sequence;
+}
+
+void iotlib::coap::VirtualClock::cancel(quint64 id)
+{
+    m_cancelled.insert(id);
+}
+
+void iotlib::coap::VirtualClock::dropCancelled()
+{
+    while (!m_cancelled.isEmpty() && !m_events.isEmpty() && m_cancelled.remove(m_events.first().sequence)) {
+        std::pop_heap(m_events.begin(), m_events.end(), &VirtualClock::later);
+        m_events.removeLast();
+    }
+}
+
+bool iotlib::coap::VirtualClock::step()
+{
+    dropCancelled();
+    if (m_events.isEmpty())
+        return false;
+    std::pop_heap(m_events.begin(), m_events.end(), &VirtualClock::later);
+    Event e = m_events.takeLast();
+    m_now = e.at;
+    e.run(); // may schedule more
+    return true;
+}
+
+int iotlib::coap::VirtualClock::runFor(qint64 msec)
+{
+    qint64 until = m_now + msec * 1000000;
+    int count = 0;
+    dropCancelled();
+    while (!m_events.isEmpty() && m_events.first().at <= until) {
+        step();
+        ++count;
+        dropCancelled();
+    }
+    m_now = until;
+    return count;
+}
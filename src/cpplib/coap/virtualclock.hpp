@@ -0,0 +1,108 @@
+#ifndef COAP_VIRTUALCLOCK_H
+#define COAP_VIRTUALCLOCK_H
+
+#include "../iotlib_global.h"
+
+#include <functional>
+
+#include <QVector>
+#include <QSet>
+#include <QElapsedTimer>
+
+namespace iotlib {
+namespace coap {
+
+/**
+ * @brief The VirtualClock class is simulated time driven by a discrete event queue.
+ * Time stands still until runFor() or step() jumps it to the next event, so simulations
+ * run as fast as the events can be processed and repeat exactly with the same inputs.
+ * Events scheduled for the same time run in the order they were scheduled. Single threaded,
+ * everything using it has to live in the thread calling run*(). @see Stack::setClock()
+ */
+class IOTLIB_SHARED_EXPORT VirtualClock
+{
+public:
+    VirtualClock();
+
+    qint64 nsecsElapsed() const { return m_now; }
+    qint64 elapsed() const { return m_now / 1000000; }
+
+    /**
+     * @brief schedule runs event after delayNsec of virtual time, negative delays run it next
+     * @return id for cancel(), never 0
+     */
+    quint64 schedule(qint64 delayNsec, const std::function<void()> &event);
+    /**
+     * @brief cancel drops event id, it must not have run yet
+     */
+    void cancel(quint64 id);
+
+    /**
+     * @brief step runs the earliest event, moving time to it
+     * @return false if there was none
+     */
+    bool step();
+    /**
+     * @brief runFor runs events due within msec and leaves time msec later
+     * @return number of events run
+     */
+    int runFor(qint64 msec);
+    int pending() const { return m_events.size() - m_cancelled.size(); }
+
+private:
+    struct Event
+    {
+        qint64 at;
+        quint64 sequence;
+        std::function<void()> run;
+    };
+    static bool later(const Event &e1, const Event &e2)
+    {
+        return e1.at != e2.at ? e1.at > e2.at : e1.sequence > e2.sequence;
+    }
+
+    void dropCancelled();
+
+    qint64 m_now;
+    quint64 m_sequence;
+    QVector<Event> m_events;    ///< min heap on (at, sequence)
+    QSet<quint64> m_cancelled;  ///< still in m_events, dropped when they come up
+};
+
+/**
+ * @brief The Clock class is the monotonic clock of a Stack and its timers,
+ * real time by default or VirtualClock time once one is set
+ */
+class Clock
+{
+public:
+    Clock() : m_virtual(0), m_origin(0) { }
+
+    void start()
+    {
+        m_timer.start();
+        m_origin = m_virtual ? m_virtual->nsecsElapsed() : 0;
+    }
+    /**
+     * @brief setVirtual switches to clock, 0 goes back to real time, restarts from 0 either way
+     */
+    void setVirtual(VirtualClock *clock)
+    {
+        m_virtual = clock;
+        start();
+    }
+    VirtualClock *virtualClock() const { return m_virtual; }
+
+    qint64 nsecsElapsed() const { return m_virtual ? m_virtual->nsecsElapsed() - m_origin : m_timer.nsecsElapsed(); }
+    qint64 elapsed() const { return nsecsElapsed() / 1000000; }
+
+private:
+    QElapsedTimer m_timer;
+    VirtualClock *m_virtual;
+    qint64 m_origin;
+};
+
+} // coap
+} // iotlib
+
+#endif // COAP_VIRTUALCLOCK_H
@@ -24,7 +24,31 @@ HEADERS += \
     coap/contenthandlers.h \
     coap/endpointbase.hpp \
     settings.h \
-    coap/udpendpoint.h
+    coap/udpendpoint.h \
+    coap/multicastexchange.hpp \
+    coap/multicastexchange_p.hpp \
+    coap/tcpendpoint.h \
+    coap/resource.hpp \
+    coap/requesttemplate.hpp \
+    coap/poller.hpp \
+    coap/poller_p.hpp \
+    coap/tokenallocator.hpp \
+    coap/peertable.hpp \
+    coap/messagebuffer.hpp \
+    coap/mpscqueue.hpp \
+    coap/admissioncontrol.hpp \
+    coap/capture.hpp \
+    coap/histogram.hpp \
+    coap/virtualclock.hpp \
+    coap/simulatednetwork.hpp \
+    coap/spscring.hpp \
+    coap/tracepoints.hpp \
+    lwm2m/object.hpp \
+    lwm2m/tlv.hpp \
+    lwm2m/senmlcbor.hpp \
+    lwm2m/client.hpp \
+    lwm2m/registrationstore.hpp \
+    lwm2m/registrationinterface.hpp
 
 SOURCES += \
     coap/coap.cpp \
@@ -34,4 +58,51 @@ SOURCES += \
     coap/exchange.cpp \
     coap/contenthandlers.cpp \
     settings.cpp \
-    coap/udpendpoint.cpp
+    coap/udpendpoint.cpp \
+    coap/multicastexchange.cpp \
+    coap/tcpendpoint.cpp \
+    coap/resource.cpp \
+    coap/requesttemplate.cpp \
+    coap/poller.cpp \
+    coap/tokenallocator.cpp \
+    coap/peertable.cpp \
+    coap/messagebuffer.cpp \
+    coap/admissioncontrol.cpp \
+    coap/capture.cpp \
+    coap/histogram.cpp \
+    coap/virtualclock.cpp \
+    coap/simulatednetwork.cpp \
+    lwm2m/object.cpp \
+    lwm2m/tlv.cpp \
+    lwm2m/senmlcbor.cpp \
+    lwm2m/client.cpp \
+    lwm2m/registrationstore.cpp \
+    lwm2m/registrationinterface.cpp
+
+# qmake CONFIG+=dtls, needs mbedTLS built with MBEDTLS_SSL_DTLS_CONNECTION_ID and MBEDTLS_THREADING_C
+dtls {
+    DEFINES += IOTLIB_DTLS
+    HEADERS += coap/dtlsendpoint.h
+    SOURCES += coap/dtlsendpoint.cpp
+    LIBS += -lmbedtls -lmbedx509 -lmbedcrypto
+}
+
+# POSIX sockets and poll(), the I/O thread bypasses QUdpSocket
+unix {
+    HEADERS += coap/pipelineendpoint.h
+    SOURCES += coap/pipelineendpoint.cpp
+}
+
+# qmake CONFIG+=uring, needs Linux 6.0+ and liburing 2.4+
+uring {
+    DEFINES += IOTLIB_URING
+    HEADERS += coap/uringendpoint.h
+    SOURCES += coap/uringendpoint.cpp
+    LIBS += -luring
+}
+
+# qmake CONFIG+=usdt, USDT probes for bpftrace and perf, needs sys/sdt.h (systemtap-sdt-dev)
+usdt {
+    DEFINES += IOTLIB_USDT
+    SOURCES += coap/tracepoints.cpp
+}
@@ -0,0 +1,191 @@
+#include "client.hpp"
+#include "tlv.hpp"
+#include "senmlcbor.hpp"
+
+#include <QStringList>
+
+using iotlib::coap::Message;
+
+iotlib::lwm2m::Client::Client() :
+    iotlib::coap::Resource(QString())
+{
+}
+
+iotlib::lwm2m::Client::~Client()
+{
+    qDeleteAll(m_objects);
+}
+
+void iotlib::lwm2m::Client::addObject(iotlib::lwm2m::Object *object)
+{
+    delete m_objects.value(object->id(), 0);
+    m_objects.insert(object->id(), object);
+}
+
+iotlib::lwm2m::Object *iotlib::lwm2m::Client::object(quint16 objectId) const
+{
+    return m_objects.value(objectId, 0);
+}
+
+void iotlib::lwm2m::Client::handle(const iotlib::coap::Message &request, iotlib::coap::Message &response)
+{
+    QStringList segments;
+    for (int i = 0; i < request.optionsCount(); ++i) {
+        iotlib::coap::Option option = request.option(i);
+        if (option.type() == Message::OptionType::UriPath)
+            segments.append(QString::fromUtf8(option.data()));
+    }
+    Path path = Path::fromString(segments.join("/"));
+
+    switch (request.code()) {
+    case Message::Code::Get:
+        if (!path.isValid()) {
+            response.setCode(Message::Code::BadRequest);
+            return;
+        }
+        read(path, request, response);
+        break;
+    case Message::Code::Fetch:
+        if (segments.isEmpty())
+            readComposite(request, response);
+        else
+            response.setCode(Message::Code::MethodNotAllowed);
+        break;
+    case Message::Code::Put:
+    case Message::Code::Post:
+        if (path.depth() < 2) {
+            response.setCode(Message::Code::MethodNotAllowed);
+            return;
+        }
+        write(path, request, response);
+        break;
+    default:
+        response.setCode(Message::Code::MethodNotAllowed);
+    }
+}
+
+void iotlib::lwm2m::Client::read(const iotlib::lwm2m::Path &path, const iotlib::coap::Message &request,
+                                 iotlib::coap::Message &response)
+{
+    Object *object = m_objects.value(path.objectId, 0);
+    QVector<Record> records;
+    if (!object || !object->read(path, records)) {
+        response.setCode(Message::Code::NotFound);
+        return;
+    }
+
+    Message::ContentFormat format = request.accept(Message::ContentFormat::LwM2mTlv);
+    if (format == Message::ContentFormat::LwM2mTlv) {
+        response.setContent(Tlv::encode(*object, records, path.depth()));
+    } else if (format == Message::ContentFormat::SenmlCbor) {
+        QVector<ResourceType> types;
+        types.reserve(records.size());
+        foreach (const Record &record, records)
+            types.append(typeOf(record.path));
+        response.setContent(SenmlCbor::encode(records, types));
+    } else if (format == Message::ContentFormat::TextPlain && records.size() == 1 && path.depth() >= 3) {
+        response.setContent(records.first().value.toString().toUtf8());
+    } else {
+        response.setCode(Message::Code::NotAcceptable);
+        return;
+    }
+    response.setCode(Message::Code::Content);
+    response.setContentFormat(format);
+}
+
+void iotlib::lwm2m::Client::readComposite(const iotlib::coap::Message &request, iotlib::coap::Message &response)
+{
+    if (request.contentFormat() != Message::ContentFormat::SenmlCbor) {
+        response.setCode(Message::Code::UnsupportedContentFormat);
+        return;
+    }
+    QVector<Record> paths;
+    if (!SenmlCbor::decode(request.content(), paths)) {
+        response.setCode(Message::Code::BadRequest);
+        return;
+    }
+
+    QVector<Record> records;
+    foreach (const Record &requested, paths) {
+        Object *object = m_objects.value(requested.path.objectId, 0);
+        if (object)
+            object->read(requested.path, records); // missing paths are skipped, not an error
+    }
+    QVector<ResourceType> types;
+    types.reserve(records.size());
+    foreach (const Record &record, records)
+        types.append(typeOf(record.path));
+
+    response.setCode(Message::Code::Content);
+    response.setContentFormat(Message::ContentFormat::SenmlCbor);
+    response.setContent(SenmlCbor::encode(records, types));
+}
+
+void iotlib::lwm2m::Client::write(const iotlib::lwm2m::Path &path, const iotlib::coap::Message &request,
+                                  iotlib::coap::Message &response)
+{
+    Object *object = m_objects.value(path.objectId, 0);
+    if (!object || object->instanceIndex(path.instanceId) < 0) {
+        response.setCode(Message::Code::NotFound);
+        return;
+    }
+
+    QVector<Record> records;
+    bool ok;
+    Message::ContentFormat format = request.contentFormat();
+    if (format == Message::ContentFormat::LwM2mTlv) {
+        ok = Tlv::decode(request.content(), *object, Path(path.objectId, path.instanceId), records);
+    } else if (format == Message::ContentFormat::SenmlCbor) {
+        ok = SenmlCbor::decode(request.content(), records);
+        for (int i = 0; ok && i < records.size(); ++i) { // CBOR types to resource types
+            int resource = object->resourceIndex(records[i].path.resourceId);
+            ok = resource >= 0;
+            if (!ok)
+                break;
+            switch (object->definition()->resources[resource].type) {
+            case ResourceType::Integer:
+            case ResourceType::Time:
+                records[i].value = records[i].value.toLongLong();
+                break;
+            case ResourceType::UnsignedInteger:
+                records[i].value = records[i].value.toULongLong();
+                break;
+            case ResourceType::Float:
+                records[i].value = records[i].value.toDouble();
+                break;
+            default:
+                break;
+            }
+        }
+    } else {
+        response.setCode(Message::Code::UnsupportedContentFormat);
+        return;
+    }
+    if (!ok) {
+        response.setCode(Message::Code::BadRequest);
+        return;
+    }
+
+    // records must stay under the request path
+    foreach (const Record &record, records) {
+        if (record.path.objectId != path.objectId || record.path.instanceId != path.instanceId ||
+                (path.resourceId >= 0 && record.path.resourceId != path.resourceId)) {
+            response.setCode(Message::Code::BadRequest);
+            return;
+        }
+    }
+    if (!object->write(records)) {
+        response.setCode(Message::Code::MethodNotAllowed);
+        return;
+    }
+    response.setCode(Message::Code::Changed);
+}
+
+iotlib::lwm2m::ResourceType iotlib::lwm2m::Client::typeOf(const iotlib::lwm2m::Path &path) const
+{
+    Object *object = m_objects.value(path.objectId, 0);
+    if (!object)
+        return ResourceType::None;
+    int index = object->resourceIndex(path.resourceId);
+    return index < 0 ? ResourceType::None : object->definition()->resources[index].type;
+}
@@ -0,0 +1,46 @@
+#ifndef LWM2M_CLIENT_H
+#define LWM2M_CLIENT_H
+
+#include "../iotlib_global.h"
+#include "../coap/resource.hpp"
+#include "object.hpp"
+
+#include <QMap>
+
+namespace iotlib {
+namespace lwm2m {
+
+/**
+ * @brief The Client class serves LWM2M objects of a device over CoAP
+ * Register it with Stack::addResource(), it takes every path no other resource claimed.
+ * Supports Read and Write on objects, instances and resources, Read-Composite (FETCH /),
+ * in LWM2M TLV or SenML-CBOR depending on Accept and Content-Format options, TLV is the default.
+ * Whole objects are returned in one response, so hundreds of resources cost one round trip.
+ */
+class IOTLIB_SHARED_EXPORT Client : public coap::Resource
+{
+public:
+    Client();
+    ~Client();
+
+    /**
+     * @brief addObject makes object accessible, client takes ownership
+     */
+    void addObject(Object *object);
+    Object *object(quint16 objectId) const;
+
+    void handle(const coap::Message &request, coap::Message &response);
+
+private:
+    void read(const Path &path, const coap::Message &request, coap::Message &response);
+    void readComposite(const coap::Message &request, coap::Message &response);
+    void write(const Path &path, const coap::Message &request, coap::Message &response);
+    ResourceType typeOf(const Path &path) const;
+
+    QMap<quint16, Object *> m_objects;
+};
+
+} // lwm2m
+} // iotlib
+
+#endif // LWM2M_CLIENT_H
@@ -0,0 +1,197 @@
+#include "object.hpp"
+
+#include <QStringList>
+
+#include <algorithm>
+
+iotlib::lwm2m::Path iotlib::lwm2m::Path::fromString(const QString &path)
+{
+    QStringList segments = path.split("/", QString::SkipEmptyParts);
+    if (segments.size() > 4)
+        return Path();
+    int ids[4] = {-1, -1, -1, -1};
+    for (int i = 0; i < segments.size(); ++i) {
+        bool ok;
+        uint id = segments[i].toUInt(&ok);
+        if (!ok || id > 0xffff)
+            return Path();
+        ids[i] = id;
+    }
+    return Path(ids[0], ids[1], ids[2], ids[3]);
+}
+
+QString iotlib::lwm2m::Path::toString() const
+{
+    QString path;
+    const int ids[4] = {objectId, instanceId, resourceId, resourceInstanceId};
+    for (int i = 0; i < 4 && ids[i] >= 0; ++i)
+        path += "/" + QString::number(ids[i]);
+    return path.isEmpty() ? QString("/") : path;
+}
+
+bool iotlib::lwm2m::Path::isValid() const
+{
+    return objectId >= 0;
+}
+
+int iotlib::lwm2m::Path::depth() const
+{
+    if (objectId < 0)
+        return 0;
+    if (instanceId < 0)
+        return 1;
+    if (resourceId < 0)
+        return 2;
+    return resourceInstanceId < 0 ? 3 : 4;
+}
+
+iotlib::lwm2m::Object::Object(const iotlib::lwm2m::ObjectDefinition *definition) :
+    m_definition(definition)
+{
+}
+
+quint16 iotlib::lwm2m::Object::id() const
+{
+    return m_definition->id;
+}
+
+const iotlib::lwm2m::ObjectDefinition *iotlib::lwm2m::Object::definition() const
+{
+    return m_definition;
+}
+
+int iotlib::lwm2m::Object::resourceIndex(quint16 resourceId) const
+{
+    const ResourceDefinition *begin = m_definition->resources;
+    const ResourceDefinition *end = begin + m_definition->resourceCount;
+    const ResourceDefinition *it = std::lower_bound(begin, end, resourceId,
+                                                    [](const ResourceDefinition &r, quint16 id) { return r.id < id; });
+    if (it == end || it->id != resourceId)
+        return -1;
+    return it - begin;
+}
+
+bool iotlib::lwm2m::Object::addInstance(quint16 instanceId)
+{
+    QVector<quint16>::iterator it = std::lower_bound(m_instanceIds.begin(), m_instanceIds.end(), instanceId);
+    if (it != m_instanceIds.end() && *it == instanceId)
+        return false;
+    int index = it - m_instanceIds.begin();
+    m_instanceIds.insert(index, instanceId);
+    m_values.insert(index * m_definition->resourceCount, m_definition->resourceCount, QVariant());
+    return true;
+}
+
+bool iotlib::lwm2m::Object::removeInstance(quint16 instanceId)
+{
+    int index = instanceIndex(instanceId);
+    if (index < 0)
+        return false;
+    m_instanceIds.remove(index);
+    m_values.remove(index * m_definition->resourceCount, m_definition->resourceCount);
+    return true;
+}
+
+QVector<quint16> iotlib::lwm2m::Object::instances() const
+{
+    return m_instanceIds;
+}
+
+int iotlib::lwm2m::Object::instanceIndex(quint16 instanceId) const
+{
+    QVector<quint16>::const_iterator it = std::lower_bound(m_instanceIds.constBegin(), m_instanceIds.constEnd(), instanceId);
+    if (it == m_instanceIds.constEnd() || *it != instanceId)
+        return -1;
+    return it - m_instanceIds.constBegin();
+}
+
+QVariant iotlib::lwm2m::Object::value(quint16 instanceId, quint16 resourceId) const
+{
+    return valueAt(instanceIndex(instanceId), resourceIndex(resourceId));
+}
+
+bool iotlib::lwm2m::Object::setValue(quint16 instanceId, quint16 resourceId, const QVariant &value)
+{
+    int instance = instanceIndex(instanceId);
+    int resource = resourceIndex(resourceId);
+    if (instance < 0 || resource < 0)
+        return false;
+    m_values[instance * m_definition->resourceCount + resource] = value;
+    return true;
+}
+
+QVariant iotlib::lwm2m::Object::valueAt(int instanceIndex, int resourceIndex) const
+{
+    if (instanceIndex < 0 || resourceIndex < 0)
+        return QVariant();
+    return m_values.at(instanceIndex * m_definition->resourceCount + resourceIndex);
+}
+
+bool iotlib::lwm2m::Object::read(const iotlib::lwm2m::Path &path, QVector<iotlib::lwm2m::Record> &records) const
+{
+    int firstInstance = 0;
+    int lastInstance = m_instanceIds.size() - 1;
+    if (path.instanceId >= 0) {
+        firstInstance = lastInstance = instanceIndex(path.instanceId);
+        if (firstInstance < 0)
+            return false;
+    }
+    int firstResource = 0;
+    int lastResource = m_definition->resourceCount - 1;
+    if (path.resourceId >= 0) {
+        firstResource = lastResource = resourceIndex(path.resourceId);
+        if (firstResource < 0 || !(m_definition->resources[firstResource].operations & Read))
+            return false;
+    }
+
+    for (int i = firstInstance; i <= lastInstance; ++i) {
+        for (int r = firstResource; r <= lastResource; ++r) {
+            const ResourceDefinition &resource = m_definition->resources[r];
+            const QVariant &value = m_values.at(i * m_definition->resourceCount + r);
+            if (!(resource.operations & Read) || !value.isValid())
+                continue;
+            Path recordPath(id(), m_instanceIds[i], resource.id);
+            if (!resource.multiple) {
+                records.append(Record{recordPath, value});
+                continue;
+            }
+            QVariantList instances = value.toList();
+            for (int ri = 0; ri < instances.size(); ++ri) {
+                if (path.resourceInstanceId >= 0 && path.resourceInstanceId != ri)
+                    continue;
+                recordPath.resourceInstanceId = ri;
+                records.append(Record{recordPath, instances[ri]});
+            }
+        }
+    }
+    return true;
+}
+
+bool iotlib::lwm2m::Object::write(const QVector<iotlib::lwm2m::Record> &records)
+{
+    if (records.isEmpty())
+        return false;
+    // check everything first, write is all or nothing
+    foreach (const Record &record, records) {
+        if (record.path.objectId != id() || record.path.resourceId < 0 || instanceIndex(record.path.instanceId) < 0)
+            return false;
+        int resource = resourceIndex(record.path.resourceId);
+        if (resource < 0 || !(m_definition->resources[resource].operations & Write))
+            return false;
+    }
+    foreach (const Record &record, records) {
+        int resource = resourceIndex(record.path.resourceId);
+        QVariant &value = m_values[instanceIndex(record.path.instanceId) * m_definition->resourceCount + resource];
+        if (!m_definition->resources[resource].multiple) {
+            value = record.value;
+            continue;
+        }
+        QVariantList instances = value.toList();
+        int ri = qMax(record.path.resourceInstanceId, 0);
+        while (instances.size() <= ri)
+            instances.append(QVariant());
+        instances[ri] = record.value;
+        value = instances;
+    }
+    return true;
+}
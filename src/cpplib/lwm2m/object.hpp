@@ -0,0 +1,132 @@
+#ifndef LWM2M_OBJECT_H
+#define LWM2M_OBJECT_H
+
+#include "../iotlib_global.h"
+
+#include <QVariant>
+#include <QVector>
+#include <QString>
+
+namespace iotlib {
+namespace lwm2m {
+
+enum class ResourceType : quint8 {
+    None,           ///< executable resources have no value
+    String,
+    Integer,
+    UnsignedInteger,
+    Float,
+    Boolean,
+    Opaque,
+    Time,
+    ObjectLink      ///< stored as quint32: object id << 16 | instance id
+};
+
+enum Operation : quint8 {
+    Read    = 0x01,
+    Write   = 0x02,
+    Execute = 0x04
+};
+
+/**
+ * @brief The ResourceDefinition struct describes one resource of an object, kept in static arrays
+ * sorted by id, one array per object type
+ */
+struct ResourceDefinition {
+    quint16 id;
+    ResourceType type;
+    quint8 operations;
+    bool multiple;      ///< value is a QVariantList, resource instance id is the index
+    const char *name;
+};
+
+struct ObjectDefinition {
+    quint16 id;
+    const char *name;
+    const ResourceDefinition *resources;
+    int resourceCount;
+};
+
+/**
+ * @brief The Path struct addresses object, instance, resource or resource instance, -1 for absent levels
+ */
+struct IOTLIB_SHARED_EXPORT Path {
+    Path(int objectId = -1, int instanceId = -1, int resourceId = -1, int resourceInstanceId = -1) :
+        objectId(objectId), instanceId(instanceId),
+        resourceId(resourceId), resourceInstanceId(resourceInstanceId)
+    { }
+
+    /**
+     * @brief fromString parses "/3/0/1", returns invalid path on error
+     */
+    static Path fromString(const QString &path);
+    QString toString() const;
+    bool isValid() const;
+    int depth() const;
+
+    int objectId;
+    int instanceId;
+    int resourceId;
+    int resourceInstanceId;
+};
+
+/**
+ * @brief The Record struct is one resource (instance) value, what TLV and SenML-CBOR decode into
+ */
+struct Record {
+    Path path;
+    QVariant value;
+};
+
+/**
+ * @brief The Object class holds all instances of one object type.
+ * Values are stored in one flat array, resourceCount values per instance, no per resource allocations.
+ */
+class IOTLIB_SHARED_EXPORT Object
+{
+public:
+    explicit Object(const ObjectDefinition *definition);
+
+    quint16 id() const;
+    const ObjectDefinition *definition() const;
+
+    /**
+     * @brief resourceIndex looks resource up in definition
+     * @return index in definition()->resources or -1
+     */
+    int resourceIndex(quint16 resourceId) const;
+
+    bool addInstance(quint16 instanceId);
+    bool removeInstance(quint16 instanceId);
+    QVector<quint16> instances() const;
+    /**
+     * @brief instanceIndex
+     * @return position of instance in instances() or -1
+     */
+    int instanceIndex(quint16 instanceId) const;
+
+    QVariant value(quint16 instanceId, quint16 resourceId) const;
+    bool setValue(quint16 instanceId, quint16 resourceId, const QVariant &value);
+    QVariant valueAt(int instanceIndex, int resourceIndex) const;
+
+    /**
+     * @brief read appends readable values under path (this object, one instance or one resource)
+     * @return false if path doesn't exist
+     */
+    bool read(const Path &path, QVector<Record> &records) const;
+    /**
+     * @brief write stores records, all of them must be writable resources of existing instances
+     * @return false if nothing was written
+     */
+    bool write(const QVector<Record> &records);
+
+private:
+    const ObjectDefinition *m_definition;
+    QVector<quint16> m_instanceIds; ///< sorted
+    QVector<QVariant> m_values;
+};
+
+} // lwm2m
+} // iotlib
+
+#endif // LWM2M_OBJECT_H
@@ -0,0 +1,174 @@
+#include "registrationinterface.hpp"
+#include "registrationstore.hpp"
+
+#include <string.h>
+
+using iotlib::coap::Message;
+
+namespace {
+const quint32 DEFAULT_LIFETIME = 86400;
+}
+
+iotlib::lwm2m::RegistrationInterface::RegistrationInterface(iotlib::lwm2m::RegistrationStore *store) :
+    iotlib::coap::Resource("rd"),
+    m_store(store)
+{
+}
+
+iotlib::lwm2m::RegistrationInterface::~RegistrationInterface()
+{
+}
+
+iotlib::lwm2m::RegistrationStore *iotlib::lwm2m::RegistrationInterface::store() const
+{
+    return m_store;
+}
+
+void iotlib::lwm2m::RegistrationInterface::handle(const iotlib::coap::Message &request,
+                                                   iotlib::coap::Message &response)
+{
+    QByteArray location;
+    int segments = 0;
+    QByteArray endpointName;
+    quint32 lifetime = 0;
+    quint8 binding = 0;
+    for (int i = 0; i < request.optionsCount(); ++i) {
+        iotlib::coap::Option option = request.option(i);
+        if (option.type() == Message::OptionType::UriPath) {
+            if (++segments == 2)
+                location = option.data();
+        } else if (option.type() == Message::OptionType::UriQuery) {
+            QByteArray query = option.data();
+            if (query.startsWith("ep="))
+                endpointName = query.mid(3);
+            else if (query.startsWith("lt="))
+                lifetime = query.mid(3).toUInt();
+            else if (query.startsWith("b="))
+                binding = parseBinding(query.mid(2));
+        }
+    }
+    if (segments > 2) {
+        response.setCode(Message::Code::NotFound);
+        return;
+    }
+
+    QHostAddress address = request.address().hostAddress();
+    quint16 port = request.address().port();
+    if (segments == 1) { // Register
+        if (request.code() != Message::Code::Post) {
+            response.setCode(Message::Code::MethodNotAllowed);
+            return;
+        }
+        QVector<quint32> objects;
+        if (endpointName.isEmpty() || !parseObjects(request.content(), objects)) {
+            response.setCode(Message::Code::BadRequest);
+            return;
+        }
+        int slot = m_store->add(endpointName, address, port, lifetime ? lifetime : DEFAULT_LIFETIME,
+                                binding, objects);
+        if (slot < 0) {
+            response.setCode(Message::Code::ServiceUnavailable);
+            return;
+        }
+        response.setCode(Message::Code::Created);
+        response.addOption(Message::OptionType::LocationPath, "rd");
+        response.addOption(Message::OptionType::LocationPath, m_store->location(slot));
+        return;
+    }
+
+    int slot = m_store->slotForLocation(location);
+    if (slot < 0) {
+        response.setCode(Message::Code::NotFound);
+        return;
+    }
+    if (request.code() != Message::Code::Post && request.code() != Message::Code::Delete) {
+        response.setCode(Message::Code::MethodNotAllowed);
+        return;
+    }
+    // only the registered host may change or drop the registration, the port may move with NAT rebinding
+    Q_IPV6ADDR registered = m_store->address(slot).toIPv6Address();
+    Q_IPV6ADDR sender = address.toIPv6Address();
+    if (memcmp(registered.c, sender.c, sizeof(registered.c)) != 0) {
+        response.setCode(Message::Code::Forbidden);
+        return;
+    }
+    if (request.code() == Message::Code::Post) { // Update
+        if (request.content().isEmpty()) {
+            m_store->update(slot, address, port, lifetime, binding);
+        } else {
+            QVector<quint32> objects;
+            if (!parseObjects(request.content(), objects)) {
+                response.setCode(Message::Code::BadRequest);
+                return;
+            }
+            m_store->update(slot, address, port, lifetime, binding, &objects);
+        }
+        response.setCode(Message::Code::Changed);
+    } else { // De-register
+        m_store->remove(slot);
+        response.setCode(Message::Code::Deleted);
+    }
+}
+
+bool iotlib::lwm2m::RegistrationInterface::parseObjects(const QByteArray &payload, QVector<quint32> &objects)
+{
+    const char *p = payload.constData();
+    const char *end = p + payload.size();
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',' || *p == '\n' || *p == '\r'))
+            ++p;
+        if (p == end)
+            break;
+        if (*p++ != '<')
+            return false;
+        const char *close = static_cast<const char *>(memchr(p, '>', end - p));
+        if (!close)
+            return false;
+
+        // "</1/0>", "</5>"; root "</>" and alternate paths are not objects
+        int ids[2] = { -1, -1 };
+        int depth = 0;
+        bool numeric = true;
+        for (const char *c = p; c < close && numeric; ++c) {
+            if (*c == '/') {
+                if (c + 1 < close && depth < 2)
+                    ids[depth++] = 0;
+                else if (c + 1 < close)
+                    numeric = false;
+            } else if (*c >= '0' && *c <= '9' && depth > 0) {
+                ids[depth - 1] = ids[depth - 1] * 10 + (*c - '0');
+                numeric = ids[depth - 1] <= 0xffff;
+            } else {
+                numeric = false;
+            }
+        }
+        if (numeric && depth > 0 && (depth == 1 || ids[1] < 0xffff))
+            objects.append(quint32(ids[0]) << 16 | quint32(depth == 2 ? ids[1] : 0xffff));
+
+        // skip attributes up to the next link, commas in quoted values included
+        p = close + 1;
+        bool quoted = false;
+        while (p < end && (quoted || *p != ',')) {
+            if (*p == '"')
+                quoted = !quoted;
+            ++p;
+        }
+    }
+    return true;
+}
+
+quint8 iotlib::lwm2m::RegistrationInterface::parseBinding(const QByteArray &binding)
+{
+    quint8 flags = 0;
+    foreach (char c, binding) {
+        switch (c) {
+        case 'U': flags |= RegistrationStore::Udp; break;
+        case 'T': flags |= RegistrationStore::Tcp; break;
+        case 'S': flags |= RegistrationStore::Sms; break;
+        case 'N': flags |= RegistrationStore::NonIp; break;
+        case 'Q': flags |= RegistrationStore::Queue; break;
+        default: break;
+        }
+    }
+    return flags;
+}
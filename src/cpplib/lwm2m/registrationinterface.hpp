@@ -0,0 +1,47 @@
+#ifndef LWM2M_REGISTRATIONINTERFACE_H
+#define LWM2M_REGISTRATIONINTERFACE_H
+
+#include "../iotlib_global.h"
+#include "../coap/resource.hpp"
+
+#include <QVector>
+
+namespace iotlib {
+namespace lwm2m {
+
+class RegistrationStore;
+/**
+ * @brief The RegistrationInterface class is the server side of LWM2M Register, Update and De-register
+ * Register it with Stack::addResource(), it serves "rd":
+ * POST /rd?ep=name&lt=86400&b=U with link-format object list -> 2.01 Created, Location-Path rd/<id>
+ * POST /rd/<id>?lt=..&b=.. with optional object list            -> 2.04 Changed
+ * DELETE /rd/<id>                                                -> 2.02 Deleted
+ * Update and De-register are accepted only from the host that registered, others get 4.03 Forbidden.
+ * Registrations are kept in the store, which is not owned.
+ */
+class IOTLIB_SHARED_EXPORT RegistrationInterface : public coap::Resource
+{
+public:
+    explicit RegistrationInterface(RegistrationStore *store);
+    ~RegistrationInterface();
+
+    RegistrationStore *store() const;
+
+    void handle(const coap::Message &request, coap::Message &response);
+
+    /**
+     * @brief parseObjects reads object list in CoRE link-format, like "</1/0>,</3/0>,</5>"
+     * @param objects object id << 16 | instance id, 0xffff for objects without instances
+     * @return false on malformed payload
+     */
+    static bool parseObjects(const QByteArray &payload, QVector<quint32> &objects);
+    static quint8 parseBinding(const QByteArray &binding);
+
+private:
+    RegistrationStore *m_store;
+};
+
+} // lwm2m
+} // iotlib
+
+#endif // LWM2M_REGISTRATIONINTERFACE_H
@@ -0,0 +1,449 @@
+#include "registrationstore.hpp"
+
+#include <QTimerEvent>
+#include <QDebug>
+#include <QtAlgorithms>
+
+#include <algorithm>
+#include <random>
+#include <string.h>
+
+namespace {
+const int WHEEL_SIZE = 1 << 16;         ///< seconds, longer lifetimes wrap around and wait for the next turn
+const int MAX_SLOTS = 1 << 24;          ///< slot has to fit in 24 bits of location and object index entry
+const int COMPACT_THRESHOLD = 64 * 1024;
+const int SECRET_DIGITS = 16;           ///< location is 64 random bits then the slot, both in hex
+const int SLOT_DIGITS = 6;
+
+quint64 randomSecret()
+{
+    // random_device reads the system entropy source, qrand() would make locations predictable
+    std::random_device device;
+    return quint64(device()) << 32 | quint64(device());
+}
+}
+
+iotlib::lwm2m::RegistrationStore::RegistrationStore(int capacity, QObject *parent) :
+    QObject(parent),
+    m_nameGarbage(0),
+    m_objectGarbage(0),
+    m_wheel(WHEEL_SIZE, -1),
+    m_lastSweep(0),
+    m_count(0)
+{
+    m_nameOffset.reserve(capacity);
+    m_nameLength.reserve(capacity);
+    m_address.reserve(capacity);
+    m_port.reserve(capacity);
+    m_lifetime.reserve(capacity);
+    m_expiry.reserve(capacity);
+    m_binding.reserve(capacity);
+    m_secret.reserve(capacity);
+    m_objectsEpoch.reserve(capacity);
+    m_used.reserve(capacity);
+    m_objectsOffset.reserve(capacity);
+    m_objectsCount.reserve(capacity);
+    m_objectsCapacity.reserve(capacity);
+    m_wheelNext.reserve(capacity);
+    m_wheelPrev.reserve(capacity);
+    m_namePool.reserve(capacity * 16);
+    m_objectPool.reserve(capacity * 8);
+    m_slotByName.reserve(capacity);
+
+    m_clock.start();
+    m_sweepTimer.start(1000, this);
+}
+
+iotlib::lwm2m::RegistrationStore::~RegistrationStore()
+{
+}
+
+int iotlib::lwm2m::RegistrationStore::add(const QByteArray &endpointName, const QHostAddress &address, quint16 port,
+                                          quint32 lifetime, quint8 binding, const QVector<quint32> &objects)
+{
+    if (endpointName.isEmpty() || endpointName.size() > 0xffff)
+        return -1;
+    int old = m_slotByName.value(endpointName, -1);
+    if (old >= 0)
+        release(old);
+
+    int slot;
+    if (!m_freeSlots.isEmpty()) {
+        slot = m_freeSlots.takeLast();
+    } else {
+        slot = m_used.size();
+        if (slot >= MAX_SLOTS) {
+            qWarning() << "RegistrationStore is full";
+            return -1;
+        }
+        m_nameOffset.append(0);
+        m_nameLength.append(0);
+        m_address.append(Q_IPV6ADDR());
+        m_port.append(0);
+        m_lifetime.append(0);
+        m_expiry.append(0);
+        m_binding.append(0);
+        m_secret.append(0);
+        m_objectsEpoch.append(0);
+        m_used.append(false);
+        m_objectsOffset.append(0);
+        m_objectsCount.append(0);
+        m_objectsCapacity.append(0);
+        m_wheelNext.append(-1);
+        m_wheelPrev.append(-1);
+    }
+
+    m_nameOffset[slot] = m_namePool.size();
+    m_nameLength[slot] = endpointName.size();
+    m_namePool.append(endpointName);
+    m_address[slot] = address.toIPv6Address();
+    m_port[slot] = port;
+    m_lifetime[slot] = qMax<quint32>(lifetime, 1);
+    m_expiry[slot] = now() + m_lifetime[slot];
+    m_binding[slot] = binding ? binding : quint8(Udp);
+    m_secret[slot] = randomSecret();
+    m_used[slot] = true;
+    m_objectsCount[slot] = 0;
+    m_objectsCapacity[slot] = 0;
+    setObjects(slot, objects);
+    link(slot);
+
+    m_slotByName.insert(endpointName, slot);
+    ++m_count;
+    emit registered(slot);
+    return slot;
+}
+
+bool iotlib::lwm2m::RegistrationStore::update(int slot, const QHostAddress &address, quint16 port,
+                                              quint32 lifetime, quint8 binding, const QVector<quint32> *objects)
+{
+    if (!isValid(slot))
+        return false;
+    // NAT rebinding moves the port around, last update wins; the interface checks the host
+    m_address[slot] = address.toIPv6Address();
+    m_port[slot] = port;
+    if (lifetime)
+        m_lifetime[slot] = lifetime;
+    if (binding)
+        m_binding[slot] = binding;
+    if (objects)
+        setObjects(slot, *objects);
+    unlink(slot);
+    m_expiry[slot] = now() + m_lifetime[slot];
+    link(slot);
+    emit updated(slot);
+    return true;
+}
+
+bool iotlib::lwm2m::RegistrationStore::remove(int slot)
+{
+    if (!isValid(slot))
+        return false;
+    QByteArray name = endpointName(slot);
+    release(slot);
+    emit deregistered(name);
+    return true;
+}
+
+int iotlib::lwm2m::RegistrationStore::find(const QByteArray &endpointName) const
+{
+    return m_slotByName.value(endpointName, -1);
+}
+
+QVector<int> iotlib::lwm2m::RegistrationStore::findByObject(quint16 objectId) const
+{
+    QVector<int> slots;
+    QHash<quint16, ObjectIndex>::iterator it = m_slotsByObject.find(objectId);
+    if (it == m_slotsByObject.end())
+        return slots;
+    if (it->entries.size() > 2 * it->live + 16)
+        pruneIndex(objectId, *it);
+
+    slots.reserve(it->live);
+    foreach (quint32 entry, it->entries) {
+        int slot = entry & 0xffffff;
+        if (m_used[slot] && m_objectsEpoch[slot] == (entry >> 24) && hasObject(slot, objectId))
+            slots.append(slot);
+    }
+    if (slots.size() != it->live) { // epoch wrapped around, same slot indexed twice
+        qSort(slots);
+        slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+    }
+    return slots;
+}
+
+int iotlib::lwm2m::RegistrationStore::count() const
+{
+    return m_count;
+}
+
+bool iotlib::lwm2m::RegistrationStore::isValid(int slot) const
+{
+    return slot >= 0 && slot < m_used.size() && m_used[slot];
+}
+
+QByteArray iotlib::lwm2m::RegistrationStore::location(int slot) const
+{
+    if (!isValid(slot))
+        return QByteArray();
+    QByteArray location = QByteArray::number(m_secret[slot], 16).rightJustified(SECRET_DIGITS, '0');
+    location += QByteArray::number(slot, 16).rightJustified(SLOT_DIGITS, '0');
+    return location;
+}
+
+int iotlib::lwm2m::RegistrationStore::slotForLocation(const QByteArray &location) const
+{
+    if (location.size() != SECRET_DIGITS + SLOT_DIGITS)
+        return -1;
+    bool ok;
+    quint64 secret = location.left(SECRET_DIGITS).toULongLong(&ok, 16);
+    if (!ok)
+        return -1;
+    int slot = location.mid(SECRET_DIGITS).toInt(&ok, 16);
+    if (!ok || !isValid(slot) || m_secret[slot] != secret)
+        return -1;
+    return slot;
+}
+
+QByteArray iotlib::lwm2m::RegistrationStore::endpointName(int slot) const
+{
+    if (!isValid(slot))
+        return QByteArray();
+    return m_namePool.mid(m_nameOffset[slot], m_nameLength[slot]);
+}
+
+QHostAddress iotlib::lwm2m::RegistrationStore::address(int slot) const
+{
+    if (!isValid(slot))
+        return QHostAddress();
+    QHostAddress address(m_address[slot]);
+    bool isIpv4;
+    quint32 ipv4 = address.toIPv4Address(&isIpv4);
+    return isIpv4 ? QHostAddress(ipv4) : address;
+}
+
+quint16 iotlib::lwm2m::RegistrationStore::port(int slot) const
+{
+    return isValid(slot) ? m_port[slot] : 0;
+}
+
+quint32 iotlib::lwm2m::RegistrationStore::lifetime(int slot) const
+{
+    return isValid(slot) ? m_lifetime[slot] : 0;
+}
+
+quint8 iotlib::lwm2m::RegistrationStore::binding(int slot) const
+{
+    return isValid(slot) ? m_binding[slot] : 0;
+}
+
+QVector<quint32> iotlib::lwm2m::RegistrationStore::objects(int slot) const
+{
+    if (!isValid(slot))
+        return QVector<quint32>();
+    return m_objectPool.mid(m_objectsOffset[slot], m_objectsCount[slot]);
+}
+
+qint64 iotlib::lwm2m::RegistrationStore::expiresIn(int slot) const
+{
+    if (!isValid(slot))
+        return 0;
+    return qint64(m_expiry[slot]) - now();
+}
+
+void iotlib::lwm2m::RegistrationStore::timerEvent(QTimerEvent *e)
+{
+    if (e->timerId() != m_sweepTimer.timerId()) {
+        QObject::timerEvent(e);
+        return;
+    }
+
+    quint32 t = now();
+    quint32 from = m_lastSweep + 1;
+    if (t - m_lastSweep > quint32(WHEEL_SIZE)) // every bucket is due
+        from = t - WHEEL_SIZE + 1;
+    m_lastSweep = t;
+
+    QList<QByteArray> expiredNames;
+    for (quint32 s = from; s <= t && s >= from; ++s) {
+        qint32 slot = m_wheel[s & (WHEEL_SIZE - 1)];
+        while (slot >= 0) {
+            qint32 next = m_wheelNext[slot];
+            if (m_expiry[slot] <= t) { // otherwise it's a long lifetime waiting for the next turn
+                expiredNames.append(endpointName(slot));
+                release(slot);
+            }
+            slot = next;
+        }
+    }
+
+    if (!expiredNames.isEmpty())
+        emit expired(expiredNames);
+}
+
+quint32 iotlib::lwm2m::RegistrationStore::now() const
+{
+    return quint32(m_clock.elapsed() / 1000);
+}
+
+void iotlib::lwm2m::RegistrationStore::link(int slot)
+{
+    qint32 &head = m_wheel[m_expiry[slot] & (WHEEL_SIZE - 1)];
+    m_wheelPrev[slot] = -1;
+    m_wheelNext[slot] = head;
+    if (head >= 0)
+        m_wheelPrev[head] = slot;
+    head = slot;
+}
+
+void iotlib::lwm2m::RegistrationStore::unlink(int slot)
+{
+    qint32 prev = m_wheelPrev[slot];
+    qint32 next = m_wheelNext[slot];
+    if (prev >= 0)
+        m_wheelNext[prev] = next;
+    else
+        m_wheel[m_expiry[slot] & (WHEEL_SIZE - 1)] = next;
+    if (next >= 0)
+        m_wheelPrev[next] = prev;
+    m_wheelPrev[slot] = m_wheelNext[slot] = -1;
+}
+
+void iotlib::lwm2m::RegistrationStore::release(int slot)
+{
+    unlink(slot);
+    unindexObjects(slot);
+    m_slotByName.remove(m_namePool.mid(m_nameOffset[slot], m_nameLength[slot]));
+    m_nameGarbage += m_nameLength[slot];
+    m_objectGarbage += m_objectsCapacity[slot];
+    m_objectsCount[slot] = 0;
+    m_objectsCapacity[slot] = 0;
+    m_used[slot] = false;
+    m_secret[slot] = 0;
+    ++m_objectsEpoch[slot];
+    m_freeSlots.append(slot);
+    --m_count;
+
+    if (m_nameGarbage > COMPACT_THRESHOLD && m_nameGarbage > m_namePool.size() / 2)
+        compactNames();
+    if (m_objectGarbage > COMPACT_THRESHOLD && m_objectGarbage > m_objectPool.size() / 2)
+        compactObjects();
+}
+
+void iotlib::lwm2m::RegistrationStore::setObjects(int slot, const QVector<quint32> &objects)
+{
+    QVector<quint32> sorted = objects;
+    qSort(sorted);
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    if (sorted.size() > 0xffff)
+        sorted.resize(0xffff);
+
+    if (m_objectsCount[slot] == sorted.size() &&
+            (sorted.isEmpty() || !memcmp(m_objectPool.constData() + m_objectsOffset[slot],
+                                         sorted.constData(), sorted.size() * sizeof(quint32))))
+        return; // usual update, nothing changed
+
+    unindexObjects(slot);
+    if (sorted.size() > m_objectsCapacity[slot]) {
+        m_objectGarbage += m_objectsCapacity[slot];
+        m_objectsOffset[slot] = m_objectPool.size();
+        m_objectsCapacity[slot] = sorted.size();
+        m_objectPool.resize(m_objectPool.size() + sorted.size());
+    }
+    if (!sorted.isEmpty())
+        memcpy(m_objectPool.data() + m_objectsOffset[slot], sorted.constData(), sorted.size() * sizeof(quint32));
+    m_objectsCount[slot] = sorted.size();
+    ++m_objectsEpoch[slot];
+    indexObjects(slot);
+}
+
+void iotlib::lwm2m::RegistrationStore::indexObjects(int slot)
+{
+    const quint32 *objects = m_objectPool.constData() + m_objectsOffset[slot];
+    quint32 entry = quint32(slot) | quint32(m_objectsEpoch[slot]) << 24;
+    for (int i = 0; i < m_objectsCount[slot]; ++i) {
+        quint16 objectId = objects[i] >> 16;
+        if (i && (objects[i - 1] >> 16) == objectId)
+            continue; // another instance of the same object
+        QHash<quint16, ObjectIndex>::iterator it = m_slotsByObject.find(objectId);
+        if (it == m_slotsByObject.end()) {
+            ObjectIndex index;
+            index.live = 0;
+            it = m_slotsByObject.insert(objectId, index);
+        }
+        if (it->entries.size() > 2 * it->live + 16)
+            pruneIndex(objectId, *it);
+        it->entries.append(entry);
+        ++it->live;
+    }
+}
+
+void iotlib::lwm2m::RegistrationStore::unindexObjects(int slot)
+{
+    // entries stay in place and become stale once objects epoch changes
+    const quint32 *objects = m_objectPool.constData() + m_objectsOffset[slot];
+    for (int i = 0; i < m_objectsCount[slot]; ++i) {
+        quint16 objectId = objects[i] >> 16;
+        if (i && (objects[i - 1] >> 16) == objectId)
+            continue;
+        QHash<quint16, ObjectIndex>::iterator it = m_slotsByObject.find(objectId);
+        if (it != m_slotsByObject.end())
+            --it->live;
+    }
+}
+
+bool iotlib::lwm2m::RegistrationStore::hasObject(int slot, quint16 objectId) const
+{
+    const quint32 *begin = m_objectPool.constData() + m_objectsOffset[slot];
+    const quint32 *end = begin + m_objectsCount[slot];
+    const quint32 *it = std::lower_bound(begin, end, quint32(objectId) << 16);
+    return it != end && (*it >> 16) == objectId;
+}
+
+void iotlib::lwm2m::RegistrationStore::pruneIndex(quint16 objectId, ObjectIndex &index) const
+{
+    int kept = 0;
+    for (int i = 0; i < index.entries.size(); ++i) {
+        quint32 entry = index.entries[i];
+        int slot = entry & 0xffffff;
+        if (m_used[slot] && m_objectsEpoch[slot] == (entry >> 24) && hasObject(slot, objectId))
+            index.entries[kept++] = entry;
+    }
+    index.entries.resize(kept);
+    if (kept != index.live) {
+        qSort(index.entries);
+        index.entries.erase(std::unique(index.entries.begin(), index.entries.end()), index.entries.end());
+    }
+}
+
+void iotlib::lwm2m::RegistrationStore::compactNames()
+{
+    QByteArray pool;
+    pool.reserve(m_namePool.size() - m_nameGarbage);
+    for (int slot = 0; slot < m_used.size(); ++slot) {
+        if (!m_used[slot])
+            continue;
+        quint32 offset = pool.size();
+        pool.append(m_namePool.constData() + m_nameOffset[slot], m_nameLength[slot]);
+        m_nameOffset[slot] = offset;
+    }
+    m_namePool = pool;
+    m_nameGarbage = 0;
+}
+
+void iotlib::lwm2m::RegistrationStore::compactObjects()
+{
+    QVector<quint32> pool;
+    pool.reserve(m_objectPool.size() - m_objectGarbage);
+    for (int slot = 0; slot < m_used.size(); ++slot) {
+        if (!m_used[slot])
+            continue;
+        quint32 offset = pool.size();
+        for (int i = 0; i < m_objectsCount[slot]; ++i)
+            pool.append(m_objectPool[m_objectsOffset[slot] + i]);
+        m_objectsOffset[slot] = offset;
+        m_objectsCapacity[slot] = m_objectsCount[slot];
+    }
+    m_objectPool = pool;
+    m_objectGarbage = 0;
+}
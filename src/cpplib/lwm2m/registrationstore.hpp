@@ -0,0 +1,144 @@
+#ifndef LWM2M_REGISTRATIONSTORE_H
+#define LWM2M_REGISTRATIONSTORE_H
+
+#include "../iotlib_global.h"
+
+#include <QObject>
+#include <QHostAddress>
+#include <QVector>
+#include <QHash>
+#include <QBasicTimer>
+#include <QElapsedTimer>
+
+namespace iotlib {
+namespace lwm2m {
+
+/**
+ * @brief The RegistrationStore class keeps LWM2M client registrations in columns, one slot per endpoint.
+ * Every field lives in it's own array indexed by slot, endpoint names are interned in one pool,
+ * object lists share another one. Update of lifetime, binding or address rewrites one slot in place,
+ * expiry is tracked with a timer wheel threaded through the slots, so there are no per client timers
+ * and no per client allocations. Secondary indexes: by endpoint name and by object id.
+ */
+class IOTLIB_SHARED_EXPORT RegistrationStore : public QObject
+{
+    Q_OBJECT
+public:
+    enum Binding : quint8 {
+        Udp   = 0x01,
+        Tcp   = 0x02,
+        Sms   = 0x04,
+        NonIp = 0x08,
+        Queue = 0x10
+    };
+
+    /**
+     * @param capacity number of slots to reserve up front
+     */
+    explicit RegistrationStore(int capacity = 1024, QObject *parent = 0);
+    ~RegistrationStore();
+
+    /**
+     * @brief add registers endpoint, previous registration with the same name is replaced
+     * @param objects object id << 16 | instance id, 0xffff instance id for objects without instances
+     * @return slot
+     */
+    int add(const QByteArray &endpointName, const QHostAddress &address, quint16 port,
+            quint32 lifetime, quint8 binding, const QVector<quint32> &objects);
+    /**
+     * @brief update refreshes registration, lifetime and binding of 0 keep old values,
+     * objects are replaced only if non null
+     */
+    bool update(int slot, const QHostAddress &address, quint16 port,
+                quint32 lifetime, quint8 binding, const QVector<quint32> *objects = 0);
+    bool remove(int slot);
+
+    int find(const QByteArray &endpointName) const;
+    QVector<int> findByObject(quint16 objectId) const;
+    int count() const;
+    bool isValid(int slot) const;
+
+    /**
+     * @brief location returns registration id for Location-Path, 64 random bits followed by the slot,
+     * so it can't be guessed from other registrations and changes when slot is reused
+     */
+    QByteArray location(int slot) const;
+    int slotForLocation(const QByteArray &location) const;
+
+    QByteArray endpointName(int slot) const;
+    QHostAddress address(int slot) const;
+    quint16 port(int slot) const;
+    quint32 lifetime(int slot) const;
+    quint8 binding(int slot) const;
+    QVector<quint32> objects(int slot) const;
+    /**
+     * @brief expiresIn returns seconds left until registration expires
+     */
+    qint64 expiresIn(int slot) const;
+
+signals:
+    void registered(int slot);
+    void updated(int slot);
+    void deregistered(const QByteArray &endpointName);
+    /**
+     * @brief expired is emitted once per sweep with every registration that ran out of lifetime
+     */
+    void expired(const QList<QByteArray> &endpointNames);
+
+protected:
+    void timerEvent(QTimerEvent *e);
+
+private:
+    struct ObjectIndex {
+        QVector<quint32> entries;   ///< slot | objects epoch << 24, stale entries are dropped lazily
+        int live;
+    };
+
+    quint32 now() const;
+    void link(int slot);
+    void unlink(int slot);
+    void release(int slot);
+    void setObjects(int slot, const QVector<quint32> &objects);
+    void indexObjects(int slot);
+    void unindexObjects(int slot);
+    bool hasObject(int slot, quint16 objectId) const;
+    void pruneIndex(quint16 objectId, ObjectIndex &index) const;
+    void compactNames();
+    void compactObjects();
+
+    // columns, indexed by slot
+    QVector<quint32> m_nameOffset;
+    QVector<quint16> m_nameLength;
+    QVector<Q_IPV6ADDR> m_address;
+    QVector<quint16> m_port;
+    QVector<quint32> m_lifetime;
+    QVector<quint32> m_expiry;        ///< seconds on m_clock
+    QVector<quint8> m_binding;
+    QVector<quint64> m_secret;        ///< random part of location, 0 while slot is free
+    QVector<quint8> m_objectsEpoch;
+    QVector<bool> m_used;
+    QVector<quint32> m_objectsOffset;
+    QVector<quint16> m_objectsCount;
+    QVector<quint16> m_objectsCapacity;
+    QVector<qint32> m_wheelNext;      ///< expiry wheel, intrusive doubly linked list per bucket
+    QVector<qint32> m_wheelPrev;
+    QVector<int> m_freeSlots;
+
+    QByteArray m_namePool;
+    int m_nameGarbage;
+    QVector<quint32> m_objectPool;
+    int m_objectGarbage;
+
+    QHash<QByteArray, int> m_slotByName;
+    mutable QHash<quint16, ObjectIndex> m_slotsByObject;
+    QVector<qint32> m_wheel;
+    quint32 m_lastSweep;
+    QElapsedTimer m_clock;
+    int m_count;
+    QBasicTimer m_sweepTimer;
+};
+
+} // lwm2m
+} // iotlib
+
+#endif // LWM2M_REGISTRATIONSTORE_H
@@ -0,0 +1,287 @@
+#include "senmlcbor.hpp"
+#include "endianhelper.h"
+
+#include <QStringList>
+
+#include <string.h>
+#include <math.h>
+
+namespace iotlib {
+namespace lwm2m {
+
+enum CborMajorType {
+    UnsignedInt = 0,
+    NegativeInt = 1,
+    ByteString  = 2,
+    TextString  = 3,
+    Array       = 4,
+    Map         = 5,
+    Simple      = 7
+};
+
+// SenML labels, RFC8428 6
+enum SenmlLabel {
+    BaseName     = -2,
+    Name         = 0,
+    Value        = 2,
+    StringValue  = 3,
+    BooleanValue = 4,
+    DataValue    = 8
+};
+
+static const char objectLinkLabel[] = "vlo"; // LWM2M 1.1 object link value
+
+static void write_head(QByteArray &out, CborMajorType major, quint64 value)
+{
+    quint8 m = major << 5;
+    if (value < 24) {
+        out.append((char)(m | value));
+    } else if (value <= 0xff) {
+        out.append((char)(m | 24));
+        out.append((char)value);
+    } else if (value <= 0xffff) {
+        char data[2];
+        endian_store16(data, (quint16)value);
+        out.append((char)(m | 25));
+        out.append(data, 2);
+    } else if (value <= 0xffffffffULL) {
+        char data[4];
+        endian_store32(data, (quint32)value);
+        out.append((char)(m | 26));
+        out.append(data, 4);
+    } else {
+        char data[8];
+        endian_store64(data, value);
+        out.append((char)(m | 27));
+        out.append(data, 8);
+    }
+}
+
+static void write_int(QByteArray &out, qint64 value)
+{
+    if (value >= 0)
+        write_head(out, UnsignedInt, value);
+    else
+        write_head(out, NegativeInt, (quint64)(-1 - value));
+}
+
+static void write_text(QByteArray &out, const QByteArray &utf8)
+{
+    write_head(out, TextString, utf8.size());
+    out.append(utf8);
+}
+
+static void write_double(QByteArray &out, double value)
+{
+    quint64 bits;
+    memcpy(&bits, &value, 8);
+    char data[8];
+    endian_store64(data, bits);
+    out.append((char)0xfb);
+    out.append(data, 8);
+}
+
+class CborReader
+{
+public:
+    CborReader(const QByteArray &data) :
+        p((const quint8 *)data.constData()), end(p + data.size())
+    { }
+
+    bool atEnd() const { return p >= end; }
+
+    bool readHead(quint8 &major, quint8 &info, quint64 &value)
+    {
+        if (p >= end)
+            return false;
+        major = *p >> 5;
+        info = *p & 0x1f;
+        p++;
+        int size = info == 24 ? 1 : (info == 25 ? 2 : (info == 26 ? 4 : (info == 27 ? 8 : 0)));
+        if (info > 27 || end - p < size) // indefinite lengths are not used by SenML encoders
+            return false;
+        value = info < 24 ? info : 0;
+        for (int i = 0; i < size; ++i)
+            value = (value << 8) | *p++;
+        return true;
+    }
+
+    bool read(QVariant &item, int depth = 0)
+    {
+        quint8 major, info;
+        quint64 value;
+        if (depth > 4 || !readHead(major, info, value))
+            return false;
+        switch (major) {
+        case UnsignedInt:
+            item = value <= 0x7fffffffffffffffULL ? QVariant((qint64)value) : QVariant(value);
+            return true;
+        case NegativeInt:
+            item = (qint64)(-1 - (qint64)value);
+            return true;
+        case ByteString:
+        case TextString:
+            if ((quint64)(end - p) < value)
+                return false;
+            if (major == ByteString)
+                item = QByteArray((const char *)p, value);
+            else
+                item = QString::fromUtf8((const char *)p, value);
+            p += value;
+            return true;
+        case Array: {
+            QVariantList list;
+            for (quint64 i = 0; i < value; ++i) {
+                QVariant element;
+                if (!read(element, depth + 1))
+                    return false;
+                list.append(element);
+            }
+            item = list;
+            return true;
+        }
+        case Map: {
+            QVariantMap map; // integer labels become their decimal strings
+            for (quint64 i = 0; i < value; ++i) {
+                QVariant key, element;
+                if (!read(key, depth + 1) || !read(element, depth + 1))
+                    return false;
+                map.insert(key.toString(), element);
+            }
+            item = map;
+            return true;
+        }
+        case Simple:
+            if (info == 20 || info == 21) {
+                item = info == 21;
+            } else if (info == 22 || info == 23) {
+                item = QVariant();
+            } else if (info == 25) {
+                item = half_to_double(value);
+            } else if (info == 26) {
+                quint32 bits = value;
+                float f;
+                memcpy(&f, &bits, 4);
+                item = (double)f;
+            } else if (info == 27) {
+                double d;
+                memcpy(&d, &value, 8);
+                item = d;
+            } else {
+                return false;
+            }
+            return true;
+        default:
+            return false;
+        }
+    }
+
+private:
+    static double half_to_double(quint64 half)
+    {
+        int exponent = (half >> 10) & 0x1f;
+        int mantissa = half & 0x3ff;
+        double value;
+        if (exponent == 0)
+            value = ldexp(mantissa, -24);
+        else if (exponent != 31)
+            value = ldexp(mantissa + 1024, exponent - 25);
+        else
+            value = mantissa == 0 ? INFINITY : NAN;
+        return (half & 0x8000) ? -value : value;
+    }
+
+    const quint8 *p;
+    const quint8 *end;
+};
+
+} // lwm2m
+} // iotlib
+
+QByteArray iotlib::lwm2m::SenmlCbor::encode(const QVector<iotlib::lwm2m::Record> &records,
+                                            const QVector<iotlib::lwm2m::ResourceType> &types)
+{
+    QByteArray out;
+    write_head(out, Array, records.size());
+    for (int i = 0; i < records.size(); ++i) {
+        const Record &record = records[i];
+        bool hasValue = record.value.isValid();
+        write_head(out, Map, hasValue ? 2 : 1);
+        write_int(out, Name);
+        write_text(out, record.path.toString().toUtf8());
+        if (!hasValue)
+            continue;
+
+        switch (types.value(i, ResourceType::None)) {
+        case ResourceType::String:
+            write_int(out, StringValue);
+            write_text(out, record.value.toString().toUtf8());
+            break;
+        case ResourceType::Boolean:
+            write_int(out, BooleanValue);
+            out.append((char)(record.value.toBool() ? 0xf5 : 0xf4));
+            break;
+        case ResourceType::Opaque:
+            write_int(out, DataValue);
+            write_head(out, ByteString, record.value.toByteArray().size());
+            out.append(record.value.toByteArray());
+            break;
+        case ResourceType::Float:
+            write_int(out, Value);
+            write_double(out, record.value.toDouble());
+            break;
+        case ResourceType::ObjectLink: {
+            quint32 link = record.value.toUInt();
+            write_text(out, objectLinkLabel);
+            write_text(out, QString("%1:%2").arg(link >> 16).arg(link & 0xffff).toLatin1());
+            break;
+        }
+        case ResourceType::UnsignedInteger:
+            write_int(out, Value);
+            write_head(out, UnsignedInt, record.value.toULongLong());
+            break;
+        default:
+            write_int(out, Value);
+            write_int(out, record.value.toLongLong());
+        }
+    }
+    return out;
+}
+
+bool iotlib::lwm2m::SenmlCbor::decode(const QByteArray &data, QVector<iotlib::lwm2m::Record> &records)
+{
+    CborReader reader(data);
+    QVariant root;
+    if (!reader.read(root) || root.type() != QVariant::List)
+        return false;
+
+    QString baseName;
+    foreach (const QVariant &item, root.toList()) {
+        QVariantMap map = item.toMap();
+        if (map.isEmpty())
+            return false;
+        if (map.contains(QString::number(BaseName)))
+            baseName = map.value(QString::number(BaseName)).toString();
+        Path path = Path::fromString(baseName + map.value(QString::number(Name)).toString());
+        if (!path.isValid())
+            return false;
+
+        QVariant value;
+        if (map.contains(QString::number(Value)))
+            value = map.value(QString::number(Value));
+        else if (map.contains(QString::number(StringValue)))
+            value = map.value(QString::number(StringValue));
+        else if (map.contains(QString::number(BooleanValue)))
+            value = map.value(QString::number(BooleanValue));
+        else if (map.contains(QString::number(DataValue)))
+            value = map.value(QString::number(DataValue));
+        else if (map.contains(objectLinkLabel)) {
+            QStringList link = map.value(objectLinkLabel).toString().split(":");
+            if (link.size() != 2)
+                return false;
+            value = (quint32)((link[0].toUInt() << 16) | (link[1].toUInt() & 0xffff));
+        }
+        records.append(Record{path, value});
+    }
+    return true;
+}
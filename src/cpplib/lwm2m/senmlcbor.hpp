@@ -0,0 +1,35 @@
+#ifndef LWM2M_SENMLCBOR_H
+#define LWM2M_SENMLCBOR_H
+
+#include "object.hpp"
+
+#include <QByteArray>
+
+namespace iotlib {
+namespace lwm2m {
+
+/**
+ * @brief The SenmlCbor class encodes and decodes SenML records in CBOR (RFC8428, content format 112)
+ * Records carry full paths in "n", decoder also accepts "bn" base names.
+ */
+class SenmlCbor
+{
+public:
+    /**
+     * @brief encode packs records, types[i] tells how records[i].value goes on the wire
+     */
+    static QByteArray encode(const QVector<Record> &records, const QVector<ResourceType> &types);
+    /**
+     * @brief decode unpacks records, values are typed as they came in CBOR (qint64, double, QString, bool, QByteArray),
+     * object links are converted back to quint32, records without value (Read-Composite request) get invalid QVariant
+     */
+    static bool decode(const QByteArray &data, QVector<Record> &records);
+
+private:
+    SenmlCbor();
+};
+
+} // lwm2m
+} // iotlib
+
+#endif // LWM2M_SENMLCBOR_H
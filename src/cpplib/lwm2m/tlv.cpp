@@ -0,0 +1,286 @@
+#include "tlv.hpp"
+#include "endianhelper.h"
+
+#include <string.h>
+
+namespace iotlib {
+namespace lwm2m {
+
+enum IdentifierType {
+    ObjectInstance   = 0,
+    ResourceInstance = 1,
+    MultipleResource = 2,
+    ResourceValue    = 3
+};
+
+static void write_tlv(QByteArray &out, IdentifierType identifierType, quint16 id, const QByteArray &value)
+{
+    quint8 type = identifierType << 6;
+    if (id > 0xff)
+        type |= 0x20;
+    int length = value.size();
+    if (length < 8)
+        type |= length;
+    else if (length <= 0xff)
+        type |= 0x08;
+    else if (length <= 0xffff)
+        type |= 0x10;
+    else
+        type |= 0x18;
+
+    out.append((char)type);
+    if (id > 0xff)
+        out.append((char)(id >> 8));
+    out.append((char)(id & 0xff));
+    if (length >= 8) {
+        if (length > 0xffff)
+            out.append((char)(length >> 16));
+        if (length > 0xff)
+            out.append((char)(length >> 8));
+        out.append((char)length);
+    }
+    out.append(value);
+}
+
+static bool read_tlv(const quint8 *&p, const quint8 *end,
+                     IdentifierType &identifierType, quint16 &id, QByteArray &value)
+{
+    if (p >= end)
+        return false;
+    quint8 type = *p++;
+    identifierType = (IdentifierType)(type >> 6);
+    int idSize = (type & 0x20) ? 2 : 1;
+    int lengthSize = (type >> 3) & 0x03;
+    if (end - p < idSize + lengthSize)
+        return false;
+    id = idSize == 2 ? endian_load16(quint16, p) : *p;
+    p += idSize;
+    int length = type & 0x07;
+    if (lengthSize) {
+        length = 0;
+        for (int i = 0; i < lengthSize; ++i)
+            length = (length << 8) | *p++;
+    }
+    if (end - p < length)
+        return false;
+    value = QByteArray((const char *)p, length);
+    p += length;
+    return true;
+}
+
+static QByteArray pack_int(qint64 value)
+{
+    char data[8];
+    int size;
+    if (value >= -128 && value <= 127) {
+        data[0] = (qint8)value;
+        size = 1;
+    } else if (value >= -32768 && value <= 32767) {
+        endian_store16(data, (quint16)value);
+        size = 2;
+    } else if (value >= -2147483647LL - 1 && value <= 2147483647LL) {
+        endian_store32(data, (quint32)value);
+        size = 4;
+    } else {
+        endian_store64(data, (quint64)value);
+        size = 8;
+    }
+    return QByteArray(data, size);
+}
+
+static QByteArray pack_value(ResourceType type, const QVariant &value)
+{
+    switch (type) {
+    case ResourceType::String:
+        return value.toString().toUtf8();
+    case ResourceType::Integer:
+    case ResourceType::Time:
+        return pack_int(value.toLongLong());
+    case ResourceType::UnsignedInteger: {
+        // LWM2M 1.1 unsigned integers are not sign extended, 0x80 takes one byte
+        quint64 u = value.toULongLong();
+        char data[8];
+        int size;
+        if (u <= 0xff) {
+            data[0] = (char)u;
+            size = 1;
+        } else if (u <= 0xffff) {
+            endian_store16(data, (quint16)u);
+            size = 2;
+        } else if (u <= 0xffffffffULL) {
+            endian_store32(data, (quint32)u);
+            size = 4;
+        } else {
+            endian_store64(data, u);
+            size = 8;
+        }
+        return QByteArray(data, size);
+    }
+    case ResourceType::Float: {
+        double d = value.toDouble();
+        quint64 bits;
+        memcpy(&bits, &d, 8);
+        char data[8];
+        endian_store64(data, bits);
+        return QByteArray(data, 8);
+    }
+    case ResourceType::Boolean:
+        return QByteArray(1, value.toBool() ? 1 : 0);
+    case ResourceType::Opaque:
+        return value.toByteArray();
+    case ResourceType::ObjectLink: {
+        char data[4];
+        endian_store32(data, value.toUInt());
+        return QByteArray(data, 4);
+    }
+    default:
+        return QByteArray();
+    }
+}
+
+static QVariant unpack_value(ResourceType type, const QByteArray &data)
+{
+    const quint8 *p = (const quint8 *)data.constData();
+    switch (type) {
+    case ResourceType::String:
+        return QString::fromUtf8(data);
+    case ResourceType::Integer:
+    case ResourceType::Time:
+        switch (data.size()) {
+        case 1: return (qint64)(qint8)p[0];
+        case 2: return (qint64)(qint16)endian_load16(quint16, p);
+        case 4: return (qint64)(qint32)endian_load32(quint32, p);
+        case 8: return (qint64)endian_load64(quint64, p);
+        default: return QVariant();
+        }
+    case ResourceType::UnsignedInteger:
+        switch (data.size()) {
+        case 1: return (quint64)p[0];
+        case 2: return (quint64)endian_load16(quint16, p);
+        case 4: return (quint64)endian_load32(quint32, p);
+        case 8: return endian_load64(quint64, p);
+        default: return QVariant();
+        }
+    case ResourceType::Float:
+        if (data.size() == 4) {
+            quint32 bits = endian_load32(quint32, p);
+            float f;
+            memcpy(&f, &bits, 4);
+            return (double)f;
+        } else if (data.size() == 8) {
+            quint64 bits = endian_load64(quint64, p);
+            double d;
+            memcpy(&d, &bits, 8);
+            return d;
+        }
+        return QVariant();
+    case ResourceType::Boolean:
+        return data.size() == 1 ? QVariant(p[0] != 0) : QVariant();
+    case ResourceType::Opaque:
+        return data;
+    case ResourceType::ObjectLink:
+        return data.size() == 4 ? QVariant(endian_load32(quint32, p)) : QVariant();
+    default:
+        return QVariant();
+    }
+}
+
+static QByteArray pack_resources(const Object &object, const QVector<Record> &records, int &i)
+{
+    // records of one instance, multiple resource instances are grouped under their resource
+    QByteArray out;
+    int instanceId = records[i].path.instanceId;
+    while (i < records.size() && records[i].path.instanceId == instanceId) {
+        const Record &record = records[i];
+        const ResourceDefinition &resource = object.definition()->resources[object.resourceIndex(record.path.resourceId)];
+        if (!resource.multiple) {
+            write_tlv(out, ResourceValue, resource.id, pack_value(resource.type, record.value));
+            ++i;
+            continue;
+        }
+        QByteArray instances;
+        while (i < records.size() && records[i].path.instanceId == instanceId &&
+               records[i].path.resourceId == resource.id) {
+            write_tlv(instances, ResourceInstance, records[i].path.resourceInstanceId,
+                      pack_value(resource.type, records[i].value));
+            ++i;
+        }
+        write_tlv(out, MultipleResource, resource.id, instances);
+    }
+    return out;
+}
+
+static bool unpack_resources(const quint8 *p, const quint8 *end, const Object &object,
+                             int instanceId, QVector<Record> &records)
+{
+    while (p < end) {
+        IdentifierType identifierType;
+        quint16 id;
+        QByteArray value;
+        if (!read_tlv(p, end, identifierType, id, value))
+            return false;
+        int index = object.resourceIndex(id);
+        if (index < 0)
+            return false;
+        ResourceType type = object.definition()->resources[index].type;
+        if (identifierType == ResourceValue) {
+            records.append(Record{Path(object.id(), instanceId, id), unpack_value(type, value)});
+        } else if (identifierType == MultipleResource) {
+            const quint8 *ip = (const quint8 *)value.constData();
+            const quint8 *iend = ip + value.size();
+            while (ip < iend) {
+                IdentifierType instanceType;
+                quint16 resourceInstanceId;
+                QByteArray instanceValue;
+                if (!read_tlv(ip, iend, instanceType, resourceInstanceId, instanceValue) ||
+                        instanceType != ResourceInstance)
+                    return false;
+                records.append(Record{Path(object.id(), instanceId, id, resourceInstanceId),
+                                      unpack_value(type, instanceValue)});
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // lwm2m
+} // iotlib
+
+QByteArray iotlib::lwm2m::Tlv::encode(const iotlib::lwm2m::Object &object,
+                                      const QVector<iotlib::lwm2m::Record> &records, int depth)
+{
+    QByteArray out;
+    int i = 0;
+    while (i < records.size()) {
+        int instanceId = records[i].path.instanceId;
+        QByteArray resources = pack_resources(object, records, i);
+        if (depth <= 1)
+            write_tlv(out, ObjectInstance, instanceId, resources);
+        else
+            out.append(resources);
+    }
+    return out;
+}
+
+bool iotlib::lwm2m::Tlv::decode(const QByteArray &data, const iotlib::lwm2m::Object &object,
+                                const iotlib::lwm2m::Path &base, QVector<iotlib::lwm2m::Record> &records)
+{
+    const quint8 *p = (const quint8 *)data.constData();
+    const quint8 *end = p + data.size();
+    if (base.instanceId >= 0)
+        return unpack_resources(p, end, object, base.instanceId, records);
+
+    while (p < end) {
+        IdentifierType identifierType;
+        quint16 instanceId;
+        QByteArray value;
+        if (!read_tlv(p, end, identifierType, instanceId, value) || identifierType != ObjectInstance)
+            return false;
+        const quint8 *ip = (const quint8 *)value.constData();
+        if (!unpack_resources(ip, ip + value.size(), object, instanceId, records))
+            return false;
+    }
+    return true;
+}
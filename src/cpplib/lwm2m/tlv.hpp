@@ -0,0 +1,35 @@
+#ifndef LWM2M_TLV_H
+#define LWM2M_TLV_H
+
+#include "object.hpp"
+
+#include <QByteArray>
+
+namespace iotlib {
+namespace lwm2m {
+
+/**
+ * @brief The Tlv class encodes and decodes OMA LWM2M TLV (content format 11542)
+ */
+class Tlv
+{
+public:
+    /**
+     * @brief encode packs records read from object
+     * @param depth of the request path: 1 packs Object Instance TLVs, 2 and 3 pack resources directly
+     */
+    static QByteArray encode(const Object &object, const QVector<Record> &records, int depth);
+    /**
+     * @brief decode unpacks TLV written to base path, value types are taken from object definition
+     * @return false on malformed data or unknown resources
+     */
+    static bool decode(const QByteArray &data, const Object &object, const Path &base, QVector<Record> &records);
+
+private:
+    Tlv();
+};
+
+} // lwm2m
+} // iotlib
+
+#endif // LWM2M_TLV_H
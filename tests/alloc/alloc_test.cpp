@@ -0,0 +1,407 @@
+#include <QtTest>
+#include <QLoggingCategory>
+#include <QHostAddress>
+
+#include <atomic>
+#include <functional>
+
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap/stack.hpp"
+#include "coap/exchange.hpp"
+#include "coap/resource.hpp"
+#include "coap/endpointbase.hpp"
+#include "coap/messagebuffer.hpp"
+#include "coap/timerqueue.hpp"
+
+using namespace iotlib::coap;
+
+/*
+ * Heap allocations of the per message paths. malloc and friends below replace glibc's for the whole
+ * process, the library's calls included. Every phase warms up first, so pools, hashes and vectors are
+ * at their steady size, then fails if the measured iterations allocate more than the phase's budget
+ * and prints the call stacks of the first allocations. Frames of functions the library doesn't export
+ * show as addresses, addr2line -Cfe libiot.so resolves them.
+ */
+
+namespace {
+const int WARMUP = 5000;                    ///< past the 4096 receives after which stacks expire peers
+const int MAX_SITES = 8;
+const int MAX_FRAMES = 16;
+const quint64 UNBOUNDED = ~quint64(0);       ///< budget of phases that are reported, not capped
+/// client Exchange GET round trip: the Exchange QObject and its private, Message and option data, the packed
+/// datagram, token, request key and MID hash nodes, the timer entry and the unpacked response come to about
+/// 30 allocations with Qt 5.5, this leaves headroom for other Qt builds and catches a new per request container
+const quint64 EXCHANGE_GET_BUDGET = 48;
+
+std::atomic<bool> counting(false);
+std::atomic<quint64> allocations(0);
+bool recordingSites = false;
+thread_local bool inHook = false;
+void *siteFrames[MAX_SITES][MAX_FRAMES];
+int siteDepth[MAX_SITES];
+
+void noteAllocation()
+{
+    if (!counting.load(std::memory_order_relaxed) || inHook)
+        return;
+    inHook = true; // backtrace() may allocate itself
+    quint64 n = allocations.fetch_add(1, std::memory_order_relaxed);
+    if (recordingSites && n < quint64(MAX_SITES))
+        siteDepth[n] = backtrace(siteFrames[n], MAX_FRAMES);
+    inHook = false;
+}
+
+QString describeSite(int site)
+{
+    QStringList frames;
+    for (int i = 0; i < siteDepth[site]; ++i) {
+        Dl_info info;
+        if (!dladdr(siteFrames[site][i], &info) || !info.dli_sname) {
+            frames << QString("0x%1 in %2").arg(quintptr(siteFrames[site][i]), 0, 16)
+                      .arg(info.dli_fname ? info.dli_fname : "?");
+            continue;
+        }
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(info.dli_sname, 0, 0, &status);
+        frames << QString::fromLatin1(status == 0 && demangled ? demangled : info.dli_sname);
+        free(demangled);
+    }
+    return frames.join("\n    ");
+}
+}
+
+#ifdef __GLIBC__
+#define ALLOCATION_COUNTING
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) noexcept
+{
+    noteAllocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept
+{
+    noteAllocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) noexcept
+{
+    noteAllocation();
+    return __libc_realloc(pointer, size);
+}
+
+void *memalign(size_t alignment, size_t size) noexcept
+{
+    noteAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    noteAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size) noexcept
+{
+    noteAllocation();
+    *pointer = __libc_memalign(alignment, size);
+    return *pointer ? 0 : ENOMEM;
+}
+}
+#endif
+
+/**
+ * Datagrams between two endpoints of one thread, queued in fixed slots until pump()
+ */
+class LoopbackEndpoint : public EndpointBase
+{
+public:
+    LoopbackEndpoint(const Address &address) :
+        m_address(address), m_peer(0), m_head(0), m_count(0), m_dropped(0), m_lastCode(0) { }
+
+    void setPeer(LoopbackEndpoint *peer) { m_peer = peer; }
+    int dropped() const { return m_dropped; }
+    int lastCode() const { return m_lastCode; }
+
+    /**
+     * @brief pump hands queued datagrams to the receiver, without one they are only counted
+     */
+    int pump()
+    {
+        int delivered = 0;
+        while (m_count) {
+            Datagram &datagram = m_queue[m_head];
+            m_head = (m_head + 1) % QUEUE_SIZE;
+            --m_count;
+            ++delivered;
+            m_lastCode = quint8(datagram.data[1]);
+            if (!receiver())
+                continue;
+            MessageBuffer buffer = MessageBuffer::allocate();
+            memcpy(buffer.data(), datagram.data, size_t(datagram.size));
+            buffer.setSize(datagram.size);
+            if (!buffer.parse())
+                continue;
+            buffer.view().setAddress(datagram.from);
+            deliver(buffer);
+        }
+        return delivered;
+    }
+
+    void send(const Message &coapMessage)
+    {
+        QByteArray packed = coapMessage.pack();
+        sendPacked(packed.constData(), packed.size(), coapMessage.address());
+    }
+
+    void sendPacked(const char *data, int size, const Address &address)
+    {
+        Q_UNUSED(address); // one peer only
+        if (m_peer)
+            m_peer->enqueue(data, size, m_address);
+    }
+
+private:
+    enum { QUEUE_SIZE = 16 };
+    struct Datagram {
+        Address from;
+        int size;
+        char data[MessageBuffer::Capacity];
+    };
+
+    void enqueue(const char *data, int size, const Address &from)
+    {
+        if (m_count == QUEUE_SIZE || size < 4 || size > MessageBuffer::Capacity) {
+            ++m_dropped;
+            return;
+        }
+        Datagram &datagram = m_queue[(m_head + m_count) % QUEUE_SIZE];
+        datagram.from = from;
+        datagram.size = size;
+        memcpy(datagram.data, data, size_t(size));
+        ++m_count;
+    }
+
+    Address m_address;
+    LoopbackEndpoint *m_peer;
+    Datagram m_queue[QUEUE_SIZE];
+    int m_head;
+    int m_count;
+    int m_dropped;
+    int m_lastCode;
+};
+
+class DataResource : public Resource
+{
+public:
+    DataResource() : Resource("data") { }
+
+    bool handleBuffer(const MessageView &, MessageBuffer &response)
+    {
+        response.setCode(Message::Code::Content);
+        response.addOption(Message::OptionType::ContentFormat, quint32(Message::ContentFormat::TextPlain));
+        response.setPayload("0123456789abcdef", 16);
+        return true;
+    }
+
+    void handle(const Message &, Message &response)
+    {
+        response.setCode(Message::Code::Content);
+        response.setContent(QByteArray("0123456789abcdef"));
+    }
+};
+
+class AllocTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void test_messageBuffer();
+    void test_timerQueue();
+    void test_serverGet();
+    void test_exchangeGet();
+
+private:
+    quint64 measure(const char *phase, int iterations, quint64 budget, const std::function<void ()> &body);
+};
+
+void AllocTest::initTestCase()
+{
+#ifndef ALLOCATION_COUNTING
+    QSKIP("Allocations are counted by replacing glibc's malloc");
+#else
+    QLoggingCategory::setFilterRules("*.debug=false"); // stack's qDebug() on every exchange
+    void *frame;
+    backtrace(&frame, 1); // loads the unwinder, it allocates the first time
+
+    allocations.store(0);
+    counting.store(true);
+    QByteArray probe(64, 'x');
+    counting.store(false);
+    QVERIFY2(allocations.load() > 0, "malloc is not interposed, the test has to export its symbols (-rdynamic)");
+#endif
+}
+
+quint64 AllocTest::measure(const char *phase, int iterations, quint64 budget, const std::function<void ()> &body)
+{
+    for (int i = 0; i < WARMUP; ++i)
+        body();
+
+    allocations.store(0);
+    counting.store(true);
+    for (int i = 0; i < iterations; ++i)
+        body();
+    counting.store(false);
+    quint64 total = allocations.load();
+    if (budget == UNBOUNDED) {
+        qInfo("%s: %.2f allocations per iteration", phase, double(total) / iterations);
+        return total;
+    }
+    qInfo("%s: %.2f allocations per iteration, budget %llu", phase, double(total) / iterations, budget);
+    if (total <= budget * quint64(iterations))
+        return total;
+
+    // once more, with the call stacks of the first allocations
+    allocations.store(0);
+    recordingSites = true;
+    counting.store(true);
+    for (int i = 0; i < iterations && allocations.load() < quint64(MAX_SITES); ++i)
+        body();
+    counting.store(false);
+    recordingSites = false;
+    int sites = int(qMin<quint64>(allocations.load(), MAX_SITES));
+    for (int site = 0; site < sites; ++site)
+        qWarning("%s, allocation %d:\n    %s", phase, site + 1, qPrintable(describeSite(site)));
+    return total;
+}
+
+void AllocTest::test_messageBuffer()
+{
+    const int iterations = 100000;
+    char token[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    quint64 total = measure("MessageBuffer build and parse", iterations, 0, [&token]() {
+        MessageBuffer buffer = MessageBuffer::allocate();
+        buffer.setHeader(Message::Type::Confirmable, Message::Code::Get, 1, token, sizeof(token));
+        buffer.addOption(Message::OptionType::UriPath, "data", 4);
+        buffer.parse();
+    });
+    QVERIFY2(total == 0, "MessageBuffer allocates in steady state");
+}
+
+void AllocTest::test_timerQueue()
+{
+    const int iterations = 100000;
+    const int pending = 32;
+    TimerQueue queue;
+    QVector<QByteArray> keys;
+    for (int i = 0; i < pending * 2; ++i)
+        keys.append(QByteArray::number(i).rightJustified(8, '0'));
+    for (int i = 0; i < pending; ++i)
+        queue.addTimer(2000, keys.at(i));
+
+    int next = 0;
+    quint64 total = measure("TimerQueue add and remove", iterations, 0, [&queue, &keys, &next, pending]() {
+        queue.addTimer(2000, keys.at((next + pending) % keys.size()));
+        queue.removeTimer(keys.at(next));
+        next = (next + 1) % keys.size();
+    });
+    QVERIFY2(total == 0, "TimerQueue allocates in steady state");
+}
+
+void AllocTest::test_serverGet()
+{
+    const int iterations = 20000;
+    Address serverAddress(QHostAddress("10.0.0.1"), 5683);
+    Address clientAddress(QHostAddress("10.0.0.2"), 5683);
+    DataResource resource; // outlives the stack
+    Stack server;
+    LoopbackEndpoint *serverEndpoint = new LoopbackEndpoint(serverAddress);
+    server.addEndpoint(serverEndpoint);
+    server.addResource(&resource);
+    LoopbackEndpoint client(clientAddress); // no stack, answers are only counted
+    client.setPeer(serverEndpoint);
+    serverEndpoint->setPeer(&client);
+
+    QByteArray request;
+    {
+        char token[4] = { 1, 2, 3, 4 };
+        MessageBuffer buffer = MessageBuffer::allocate();
+        buffer.setHeader(Message::Type::Confirmable, Message::Code::Get, 0, token, sizeof(token));
+        buffer.addOption(Message::OptionType::UriPath, "data", 4);
+        request = QByteArray(buffer.constData(), buffer.size());
+    }
+
+    quint16 messageId = 0;
+    int answered = 0;
+    quint64 total = measure("GET round trip, server on MessageBuffer", iterations, 0,
+                            [&]() {
+        ++messageId;
+        request[2] = char(messageId >> 8);
+        request[3] = char(messageId);
+        client.sendPacked(request.constData(), request.size(), serverAddress);
+        serverEndpoint->pump();
+        answered += client.pump();
+    });
+    QCOMPARE(answered, WARMUP + iterations);
+    QCOMPARE(client.lastCode(), int(Message::Code::Content));
+    QCOMPARE(client.dropped() + serverEndpoint->dropped(), 0);
+    QVERIFY2(total == 0, "Server allocates per GET round trip in steady state");
+}
+
+void AllocTest::test_exchangeGet()
+{
+    const int iterations = 2000;
+    Address serverAddress(QHostAddress("10.0.0.1"), 5683);
+    Address clientAddress(QHostAddress("10.0.0.2"), 5683);
+    DataResource resource;
+    Stack server;
+    Stack client;
+    LoopbackEndpoint *serverEndpoint = new LoopbackEndpoint(serverAddress);
+    LoopbackEndpoint *clientEndpoint = new LoopbackEndpoint(clientAddress);
+    server.addEndpoint(serverEndpoint);
+    client.addEndpoint(clientEndpoint);
+    serverEndpoint->setPeer(clientEndpoint);
+    clientEndpoint->setPeer(serverEndpoint);
+    server.addResource(&resource);
+    QUrl url("coap://10.0.0.1:5683/data");
+
+    int completed = 0;
+    std::function<void ()> body = [&]() {
+        Exchange exchange(&client);
+        exchange.setUrl(url);
+        exchange.get();
+        while (serverEndpoint->pump() + clientEndpoint->pump())
+            ;
+        if (exchange.status() == Exchange::Completed)
+            ++completed;
+    };
+    // Exchange and Message still allocate for their QObjects, QByteArrays and hash nodes, they are capped
+    // per round trip, and the count must not creep up with the number of exchanges already done,
+    // which is what leaked or ever growing state looks like
+    quint64 first = measure("GET round trip, client Exchange and Message", iterations, EXCHANGE_GET_BUDGET, body);
+    quint64 second = measure("GET round trip, client Exchange and Message, again", iterations,
+                             EXCHANGE_GET_BUDGET, body);
+    QCOMPARE(completed, 2 * (WARMUP + iterations));
+    QCOMPARE(clientEndpoint->dropped() + serverEndpoint->dropped(), 0);
+    QVERIFY2(first <= EXCHANGE_GET_BUDGET * iterations, "Exchange GET round trip allocates over its budget");
+    QVERIFY2(second <= first + first / 100, "Exchange GET round trip allocates more the longer the stack runs");
+}
+
+QTEST_GUILESS_MAIN(AllocTest)
+
+#include "alloc_test.moc"
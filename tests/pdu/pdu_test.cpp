@@ -1,19 +1,120 @@
 #include <QtTest>
 
+#include "coap/message.hpp"
+
+using iotlib::coap::Message;
+using iotlib::coap::Option;
+
+typedef QList<QPair<int, QByteArray> > OptionList;
+Q_DECLARE_METATYPE(OptionList)
+
 class PDUTest : public QObject
 {
     Q_OBJECT
 
 private Q_SLOTS:
     void test_pack();
+    void test_roundtrip_data();
+    void test_roundtrip();
+    void test_truncated();
 
 };
 
 void PDUTest::test_pack()
 {
+    // RFC7252 Appendix A style GET with Uri-Path "temp"
+    Message message;
+    message.setType(Message::Type::Confirmable);
+    message.setCode(Message::Code::Get);
+    message.setMessageId(0x7d34);
+    message.addOption(Message::OptionType::UriPath, "temp");
+    QCOMPARE(message.pack(), QByteArray::fromHex("40017d34b474656d70"));
+}
+
+void PDUTest::test_roundtrip_data()
+{
+    QTest::addColumn<OptionList>("options");
+    QTest::addColumn<QByteArray>("payload");
+
+    QByteArray length13(13, 'a');
+    QByteArray length269(269, 'b');
+
+    QTest::newRow("three options")
+            << (OptionList() << qMakePair(3, QByteArray("example.com"))
+                             << qMakePair(11, QByteArray("temp"))
+                             << qMakePair(12, QByteArray("\x32", 1))
+                             << qMakePair(15, QByteArray("unit=c")))
+            << QByteArray("22.5");
+    QTest::newRow("delta 13")
+            << (OptionList() << qMakePair(1, QByteArray("x")) << qMakePair(14, QByteArray("\x3c", 1)))
+            << QByteArray();
+    QTest::newRow("delta 269")
+            << (OptionList() << qMakePair(1, QByteArray("x")) << qMakePair(270, QByteArray("y")))
+            << QByteArray();
+    QTest::newRow("deltas after extended")
+            << (OptionList() << qMakePair(20, QByteArray("a")) << qMakePair(300, QByteArray("b"))
+                             << qMakePair(301, QByteArray("c")) << qMakePair(2000, QByteArray()))
+            << QByteArray("p");
+    QTest::newRow("length 13")
+            << (OptionList() << qMakePair(11, length13) << qMakePair(15, QByteArray("q")))
+            << QByteArray();
+    QTest::newRow("length 269")
+            << (OptionList() << qMakePair(11, length269) << qMakePair(15, length13))
+            << length269;
+}
+
+void PDUTest::test_roundtrip()
+{
+    QFETCH(OptionList, options);
+    QFETCH(QByteArray, payload);
+
+    Message message;
+    message.setType(Message::Type::NonConfirmable);
+    message.setCode(Message::Code::Post);
+    message.setMessageId(0x1234);
+    message.setToken(QByteArray("\x01\x02\x03", 3));
+    for (int i = 0; i < options.size(); ++i)
+        message.addOption((Message::OptionType)options[i].first, options[i].second);
+    message.setContent(payload);
+
+    Message unpacked;
+    unpacked.unpack(message.pack());
+    QVERIFY(unpacked.isValid());
+    QCOMPARE(unpacked.type(), Message::Type::NonConfirmable);
+    QCOMPARE(unpacked.code(), Message::Code::Post);
+    QCOMPARE(unpacked.messageId(), (quint16)0x1234);
+    QCOMPARE(unpacked.token(), QByteArray("\x01\x02\x03", 3));
+    QCOMPARE(unpacked.optionsCount(), options.size());
+    for (int i = 0; i < options.size(); ++i) {
+        Option option = unpacked.option(i);
+        QCOMPARE((int)option.type(), options[i].first);
+        QCOMPARE(option.data(), options[i].second);
+    }
+    QCOMPARE(unpacked.content(), payload);
+    QCOMPARE(unpacked.pack(), message.pack());
+}
+
+void PDUTest::test_truncated()
+{
+    Message message;
+    message.setCode(Message::Code::Get);
+    message.setToken(QByteArray("\x0a\x0b", 2));
+    message.addOption((Message::OptionType)11, QByteArray(20, 'a'));
+    message.addOption((Message::OptionType)300, QByteArray(300, 'b'));
+    QByteArray packed = message.pack();
+    int firstOptionEnd = 4 + 2 + 2 + 20;
 
+    // every prefix that cuts an option short must be rejected without reading past the end
+    for (int size = 4 + 2 + 1; size < packed.size(); ++size) {
+        if (size == firstOptionEnd)
+            continue;
+        QByteArray prefix(packed.constData(), size);
+        Message truncated;
+        truncated.unpack(prefix);
+        QVERIFY2(!truncated.isValid(), qPrintable(QString("size %1").arg(size)));
+    }
 }
 
 QTEST_APPLESS_MAIN(PDUTest)
 
-#include "pdu_test.moc"
\ No newline at end of file
+#include "pdu_test.moc"
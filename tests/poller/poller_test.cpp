@@ -0,0 +1,210 @@
+#include <QtTest>
+
+#include "coap/stack.hpp"
+#include "coap/poller.hpp"
+#include "coap/requesttemplate.hpp"
+#include "coap/endpointbase.hpp"
+
+using namespace iotlib::coap;
+
+namespace {
+const int WAIT = 5000;
+}
+
+/**
+ * Keeps what the stack sends, datagrams for the stack are handed in by inject()
+ */
+class RecordingEndpoint : public EndpointBase
+{
+public:
+    struct Datagram {
+        QByteArray data;
+        Address address;
+    };
+
+    void send(const Message &coapMessage)
+    {
+        QByteArray packed = coapMessage.pack();
+        sendPacked(packed.constData(), packed.size(), coapMessage.address());
+    }
+    void sendPacked(const char *data, int size, const Address &address)
+    {
+        Datagram datagram;
+        datagram.data = QByteArray(data, size);
+        datagram.address = address;
+        sent.append(datagram);
+    }
+    void inject(const Message &message)
+    {
+        QByteArray packed = message.pack();
+        deliverDatagram(packed.constData(), packed.size(), message.address());
+    }
+
+    QList<Datagram> sent;
+};
+
+/**
+ * Two devices on different hosts polled with the same message id, which is what every poller
+ * sees sooner or later with random 16 bit ids. Empty ACKs and RSTs carry only the message id,
+ * the sender's address is what tells the devices apart.
+ */
+class PollerTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void init();
+    void cleanup();
+
+    void test_reset_matched_by_address();
+    void test_ack_matched_by_address();
+
+private:
+    /**
+     * @brief addCollidingDevices seeds qrand() so that both devices start from the same message id
+     */
+    void addCollidingDevices();
+    static quint16 messageId(const QByteArray &datagram);
+    Message empty(Message::Type type, quint16 messageId, const Address &from);
+    /**
+     * @brief results collects device indexes and codes polled so far
+     */
+    QList<QPair<int, Message::Code> > results() const;
+
+    Stack *m_stack;
+    RecordingEndpoint *m_endpoint;
+    Poller *m_poller;
+    QSignalSpy *m_polled;
+    Address m_first;
+    Address m_second;
+};
+
+void PollerTest::init()
+{
+    m_stack = new Stack;
+    m_endpoint = new RecordingEndpoint;
+    m_stack->addEndpoint(m_endpoint);
+    m_first = Address(QHostAddress("10.0.0.2"), 5683);
+    m_second = Address(QHostAddress("10.0.0.3"), 5683);
+    addCollidingDevices();
+    m_polled = new QSignalSpy(m_poller, SIGNAL(polled(QVector<iotlib::coap::PollResult>)));
+
+    Message request;
+    request.setType(Message::Type::Confirmable);
+    request.setCode(Message::Code::Get);
+    request.addOption(Message::OptionType::UriPath, "data");
+    m_poller->setRequest(RequestTemplate(request));
+    m_poller->setInterval(100);
+    m_poller->start();
+}
+
+void PollerTest::cleanup()
+{
+    delete m_polled;
+    delete m_poller;
+    delete m_stack;
+}
+
+void PollerTest::addCollidingDevices()
+{
+    // Poller takes one qrand() for its id, then one per device for the first message id
+    uint seed = 1;
+    forever {
+        qsrand(seed);
+        quint16 id = quint16(qrand());
+        quint16 first = quint16(qrand());
+        quint16 second = quint16(qrand());
+        if (id && first == second)
+            break;
+        ++seed;
+    }
+    qsrand(seed);
+    m_poller = new Poller(m_stack);
+    QCOMPARE(m_poller->addDevice(m_first.hostAddress(), m_first.port()), 0);
+    QCOMPARE(m_poller->addDevice(m_second.hostAddress(), m_second.port()), 1);
+}
+
+quint16 PollerTest::messageId(const QByteArray &datagram)
+{
+    return quint16(quint8(datagram[2]) << 8 | quint8(datagram[3]));
+}
+
+Message PollerTest::empty(Message::Type type, quint16 messageId, const Address &from)
+{
+    Message message;
+    message.setType(type);
+    message.setCode(Message::Code::Empty);
+    message.setMessageId(messageId);
+    message.setAddress(from);
+    return message;
+}
+
+QList<QPair<int, Message::Code> > PollerTest::results() const
+{
+    QList<QPair<int, Message::Code> > all;
+    for (int i = 0; i < m_polled->size(); ++i) {
+        QVector<PollResult> batch = m_polled->at(i).first().value<QVector<PollResult> >();
+        foreach (const PollResult &result, batch)
+            all.append(qMakePair(result.device, result.code));
+    }
+    return all;
+}
+
+void PollerTest::test_reset_matched_by_address()
+{
+    QTRY_COMPARE_WITH_TIMEOUT(m_endpoint->sent.size(), 2, WAIT);
+    const RecordingEndpoint::Datagram &first = m_endpoint->sent[0];
+    const RecordingEndpoint::Datagram &second = m_endpoint->sent[1];
+    QVERIFY(first.address == m_first);
+    QVERIFY(second.address == m_second);
+    quint16 mid = messageId(first.data);
+    QCOMPARE(messageId(second.data), mid);
+
+    // the second device was registered last, a message id alone would find it
+    m_endpoint->inject(empty(Message::Type::Reset, mid, m_first));
+    QTRY_COMPARE_WITH_TIMEOUT(results().size(), 1, WAIT);
+    QCOMPARE(results().first().first, 0);
+    QCOMPARE(results().first().second, Message::Code::UndefinedCode);
+
+    m_endpoint->inject(empty(Message::Type::Reset, mid, m_second));
+    QTRY_COMPARE_WITH_TIMEOUT(results().size(), 2, WAIT);
+    QCOMPARE(results().last().first, 1);
+    QCOMPARE(m_poller->stats(0).failures, quint32(1));
+    QCOMPARE(m_poller->stats(1).failures, quint32(1));
+}
+
+void PollerTest::test_ack_matched_by_address()
+{
+    QTRY_COMPARE_WITH_TIMEOUT(m_endpoint->sent.size(), 2, WAIT);
+    quint16 mid = messageId(m_endpoint->sent[0].data);
+    QCOMPARE(messageId(m_endpoint->sent[1].data), mid);
+
+    // an ACK from the first host leaves the second device waiting for its own
+    m_endpoint->inject(empty(Message::Type::Acknowledgement, mid, m_first));
+    m_endpoint->inject(empty(Message::Type::Reset, mid, m_first)); // already acknowledged, not in flight by MID
+    QTest::qWait(100);
+    QVERIFY(results().isEmpty());
+
+    m_endpoint->inject(empty(Message::Type::Reset, mid, m_second));
+    QTRY_COMPARE_WITH_TIMEOUT(results().size(), 1, WAIT);
+    QCOMPARE(results().first().first, 1);
+    QCOMPARE(results().first().second, Message::Code::UndefinedCode);
+
+    // the acknowledged device takes its separate response, matched by token
+    QByteArray request = m_endpoint->sent[0].data;
+    Message response;
+    response.setType(Message::Type::NonConfirmable);
+    response.setCode(Message::Code::Content);
+    response.setMessageId(quint16(mid + 1000));
+    response.setToken(request.mid(4, request[0] & 0x0f));
+    response.setContent("22.5");
+    response.setAddress(m_first);
+    m_endpoint->inject(response);
+    QTRY_COMPARE_WITH_TIMEOUT(results().size(), 2, WAIT);
+    QCOMPARE(results().last().first, 0);
+    QCOMPARE(results().last().second, Message::Code::Content);
+}
+
+QTEST_GUILESS_MAIN(PollerTest)
+
+#include "poller_test.moc"
@@ -0,0 +1,181 @@
+#include <QtTest>
+
+#include "lwm2m/registrationstore.hpp"
+#include "lwm2m/registrationinterface.hpp"
+
+using iotlib::coap::Address;
+using iotlib::coap::Message;
+using iotlib::coap::Option;
+using iotlib::lwm2m::RegistrationInterface;
+using iotlib::lwm2m::RegistrationStore;
+
+/**
+ * LWM2M Register, Update and De-register straight through RegistrationInterface::handle()
+ */
+class RegistrationTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void init();
+    void cleanup();
+
+    void test_register();
+    void test_location_not_guessable();
+    void test_update_bound_to_host();
+    void test_deregister_bound_to_host();
+    void test_method_not_allowed();
+
+private:
+    Message request(Message::Code code, const Address &from, const QByteArray &location = QByteArray());
+    Message handle(const Message &request);
+    /**
+     * @brief registerEndpoint registers name from client and returns its location, empty on failure
+     */
+    QByteArray registerEndpoint(const QByteArray &name, const Address &from);
+
+    RegistrationStore *m_store;
+    RegistrationInterface *m_interface;
+    Address m_client;
+    Address m_rebound;      ///< same host, port changed by NAT
+    Address m_other;
+};
+
+void RegistrationTest::init()
+{
+    m_store = new RegistrationStore;
+    m_interface = new RegistrationInterface(m_store);
+    m_client = Address(QHostAddress("10.0.0.2"), 56830);
+    m_rebound = Address(QHostAddress("10.0.0.2"), 40000);
+    m_other = Address(QHostAddress("10.0.0.3"), 56830);
+}
+
+void RegistrationTest::cleanup()
+{
+    delete m_interface;
+    delete m_store;
+}
+
+Message RegistrationTest::request(Message::Code code, const Address &from, const QByteArray &location)
+{
+    Message message;
+    message.setType(Message::Type::Confirmable);
+    message.setCode(code);
+    message.addOption(Message::OptionType::UriPath, "rd");
+    if (!location.isEmpty())
+        message.addOption(Message::OptionType::UriPath, location);
+    message.setAddress(from);
+    return message;
+}
+
+Message RegistrationTest::handle(const Message &request)
+{
+    Message response;
+    m_interface->handle(request, response);
+    return response;
+}
+
+QByteArray RegistrationTest::registerEndpoint(const QByteArray &name, const Address &from)
+{
+    Message message = request(Message::Code::Post, from);
+    message.addOption(Message::OptionType::UriQuery, "ep=" + name);
+    message.addOption(Message::OptionType::UriQuery, "lt=300");
+    message.setContent("</1/0>,</3/0>");
+    Message response = handle(message);
+    if (response.code() != Message::Code::Created)
+        return QByteArray();
+    QList<QByteArray> path;
+    for (int i = 0; i < response.optionsCount(); ++i) {
+        Option option = response.option(i);
+        if (option.type() == Message::OptionType::LocationPath)
+            path.append(option.data());
+    }
+    if (path.size() != 2 || path.first() != "rd")
+        return QByteArray();
+    return path.last();
+}
+
+void RegistrationTest::test_register()
+{
+    QByteArray location = registerEndpoint("node-1", m_client);
+    QVERIFY(!location.isEmpty());
+    int slot = m_store->slotForLocation(location);
+    QVERIFY(slot >= 0);
+    QCOMPARE(m_store->endpointName(slot), QByteArray("node-1"));
+    QCOMPARE(m_store->lifetime(slot), quint32(300));
+    QCOMPARE(m_store->location(slot), location);
+
+    Message anonymous = request(Message::Code::Post, m_client);
+    anonymous.setContent("</1/0>");
+    QCOMPARE(handle(anonymous).code(), Message::Code::BadRequest);
+}
+
+void RegistrationTest::test_location_not_guessable()
+{
+    QByteArray first = registerEndpoint("node-1", m_client);
+    QByteArray second = registerEndpoint("node-2", m_other);
+    QVERIFY(!first.isEmpty() && !second.isEmpty());
+    QVERIFY(first != second);
+    // 64 random bits ahead of the slot, they differ between neighbouring slots
+    QCOMPARE(first.size(), second.size());
+    QVERIFY(first.size() >= 16);
+    QVERIFY(first.left(16) != second.left(16));
+
+    // right slot, wrong random part
+    QByteArray forged = first;
+    forged[0] = forged[0] == '0' ? '1' : '0';
+    QCOMPARE(m_store->slotForLocation(forged), -1);
+    QCOMPARE(handle(request(Message::Code::Delete, m_client, forged)).code(), Message::Code::NotFound);
+    QCOMPARE(m_store->count(), 2);
+
+    // a slot reused after De-register gets a new location
+    QCOMPARE(handle(request(Message::Code::Delete, m_client, first)).code(), Message::Code::Deleted);
+    QByteArray third = registerEndpoint("node-3", m_client);
+    QCOMPARE(m_store->slotForLocation(third), m_store->find("node-3"));
+    QVERIFY(third != first);
+    QCOMPARE(m_store->slotForLocation(first), -1);
+}
+
+void RegistrationTest::test_update_bound_to_host()
+{
+    QByteArray location = registerEndpoint("node-1", m_client);
+    int slot = m_store->slotForLocation(location);
+
+    Message update = request(Message::Code::Post, m_other, location);
+    update.addOption(Message::OptionType::UriQuery, "lt=600");
+    QCOMPARE(handle(update).code(), Message::Code::Forbidden);
+    QCOMPARE(m_store->lifetime(slot), quint32(300));
+    QCOMPARE(m_store->port(slot), m_client.port());
+
+    update.setAddress(m_rebound);
+    QCOMPARE(handle(update).code(), Message::Code::Changed);
+    QCOMPARE(m_store->lifetime(slot), quint32(600));
+    QCOMPARE(m_store->port(slot), m_rebound.port());
+}
+
+void RegistrationTest::test_deregister_bound_to_host()
+{
+    QByteArray location = registerEndpoint("node-1", m_client);
+
+    QCOMPARE(handle(request(Message::Code::Delete, m_other, location)).code(), Message::Code::Forbidden);
+    QCOMPARE(m_store->count(), 1);
+
+    QCOMPARE(handle(request(Message::Code::Delete, m_client, location)).code(), Message::Code::Deleted);
+    QCOMPARE(m_store->count(), 0);
+    QCOMPARE(handle(request(Message::Code::Post, m_client, location)).code(), Message::Code::NotFound);
+}
+
+void RegistrationTest::test_method_not_allowed()
+{
+    QCOMPARE(handle(request(Message::Code::Get, m_client)).code(), Message::Code::MethodNotAllowed);
+    QCOMPARE(handle(request(Message::Code::Delete, m_client)).code(), Message::Code::MethodNotAllowed);
+
+    QByteArray location = registerEndpoint("node-1", m_client);
+    QCOMPARE(handle(request(Message::Code::Get, m_client, location)).code(), Message::Code::MethodNotAllowed);
+    QCOMPARE(handle(request(Message::Code::Put, m_client, location)).code(), Message::Code::MethodNotAllowed);
+    QCOMPARE(m_store->count(), 1);
+}
+
+QTEST_GUILESS_MAIN(RegistrationTest)
+
+#include "registration_test.moc"
@@ -0,0 +1,265 @@
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTemporaryDir>
+
+#include <functional>
+
+#include "settings.h"
+#include "coap/tcpendpoint.h"
+
+using namespace iotlib::coap;
+
+namespace {
+const int DEFAULT_MAX_MESSAGE_SIZE = 1152;  ///< RFC8323 5.3.1, until peer's CSM arrives
+const int MAX_MESSAGE_SIZE_OPTION = 2;
+const int WAIT = 5000;
+const int QUIET = 300;                      ///< how long nothing has to arrive
+}
+
+Q_DECLARE_METATYPE(iotlib::coap::Message)
+
+/**
+ * TcpEndpoint connecting to a bare QTcpServer on loopback, which plays the peer by hand:
+ * it collects the frames it reads and sends its CSM only when the test says so.
+ */
+class TcpTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+    void cleanup();
+
+    void test_frame_roundtrip_data();
+    void test_frame_roundtrip();
+    void test_small_before_csm();
+    void test_large_waits_for_csm();
+    void test_over_peer_limit_fails();
+    void test_held_frame_over_peer_limit_fails();
+
+private:
+    Message request(int payloadSize);
+    /**
+     * @brief frameSize returns the size of request(payloadSize) on the wire
+     */
+    static int frameSize(int payloadSize);
+    /**
+     * @brief sendPeerCsm sends peer's CSM followed by a Ping, and returns once the Pong is back,
+     * so the endpoint has processed the CSM by then
+     */
+    bool sendPeerCsm(quint32 maxMessageSize);
+    /**
+     * @brief waitForFrames reads from the peer's socket until count non signaling frames came or timeout runs out
+     */
+    bool waitForFrames(int count, int timeout = WAIT);
+    bool readPeer(const std::function<bool ()> &done, int timeout);
+
+    QTemporaryDir m_dir;
+    iotlib::Settings *m_settings;
+    TcpEndpoint *m_endpoint;
+    QTcpServer *m_peer;
+    QTcpSocket *m_peerSocket;
+    QByteArray m_peerBuffer;
+    QList<Message> m_peerFrames;
+    int m_peerCsms;
+    int m_peerPongs;
+};
+
+void TcpTest::initTestCase()
+{
+    qRegisterMetaType<iotlib::coap::Message>();
+    QVERIFY(m_dir.isValid());
+}
+
+void TcpTest::init()
+{
+    m_settings = new iotlib::Settings(m_dir.path() + "/tcp.json");
+    m_endpoint = new TcpEndpoint(m_settings);
+    m_peer = new QTcpServer;
+    QVERIFY(m_peer->listen(QHostAddress::LocalHost));
+    m_peerSocket = 0;
+    m_peerBuffer.clear();
+    m_peerFrames.clear();
+    m_peerCsms = 0;
+    m_peerPongs = 0;
+}
+
+void TcpTest::cleanup()
+{
+    delete m_endpoint;
+    delete m_peer;
+    delete m_settings;
+}
+
+Message TcpTest::request(int payloadSize)
+{
+    static quint8 token = 0;
+    Message message;
+    message.setCode(Message::Code::Post);
+    message.setToken(QByteArray(1, char(++token)));
+    message.setContent(QByteArray(payloadSize, 'p'));
+    message.setAddress(Address(QHostAddress::LocalHost, m_peer->serverPort()));
+    return message;
+}
+
+int TcpTest::frameSize(int payloadSize)
+{
+    Message message;
+    message.setCode(Message::Code::Post);
+    message.setToken(QByteArray(1, 'x'));
+    message.setContent(QByteArray(payloadSize, 'p'));
+    return TcpEndpoint::frame(message).size();
+}
+
+bool TcpTest::sendPeerCsm(quint32 maxMessageSize)
+{
+    if (!m_peerSocket)
+        return false;
+    Message csm;
+    csm.setCode(Message::Code::Csm);
+    csm.addOption((Message::OptionType)MAX_MESSAGE_SIZE_OPTION, pack_uint(maxMessageSize));
+    Message ping;
+    ping.setCode(Message::Code::Ping);
+    m_peerSocket->write(TcpEndpoint::frame(csm) + TcpEndpoint::frame(ping));
+    m_peerSocket->flush();
+    int pongs = m_peerPongs;
+    return readPeer([this, pongs]() { return m_peerPongs > pongs; }, WAIT);
+}
+
+bool TcpTest::waitForFrames(int count, int timeout)
+{
+    return readPeer([this, count]() { return m_peerFrames.size() >= count; }, timeout);
+}
+
+bool TcpTest::readPeer(const std::function<bool ()> &done, int timeout)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.elapsed() < timeout) {
+        if (!m_peerSocket) {
+            if (m_peer->waitForNewConnection(10))
+                m_peerSocket = m_peer->nextPendingConnection();
+            QCoreApplication::processEvents();
+            continue;
+        }
+        if (m_peerSocket->bytesAvailable() || m_peerSocket->waitForReadyRead(10))
+            m_peerBuffer.append(m_peerSocket->readAll());
+        Message message;
+        while (TcpEndpoint::takeFrame(m_peerBuffer, message)) {
+            if (message.code() == Message::Code::Csm)
+                ++m_peerCsms;
+            else if (message.code() == Message::Code::Pong)
+                ++m_peerPongs;
+            else
+                m_peerFrames.append(message);
+        }
+        if (done())
+            return true;
+        QCoreApplication::processEvents();
+    }
+    return done();
+}
+
+void TcpTest::test_frame_roundtrip_data()
+{
+    QTest::addColumn<int>("payloadSize");
+
+    // extended length boundaries of RFC8323 3.2
+    QTest::newRow("0") << 0;
+    QTest::newRow("11") << 11;
+    QTest::newRow("12") << 12;
+    QTest::newRow("267") << 267;
+    QTest::newRow("268") << 268;
+    QTest::newRow("1140") << 1140;
+    QTest::newRow("65803") << 65803;
+    QTest::newRow("65804") << 65804;
+}
+
+void TcpTest::test_frame_roundtrip()
+{
+    QFETCH(int, payloadSize);
+
+    Message message;
+    message.setCode(Message::Code::Post);
+    message.setToken(QByteArray("\x01\x02", 2));
+    message.addOption(Message::OptionType::UriPath, "data");
+    message.setContent(QByteArray(payloadSize, 'p'));
+
+    QByteArray buffer = TcpEndpoint::frame(message);
+    buffer.append(char(0)); // start of the next frame stays in the buffer
+    Message unpacked;
+    QVERIFY(TcpEndpoint::takeFrame(buffer, unpacked));
+    QCOMPARE(buffer.size(), 1);
+    QCOMPARE(unpacked.code(), message.code());
+    QCOMPARE(unpacked.token(), message.token());
+    QCOMPARE(unpacked.content(), message.content());
+}
+
+void TcpTest::test_small_before_csm()
+{
+    // frames within the default limit don't wait for peer's CSM
+    int payloadSize = 1000;
+    QVERIFY(frameSize(payloadSize) <= DEFAULT_MAX_MESSAGE_SIZE);
+    QSignalSpy failed(m_endpoint, SIGNAL(sendFailed(iotlib::coap::Message)));
+    m_endpoint->send(request(payloadSize));
+    QVERIFY(waitForFrames(1));
+    QCOMPARE(m_peerCsms, 1);
+    QCOMPARE(m_peerFrames.first().content().size(), payloadSize);
+    QCOMPARE(failed.count(), 0);
+}
+
+void TcpTest::test_large_waits_for_csm()
+{
+    int largeSize = 2000;
+    QVERIFY(frameSize(largeSize) > DEFAULT_MAX_MESSAGE_SIZE);
+    QSignalSpy failed(m_endpoint, SIGNAL(sendFailed(iotlib::coap::Message)));
+    m_endpoint->send(request(largeSize));
+    m_endpoint->send(request(10)); // fits, but must not overtake the held one
+    QVERIFY(!waitForFrames(1, QUIET));
+    QCOMPARE(m_peerCsms, 1);
+
+    QVERIFY(sendPeerCsm(8192));
+    QVERIFY(waitForFrames(2));
+    QCOMPARE(m_peerFrames[0].content().size(), largeSize);
+    QCOMPARE(m_peerFrames[1].content().size(), 10);
+    QCOMPARE(failed.count(), 0);
+}
+
+void TcpTest::test_over_peer_limit_fails()
+{
+    m_endpoint->send(request(10));
+    QVERIFY(waitForFrames(1));
+    QVERIFY(sendPeerCsm(DEFAULT_MAX_MESSAGE_SIZE));
+
+    QSignalSpy failed(m_endpoint, SIGNAL(sendFailed(iotlib::coap::Message)));
+    Message large = request(2000);
+    m_endpoint->send(large);
+    QCOMPARE(failed.count(), 1);
+    QCOMPARE(failed.first().first().value<Message>().token(), large.token());
+
+    m_endpoint->send(request(20));
+    QVERIFY(waitForFrames(2));
+    QCOMPARE(m_peerFrames[1].content().size(), 20);
+}
+
+void TcpTest::test_held_frame_over_peer_limit_fails()
+{
+    QSignalSpy failed(m_endpoint, SIGNAL(sendFailed(iotlib::coap::Message)));
+    Message large = request(2000);
+    m_endpoint->send(large);
+    m_endpoint->send(request(30));
+    QVERIFY(!waitForFrames(1, QUIET));
+
+    // peer keeps the default, the held frame can't go out and the one behind it is released
+    QVERIFY(sendPeerCsm(DEFAULT_MAX_MESSAGE_SIZE));
+    QVERIFY(waitForFrames(1));
+    QCOMPARE(m_peerFrames.first().content().size(), 30);
+    QCOMPARE(failed.count(), 1);
+    QCOMPARE(failed.first().first().value<Message>().token(), large.token());
+}
+
+QTEST_GUILESS_MAIN(TcpTest)
+
+#include "tcp_test.moc"
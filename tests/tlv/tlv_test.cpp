@@ -0,0 +1,141 @@
+#include <QtTest>
+
+#include <limits>
+
+#include "lwm2m/tlv.hpp"
+#include "lwm2m/senmlcbor.hpp"
+
+using iotlib::lwm2m::Object;
+using iotlib::lwm2m::ObjectDefinition;
+using iotlib::lwm2m::Path;
+using iotlib::lwm2m::Record;
+using iotlib::lwm2m::ResourceDefinition;
+using iotlib::lwm2m::ResourceType;
+using iotlib::lwm2m::Tlv;
+using iotlib::lwm2m::SenmlCbor;
+
+namespace {
+const quint16 OBJECT_ID = 32769;
+const quint16 SIGNED_ID = 1;
+const quint16 UNSIGNED_ID = 2;
+
+const ResourceDefinition resources[] = {
+    { SIGNED_ID,   ResourceType::Integer,         iotlib::lwm2m::Read, false, "Signed" },
+    { UNSIGNED_ID, ResourceType::UnsignedInteger, iotlib::lwm2m::Read, false, "Unsigned" }
+};
+const ObjectDefinition definition = { OBJECT_ID, "Test", resources, 2 };
+}
+
+class TlvTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void test_unsigned_roundtrip_data();
+    void test_unsigned_roundtrip();
+    void test_unsigned_not_sign_extended();
+    void test_signed_roundtrip_data();
+    void test_signed_roundtrip();
+    void test_senml_roundtrip();
+
+};
+
+void TlvTest::test_unsigned_roundtrip_data()
+{
+    QTest::addColumn<quint64>("value");
+    QTest::addColumn<int>("size");
+
+    QTest::newRow("0") << Q_UINT64_C(0) << 1;
+    QTest::newRow("0x80") << Q_UINT64_C(0x80) << 1;
+    QTest::newRow("0xff") << Q_UINT64_C(0xff) << 1;
+    QTest::newRow("0x100") << Q_UINT64_C(0x100) << 2;
+    QTest::newRow("0xffff") << Q_UINT64_C(0xffff) << 2;
+    QTest::newRow("0xffffffff") << Q_UINT64_C(0xffffffff) << 4;
+    QTest::newRow("0xffffffffffffffff") << Q_UINT64_C(0xffffffffffffffff) << 8;
+}
+
+void TlvTest::test_unsigned_roundtrip()
+{
+    QFETCH(quint64, value);
+    QFETCH(int, size);
+
+    Object object(&definition);
+    QVector<Record> records;
+    records.append(Record{Path(OBJECT_ID, 0, UNSIGNED_ID), QVariant(value)});
+    QByteArray encoded = Tlv::encode(object, records, 2);
+    QCOMPARE(encoded.size(), 2 + size); // type, 8 bit id, value
+
+    QVector<Record> decoded;
+    QVERIFY(Tlv::decode(encoded, object, Path(OBJECT_ID, 0), decoded));
+    QCOMPARE(decoded.size(), 1);
+    QCOMPARE(decoded[0].path.resourceId, int(UNSIGNED_ID));
+    QCOMPARE(decoded[0].value.toULongLong(), value);
+}
+
+void TlvTest::test_unsigned_not_sign_extended()
+{
+    // as other implementations write them: resource 2 with one, two and four byte values
+    Object object(&definition);
+    QVector<Record> decoded;
+    QVERIFY(Tlv::decode(QByteArray::fromHex("c10280"), object, Path(OBJECT_ID, 0), decoded));
+    QVERIFY(Tlv::decode(QByteArray::fromHex("c202ffff"), object, Path(OBJECT_ID, 0), decoded));
+    QVERIFY(Tlv::decode(QByteArray::fromHex("c402ffffffff"), object, Path(OBJECT_ID, 0), decoded));
+    QCOMPARE(decoded.size(), 3);
+    QCOMPARE(decoded[0].value.toULongLong(), Q_UINT64_C(0x80));
+    QCOMPARE(decoded[1].value.toULongLong(), Q_UINT64_C(0xffff));
+    QCOMPARE(decoded[2].value.toULongLong(), Q_UINT64_C(0xffffffff));
+}
+
+void TlvTest::test_signed_roundtrip_data()
+{
+    QTest::addColumn<qint64>("value");
+
+    QTest::newRow("-1") << Q_INT64_C(-1);
+    QTest::newRow("-128") << Q_INT64_C(-128);
+    QTest::newRow("0x80") << Q_INT64_C(0x80);
+    QTest::newRow("-32769") << Q_INT64_C(-32769);
+    QTest::newRow("0xffffffff") << Q_INT64_C(0xffffffff);
+    QTest::newRow("min") << std::numeric_limits<qint64>::min();
+}
+
+void TlvTest::test_signed_roundtrip()
+{
+    QFETCH(qint64, value);
+
+    Object object(&definition);
+    QVector<Record> records;
+    records.append(Record{Path(OBJECT_ID, 0, SIGNED_ID), QVariant(value)});
+    QVector<Record> decoded;
+    QVERIFY(Tlv::decode(Tlv::encode(object, records, 2), object, Path(OBJECT_ID, 0), decoded));
+    QCOMPARE(decoded.size(), 1);
+    QCOMPARE(decoded[0].value.toLongLong(), value);
+}
+
+void TlvTest::test_senml_roundtrip()
+{
+    QVector<Record> records;
+    QVector<ResourceType> types;
+    records.append(Record{Path(OBJECT_ID, 0, SIGNED_ID), QVariant(Q_INT64_C(-129))});
+    types.append(ResourceType::Integer);
+    records.append(Record{Path(OBJECT_ID, 0, UNSIGNED_ID), QVariant(Q_UINT64_C(0x80))});
+    types.append(ResourceType::UnsignedInteger);
+    records.append(Record{Path(OBJECT_ID, 1, UNSIGNED_ID), QVariant(Q_UINT64_C(0xffffffff))});
+    types.append(ResourceType::UnsignedInteger);
+    records.append(Record{Path(OBJECT_ID, 2, UNSIGNED_ID), QVariant(Q_UINT64_C(0xffffffffffffffff))});
+    types.append(ResourceType::UnsignedInteger);
+
+    QVector<Record> decoded;
+    QVERIFY(SenmlCbor::decode(SenmlCbor::encode(records, types), decoded));
+    QCOMPARE(decoded.size(), records.size());
+    for (int i = 0; i < records.size(); ++i) {
+        QCOMPARE(decoded[i].path.toString(), records[i].path.toString());
+        if (types[i] == ResourceType::Integer)
+            QCOMPARE(decoded[i].value.toLongLong(), records[i].value.toLongLong());
+        else
+            QCOMPARE(decoded[i].value.toULongLong(), records[i].value.toULongLong());
+    }
+}
+
+QTEST_APPLESS_MAIN(TlvTest)
+
+#include "tlv_test.moc"
@@ -0,0 +1,144 @@
+#include <QtTest>
+
+#include "coap/stack.hpp"
+#include "coap/exchange.hpp"
+#include "coap/tokenallocator.hpp"
+#include "coap/virtualclock.hpp"
+#include "coap/simulatednetwork.hpp"
+
+using namespace iotlib::coap;
+
+/**
+ * Client stack on a SimulatedNetwork sending to an endpoint without a stack, which only records
+ * the tokens it sees. Requests are never answered, so their exchanges stay in progress.
+ */
+class TokenTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void test_allocator_unique();
+    void test_length_kept_while_in_progress();
+    void test_length_changed_when_idle();
+    void test_unique_after_wrap();
+
+private:
+    struct Setup {
+        Setup() :
+            network(&clock),
+            client(Address(QHostAddress("10.0.0.1"), 5683)),
+            server(Address(QHostAddress("10.0.0.2"), 5683))
+        {
+            stack.setClock(&clock);
+            stack.addEndpoint(network.createEndpoint(client));
+            EndpointBase *endpoint = network.createEndpoint(server, &network);
+            QObject::connect(endpoint, &EndpointBase::received, [this](Message &message) {
+                tokens.append(message.token());
+            });
+        }
+        ~Setup()
+        {
+            foreach (Exchange *exchange, inProgress)
+                exchange->cancel();
+        }
+
+        void get(int count)
+        {
+            for (int i = 0; i < count; ++i) {
+                // distinct paths, identical GETs would be collapsed into one
+                Exchange *exchange = new Exchange(&stack, &exchanges);
+                exchange->setUrl(QUrl(QString("coap://10.0.0.2/data/%1").arg(sent++)));
+                exchange->get();
+                inProgress.append(exchange);
+            }
+            clock.runFor(100); // well before the first retransmission
+        }
+
+        VirtualClock clock;
+        SimulatedNetwork network;
+        Address client;
+        Address server;
+        Stack stack;
+        QObject exchanges;      ///< declared after the stack, deleted before it
+        QList<Exchange *> inProgress;
+        QList<QByteArray> tokens;
+        int sent = 0;
+    };
+
+    static bool allUnique(const QList<QByteArray> &tokens)
+    {
+        return tokens.toSet().size() == tokens.size();
+    }
+};
+
+void TokenTest::test_allocator_unique()
+{
+    TokenAllocator one(1);
+    QSet<QByteArray> tokens;
+    for (int i = 0; i < 256; ++i)
+        tokens.insert(one.next());
+    QCOMPARE(tokens.size(), 256);
+    QVERIFY(!one.hasWrapped());
+    one.next();
+    QVERIFY(one.hasWrapped());
+
+    TokenAllocator two(2);
+    tokens.clear();
+    for (int i = 0; i < 65536; ++i) {
+        QByteArray token = two.next();
+        QCOMPARE(token.size(), 2);
+        tokens.insert(token);
+    }
+    QCOMPARE(tokens.size(), 65536);
+}
+
+void TokenTest::test_length_kept_while_in_progress()
+{
+    Setup setup;
+    setup.get(1);
+    QCOMPARE(setup.tokens.size(), 1);
+    QCOMPARE(setup.tokens.first().size(), 4);
+
+    // a new allocator would start its sequence over under the exchange in progress
+    QTest::ignoreMessage(QtWarningMsg, "Stack::setTokenLength(): exchanges are in progress, keeping token length");
+    setup.stack.setTokenLength(1);
+    QCOMPARE(setup.stack.tokenLength(), 4);
+
+    setup.get(300);
+    QCOMPARE(setup.tokens.size(), 301);
+    foreach (const QByteArray &token, setup.tokens)
+        QCOMPARE(token.size(), 4);
+    QVERIFY(allUnique(setup.tokens));
+}
+
+void TokenTest::test_length_changed_when_idle()
+{
+    Setup setup;
+    setup.stack.setTokenLength(2);
+    QCOMPARE(setup.stack.tokenLength(), 2);
+    setup.get(1000);
+    QCOMPARE(setup.tokens.size(), 1000);
+    foreach (const QByteArray &token, setup.tokens)
+        QCOMPARE(token.size(), 2);
+    QVERIFY(allUnique(setup.tokens));
+}
+
+void TokenTest::test_unique_after_wrap()
+{
+    // one byte tokens run out of counter space at 256, past that in progress ones are skipped
+    Setup setup;
+    setup.stack.setTokenLength(1);
+    setup.get(200);
+    for (int i = 0; i < 150; ++i)
+        setup.inProgress.takeFirst()->cancel();
+    QList<QByteArray> kept = setup.tokens.mid(150);
+
+    setup.tokens.clear();
+    setup.get(150); // 56 more, then the counter wraps over the 50 kept ones
+    QCOMPARE(setup.tokens.size(), 150);
+    QVERIFY(allUnique(kept + setup.tokens));
+}
+
+QTEST_GUILESS_MAIN(TokenTest)
+
+#include "token_test.moc"